@@ -0,0 +1,434 @@
+
+#include "Activation.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+
+#if HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+// Scalar Forms ---------------------------------------------------------------
+float identity(float x) {
+   return x;
+}
+
+float relu(float x) {
+   return std::max(0.0f, x);
+}
+
+float sigmoid(float x) {
+   return 1.0f / (1.0f + std::exp(-x));
+}
+
+float tanh_act(float x) {
+   return std::tanh(x);
+}
+
+float leaky_relu(float x) {
+   return x > 0.0f ? x : LEAKY_RELU_SLOPE * x;
+}
+
+// Scalar Kernels -------------------------------------------------------------
+static void identity_scalar(const float* in, float* out, size_t n) {
+   if(in == out) return;
+   for(size_t i = 0; i < n; i++) out[i] = in[i];
+}
+
+static void relu_scalar(const float* in, float* out, size_t n) {
+   for(size_t i = 0; i < n; i++) out[i] = relu(in[i]);
+}
+
+static void sigmoid_scalar(const float* in, float* out, size_t n) {
+   for(size_t i = 0; i < n; i++) out[i] = sigmoid(in[i]);
+}
+
+static void tanh_scalar(const float* in, float* out, size_t n) {
+   for(size_t i = 0; i < n; i++) out[i] = tanh_act(in[i]);
+}
+
+static void leaky_relu_scalar(const float* in, float* out, size_t n) {
+   for(size_t i = 0; i < n; i++) out[i] = leaky_relu(in[i]);
+}
+
+#if HAVE_X86_SIMD
+/* exp(x) = 2^n * exp(r) with n = round(x / ln 2) and |r| <= ln 2 / 2.
+ * exp(r) is the Cephes single precision polynomial, ln 2 is split in two so
+ * r is exact. x is clamped so that 2^n stays a normal float.
+ */
+#define EXP_HI 88.0f
+#define EXP_LO -87.3365447504f
+#define LOG2E 1.44269504088896341f
+#define LN2_HI 0.693359375f
+#define LN2_LO -2.12194440e-4f
+#define EXP_P0 1.9875691500e-4f
+#define EXP_P1 1.3981999507e-3f
+#define EXP_P2 8.3334519073e-3f
+#define EXP_P3 4.1665795894e-2f
+#define EXP_P4 1.6666665459e-1f
+#define EXP_P5 5.0000001201e-1f
+
+// AVX2 -----------------------------------------------------------------------
+__attribute__((target("avx2,fma")))
+static inline __m256 exp_ps_avx2(__m256 x) {
+   x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(EXP_LO)), _mm256_set1_ps(EXP_HI));
+   __m256 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(LOG2E)),
+                              _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+   __m256 r = _mm256_fnmadd_ps(n, _mm256_set1_ps(LN2_HI), x);
+   r = _mm256_fnmadd_ps(n, _mm256_set1_ps(LN2_LO), r);
+
+   __m256 p = _mm256_set1_ps(EXP_P0);
+   p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(EXP_P1));
+   p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(EXP_P2));
+   p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(EXP_P3));
+   p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(EXP_P4));
+   p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(EXP_P5));
+   p = _mm256_fmadd_ps(p, _mm256_mul_ps(r, r), _mm256_add_ps(r, _mm256_set1_ps(1.0f)));
+
+   __m256i pow2n = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n),
+                                                      _mm256_set1_epi32(127)), 23);
+   return _mm256_mul_ps(p, _mm256_castsi256_ps(pow2n));
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256 sigmoid_ps_avx2(__m256 x) {
+   const __m256 one = _mm256_set1_ps(1.0f);
+   __m256 e = exp_ps_avx2(_mm256_sub_ps(_mm256_setzero_ps(), x));
+   return _mm256_div_ps(one, _mm256_add_ps(one, e));
+}
+
+__attribute__((target("avx2,fma")))
+static void relu_avx2(const float* in, float* out, size_t n) {
+   const __m256 zero = _mm256_setzero_ps();
+   size_t i = 0;
+   for(; i + 8 <= n; i += 8) {
+      _mm256_storeu_ps(out + i, _mm256_max_ps(_mm256_loadu_ps(in + i), zero));
+   }
+   relu_scalar(in + i, out + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+static void leaky_relu_avx2(const float* in, float* out, size_t n) {
+   const __m256 slope = _mm256_set1_ps(LEAKY_RELU_SLOPE);
+   size_t i = 0;
+   for(; i + 8 <= n; i += 8) {
+      __m256 x = _mm256_loadu_ps(in + i);
+      _mm256_storeu_ps(out + i, _mm256_max_ps(x, _mm256_mul_ps(x, slope)));
+   }
+   leaky_relu_scalar(in + i, out + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+static void sigmoid_avx2(const float* in, float* out, size_t n) {
+   size_t i = 0;
+   for(; i + 8 <= n; i += 8) {
+      _mm256_storeu_ps(out + i, sigmoid_ps_avx2(_mm256_loadu_ps(in + i)));
+   }
+   sigmoid_scalar(in + i, out + i, n - i);
+}
+
+// tanh(x) = 2 * sigmoid(2x) - 1
+__attribute__((target("avx2,fma")))
+static void tanh_avx2(const float* in, float* out, size_t n) {
+   const __m256 two = _mm256_set1_ps(2.0f);
+   const __m256 one = _mm256_set1_ps(1.0f);
+   size_t i = 0;
+   for(; i + 8 <= n; i += 8) {
+      __m256 s = sigmoid_ps_avx2(_mm256_mul_ps(two, _mm256_loadu_ps(in + i)));
+      _mm256_storeu_ps(out + i, _mm256_fmsub_ps(two, s, one));
+   }
+   tanh_scalar(in + i, out + i, n - i);
+}
+
+// AVX-512 --------------------------------------------------------------------
+__attribute__((target("avx512f")))
+static inline __m512 exp_ps_avx512(__m512 x) {
+   x = _mm512_min_ps(_mm512_max_ps(x, _mm512_set1_ps(EXP_LO)), _mm512_set1_ps(EXP_HI));
+   __m512 n = _mm512_roundscale_ps(_mm512_mul_ps(x, _mm512_set1_ps(LOG2E)),
+                                   _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+   __m512 r = _mm512_fnmadd_ps(n, _mm512_set1_ps(LN2_HI), x);
+   r = _mm512_fnmadd_ps(n, _mm512_set1_ps(LN2_LO), r);
+
+   __m512 p = _mm512_set1_ps(EXP_P0);
+   p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(EXP_P1));
+   p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(EXP_P2));
+   p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(EXP_P3));
+   p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(EXP_P4));
+   p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(EXP_P5));
+   p = _mm512_fmadd_ps(p, _mm512_mul_ps(r, r), _mm512_add_ps(r, _mm512_set1_ps(1.0f)));
+
+   return _mm512_scalef_ps(p, n);
+}
+
+__attribute__((target("avx512f")))
+static inline __m512 sigmoid_ps_avx512(__m512 x) {
+   const __m512 one = _mm512_set1_ps(1.0f);
+   __m512 e = exp_ps_avx512(_mm512_sub_ps(_mm512_setzero_ps(), x));
+   return _mm512_div_ps(one, _mm512_add_ps(one, e));
+}
+
+// The tail is done with a masked load / store instead of the scalar loop
+__attribute__((target("avx512f")))
+static void relu_avx512(const float* in, float* out, size_t n) {
+   const __m512 zero = _mm512_setzero_ps();
+   for(size_t i = 0; i < n; i += 16) {
+      __mmask16 mask = n - i >= 16 ? 0xFFFF : (__mmask16)((1u << (n - i)) - 1);
+      __m512 x = _mm512_maskz_loadu_ps(mask, in + i);
+      _mm512_mask_storeu_ps(out + i, mask, _mm512_max_ps(x, zero));
+   }
+}
+
+__attribute__((target("avx512f")))
+static void leaky_relu_avx512(const float* in, float* out, size_t n) {
+   const __m512 slope = _mm512_set1_ps(LEAKY_RELU_SLOPE);
+   for(size_t i = 0; i < n; i += 16) {
+      __mmask16 mask = n - i >= 16 ? 0xFFFF : (__mmask16)((1u << (n - i)) - 1);
+      __m512 x = _mm512_maskz_loadu_ps(mask, in + i);
+      _mm512_mask_storeu_ps(out + i, mask, _mm512_max_ps(x, _mm512_mul_ps(x, slope)));
+   }
+}
+
+__attribute__((target("avx512f")))
+static void sigmoid_avx512(const float* in, float* out, size_t n) {
+   for(size_t i = 0; i < n; i += 16) {
+      __mmask16 mask = n - i >= 16 ? 0xFFFF : (__mmask16)((1u << (n - i)) - 1);
+      __m512 x = _mm512_maskz_loadu_ps(mask, in + i);
+      _mm512_mask_storeu_ps(out + i, mask, sigmoid_ps_avx512(x));
+   }
+}
+
+__attribute__((target("avx512f")))
+static void tanh_avx512(const float* in, float* out, size_t n) {
+   const __m512 two = _mm512_set1_ps(2.0f);
+   const __m512 one = _mm512_set1_ps(1.0f);
+   for(size_t i = 0; i < n; i += 16) {
+      __mmask16 mask = n - i >= 16 ? 0xFFFF : (__mmask16)((1u << (n - i)) - 1);
+      __m512 x = _mm512_maskz_loadu_ps(mask, in + i);
+      __m512 s = sigmoid_ps_avx512(_mm512_mul_ps(two, x));
+      _mm512_mask_storeu_ps(out + i, mask, _mm512_fmsub_ps(two, s, one));
+   }
+}
+#endif
+
+// Kernel Selection -----------------------------------------------------------
+ActivationKernel activation_kernel(Activation act, SimdLevel level) {
+#if HAVE_X86_SIMD
+   if(level >= SIMD_AVX512) {
+      switch(act) {
+         case ACT_RELU: return relu_avx512;
+         case ACT_SIGMOID: return sigmoid_avx512;
+         case ACT_TANH: return tanh_avx512;
+         case ACT_LEAKY_RELU: return leaky_relu_avx512;
+         default: break;
+      }
+   }
+   if(level >= SIMD_AVX2) {
+      switch(act) {
+         case ACT_RELU: return relu_avx2;
+         case ACT_SIGMOID: return sigmoid_avx2;
+         case ACT_TANH: return tanh_avx2;
+         case ACT_LEAKY_RELU: return leaky_relu_avx2;
+         default: break;
+      }
+   }
+#endif
+   switch(act) {
+      case ACT_IDENTITY: return identity_scalar;
+      case ACT_RELU: return relu_scalar;
+      case ACT_SIGMOID: return sigmoid_scalar;
+      case ACT_TANH: return tanh_scalar;
+      case ACT_LEAKY_RELU: return leaky_relu_scalar;
+      default: break;
+   }
+   printf("Activation %d has no built-in kernel!\n", act);
+   throw invalid_argument("Activation has no built-in kernel!");
+}
+
+// Registry -------------------------------------------------------------------
+/* Entries are only ever appended. The count is published after the entry
+ * is written, so lookups don't need the lock.
+ */
+struct ActivationRegistry {
+   ActivationInfo entries[MAX_ACTIVATIONS];
+   atomic<unsigned int> count;
+   mutex lock;
+
+   ActivationRegistry() {
+      SimdLevel level = cpu_simd_level();
+      entries[ACT_IDENTITY] = {"IDENTITY", identity, activation_kernel(ACT_IDENTITY, level)};
+      entries[ACT_RELU] = {"RELU", relu, activation_kernel(ACT_RELU, level)};
+      entries[ACT_SIGMOID] = {"SIGMOID", sigmoid, activation_kernel(ACT_SIGMOID, level)};
+      entries[ACT_TANH] = {"TANH", tanh_act, activation_kernel(ACT_TANH, level)};
+      entries[ACT_LEAKY_RELU] = {"LEAKY_RELU", leaky_relu, activation_kernel(ACT_LEAKY_RELU, level)};
+      count = NUM_BUILTIN_ACTIVATIONS;
+   }
+};
+
+static ActivationRegistry& registry() {
+   static ActivationRegistry reg;
+   return reg;
+}
+
+const ActivationInfo& activation_info(Activation act) {
+   ActivationRegistry& reg = registry();
+   if(static_cast<unsigned int>(act) >= reg.count) {
+      printf("Activation %d is not registered!\n", act);
+      throw out_of_range("Activation is not registered!");
+   }
+   return reg.entries[act];
+}
+
+const char* activation_str(Activation act) {
+   return activation_info(act).name;
+}
+
+static int find_activation(ActivationRegistry& reg, float (*func)(float)) {
+   unsigned int count = reg.count;
+   for(unsigned int i = 0; i < count; i++) {
+      if(reg.entries[i].func == func) return i;
+   }
+   return -1;
+}
+
+Activation register_activation(const char* name, float (*func)(float), ActivationKernel kernel) {
+   ActivationRegistry& reg = registry();
+   lock_guard<mutex> guard(reg.lock);
+
+   int found = find_activation(reg, func);
+   if(found >= 0) {
+      return static_cast<Activation>(found);
+   }
+   if(reg.count == MAX_ACTIVATIONS) {
+      printf("Can't register activation %s, all %d slots are used!\n", name, MAX_ACTIVATIONS);
+      throw out_of_range("Too many activations registered!");
+   }
+   unsigned int id = reg.count;
+   reg.entries[id] = {name, func, kernel};
+   reg.count = id + 1;
+   return static_cast<Activation>(id);
+}
+
+Activation activation_from_func(float (*func)(float)) {
+   // A missing activation function has always meant the identity
+   if(func == nullptr) {
+      return ACT_IDENTITY;
+   }
+   int found = find_activation(registry(), func);
+   if(found >= 0) {
+      return static_cast<Activation>(found);
+   }
+   return register_activation("CUSTOM", func);
+}
+
+Activation activation_from_name(const char* name) {
+   ActivationRegistry& reg = registry();
+   unsigned int count = reg.count;
+   for(unsigned int i = 0; i < count; i++) {
+      if(strcmp(reg.entries[i].name, name) == 0) return static_cast<Activation>(i);
+   }
+   printf("Activation %s is not registered!\n", name);
+   throw invalid_argument("Activation is not registered!");
+}
+
+void activate(Activation act, const float* in, float* out, size_t n) {
+   const ActivationInfo& info = activation_info(act);
+   if(info.kernel) {
+      info.kernel(in, out, n);
+   } else {
+      for(size_t i = 0; i < n; i++) out[i] = info.func(in[i]);
+   }
+}
+
+// Backward Pass --------------------------------------------------------------
+static void backward_scalar(Activation act, const float* pre_act, const float* out,
+                            const float* grad_out, float* grad_in, size_t n) {
+   switch(act) {
+      case ACT_IDENTITY:
+         if(grad_in != grad_out) {
+            for(size_t i = 0; i < n; i++) grad_in[i] = grad_out[i];
+         }
+         return;
+      case ACT_RELU:
+         for(size_t i = 0; i < n; i++) grad_in[i] = pre_act[i] > 0.0f ? grad_out[i] : 0.0f;
+         return;
+      case ACT_SIGMOID:
+         for(size_t i = 0; i < n; i++) grad_in[i] = grad_out[i] * out[i] * (1.0f - out[i]);
+         return;
+      case ACT_TANH:
+         for(size_t i = 0; i < n; i++) grad_in[i] = grad_out[i] * (1.0f - out[i] * out[i]);
+         return;
+      case ACT_LEAKY_RELU:
+         for(size_t i = 0; i < n; i++) {
+            grad_in[i] = pre_act[i] > 0.0f ? grad_out[i] : LEAKY_RELU_SLOPE * grad_out[i];
+         }
+         return;
+      default: break;
+   }
+
+   float (*func)(float) = activation_info(act).func;
+   for(size_t i = 0; i < n; i++) {
+      float x = pre_act[i];
+      float h = 1e-3f * std::max(1.0f, std::fabs(x));
+      grad_in[i] = grad_out[i] * (func(x + h) - func(x - h)) / (2.0f * h);
+   }
+}
+
+#if HAVE_X86_SIMD
+__attribute__((target("avx2,fma")))
+static void backward_avx2(Activation act, const float* pre_act, const float* out,
+                          const float* grad_out, float* grad_in, size_t n) {
+   const __m256 zero = _mm256_setzero_ps();
+   const __m256 one = _mm256_set1_ps(1.0f);
+   const __m256 slope = _mm256_set1_ps(LEAKY_RELU_SLOPE);
+   size_t i = 0;
+   switch(act) {
+      case ACT_RELU:
+         for(; i + 8 <= n; i += 8) {
+            __m256 pos = _mm256_cmp_ps(_mm256_loadu_ps(pre_act + i), zero, _CMP_GT_OQ);
+            _mm256_storeu_ps(grad_in + i, _mm256_and_ps(pos, _mm256_loadu_ps(grad_out + i)));
+         }
+         break;
+      case ACT_SIGMOID:
+         for(; i + 8 <= n; i += 8) {
+            __m256 y = _mm256_loadu_ps(out + i);
+            __m256 dy = _mm256_mul_ps(y, _mm256_sub_ps(one, y));
+            _mm256_storeu_ps(grad_in + i, _mm256_mul_ps(_mm256_loadu_ps(grad_out + i), dy));
+         }
+         break;
+      case ACT_TANH:
+         for(; i + 8 <= n; i += 8) {
+            __m256 y = _mm256_loadu_ps(out + i);
+            __m256 dy = _mm256_fnmadd_ps(y, y, one);
+            _mm256_storeu_ps(grad_in + i, _mm256_mul_ps(_mm256_loadu_ps(grad_out + i), dy));
+         }
+         break;
+      case ACT_LEAKY_RELU:
+         for(; i + 8 <= n; i += 8) {
+            __m256 pos = _mm256_cmp_ps(_mm256_loadu_ps(pre_act + i), zero, _CMP_GT_OQ);
+            __m256 dy = _mm256_blendv_ps(slope, one, pos);
+            _mm256_storeu_ps(grad_in + i, _mm256_mul_ps(_mm256_loadu_ps(grad_out + i), dy));
+         }
+         break;
+      default: break;
+   }
+   backward_scalar(act, pre_act + i, out + i, grad_out + i, grad_in + i, n - i);
+}
+#endif
+
+void activate_backward(Activation act, const float* pre_act, const float* out,
+                       const float* grad_out, float* grad_in, size_t n) {
+#if HAVE_X86_SIMD
+   static const bool use_avx2 = cpu_simd_level() >= SIMD_AVX2;
+   if(use_avx2) {
+      backward_avx2(act, pre_act, out, grad_out, grad_in, n);
+      return;
+   }
+#endif
+   backward_scalar(act, pre_act, out, grad_out, grad_in, n);
+}
@@ -0,0 +1,84 @@
+
+#ifndef ACTIVATION_HPP
+#define ACTIVATION_HPP
+
+#include <cstddef>
+#include "CpuFeatures.hpp"
+
+/* Activation functions
+ *
+ * Every activation has a scalar form, float f(float), and a batch kernel
+ * that applies it to a whole array at once (in and out may be the same
+ * array). The batch kernels are what the dense layers run, they are picked
+ * for the running CPU and vectorized where the instruction set allows.
+ *
+ * The vectorized sigmoid and tanh are built on a polynomial exp. Their
+ * absolute error against the exact functions is at most 1e-7 for sigmoid
+ * and 2e-7 for tanh over all finite inputs, about the same as the scalar
+ * libm based versions.
+ *
+ * Built-in activations have fixed ids. Any other float(float) function can
+ * be registered and then used per layer like the built-ins, it just runs
+ * one element at a time unless a batch kernel is registered with it.
+ */
+// The fixed underlying type makes every registry id up to MAX_ACTIVATIONS
+// a valid Activation, not just the named ones
+enum Activation : int {
+   ACT_IDENTITY,
+   ACT_RELU,
+   ACT_SIGMOID,
+   ACT_TANH,
+   ACT_LEAKY_RELU,
+   NUM_BUILTIN_ACTIVATIONS
+};
+
+// Registered activations, including the built-ins
+#define MAX_ACTIVATIONS 32
+
+// Slope of leaky_relu for negative inputs
+#define LEAKY_RELU_SLOPE 0.01f
+
+typedef void (*ActivationKernel)(const float* in, float* out, size_t n);
+
+struct ActivationInfo {
+   const char* name;
+   float (*func)(float);     // scalar form
+   ActivationKernel kernel;  // batch form, null for registered ones without one
+};
+
+// Scalar Forms ---------------------------------------------------------------
+float identity(float x);
+float relu(float x);
+float sigmoid(float x);
+float tanh_act(float x);
+float leaky_relu(float x);
+
+// Registry -------------------------------------------------------------------
+const ActivationInfo& activation_info(Activation act);
+const char* activation_str(Activation act);
+
+// The id of a scalar function, registering it if it isn't known yet
+Activation activation_from_func(float (*func)(float));
+Activation register_activation(const char* name, float (*func)(float),
+                               ActivationKernel kernel = nullptr);
+// The first activation registered under name, throws if there is none
+Activation activation_from_name(const char* name);
+
+// out[i] = act(in[i]) for n values
+void activate(Activation act, const float* in, float* out, size_t n);
+
+// A built-in's kernel for a specific instruction set, falling back to the
+// next best one when this build can't provide it
+ActivationKernel activation_kernel(Activation act, SimdLevel level);
+
+// Backward Pass --------------------------------------------------------------
+/* grad_in[i] = grad_out[i] * act'(x[i]) for n values, where pre_act holds
+ * the inputs x of the forward pass and out its outputs act(x). Sigmoid and
+ * tanh work from the outputs, the others from the inputs. grad_in may be
+ * grad_out. Registered activations use a central difference.
+ */
+void activate_backward(Activation act, const float* pre_act, const float* out,
+                       const float* grad_out, float* grad_in, size_t n);
+
+#endif
+
@@ -0,0 +1,392 @@
+
+#include "CodeGen.hpp"
+#include "Gemm.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <vector>
+
+using namespace std;
+
+// The generated kernels work on 8 float slivers, one AVX2 register each
+static_assert(GEMM_NR == 8, "Generated code assumes 8 column slivers");
+
+CodeGenOptions codegen_options(const string& name, unsigned int unroll_limit, bool simd) {
+   return {name, unroll_limit, simd};
+}
+
+// Emitting -------------------------------------------------------------------
+static void emit(string& out, const char* format, ...) {
+   char line[512];
+   va_list args;
+   va_start(args, format);
+   vsnprintf(line, sizeof(line), format, args);
+   va_end(args);
+   out += line;
+}
+
+// Shortest literal that reads back as exactly the same float
+static string float_literal(float value) {
+   if(!std::isfinite(value)) {
+      printf("Can't generate code for the weight %f\n", value);
+      throw invalid_argument("Network parameters must be finite to generate code!");
+   }
+   char text[32];
+   for(int digits = 6; digits <= 9; digits++) {
+      snprintf(text, sizeof(text), "%.*g", digits, value);
+      if(strtof(text, nullptr) == value) break;
+   }
+   string literal = text;
+   if(literal.find_first_of(".e") == string::npos) literal += ".0";
+   return literal + "f";
+}
+
+static void emit_array(string& out, const char* name, const vector<float>& values) {
+   emit(out, "alignas(32) constexpr float %s[%d] = {", name, (int)values.size());
+   for(size_t i = 0; i < values.size(); i++) {
+      out += i % 8 == 0 ? "\n   " : " ";
+      out += float_literal(values[i]);
+      if(i + 1 < values.size()) out += ",";
+   }
+   out += "\n};\n\n";
+}
+
+static bool is_identifier(const string& name) {
+   if(name.empty() || isdigit((unsigned char)name[0])) return false;
+   for(char c : name) {
+      if(!isalnum((unsigned char)c) && c != '_') return false;
+   }
+   return true;
+}
+
+// Activations ----------------------------------------------------------------
+static const char* activation_function(Activation activation) {
+   switch(activation) {
+      case ACT_IDENTITY: return nullptr;
+      case ACT_RELU: return "relu";
+      case ACT_SIGMOID: return "sigmoid";
+      case ACT_TANH: return "tanh_act";
+      case ACT_LEAKY_RELU: return "leaky_relu";
+      default:
+         printf("Can't generate code for the registered activation %s\n", activation_str(activation));
+         throw invalid_argument("Only built-in activations can be generated!");
+   }
+}
+
+// The same expressions as the scalar forms in Activation.cpp
+static void emit_activations(string& out, const vector<bool>& used) {
+   if(used[ACT_RELU]) {
+      out += "inline float relu(float x) { return x > 0.0f ? x : 0.0f; }\n";
+   }
+   if(used[ACT_SIGMOID]) {
+      out += "inline float sigmoid(float x) { return 1.0f / (1.0f + std::exp(-x)); }\n";
+   }
+   if(used[ACT_TANH]) {
+      out += "inline float tanh_act(float x) { return std::tanh(x); }\n";
+   }
+   if(used[ACT_LEAKY_RELU]) {
+      emit(out, "inline float leaky_relu(float x) { return x > 0.0f ? x : %s * x; }\n",
+           float_literal(LEAKY_RELU_SLOPE).c_str());
+   }
+   out += "\n";
+}
+
+/* exp, sigmoid and tanh over whole rows for the looped layers. The vector
+ * exp is the polynomial the library's AVX2 activation kernels use, see
+ * Activation.cpp.
+ */
+static void emit_vector_activations(string& out, bool sigmoid, bool tanh) {
+   out +=
+      "#if defined(__AVX2__) && defined(__FMA__)\n"
+      "inline __m256 exp8(__m256 x) {\n"
+      "   x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-87.3365447504f)), _mm256_set1_ps(88.0f));\n"
+      "   __m256 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504088896341f)),\n"
+      "                              _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);\n"
+      "   __m256 r = _mm256_fnmadd_ps(n, _mm256_set1_ps(0.693359375f), x);\n"
+      "   r = _mm256_fnmadd_ps(n, _mm256_set1_ps(-2.12194440e-4f), r);\n"
+      "   __m256 p = _mm256_set1_ps(1.9875691500e-4f);\n"
+      "   p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.3981999507e-3f));\n"
+      "   p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(8.3334519073e-3f));\n"
+      "   p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(4.1665795894e-2f));\n"
+      "   p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.6666665459e-1f));\n"
+      "   p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(5.0000001201e-1f));\n"
+      "   p = _mm256_fmadd_ps(p, _mm256_mul_ps(r, r), _mm256_add_ps(r, _mm256_set1_ps(1.0f)));\n"
+      "   __m256i pow2n = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n),\n"
+      "                                                      _mm256_set1_epi32(127)), 23);\n"
+      "   return _mm256_mul_ps(p, _mm256_castsi256_ps(pow2n));\n"
+      "}\n\n"
+      "inline __m256 sigmoid8(__m256 x) {\n"
+      "   const __m256 one = _mm256_set1_ps(1.0f);\n"
+      "   return _mm256_div_ps(one, _mm256_add_ps(one, exp8(_mm256_sub_ps(_mm256_setzero_ps(), x))));\n"
+      "}\n"
+      "#endif\n\n";
+   if(sigmoid) {
+      out +=
+         "inline void sigmoid_row(float* out, unsigned int n) {\n"
+         "   unsigned int j = 0;\n"
+         "#if defined(__AVX2__) && defined(__FMA__)\n"
+         "   for(; j + 8 <= n; j += 8) _mm256_storeu_ps(out + j, sigmoid8(_mm256_loadu_ps(out + j)));\n"
+         "#endif\n"
+         "   for(; j < n; j++) out[j] = sigmoid(out[j]);\n"
+         "}\n\n";
+   }
+   if(tanh) {
+      out +=
+         "// tanh(x) = 2 * sigmoid(2x) - 1\n"
+         "inline void tanh_row(float* out, unsigned int n) {\n"
+         "   unsigned int j = 0;\n"
+         "#if defined(__AVX2__) && defined(__FMA__)\n"
+         "   const __m256 two = _mm256_set1_ps(2.0f);\n"
+         "   for(; j + 8 <= n; j += 8) {\n"
+         "      __m256 s = sigmoid8(_mm256_mul_ps(two, _mm256_loadu_ps(out + j)));\n"
+         "      _mm256_storeu_ps(out + j, _mm256_fmsub_ps(two, s, _mm256_set1_ps(1.0f)));\n"
+         "   }\n"
+         "#endif\n"
+         "   for(; j < n; j++) out[j] = tanh_act(out[j]);\n"
+         "}\n\n";
+   }
+}
+
+// Looped Layers --------------------------------------------------------------
+static void emit_dense_kernel(string& out, bool simd) {
+   out +=
+      "// out = in . W + b for W packed in 8 column slivers, each k rows of 8\n"
+      "inline void dense(const float* in, const float* w, const float* b, float* out,\n"
+      "                  unsigned int k, unsigned int n) {\n"
+      "   unsigned int slivers = (n + 7) / 8;\n"
+      "   unsigned int s = 0;\n";
+   if(simd) {
+      out +=
+         "#if defined(__AVX2__) && defined(__FMA__)\n"
+         "   // Four slivers at a time, four independent chains of FMAs\n"
+         "   for(; s + 4 <= slivers; s += 4) {\n"
+         "      const float* ws = w + s * k * 8;\n"
+         "      __m256 acc[4];\n"
+         "      for(unsigned int i = 0; i < 4; i++) acc[i] = _mm256_load_ps(b + (s + i) * 8);\n"
+         "      for(unsigned int p = 0; p < k; p++) {\n"
+         "         __m256 x = _mm256_set1_ps(in[p]);\n"
+         "         for(unsigned int i = 0; i < 4; i++) {\n"
+         "            acc[i] = _mm256_fmadd_ps(x, _mm256_load_ps(ws + (i * k + p) * 8), acc[i]);\n"
+         "         }\n"
+         "      }\n"
+         "      for(unsigned int i = 0; i < 4; i++) store(out, (s + i) * 8, n, acc[i]);\n"
+         "   }\n"
+         "   // The last few one at a time, with the rows split over four chains\n"
+         "   for(; s < slivers; s++) {\n"
+         "      const float* ws = w + s * k * 8;\n"
+         "      __m256 acc[4] = {_mm256_load_ps(b + s * 8), _mm256_setzero_ps(),\n"
+         "                       _mm256_setzero_ps(), _mm256_setzero_ps()};\n"
+         "      unsigned int p = 0;\n"
+         "      for(; p + 4 <= k; p += 4) {\n"
+         "         for(unsigned int i = 0; i < 4; i++) {\n"
+         "            acc[i] = _mm256_fmadd_ps(_mm256_set1_ps(in[p + i]), _mm256_load_ps(ws + (p + i) * 8), acc[i]);\n"
+         "         }\n"
+         "      }\n"
+         "      for(; p < k; p++) {\n"
+         "         acc[0] = _mm256_fmadd_ps(_mm256_set1_ps(in[p]), _mm256_load_ps(ws + p * 8), acc[0]);\n"
+         "      }\n"
+         "      store(out, s * 8, n, _mm256_add_ps(_mm256_add_ps(acc[0], acc[1]), _mm256_add_ps(acc[2], acc[3])));\n"
+         "   }\n"
+         "#endif\n";
+   }
+   out +=
+      "   for(; s < slivers; s++) {\n"
+      "      const float* ws = w + s * k * 8;\n"
+      "      float acc[8];\n"
+      "      for(unsigned int i = 0; i < 8; i++) acc[i] = b[s * 8 + i];\n"
+      "      for(unsigned int p = 0; p < k; p++) {\n"
+      "         for(unsigned int i = 0; i < 8; i++) acc[i] += in[p] * ws[p * 8 + i];\n"
+      "      }\n"
+      "      for(unsigned int i = 0; i < 8 && s * 8 + i < n; i++) out[s * 8 + i] = acc[i];\n"
+      "   }\n"
+      "}\n\n";
+}
+
+static void emit_store(string& out) {
+   out +=
+      "#if defined(__AVX2__) && defined(__FMA__)\n"
+      "// Stores columns j .. j + 7 of a row of n values\n"
+      "inline void store(float* out, unsigned int j, unsigned int n, __m256 v) {\n"
+      "   if(j + 8 <= n) {\n"
+      "      _mm256_storeu_ps(out + j, v);\n"
+      "      return;\n"
+      "   }\n"
+      "   alignas(32) float tail[8];\n"
+      "   _mm256_store_ps(tail, v);\n"
+      "   for(unsigned int i = 0; j + i < n; i++) out[j + i] = tail[i];\n"
+      "}\n"
+      "#endif\n\n";
+}
+
+// Layers ---------------------------------------------------------------------
+static bool unrolled(const Layer& layer, const CodeGenOptions& options) {
+   return (unsigned long)layer.get_input_size() * layer.get_layer_size() <= options.unroll_limit;
+}
+
+// Sigmoid and tanh over a whole row of 8 or more outputs run vectorized
+static bool row_activation(const Layer& layer, const CodeGenOptions& options) {
+   Activation activation = layer.get_activation();
+   return options.simd && (activation == ACT_SIGMOID || activation == ACT_TANH) &&
+          (!unrolled(layer, options) || layer.get_layer_size() >= 8);
+}
+
+static void emit_row_activation(string& out, const Layer& layer) {
+   emit(out, "   %s_row(out, %d);\n",
+        layer.get_activation() == ACT_SIGMOID ? "sigmoid" : "tanh", layer.get_layer_size());
+}
+
+static void emit_unrolled_layer(string& out, unsigned int num, const Layer& layer, bool row_act) {
+   unsigned int k = layer.get_input_size();
+   unsigned int n = layer.get_layer_size();
+   auto weights = layer.get_weights();
+   const float* biases = layer.get_biases()->get_data();
+   const char* act = row_act ? nullptr : activation_function(layer.get_activation());
+
+   emit(out, "// Layer %d: %d -> %d, %s, unrolled\n", num, k, n, activation_str(layer.get_activation()));
+   emit(out, "inline void layer%d(const float* in, float* out) {\n", num);
+   for(unsigned int j = 0; j < n; j++) {
+      string sum = float_literal(biases[j]);
+      for(unsigned int p = 0; p < k; p++) {
+         float w = weights->row_data(p)[j];
+         if(w == 0.0f) continue;
+         sum += "\n                  + in[" + to_string(p) + "] * " + float_literal(w);
+      }
+      // Appended rather than emitted, the sum can be any length
+      out += "   out[" + to_string(j) + "] = ";
+      out += act ? string(act) + "(" + sum + ");\n" : sum + ";\n";
+   }
+   if(row_act) emit_row_activation(out, layer);
+   out += "}\n\n";
+}
+
+static void emit_looped_layer(string& out, unsigned int num, const Layer& layer, bool row_act) {
+   unsigned int k = layer.get_input_size();
+   unsigned int n = layer.get_layer_size();
+   auto weights = layer.get_weights();
+   const char* act = activation_function(layer.get_activation());
+
+   vector<float> packed(gemm_packed_b_size(k, n));
+   gemm_pack_b(k, n, weights->get_data(), weights->get_stride(), packed.data());
+   vector<float> biases((n + 7) / 8 * 8, 0.0f);
+   std::copy(layer.get_biases()->get_data(), layer.get_biases()->get_data() + n, biases.begin());
+
+   emit(out, "// Layer %d: %d -> %d, %s\n", num, k, n, activation_str(layer.get_activation()));
+   emit_array(out, ("w" + to_string(num)).c_str(), packed);
+   emit_array(out, ("b" + to_string(num)).c_str(), biases);
+   emit(out, "inline void layer%d(const float* in, float* out) {\n", num);
+   emit(out, "   dense(in, w%d, b%d, out, %d, %d);\n", num, num, k, n);
+   if(row_act) {
+      emit_row_activation(out, layer);
+   } else if(act) {
+      emit(out, "   for(unsigned int j = 0; j < %d; j++) out[j] = %s(out[j]);\n", n, act);
+   }
+   out += "}\n\n";
+}
+
+// Network --------------------------------------------------------------------
+string generate_code(const Network& network, const CodeGenOptions& options, const string& source) {
+   if(!is_identifier(options.name)) {
+      printf("%s is not a valid C++ identifier\n", options.name.c_str());
+      throw invalid_argument("Generated code needs an identifier for its name!");
+   }
+   unsigned int num_layers = network.get_num_layers();
+
+   // What the layers need, so only that gets emitted
+   vector<bool> used(NUM_BUILTIN_ACTIVATIONS, false);
+   vector<bool> used_rows(NUM_BUILTIN_ACTIVATIONS, false);
+   bool any_looped = false;
+   unsigned int widest = 0;
+   for(unsigned int i = 0; i < num_layers; i++) {
+      const Layer& layer = network.get_layer(i);
+      activation_function(layer.get_activation()); // throws for registered ones
+      used[layer.get_activation()] = true;
+      any_looped |= !unrolled(layer, options);
+      if(row_activation(layer, options)) used_rows[layer.get_activation()] = true;
+      if(i + 1 < num_layers) widest = max(widest, layer.get_layer_size());
+   }
+   bool any_rows = used_rows[ACT_SIGMOID] || used_rows[ACT_TANH];
+   bool simd = options.simd && (any_looped || any_rows);
+
+   string guard = options.name;
+   std::transform(guard.begin(), guard.end(), guard.begin(), ::toupper);
+   guard += "_HPP";
+
+   string out;
+   out += "// Generated by nncodegen";
+   if(!source.empty()) out += " from " + source;
+   out += ", do not edit.\n";
+   emit(out, "// %d inputs, %d layers (", network.get_input_size(), num_layers);
+   for(unsigned int i = 0; i < num_layers; i++) {
+      emit(out, i == 0 ? "%d" : ", %d", network.get_layer_size(i));
+   }
+   out += ")\n\n";
+   emit(out, "#ifndef %s\n#define %s\n\n#include <cmath>\n", guard.c_str(), guard.c_str());
+   if(simd) {
+      out += "#if defined(__AVX2__) && defined(__FMA__)\n#include <immintrin.h>\n#endif\n";
+   }
+   emit(out, "\nnamespace %s {\n\n", options.name.c_str());
+   emit(out, "constexpr unsigned int input_size = %d;\n", network.get_input_size());
+   emit(out, "constexpr unsigned int output_size = %d;\n", network.get_layer_size(num_layers - 1));
+   emit(out, "constexpr unsigned int num_layers = %d;\n\n", num_layers);
+
+   out += "namespace detail {\n\n";
+   emit_activations(out, used);
+   if(any_rows) {
+      emit_vector_activations(out, used_rows[ACT_SIGMOID], used_rows[ACT_TANH]);
+   }
+   if(any_looped) {
+      if(simd) emit_store(out);
+      emit_dense_kernel(out, simd);
+   }
+   for(unsigned int i = 0; i < num_layers; i++) {
+      const Layer& layer = network.get_layer(i);
+      bool row_act = row_activation(layer, options);
+      if(unrolled(layer, options)) emit_unrolled_layer(out, i, layer, row_act);
+      else emit_looped_layer(out, i, layer, row_act);
+   }
+   out += "} // namespace detail\n\n";
+
+   // Hidden layers ping-pong between two buffers on the stack
+   out += "// in holds input_size floats, out gets output_size\n";
+   out += "inline void compute(const float* in, float* out) {\n";
+   if(num_layers > 2) {
+      emit(out, "   alignas(32) float a[%d], b[%d];\n", widest, widest);
+   } else if(num_layers == 2) {
+      emit(out, "   alignas(32) float a[%d];\n", widest);
+   }
+   for(unsigned int i = 0; i < num_layers; i++) {
+      const char* from = i == 0 ? "in" : (i % 2 == 1 ? "a" : "b");
+      const char* to = i + 1 == num_layers ? "out" : (i % 2 == 0 ? "a" : "b");
+      emit(out, "   detail::layer%d(%s, %s);\n", i, from, to);
+   }
+   out += "}\n\n";
+
+   out += "// rows samples, one after the other\n";
+   out += "inline void compute(const float* in, float* out, unsigned int rows) {\n";
+   out += "   for(unsigned int r = 0; r < rows; r++) {\n";
+   out += "      compute(in + r * input_size, out + r * output_size);\n";
+   out += "   }\n";
+   out += "}\n\n";
+
+   emit(out, "} // namespace %s\n\n#endif\n", options.name.c_str());
+   return out;
+}
+
+void write_code(const Network& network, const string& path,
+                const CodeGenOptions& options, const string& source) {
+   string code = generate_code(network, options, source);
+   FILE* file = fopen(path.c_str(), "w");
+   if(file == nullptr) {
+      printf("Couldn't open %s for writing\n", path.c_str());
+      throw runtime_error("Couldn't open generated code file for writing!");
+   }
+   size_t written = fwrite(code.data(), 1, code.size(), file);
+   if(fclose(file) != 0 || written != code.size()) {
+      printf("Couldn't write %s\n", path.c_str());
+      throw runtime_error("Couldn't write generated code file!");
+   }
+}
@@ -0,0 +1,55 @@
+
+#ifndef CODEGEN_HPP
+#define CODEGEN_HPP
+
+#include <string>
+#include "Network.hpp"
+
+/* Ahead of time C++ for frozen networks
+ *
+ * generate_code turns a Network into a standalone header: the weights
+ * become constexpr arrays and the forward pass straight-line code that
+ * only needs <cmath> (and <immintrin.h> for the SIMD kernels), nothing
+ * from this project. The header defines, in namespace options.name,
+ *
+ *    constexpr unsigned int input_size, output_size, num_layers;
+ *    void compute(const float* in, float* out);
+ *    void compute(const float* in, float* out, unsigned int rows);
+ *
+ * Layers with at most unroll_limit weights are unrolled completely, one
+ * expression per output with every weight a literal and zero weights left
+ * out. Larger layers keep their weights in GEMM_NR wide column slivers
+ * (see gemm_pack_b) and run a loop over them, with AVX2 + FMA intrinsics
+ * when the including code is compiled with them enabled and simd is set,
+ * and a plain loop the compiler can vectorize otherwise.
+ *
+ * Activations are emitted as the same scalar expressions the library
+ * uses. With simd set, sigmoid and tanh over 8 or more outputs use the
+ * library's AVX2 polynomial instead. Only the built-in activations can be
+ * generated, registered ones have no source to emit.
+ *
+ * The tools/nncodegen target runs this on a model file or one of the
+ * default networks.
+ */
+
+// Layers with more weights than this run as loops by default
+#define CODEGEN_UNROLL_LIMIT 256
+
+struct CodeGenOptions {
+   std::string name;            // namespace of the generated code, a C identifier
+   unsigned int unroll_limit;   // largest layer (in weights) to unroll
+   bool simd;                   // emit AVX2 kernels for the looped layers
+};
+
+CodeGenOptions codegen_options(const std::string& name,
+                               unsigned int unroll_limit = CODEGEN_UNROLL_LIMIT,
+                               bool simd = true);
+
+// source is mentioned in the header comment, e.g. the model file's path
+std::string generate_code(const Network& network, const CodeGenOptions& options,
+                          const std::string& source = "");
+void write_code(const Network& network, const std::string& path,
+                const CodeGenOptions& options, const std::string& source = "");
+
+#endif
+
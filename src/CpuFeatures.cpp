@@ -0,0 +1,55 @@
+
+#include "CpuFeatures.hpp"
+
+static const char* SimdLevelStrings[] = { "SCALAR", "SSE", "AVX2", "AVX512" };
+
+static SimdLevel detect_simd_level() {
+#if HAVE_X86_SIMD
+   __builtin_cpu_init();
+   if(__builtin_cpu_supports("avx512f"))
+      return SIMD_AVX512;
+   if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+      return SIMD_AVX2;
+   if(__builtin_cpu_supports("sse2"))
+      return SIMD_SSE;
+#endif
+   return SIMD_SCALAR;
+}
+
+SimdLevel cpu_simd_level() {
+   static const SimdLevel level = detect_simd_level();
+   return level;
+}
+
+static bool detect_avx512_vnni() {
+#if HAVE_X86_SIMD
+   __builtin_cpu_init();
+   return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vnni");
+#else
+   return false;
+#endif
+}
+
+bool cpu_has_avx512_vnni() {
+   static const bool vnni = detect_avx512_vnni();
+   return vnni;
+}
+
+static bool detect_f16c() {
+#if HAVE_X86_SIMD
+   __builtin_cpu_init();
+   return __builtin_cpu_supports("f16c");
+#else
+   return false;
+#endif
+}
+
+bool cpu_has_f16c() {
+   static const bool f16c = detect_f16c();
+   return f16c;
+}
+
+const char* simd_level_str(SimdLevel level) {
+   return SimdLevelStrings[level];
+}
+
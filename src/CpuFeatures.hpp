@@ -0,0 +1,31 @@
+
+#ifndef CPUFEATURES_HPP
+#define CPUFEATURES_HPP
+
+// x86 SIMD kernels are only built with compilers that support per-function
+// target attributes, everything else falls back to the scalar kernels.
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD 1
+#else
+#define HAVE_X86_SIMD 0
+#endif
+
+// Instruction set levels in increasing order of capability
+enum SimdLevel {
+   SIMD_SCALAR,
+   SIMD_SSE,
+   SIMD_AVX2,
+   SIMD_AVX512
+};
+
+// The best level the running CPU supports, detected once on first use
+SimdLevel cpu_simd_level();
+const char* simd_level_str(SimdLevel level);
+
+// AVX-512 VNNI (8 bit dot products), an extension on top of SIMD_AVX512
+bool cpu_has_avx512_vnni();
+// F16C (half precision conversions), found alongside AVX2 in practice
+bool cpu_has_f16c();
+
+#endif
+
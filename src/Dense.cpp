@@ -0,0 +1,297 @@
+
+#include "Dense.hpp"
+#include "Gemm.hpp"
+#include "Gemv.hpp"
+#include "SparseMatrix.hpp"
+#include "TernaryMatrix.hpp"
+#include <algorithm>
+#include <stdexcept>
+
+using namespace std;
+
+static void check_shape(const Matrix* mat, unsigned int rows, unsigned int cols,
+                        const char* name) {
+   if(mat && (mat->get_rows() != rows || mat->get_cols() != cols)) {
+      printf("Dense layer %s has the wrong shape!\n", name);
+      printf("Got (%d , %d) expected (%d , %d)\n", mat->get_rows(), mat->get_cols(), rows, cols);
+      throw invalid_argument("Dense layer buffer has the wrong shape!");
+   }
+}
+
+static void multiply(const Matrix& input, const Matrix& weights, WeightLayout layout,
+                     Matrix& result, const GemmEpilogue* epilogue) {
+   unsigned int rows = input.get_rows();
+   unsigned int k = input.get_cols();
+   unsigned int n = result.get_cols();
+
+   switch(layout) {
+      case INPUT_MAJOR:
+         if(rows == 1) {
+            gemv_sparse_input(n, k, input.get_data(), weights.get_data(), weights.get_stride(),
+                              result.get_data(), epilogue);
+         } else {
+            gemm(rows, n, k, input.get_data(), input.get_stride(),
+                 weights.get_data(), weights.get_stride(),
+                 result.get_data(), result.get_stride(), epilogue);
+         }
+         break;
+
+      case OUTPUT_MAJOR:
+         if(rows == 1) {
+            gemv_t(n, k, input.get_data(), weights.get_data(), weights.get_stride(),
+                   result.get_data(), epilogue);
+         } else {
+            gemm_bt(rows, n, k, input.get_data(), input.get_stride(),
+                    weights.get_data(), weights.get_stride(),
+                    result.get_data(), result.get_stride(), epilogue);
+         }
+         break;
+
+      case PACKED_OUTPUT_MAJOR:
+         if(rows == 1) {
+            gemv_packed_sparse_input(n, k, input.get_data(), weights.get_data(),
+                                     result.get_data(), epilogue);
+         } else {
+            gemm_packed_b(rows, n, k, input.get_data(), input.get_stride(),
+                          weights.get_data(),
+                          result.get_data(), result.get_stride(), epilogue);
+         }
+         break;
+   }
+}
+
+// Weight Layouts -------------------------------------------------------------
+static const char* WeightLayoutStrings[] = { "INPUT_MAJOR", "OUTPUT_MAJOR", "PACKED_OUTPUT_MAJOR" };
+
+const char* weight_layout_str(WeightLayout layout) {
+   return WeightLayoutStrings[layout];
+}
+
+shared_ptr<Matrix> layout_weights(const Matrix& weights, WeightLayout layout) {
+   unsigned int k = weights.get_rows();
+   unsigned int n = weights.get_cols();
+
+   unsigned int rows, cols;
+   stored_weights_shape(layout, k, n, rows, cols);
+   auto stored = make_shared<Matrix>(rows, cols);
+   layout_weights_into(weights, layout, *stored);
+   return stored;
+}
+
+void stored_weights_shape(WeightLayout layout, unsigned int k, unsigned int n,
+                          unsigned int& rows, unsigned int& cols) {
+   switch(layout) {
+      case OUTPUT_MAJOR: rows = n; cols = k; break;
+      case PACKED_OUTPUT_MAJOR: rows = 1; cols = gemm_packed_b_size(k, n); break;
+      case INPUT_MAJOR:
+      default: rows = k; cols = n; break;
+   }
+}
+
+void layout_weights_into(const Matrix& weights, WeightLayout layout, Matrix& stored) {
+   unsigned int k = weights.get_rows();
+   unsigned int n = weights.get_cols();
+
+   switch(layout) {
+      case OUTPUT_MAJOR:
+         for(unsigned int p = 0; p < k; p++) {
+            const float* w_row = weights.row_data(p);
+            for(unsigned int j = 0; j < n; j++) {
+               stored.row_data(j)[p] = w_row[j];
+            }
+         }
+         break;
+
+      case PACKED_OUTPUT_MAJOR:
+         gemm_pack_b(k, n, weights.get_data(), weights.get_stride(), stored.get_data());
+         break;
+
+      case INPUT_MAJOR:
+      default:
+         for(unsigned int p = 0; p < k; p++) {
+            std::copy(weights.row_data(p), weights.row_data(p) + n, stored.row_data(p));
+         }
+         break;
+   }
+}
+
+shared_ptr<Matrix> logical_weights(const Matrix& stored, WeightLayout layout,
+                                   unsigned int k, unsigned int n) {
+   switch(layout) {
+      case OUTPUT_MAJOR: {
+         auto weights = make_shared<Matrix>(k, n);
+         for(unsigned int j = 0; j < n; j++) {
+            const float* w_row = stored.row_data(j);
+            for(unsigned int p = 0; p < k; p++) {
+               weights->row_data(p)[j] = w_row[p];
+            }
+         }
+         return weights;
+      }
+
+      case PACKED_OUTPUT_MAJOR: {
+         auto weights = make_shared<Matrix>(k, n);
+         const float* packed = stored.get_data();
+         for(unsigned int j = 0; j < n; j++) {
+            const float* sliver = packed + (j / GEMM_NR) * GEMM_NR * k;
+            unsigned int c = j % GEMM_NR;
+            for(unsigned int p = 0; p < k; p++) {
+               weights->row_data(p)[j] = sliver[p * GEMM_NR + c];
+            }
+         }
+         return weights;
+      }
+
+      case INPUT_MAJOR:
+      default:
+         return make_shared<Matrix>(&stored);
+   }
+}
+
+// 16 Bit Weights -------------------------------------------------------------
+shared_ptr<uint16_t> half_weights(const Matrix& weights, WeightPrecision precision) {
+   auto stored = matrix_alloc_as<uint16_t>(gemm_packed_b_size(weights.get_rows(), weights.get_cols()));
+   half_weights_into(weights, precision, stored.get());
+   return stored;
+}
+
+void half_weights_into(const Matrix& weights, WeightPrecision precision, uint16_t* stored) {
+   auto packed = layout_weights(weights, PACKED_OUTPUT_MAJOR);
+   floats_to_half(packed->get_data(), stored, packed->get_size(), precision);
+}
+
+shared_ptr<Matrix> logical_half_weights(const uint16_t* stored, WeightPrecision precision,
+                                        unsigned int k, unsigned int n) {
+   Matrix packed(1, gemm_packed_b_size(k, n));
+   half_to_floats(stored, packed.get_data(), packed.get_size(), precision);
+   return logical_weights(packed, PACKED_OUTPUT_MAJOR, k, n);
+}
+
+// Forward Pass ---------------------------------------------------------------
+/* Runs multiply(result, epilogue) for a layer and takes care of the bias
+ * add and activation, fused or with the intermediates kept.
+ */
+template<typename Multiply>
+static void forward(unsigned int rows, unsigned int n, const Matrix& biases,
+                    Activation activation, Matrix& output,
+                    Matrix* pre_bias, Matrix* pre_act, Multiply multiply) {
+   check_shape(&biases, 1, n, "biases");
+   check_shape(&output, rows, n, "output");
+   check_shape(pre_bias, rows, n, "pre-bias output");
+   check_shape(pre_act, rows, n, "pre-activation output");
+
+   const ActivationInfo& act = activation_info(activation);
+   bool identity = activation == ACT_IDENTITY;
+
+   // Fast path, everything happens as the product is written out
+   if(!pre_bias && !pre_act) {
+      GemmEpilogue epilogue = {biases.get_data(),
+                               identity ? nullptr : act.func,
+                               identity ? nullptr : act.kernel};
+      multiply(output, &epilogue);
+      return;
+   }
+
+   // Debug path, keep the intermediate values around as well
+   Matrix& product = pre_bias ? *pre_bias : output;
+   multiply(product, nullptr);
+
+   const float* bias = biases.get_data();
+   for(unsigned int y = 0; y < rows; y++) {
+      const float* pb = product.row_data(y);
+      float* pa = pre_act ? pre_act->row_data(y) : nullptr;
+      float* out = output.row_data(y);
+      for(unsigned int x = 0; x < n; x++) {
+         float val = pb[x] + bias[x];
+         if(pa) pa[x] = val;
+         out[x] = val;
+      }
+      activate(activation, out, out, n);
+   }
+}
+
+void dense_forward(const Matrix& input, const Matrix& weights,
+                   WeightLayout layout, const Matrix& biases,
+                   Activation activation,
+                   Matrix& output, Matrix* pre_bias, Matrix* pre_act) {
+   unsigned int rows = input.get_rows();
+   unsigned int k = input.get_cols();
+   unsigned int n = biases.get_cols();
+
+   switch(layout) {
+      case INPUT_MAJOR: check_shape(&weights, k, n, "weights"); break;
+      case OUTPUT_MAJOR: check_shape(&weights, n, k, "weights"); break;
+      case PACKED_OUTPUT_MAJOR: check_shape(&weights, 1, gemm_packed_b_size(k, n), "weights"); break;
+   }
+   forward(rows, n, biases, activation, output, pre_bias, pre_act,
+           [&](Matrix& result, const GemmEpilogue* epilogue) {
+      multiply(input, weights, layout, result, epilogue);
+   });
+}
+
+void dense_forward_half(const Matrix& input, const uint16_t* weights,
+                        WeightPrecision precision, const Matrix& biases,
+                        Activation activation,
+                        Matrix& output, Matrix* pre_bias, Matrix* pre_act) {
+   unsigned int rows = input.get_rows();
+   unsigned int k = input.get_cols();
+   unsigned int n = biases.get_cols();
+
+   forward(rows, n, biases, activation, output, pre_bias, pre_act,
+           [&](Matrix& result, const GemmEpilogue* epilogue) {
+      if(rows == 1) {
+         gemv_packed_half(n, k, input.get_data(), weights, precision,
+                          result.get_data(), epilogue);
+      } else {
+         gemm_packed_b_half(rows, n, k, input.get_data(), input.get_stride(),
+                            weights, precision,
+                            result.get_data(), result.get_stride(), epilogue);
+      }
+   });
+}
+
+void dense_forward_sparse(const Matrix& input, const SparseMatrix& weights,
+                          const Matrix& biases, Activation activation,
+                          Matrix& output, Matrix* pre_bias, Matrix* pre_act) {
+   unsigned int rows = input.get_rows();
+   unsigned int k = input.get_cols();
+   unsigned int n = biases.get_cols();
+
+   if(weights.get_rows() != n || weights.get_cols() != k) {
+      printf("Dense layer sparse weights have the wrong shape!\n");
+      printf("Got (%d , %d) expected (%d , %d)\n", weights.get_rows(), weights.get_cols(), n, k);
+      throw invalid_argument("Dense layer buffer has the wrong shape!");
+   }
+   forward(rows, n, biases, activation, output, pre_bias, pre_act,
+           [&](Matrix& result, const GemmEpilogue* epilogue) {
+      if(rows == 1) {
+         sparse_gemv(weights, input.get_data(), result.get_data(), epilogue);
+      } else {
+         sparse_gemm(rows, input.get_data(), input.get_stride(), weights,
+                     result.get_data(), result.get_stride(), epilogue);
+      }
+   });
+}
+
+void dense_forward_ternary(const Matrix& input, const TernaryMatrix& weights,
+                           const Matrix& biases, Activation activation,
+                           Matrix& output, Matrix* pre_bias, Matrix* pre_act) {
+   unsigned int rows = input.get_rows();
+   unsigned int k = input.get_cols();
+   unsigned int n = biases.get_cols();
+
+   if(weights.get_rows() != n || weights.get_cols() != k) {
+      printf("Dense layer ternary weights have the wrong shape!\n");
+      printf("Got (%d , %d) expected (%d , %d)\n", weights.get_rows(), weights.get_cols(), n, k);
+      throw invalid_argument("Dense layer buffer has the wrong shape!");
+   }
+   forward(rows, n, biases, activation, output, pre_bias, pre_act,
+           [&](Matrix& result, const GemmEpilogue* epilogue) {
+      if(rows == 1) {
+         ternary_gemv(weights, input.get_data(), result.get_data(), epilogue);
+      } else {
+         ternary_gemm(rows, input.get_data(), input.get_stride(), weights,
+                      result.get_data(), result.get_stride(), epilogue);
+      }
+   });
+}
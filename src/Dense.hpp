@@ -0,0 +1,94 @@
+
+#ifndef DENSE_HPP
+#define DENSE_HPP
+
+#include <cstdint>
+#include <memory>
+#include "Matrix.hpp"
+#include "Activation.hpp"
+#include "Half.hpp"
+
+class SparseMatrix;
+class TernaryMatrix;
+
+/* How a layer stores its (k inputs x n outputs) weight matrix.
+ *
+ * INPUT_MAJOR is the logical layout, one row per input. OUTPUT_MAJOR is
+ * its transpose, one contiguous row per output neuron, which turns every
+ * output of a single sample into a streaming dot product.
+ * PACKED_OUTPUT_MAJOR cuts the outputs into GEMM_NR wide slivers stored
+ * top to bottom (see gemm_pack_b), which both the GEMV and GEMM kernels
+ * stream through without any packing at run time.
+ */
+enum WeightLayout {
+   INPUT_MAJOR,
+   OUTPUT_MAJOR,
+   PACKED_OUTPUT_MAJOR
+};
+
+const char* weight_layout_str(WeightLayout layout);
+
+// Converts logical (k x n) weights into the given layout and back again
+std::shared_ptr<Matrix> layout_weights(const Matrix& weights, WeightLayout layout);
+std::shared_ptr<Matrix> logical_weights(const Matrix& stored, WeightLayout layout,
+                                        unsigned int k, unsigned int n);
+
+// Lays weights out into an existing buffer of the size layout_weights gives
+void layout_weights_into(const Matrix& weights, WeightLayout layout, Matrix& stored);
+
+// Dimensions of the matrix layout_weights gives for (k x n) weights
+void stored_weights_shape(WeightLayout layout, unsigned int k, unsigned int n,
+                          unsigned int& rows, unsigned int& cols);
+
+// Logical (k x n) weights to and from 16 bit storage, packed the same way
+// as PACKED_OUTPUT_MAJOR (gemm_packed_b_size(k, n) values)
+std::shared_ptr<uint16_t> half_weights(const Matrix& weights, WeightPrecision precision);
+void half_weights_into(const Matrix& weights, WeightPrecision precision, uint16_t* stored);
+std::shared_ptr<Matrix> logical_half_weights(const uint16_t* stored, WeightPrecision precision,
+                                             unsigned int k, unsigned int n);
+
+/* Fully connected layer kernel
+ *
+ *    output = activation(input . weights + biases)
+ *
+ * input is (rows x k), biases (1 x n) and output (rows x n), all
+ * preallocated by the caller. weights hold the (k x n) weight matrix stored
+ * in the given layout. Normally the bias add and activation are
+ * applied to each tile of the product as it is written, so the whole layer
+ * is one pass over its output with no temporaries.
+ *
+ * Passing pre_bias and/or pre_act also stores (input . weights) and
+ * (input . weights + biases) into them, at the cost of the extra passes.
+ */
+void dense_forward(const Matrix& input, const Matrix& weights,
+                   WeightLayout layout, const Matrix& biases, Activation activation,
+                   Matrix& output,
+                   Matrix* pre_bias = nullptr, Matrix* pre_act = nullptr);
+
+/* Same, with 16 bit weights (FP16 or BF16) packed as for
+ * PACKED_OUTPUT_MAJOR, gemm_packed_b_size(k, n) of them. They are widened
+ * inside the kernels and everything is summed in fp32.
+ */
+void dense_forward_half(const Matrix& input, const uint16_t* weights,
+                        WeightPrecision precision, const Matrix& biases,
+                        Activation activation, Matrix& output,
+                        Matrix* pre_bias = nullptr, Matrix* pre_act = nullptr);
+
+/* Same, with sparse weights held as the CSR of their transpose (n x k),
+ * so only the non-zero weights are ever read or multiplied.
+ */
+void dense_forward_sparse(const Matrix& input, const SparseMatrix& weights,
+                          const Matrix& biases, Activation activation,
+                          Matrix& output,
+                          Matrix* pre_bias = nullptr, Matrix* pre_act = nullptr);
+
+/* Same, with {-1, 0, +1} weights held as bitplanes of their transpose
+ * (n x k), each output a masked sum of inputs with no multiplies.
+ */
+void dense_forward_ternary(const Matrix& input, const TernaryMatrix& weights,
+                           const Matrix& biases, Activation activation,
+                           Matrix& output,
+                           Matrix* pre_bias = nullptr, Matrix* pre_act = nullptr);
+
+#endif
+
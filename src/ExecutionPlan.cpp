@@ -0,0 +1,278 @@
+
+#include "ExecutionPlan.hpp"
+#include "Network.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <stdexcept>
+
+using namespace std;
+
+static const char* PlanKernelStrings[] = { "GEMV", "GEMV_T", "GEMV_PACKED",
+                                           "GEMM", "GEMM_BT", "GEMM_PACKED",
+                                           "GEMV_HALF", "GEMM_HALF",
+                                           "SPARSE_GEMV", "SPARSE_GEMM",
+                                           "TERNARY_GEMV", "TERNARY_GEMM" };
+
+const char* plan_kernel_str(PlanKernel kernel) {
+   return PlanKernelStrings[kernel];
+}
+
+// Compiling ------------------------------------------------------------------
+ExecutionPlan::ExecutionPlan(const Network& network, unsigned int max_rows) {
+   if(max_rows == 0) {
+      printf("An execution plan needs room for at least one row!\n");
+      throw invalid_argument("An execution plan needs room for at least one row!");
+   }
+   this->max_rows = max_rows;
+   this->input_size = network.get_input_size();
+
+   SimdLevel level = cpu_simd_level();
+   unsigned int widest = 0;
+   unsigned int widest_input = 0;
+   for(unsigned int i = 0; i < network.get_num_layers(); i++) {
+      const Layer& layer = network.get_layer(i);
+      WeightPrecision precision = layer.get_precision();
+      auto sparse_weights = layer.get_sparse_weights();
+      auto ternary_weights = layer.get_ternary_weights();
+      bool dense = precision == PRECISION_FP32 && !sparse_weights && !ternary_weights;
+      auto weights = dense ? layer.get_stored_weights() : nullptr;
+      auto half_weights = layer.get_half_weights();
+      auto biases = layer.get_biases();
+      Activation activation = layer.get_activation();
+      const ActivationInfo& act = activation_info(activation);
+      bool identity = activation == ACT_IDENTITY;
+
+      PlanStep step;
+      step.k = layer.get_input_size();
+      step.n = layer.get_layer_size();
+      step.weights = weights ? weights->get_data() : nullptr;
+      step.half_weights = half_weights.get();
+      step.sparse_weights = sparse_weights.get();
+      step.ternary_weights = ternary_weights.get();
+      step.precision = precision;
+      step.ldw = weights ? weights->get_stride() : 0;
+      step.gemv_compact = nullptr;
+      step.gemv_half = nullptr;
+      step.gemv_sparse = nullptr;
+      step.gemv_ternary = nullptr;
+      step.epilogue = {biases->get_data(),
+                       identity ? nullptr : act.func,
+                       identity ? nullptr : act.kernel};
+      step.activation = activation;
+
+      // 16 bit weights are always packed, whatever the layout
+      WeightLayout layout = layer.get_weight_layout();
+      if(precision != PRECISION_FP32) layout = PACKED_OUTPUT_MAJOR;
+
+      switch(layout) {
+         case OUTPUT_MAJOR:
+            step.gemv_kernel = PLAN_GEMV_T;
+            step.gemm_kernel = PLAN_GEMM_BT;
+            step.gemv = gemv_t_kernel(level);
+            break;
+         case PACKED_OUTPUT_MAJOR:
+            step.gemv_kernel = PLAN_GEMV_PACKED;
+            step.gemm_kernel = PLAN_GEMM_PACKED;
+            step.gemv = gemv_packed_kernel(level);
+            step.gemv_compact = gemv_packed_compact_kernel(level);
+            break;
+         case INPUT_MAJOR:
+         default:
+            step.gemv_kernel = PLAN_GEMV;
+            step.gemm_kernel = PLAN_GEMM;
+            step.gemv = gemv_kernel(level);
+            step.gemv_compact = gemv_compact_kernel(level);
+            break;
+      }
+      if(precision != PRECISION_FP32) {
+         step.gemv_kernel = PLAN_GEMV_HALF;
+         step.gemm_kernel = PLAN_GEMM_HALF;
+         step.gemv = nullptr;
+         step.gemv_compact = nullptr;
+         step.gemv_half = gemv_packed_half_kernel(level, precision);
+      }
+      if(sparse_weights) {
+         step.gemv_kernel = PLAN_SPARSE_GEMV;
+         step.gemm_kernel = PLAN_SPARSE_GEMM;
+         step.gemv = nullptr;
+         step.gemv_compact = nullptr;
+         step.gemv_sparse = sparse_gemv_kernel(level);
+      }
+      if(ternary_weights) {
+         step.gemv_kernel = PLAN_TERNARY_GEMV;
+         step.gemm_kernel = PLAN_TERNARY_GEMM;
+         step.gemv = nullptr;
+         step.gemv_compact = nullptr;
+         step.gemv_ternary = ternary_gemv_kernel(level);
+      }
+
+      this->steps.push_back(step);
+      if(weights) this->parameters.push_back(weights);
+      if(half_weights) this->half_parameters.push_back(half_weights);
+      if(sparse_weights) this->sparse_parameters.push_back(sparse_weights);
+      if(ternary_weights) this->ternary_parameters.push_back(ternary_weights);
+      this->parameters.push_back(biases);
+      widest = max(widest, step.n);
+      if(step.gemv_compact) widest_input = max(widest_input, step.k);
+   }
+
+   this->buffer_size = max_rows * widest;
+   this->compact_size = widest_input;
+   this->allocate_buffers();
+}
+
+ExecutionPlan::ExecutionPlan(const ExecutionPlan& other)
+   : steps(other.steps), max_rows(other.max_rows), input_size(other.input_size),
+     buffer_size(other.buffer_size), compact_size(other.compact_size), parameters(other.parameters),
+     half_parameters(other.half_parameters), sparse_parameters(other.sparse_parameters),
+     ternary_parameters(other.ternary_parameters) {
+   this->allocate_buffers();
+}
+
+ExecutionPlan& ExecutionPlan::operator=(const ExecutionPlan& other) {
+   if(this != &other) {
+      this->steps = other.steps;
+      this->max_rows = other.max_rows;
+      this->input_size = other.input_size;
+      this->buffer_size = other.buffer_size;
+      this->compact_size = other.compact_size;
+      this->parameters = other.parameters;
+      this->half_parameters = other.half_parameters;
+      this->sparse_parameters = other.sparse_parameters;
+      this->ternary_parameters = other.ternary_parameters;
+      this->allocate_buffers();
+   }
+   return *this;
+}
+
+ExecutionPlan::~ExecutionPlan() {}
+
+void ExecutionPlan::allocate_buffers() {
+   this->buffers[0] = matrix_alloc(this->buffer_size);
+   this->buffers[1] = matrix_alloc(this->buffer_size);
+   this->compact_index.assign(this->compact_size, 0);
+   this->compact_values.assign(this->compact_size, 0.0f);
+}
+
+// Running --------------------------------------------------------------------
+void ExecutionPlan::check_rows(unsigned int rows) const {
+   if(rows == 0 || rows > this->max_rows) {
+      printf("Execution plan was compiled for 1 to %d rows, got %d\n", this->max_rows, rows);
+      throw out_of_range("Too many rows for the execution plan!");
+   }
+}
+
+void ExecutionPlan::execute(const float* input, unsigned int ld_input, unsigned int rows,
+                            float* output, unsigned int ld_output) {
+   const float* x = input;
+   unsigned int ldx = ld_input;
+   unsigned int num_steps = (unsigned int)this->steps.size();
+   for(unsigned int i = 0; i < num_steps; i++) {
+      const PlanStep& step = this->steps[i];
+      bool last = i + 1 == num_steps;
+      float* y = last ? output : this->buffers[i % 2].get();
+      unsigned int ldy = last ? ld_output : step.n;
+
+      if(rows == 1 && step.gemv_ternary) {
+         step.gemv_ternary(*step.ternary_weights, x, y, &step.epilogue);
+      } else if(rows == 1 && step.gemv_sparse) {
+         step.gemv_sparse(*step.sparse_weights, x, y, &step.epilogue);
+      } else if(rows == 1 && step.gemv_half) {
+         step.gemv_half(step.n, step.k, x, step.half_weights, y, &step.epilogue);
+      } else if(rows == 1 && step.gemv_compact) {
+         uint32_t* index = this->compact_index.data();
+         float* values = this->compact_values.data();
+         unsigned int count = gemv_compact_inputs(step.k, x, index, values);
+         if(gemv_skip_zero_inputs(count, step.k)) {
+            step.gemv_compact(step.n, step.k, index, values, count, step.weights, step.ldw,
+                              y, &step.epilogue);
+         } else {
+            step.gemv(step.n, step.k, x, step.weights, step.ldw, y, &step.epilogue);
+         }
+      } else if(rows == 1) {
+         step.gemv(step.n, step.k, x, step.weights, step.ldw, y, &step.epilogue);
+      } else {
+         switch(step.gemm_kernel) {
+            case PLAN_TERNARY_GEMM:
+               ternary_gemm(rows, x, ldx, *step.ternary_weights, y, ldy, &step.epilogue);
+               break;
+            case PLAN_SPARSE_GEMM:
+               sparse_gemm(rows, x, ldx, *step.sparse_weights, y, ldy, &step.epilogue);
+               break;
+            case PLAN_GEMM_HALF:
+               gemm_packed_b_half(rows, step.n, step.k, x, ldx, step.half_weights, step.precision,
+                                  y, ldy, &step.epilogue);
+               break;
+            case PLAN_GEMM_BT:
+               gemm_bt(rows, step.n, step.k, x, ldx, step.weights, step.ldw, y, ldy, &step.epilogue);
+               break;
+            case PLAN_GEMM_PACKED:
+               gemm_packed_b(rows, step.n, step.k, x, ldx, step.weights, y, ldy, &step.epilogue);
+               break;
+            case PLAN_GEMM:
+            default:
+               gemm(rows, step.n, step.k, x, ldx, step.weights, step.ldw, y, ldy, &step.epilogue);
+               break;
+         }
+      }
+      x = y;
+      ldx = ldy;
+   }
+}
+
+const float* ExecutionPlan::run(const float* input, unsigned int rows) {
+   this->check_rows(rows);
+   float* output = this->buffers[(this->steps.size() - 1) % 2].get();
+   this->execute(input, this->input_size, rows, output, this->get_output_size());
+   return output;
+}
+
+void ExecutionPlan::run(const Matrix& inputs, Matrix& outputs) {
+   unsigned int rows = inputs.get_rows();
+   this->check_rows(rows);
+   if(inputs.get_cols() != this->input_size ||
+      outputs.get_rows() != rows || outputs.get_cols() != this->get_output_size()) {
+      printf("Execution plan maps (%d,%d) to (%d,%d), got (%d,%d) and (%d,%d)\n",
+             rows, this->input_size, rows, this->get_output_size(),
+             inputs.get_rows(), inputs.get_cols(), outputs.get_rows(), outputs.get_cols());
+      throw invalid_argument("Execution plan inputs or outputs have the wrong dimensions!");
+   }
+   this->execute(inputs.get_data(), inputs.get_stride(), rows,
+                 outputs.get_data(), outputs.get_stride());
+}
+
+// Plan Info ------------------------------------------------------------------
+unsigned int ExecutionPlan::get_max_rows() const {
+   return this->max_rows;
+}
+
+unsigned int ExecutionPlan::get_input_size() const {
+   return this->input_size;
+}
+
+unsigned int ExecutionPlan::get_output_size() const {
+   return this->steps.back().n;
+}
+
+unsigned int ExecutionPlan::get_num_steps() const {
+   return (unsigned int)this->steps.size();
+}
+
+const PlanStep& ExecutionPlan::get_step(unsigned int step_num) const {
+   if(step_num >= this->steps.size()) {
+      printf("Step %d does not exist, the plan has %d steps!\n", step_num, (int)this->steps.size());
+      throw out_of_range("Step does not exist!");
+   }
+   return this->steps[step_num];
+}
+
+void ExecutionPlan::print_plan() const {
+   printf("Execution Plan (up to %d rows, %d floats per buffer)\n", this->max_rows, this->buffer_size);
+   for(unsigned int i = 0; i < this->steps.size(); i++) {
+      const PlanStep& step = this->steps[i];
+      printf("   %d: %s / %s %d -> %d, %s, %s\n", i,
+             plan_kernel_str(step.gemv_kernel), plan_kernel_str(step.gemm_kernel),
+             step.k, step.n, activation_str(step.activation),
+             weight_precision_str(step.precision));
+   }
+}
@@ -0,0 +1,126 @@
+
+#ifndef EXECUTIONPLAN_HPP
+#define EXECUTIONPLAN_HPP
+
+#include <memory>
+#include <vector>
+#include "Matrix.hpp"
+#include "Dense.hpp"
+#include "Gemm.hpp"
+#include "Gemv.hpp"
+#include "SparseMatrix.hpp"
+#include "TernaryMatrix.hpp"
+
+class Network;
+
+// Kernel a plan step runs, picked from the layer's layout and batch size
+enum PlanKernel {
+   PLAN_GEMV,
+   PLAN_GEMV_T,
+   PLAN_GEMV_PACKED,
+   PLAN_GEMM,
+   PLAN_GEMM_BT,
+   PLAN_GEMM_PACKED,
+   PLAN_GEMV_HALF,
+   PLAN_GEMM_HALF,
+   PLAN_SPARSE_GEMV,
+   PLAN_SPARSE_GEMM,
+   PLAN_TERNARY_GEMV,
+   PLAN_TERNARY_GEMM
+};
+
+const char* plan_kernel_str(PlanKernel kernel);
+
+/* One layer of a plan, everything the kernel call needs worked out ahead
+ * of time. The bias add and activation are fused into the multiply.
+ */
+struct PlanStep {
+   PlanKernel gemv_kernel;    // used for single samples
+   PlanKernel gemm_kernel;    // used for batches
+   GemvKernel gemv;           // resolved for the running CPU
+   GemvCompactKernel gemv_compact; // same, skipping zero inputs
+   HalfGemvKernel gemv_half;  // same, for 16 bit weights
+   SparseGemvKernel gemv_sparse; // same, for sparse weights
+   TernaryGemvKernel gemv_ternary; // same, for ternary weights
+   unsigned int k;            // inputs
+   unsigned int n;            // outputs
+   const float* weights;      // fp32 layers
+   const uint16_t* half_weights; // 16 bit layers, packed
+   const SparseMatrix* sparse_weights; // sparse layers
+   const TernaryMatrix* ternary_weights; // ternary layers
+   WeightPrecision precision;
+   unsigned int ldw;
+   GemmEpilogue epilogue;
+   Activation activation;
+};
+
+/* A Network flattened for inference, made by Network::compile.
+ *
+ * The plan is a list of kernel calls, one per layer, with the shapes,
+ * kernel variants and activation kernels all chosen when it is built.
+ * Layer outputs go to two buffers allocated up front, layer i writing the
+ * one layer i - 1 didn't, so running the plan never allocates and doesn't
+ * touch a shared_ptr. Single samples take the GEMV kernels, batches of up
+ * to max_rows samples the GEMM ones. Single samples through fp32 weights
+ * skip their zero inputs when there are enough of them (see
+ * gemv_compact_inputs), the plan keeping the compacted inputs too.
+ *
+ * The steps point straight at the network's parameters, which stay alive
+ * for as long as the plan does. Changing weights in place is seen by the
+ * plan, but it has to be compiled again after anything else about the
+ * network changes (activations, layouts, layers).
+ *
+ * The buffers belong to the plan, so a plan serves one thread at a time.
+ * Copies get buffers of their own.
+ */
+class ExecutionPlan {
+public:
+   ExecutionPlan(const Network& network, unsigned int max_rows = 1);
+   ExecutionPlan(const ExecutionPlan& other);
+   ExecutionPlan& operator=(const ExecutionPlan& other);
+   virtual ~ExecutionPlan();
+
+   // rows samples from input (rows x input size, one after the other).
+   // Returns the rows x output size result, which stays in the plan's
+   // buffers until the next run.
+   const float* run(const float* input, unsigned int rows = 1);
+
+   // inputs is rows x input size, outputs must already be rows x output
+   // size. The last layer writes straight into outputs.
+   void run(const Matrix& inputs, Matrix& outputs);
+
+   unsigned int get_max_rows() const;
+   unsigned int get_input_size() const;
+   unsigned int get_output_size() const;
+   unsigned int get_num_steps() const;
+   const PlanStep& get_step(unsigned int step_num) const;
+
+   void print_plan() const;
+
+private:
+   std::vector<PlanStep> steps;
+   unsigned int max_rows;
+   unsigned int input_size;
+   unsigned int buffer_size;
+
+   // Ping-pong layer outputs
+   std::shared_ptr<float> buffers[2];
+   // Non-zero inputs of the current GEMV step
+   unsigned int compact_size;
+   std::vector<uint32_t> compact_index;
+   std::vector<float> compact_values;
+
+   // Keep the network's parameters alive
+   std::vector<std::shared_ptr<Matrix>> parameters;
+   std::vector<std::shared_ptr<uint16_t>> half_parameters;
+   std::vector<std::shared_ptr<SparseMatrix>> sparse_parameters;
+   std::vector<std::shared_ptr<TernaryMatrix>> ternary_parameters;
+
+   void allocate_buffers();
+   void check_rows(unsigned int rows) const;
+   void execute(const float* input, unsigned int ld_input, unsigned int rows,
+                float* output, unsigned int ld_output);
+};
+
+#endif
+
@@ -0,0 +1,483 @@
+
+#include "Gemm.hpp"
+#include "Matrix.hpp"
+#include "Scheduler.hpp"
+#include "CpuFeatures.hpp"
+#include "Half.hpp"
+#include <algorithm>
+#include <memory>
+#include <atomic>
+#include <cstring>
+
+#if HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+// Packing Buffers ------------------------------------------------------------
+/* Each thread keeps its own packing buffers so the kernel never allocates
+ * once it has seen the largest block size it will be asked for.
+ */
+struct PackBuffer {
+   shared_ptr<float> buffer;
+   unsigned int size = 0;
+
+   float* get(unsigned int needed) {
+      if(needed > size) {
+         buffer = matrix_alloc(needed);
+         size = needed;
+      }
+      return buffer.get();
+   }
+};
+
+static thread_local PackBuffer pack_a_buffer;
+static thread_local PackBuffer pack_b_buffer;
+
+static unsigned int round_up(unsigned int x, unsigned int to) {
+   return ((x + to - 1) / to) * to;
+}
+
+// Packing --------------------------------------------------------------------
+/* Packs an mc x kc block of A into MR row panels. Within a panel the MR
+ * values of each column are contiguous, so the micro-kernel reads A with
+ * unit stride. Rows past the edge of A are zero padded.
+ */
+static void pack_a(unsigned int mc, unsigned int kc,
+                   const float* a, unsigned int lda, float* packed) {
+   for(unsigned int i = 0; i < mc; i += GEMM_MR) {
+      unsigned int rows = min(GEMM_MR, mc - i);
+      for(unsigned int p = 0; p < kc; p++) {
+         for(unsigned int r = 0; r < rows; r++) {
+            packed[r] = a[(i + r) * lda + p];
+         }
+         for(unsigned int r = rows; r < GEMM_MR; r++) {
+            packed[r] = 0.0f;
+         }
+         packed += GEMM_MR;
+      }
+   }
+}
+
+/* Packs a kc x nc panel of B into NR column slivers. Within a sliver the NR
+ * values of each row are contiguous. Columns past the edge are zero padded.
+ */
+static void pack_b(unsigned int kc, unsigned int nc,
+                   const float* b, unsigned int ldb, float* packed) {
+   for(unsigned int j = 0; j < nc; j += GEMM_NR) {
+      unsigned int cols = min(GEMM_NR, nc - j);
+      for(unsigned int p = 0; p < kc; p++) {
+         const float* b_row = b + p * ldb + j;
+         for(unsigned int c = 0; c < cols; c++) {
+            packed[c] = b_row[c];
+         }
+         for(unsigned int c = cols; c < GEMM_NR; c++) {
+            packed[c] = 0.0f;
+         }
+         packed += GEMM_NR;
+      }
+   }
+}
+
+/* Same as pack_b, but reads B from its transpose (n x k, leading dimension
+ * ldbt), i.e. from weights stored one output neuron per row.
+ */
+static void pack_bt(unsigned int kc, unsigned int nc,
+                    const float* bt, unsigned int ldbt, float* packed) {
+   for(unsigned int j = 0; j < nc; j += GEMM_NR) {
+      unsigned int cols = min(GEMM_NR, nc - j);
+      for(unsigned int p = 0; p < kc; p++) {
+         for(unsigned int c = 0; c < cols; c++) {
+            packed[c] = bt[(j + c) * ldbt + p];
+         }
+         for(unsigned int c = cols; c < GEMM_NR; c++) {
+            packed[c] = 0.0f;
+         }
+         packed += GEMM_NR;
+      }
+   }
+}
+
+// Micro-Kernel ---------------------------------------------------------------
+/* Computes an MR x NR tile of C from a packed sliver of A and of B. The
+ * kernels only produce the accumulated tile, store_tile writes the valid
+ * rows x cols corner of it back, either overwriting C (first kc block) or
+ * accumulating into it. The epilogue is only passed in for the last kc
+ * block.
+ */
+typedef void (*MicroKernel)(unsigned int kc, const float* a, const float* b,
+                            float acc[GEMM_MR][GEMM_NR]);
+
+static void store_tile(const float acc[GEMM_MR][GEMM_NR],
+                       float* c, unsigned int ldc,
+                       unsigned int rows, unsigned int cols, bool accumulate,
+                       const GemmEpilogue* epilogue, unsigned int col) {
+   for(unsigned int i = 0; i < rows; i++) {
+      float* c_row = c + i * ldc;
+      if(accumulate) {
+         for(unsigned int j = 0; j < cols; j++) c_row[j] += acc[i][j];
+      } else {
+         for(unsigned int j = 0; j < cols; j++) c_row[j] = acc[i][j];
+      }
+      if(epilogue) {
+         apply_epilogue(epilogue, col, c_row, cols);
+      }
+   }
+}
+
+// The accumulators are a fixed size array so the compiler can keep them in
+// vector registers
+static void micro_kernel_scalar(unsigned int kc, const float* a, const float* b,
+                                float acc[GEMM_MR][GEMM_NR]) {
+   for(unsigned int i = 0; i < GEMM_MR; i++) {
+      for(unsigned int j = 0; j < GEMM_NR; j++) acc[i][j] = 0.0f;
+   }
+
+   for(unsigned int p = 0; p < kc; p++) {
+      for(unsigned int i = 0; i < GEMM_MR; i++) {
+         const float a_val = a[i];
+         for(unsigned int j = 0; j < GEMM_NR; j++) {
+            acc[i][j] += a_val * b[j];
+         }
+      }
+      a += GEMM_MR;
+      b += GEMM_NR;
+   }
+}
+
+#if HAVE_X86_SIMD
+// One ymm accumulator per row of the tile, eight independent FMA chains
+__attribute__((target("avx2,fma")))
+static void micro_kernel_avx2(unsigned int kc, const float* a, const float* b,
+                              float acc[GEMM_MR][GEMM_NR]) {
+   __m256 c0 = _mm256_setzero_ps();
+   __m256 c1 = _mm256_setzero_ps();
+   __m256 c2 = _mm256_setzero_ps();
+   __m256 c3 = _mm256_setzero_ps();
+   __m256 c4 = _mm256_setzero_ps();
+   __m256 c5 = _mm256_setzero_ps();
+   __m256 c6 = _mm256_setzero_ps();
+   __m256 c7 = _mm256_setzero_ps();
+
+   for(unsigned int p = 0; p < kc; p++) {
+      const __m256 bv = _mm256_loadu_ps(b);
+      c0 = _mm256_fmadd_ps(_mm256_broadcast_ss(a + 0), bv, c0);
+      c1 = _mm256_fmadd_ps(_mm256_broadcast_ss(a + 1), bv, c1);
+      c2 = _mm256_fmadd_ps(_mm256_broadcast_ss(a + 2), bv, c2);
+      c3 = _mm256_fmadd_ps(_mm256_broadcast_ss(a + 3), bv, c3);
+      c4 = _mm256_fmadd_ps(_mm256_broadcast_ss(a + 4), bv, c4);
+      c5 = _mm256_fmadd_ps(_mm256_broadcast_ss(a + 5), bv, c5);
+      c6 = _mm256_fmadd_ps(_mm256_broadcast_ss(a + 6), bv, c6);
+      c7 = _mm256_fmadd_ps(_mm256_broadcast_ss(a + 7), bv, c7);
+      a += GEMM_MR;
+      b += GEMM_NR;
+   }
+
+   _mm256_storeu_ps(acc[0], c0);
+   _mm256_storeu_ps(acc[1], c1);
+   _mm256_storeu_ps(acc[2], c2);
+   _mm256_storeu_ps(acc[3], c3);
+   _mm256_storeu_ps(acc[4], c4);
+   _mm256_storeu_ps(acc[5], c5);
+   _mm256_storeu_ps(acc[6], c6);
+   _mm256_storeu_ps(acc[7], c7);
+}
+#endif
+
+static MicroKernel select_micro_kernel() {
+#if HAVE_X86_SIMD
+   if(cpu_simd_level() >= SIMD_AVX2) return micro_kernel_avx2;
+#endif
+   return micro_kernel_scalar;
+}
+
+static void micro_kernel(unsigned int kc, const float* a, const float* b,
+                         float* c, unsigned int ldc,
+                         unsigned int rows, unsigned int cols, bool accumulate,
+                         const GemmEpilogue* epilogue, unsigned int col) {
+   static const MicroKernel kernel = select_micro_kernel();
+   alignas(MATRIX_ALIGNMENT) float acc[GEMM_MR][GEMM_NR];
+   kernel(kc, a, b, acc);
+   store_tile(acc, c, ldc, rows, cols, accumulate, epilogue, col);
+}
+
+// Macro-Kernel ---------------------------------------------------------------
+/* The B slivers are sliver_stride * NR floats apart: kc when B was packed
+ * for this block, the full k when B was packed ahead of time.
+ */
+static void macro_kernel(unsigned int mc, unsigned int nc, unsigned int kc,
+                         const float* packed_a, const float* packed_b,
+                         unsigned int sliver_stride,
+                         float* c, unsigned int ldc, bool accumulate,
+                         const GemmEpilogue* epilogue, unsigned int col) {
+   for(unsigned int j = 0; j < nc; j += GEMM_NR) {
+      unsigned int cols = min(GEMM_NR, nc - j);
+      const float* b_sliver = packed_b + j * sliver_stride;
+      for(unsigned int i = 0; i < mc; i += GEMM_MR) {
+         unsigned int rows = min(GEMM_MR, mc - i);
+         const float* a_sliver = packed_a + i * kc;
+         micro_kernel(kc, a_sliver, b_sliver, c + i * ldc + j, ldc,
+                      rows, cols, accumulate, epilogue, col + j);
+      }
+   }
+}
+
+// Public ---------------------------------------------------------------------
+void apply_epilogue(const GemmEpilogue* epilogue, unsigned int col,
+                    float* c, unsigned int cols) {
+   if(epilogue->bias) {
+      const float* bias = epilogue->bias + col;
+      for(unsigned int j = 0; j < cols; j++) c[j] += bias[j];
+   }
+   if(epilogue->act_kernel) {
+      epilogue->act_kernel(c, c, cols);
+   } else if(epilogue->act_func) {
+      for(unsigned int j = 0; j < cols; j++) c[j] = epilogue->act_func(c[j]);
+   }
+}
+
+// How the B operand is laid out in memory
+enum BFormat {
+   B_ROW_MAJOR,
+   B_TRANSPOSED,
+   B_PACKED,
+   B_PACKED_FP16,
+   B_PACKED_BF16
+};
+
+/* Widens a kc x nc panel of 16 bit packed B (slivers k rows apart) into
+ * the float panel the micro-kernel reads, the way pack_b lays it out.
+ */
+static void unpack_half_panel(unsigned int kc, unsigned int nc,
+                              const uint16_t* b, unsigned int k,
+                              WeightPrecision precision, float* packed) {
+   for(unsigned int j = 0; j < nc; j += GEMM_NR) {
+      half_to_floats(b + j * k, packed, kc * GEMM_NR, precision);
+      packed += kc * GEMM_NR;
+   }
+}
+
+static void gemm_serial(unsigned int m, unsigned int n, unsigned int k,
+                        const float* a, unsigned int lda,
+                        const void* b, unsigned int ldb, BFormat b_format,
+                        float* c, unsigned int ldc,
+                        const GemmEpilogue* epilogue) {
+   if(k == 0) {
+      for(unsigned int i = 0; i < m; i++) {
+         memset(c + i * ldc, 0, n * sizeof(float));
+         if(epilogue) apply_epilogue(epilogue, 0, c + i * ldc, n);
+      }
+      return;
+   }
+
+   const float* b_float = static_cast<const float*>(b);
+   const uint16_t* b_half = static_cast<const uint16_t*>(b);
+   float* packed_a = pack_a_buffer.get(round_up(min(m, GEMM_MC), GEMM_MR) * GEMM_KC);
+   float* packed_b = nullptr;
+   if(b_format != B_PACKED) {
+      packed_b = pack_b_buffer.get(round_up(min(n, GEMM_NC), GEMM_NR) * GEMM_KC);
+   }
+
+   for(unsigned int jc = 0; jc < n; jc += GEMM_NC) {
+      unsigned int nc = min(GEMM_NC, n - jc);
+
+      for(unsigned int pc = 0; pc < k; pc += GEMM_KC) {
+         unsigned int kc = min(GEMM_KC, k - pc);
+         const GemmEpilogue* tile_epilogue = (pc + kc == k) ? epilogue : nullptr;
+
+         const float* b_panel = packed_b;
+         unsigned int sliver_stride = kc;
+         switch(b_format) {
+            case B_ROW_MAJOR: pack_b(kc, nc, b_float + pc * ldb + jc, ldb, packed_b); break;
+            case B_TRANSPOSED: pack_bt(kc, nc, b_float + jc * ldb + pc, ldb, packed_b); break;
+            case B_PACKED:
+               b_panel = b_float + jc * k + pc * GEMM_NR;
+               sliver_stride = k;
+               break;
+            case B_PACKED_FP16:
+            case B_PACKED_BF16:
+               unpack_half_panel(kc, nc, b_half + jc * k + pc * GEMM_NR, k,
+                                 b_format == B_PACKED_BF16 ? PRECISION_BF16 : PRECISION_FP16,
+                                 packed_b);
+               break;
+         }
+
+         for(unsigned int ic = 0; ic < m; ic += GEMM_MC) {
+            unsigned int mc = min(GEMM_MC, m - ic);
+            pack_a(mc, kc, a + ic * lda + pc, lda, packed_a);
+            macro_kernel(mc, nc, kc, packed_a, b_panel, sliver_stride,
+                         c + ic * ldc + jc, ldc, pc != 0, tile_epilogue, jc);
+         }
+      }
+   }
+}
+
+// Threading ------------------------------------------------------------------
+static atomic<unsigned int> gemm_threads(0);
+static unsigned long gemm_min_work = GEMM_PARALLEL_MIN_WORK;
+
+void gemm_set_num_threads(unsigned int threads) {
+   gemm_threads = threads;
+}
+
+unsigned int gemm_get_num_threads() {
+   unsigned int threads = gemm_threads;
+   if(threads == 0) {
+      // Every worker plus the thread that called gemm
+      threads = default_scheduler()->get_num_workers() + 1;
+   }
+   return threads;
+}
+
+void gemm_set_parallel_threshold(unsigned long min_work) {
+   gemm_min_work = min_work;
+}
+
+unsigned long gemm_get_parallel_threshold() {
+   return gemm_min_work;
+}
+
+/* Splits C into a grid of row_parts x col_parts tiles, one per thread. Of
+ * the grids that use every thread the one with the squarest tiles is
+ * picked, as it packs the least redundant A and B. Tiles are whole
+ * multiples of MR x NR so no thread writes a partial register block.
+ */
+static unsigned int choose_grid(unsigned int m, unsigned int n, unsigned int threads,
+                                unsigned int& row_parts, unsigned int& col_parts) {
+   unsigned int row_blocks = (m + GEMM_MR - 1) / GEMM_MR;
+   unsigned int col_blocks = (n + GEMM_NR - 1) / GEMM_NR;
+   threads = min(threads, row_blocks * col_blocks);
+
+   for(unsigned int parts = threads; parts > 1; parts--) {
+      unsigned long best = ~0ul;
+      for(unsigned int rp = 1; rp <= parts; rp++) {
+         unsigned int cp = parts / rp;
+         if(rp * cp != parts || rp > row_blocks || cp > col_blocks) continue;
+         unsigned long cost = (m + rp - 1) / rp + (n + cp - 1) / cp;
+         if(cost < best) {
+            best = cost;
+            row_parts = rp;
+            col_parts = cp;
+         }
+      }
+      if(best != ~0ul) return parts;
+   }
+   row_parts = col_parts = 1;
+   return 1;
+}
+
+/* Every element of C is computed by exactly one tile, summing over k in the
+ * same order as the serial kernel, so the result is bitwise identical for
+ * any number of threads.
+ */
+static void gemm_driver(unsigned int m, unsigned int n, unsigned int k,
+                        const float* a, unsigned int lda,
+                        const void* b, unsigned int ldb, BFormat b_format,
+                        float* c, unsigned int ldc,
+                        const GemmEpilogue* epilogue) {
+   if(m == 0 || n == 0) return;
+
+   unsigned long work = (unsigned long)m * n * k;
+   if(work < gemm_min_work) {
+      gemm_serial(m, n, k, a, lda, b, ldb, b_format, c, ldc, epilogue);
+      return;
+   }
+
+   unsigned int row_parts, col_parts;
+   unsigned int parts = choose_grid(m, n, gemm_get_num_threads(), row_parts, col_parts);
+   if(parts == 1) {
+      gemm_serial(m, n, k, a, lda, b, ldb, b_format, c, ldc, epilogue);
+      return;
+   }
+
+   unsigned int tile_m = round_up((m + row_parts - 1) / row_parts, GEMM_MR);
+   unsigned int tile_n = round_up((n + col_parts - 1) / col_parts, GEMM_NR);
+
+   default_scheduler()->parallel_for(0, parts, 1, [&](size_t begin, size_t) {
+      unsigned int task = static_cast<unsigned int>(begin);
+      unsigned int i0 = (task / col_parts) * tile_m;
+      unsigned int j0 = (task % col_parts) * tile_n;
+      if(i0 >= m || j0 >= n) return;
+      unsigned int mt = min(tile_m, m - i0);
+      unsigned int nt = min(tile_n, n - j0);
+
+      const float* b_float = static_cast<const float*>(b);
+      const uint16_t* b_half = static_cast<const uint16_t*>(b);
+      const void* b_tile = b;
+      switch(b_format) {
+         case B_ROW_MAJOR: b_tile = b_float + j0; break;
+         case B_TRANSPOSED: b_tile = b_float + j0 * ldb; break;
+         case B_PACKED: b_tile = b_float + j0 * k; break;
+         case B_PACKED_FP16:
+         case B_PACKED_BF16: b_tile = b_half + j0 * k; break;
+      }
+
+      GemmEpilogue tile_epilogue;
+      if(epilogue) {
+         tile_epilogue = *epilogue;
+         if(tile_epilogue.bias) tile_epilogue.bias += j0;
+      }
+
+      gemm_serial(mt, nt, k, a + i0 * lda, lda, b_tile, ldb, b_format,
+                  c + i0 * ldc + j0, ldc, epilogue ? &tile_epilogue : nullptr);
+   });
+}
+
+void gemm(unsigned int m, unsigned int n, unsigned int k,
+          const float* a, unsigned int lda,
+          const float* b, unsigned int ldb,
+          float* c, unsigned int ldc,
+          const GemmEpilogue* epilogue) {
+   gemm_driver(m, n, k, a, lda, b, ldb, B_ROW_MAJOR, c, ldc, epilogue);
+}
+
+void gemm_bt(unsigned int m, unsigned int n, unsigned int k,
+             const float* a, unsigned int lda,
+             const float* bt, unsigned int ldbt,
+             float* c, unsigned int ldc,
+             const GemmEpilogue* epilogue) {
+   gemm_driver(m, n, k, a, lda, bt, ldbt, B_TRANSPOSED, c, ldc, epilogue);
+}
+
+unsigned int gemm_packed_b_size(unsigned int k, unsigned int n) {
+   return round_up(n, GEMM_NR) * k;
+}
+
+void gemm_pack_b(unsigned int k, unsigned int n,
+                 const float* b, unsigned int ldb, float* packed) {
+   pack_b(k, n, b, ldb, packed);
+}
+
+void gemm_packed_b(unsigned int m, unsigned int n, unsigned int k,
+                   const float* a, unsigned int lda,
+                   const float* packed_b,
+                   float* c, unsigned int ldc,
+                   const GemmEpilogue* epilogue) {
+   gemm_driver(m, n, k, a, lda, packed_b, 0, B_PACKED, c, ldc, epilogue);
+}
+
+void gemm_packed_b_half(unsigned int m, unsigned int n, unsigned int k,
+                        const float* a, unsigned int lda,
+                        const uint16_t* packed_b, WeightPrecision precision,
+                        float* c, unsigned int ldc,
+                        const GemmEpilogue* epilogue) {
+   BFormat format = precision == PRECISION_BF16 ? B_PACKED_BF16 : B_PACKED_FP16;
+   gemm_driver(m, n, k, a, lda, packed_b, 0, format, c, ldc, epilogue);
+}
+
+void gemm_reference(unsigned int m, unsigned int n, unsigned int k,
+                    const float* a, unsigned int lda,
+                    const float* b, unsigned int ldb,
+                    float* c, unsigned int ldc) {
+   for(unsigned int i = 0; i < m; i++) {
+      for(unsigned int j = 0; j < n; j++) {
+         float val = 0;
+         for(unsigned int p = 0; p < k; p++) {
+            val += a[i * lda + p] * b[p * ldb + j];
+         }
+         c[i * ldc + j] = val;
+      }
+   }
+}
+
@@ -0,0 +1,111 @@
+
+#ifndef GEMM_HPP
+#define GEMM_HPP
+
+#include <cstdint>
+#include "Activation.hpp"
+#include "Half.hpp"
+
+/* Single precision matrix multiply kernels.
+ *
+ * All matrices are row-major and described by a data pointer and a leading
+ * dimension (the distance in floats between the starts of two rows), so
+ * Matrix views can be passed straight through.
+ *
+ *    C (m x n) = A (m x k) . B (k x n)
+ */
+
+// Register block of the micro-kernel (rows of A x columns of B)
+#define GEMM_MR 8u
+#define GEMM_NR 8u
+
+// Cache blocking: an MC x KC block of A stays in L2, a KC x NR sliver of B
+// stays in L1 and the packed KC x NC panel of B stays in L3.
+#define GEMM_MC 128u
+#define GEMM_KC 256u
+#define GEMM_NC 4096u
+
+// Products with fewer multiply-adds (m * n * k) than this stay on the
+// calling thread, so small layers never pay for waking the scheduler
+#define GEMM_PARALLEL_MIN_WORK (1ul << 21)
+
+/* Optional work done on each tile of C as it is written out, so a dense
+ * layer's bias add and activation happen while the tile is still in cache.
+ *
+ *    C = act(C + bias)
+ *
+ * The activation is the batch act_kernel when there is one, otherwise the
+ * scalar act_func element by element.
+ */
+struct GemmEpilogue {
+   const float* bias;          // 1 x n row added to every row of C, or null
+   float (*act_func)(float);   // applied to every element of C, or null
+   ActivationKernel act_kernel; // applied to each stretch of C, or null
+};
+
+// Applies the epilogue to cols values of one row of C starting at column col
+void apply_epilogue(const GemmEpilogue* epilogue, unsigned int col,
+                    float* c, unsigned int cols);
+
+// Tiled and packed multiply, the engine behind Matrix::dot
+void gemm(unsigned int m, unsigned int n, unsigned int k,
+          const float* a, unsigned int lda,
+          const float* b, unsigned int ldb,
+          float* c, unsigned int ldc,
+          const GemmEpilogue* epilogue = nullptr);
+
+// Same, with B given as its transpose (n x k, leading dimension ldbt)
+void gemm_bt(unsigned int m, unsigned int n, unsigned int k,
+             const float* a, unsigned int lda,
+             const float* bt, unsigned int ldbt,
+             float* c, unsigned int ldc,
+             const GemmEpilogue* epilogue = nullptr);
+
+/* B packed ahead of time, for operands that are reused across many calls
+ * such as layer weights. The packed form is the k x n matrix cut into
+ * NR-column slivers, each stored as k contiguous rows of NR floats (zero
+ * padded), which is exactly what the micro-kernel reads, so the multiply
+ * skips packing B altogether.
+ */
+unsigned int gemm_packed_b_size(unsigned int k, unsigned int n);
+void gemm_pack_b(unsigned int k, unsigned int n,
+                 const float* b, unsigned int ldb, float* packed);
+void gemm_packed_b(unsigned int m, unsigned int n, unsigned int k,
+                   const float* a, unsigned int lda,
+                   const float* packed_b,
+                   float* c, unsigned int ldc,
+                   const GemmEpilogue* epilogue = nullptr);
+
+/* Packed B stored in 16 bits (FP16 or BF16, see Half.hpp). Each KC deep
+ * panel is widened into the float packing buffer just before the
+ * micro-kernel uses it, so B is read at half the bytes and everything is
+ * still summed in fp32.
+ */
+void gemm_packed_b_half(unsigned int m, unsigned int n, unsigned int k,
+                        const float* a, unsigned int lda,
+                        const uint16_t* packed_b, WeightPrecision precision,
+                        float* c, unsigned int ldc,
+                        const GemmEpilogue* epilogue = nullptr);
+
+/* Threading
+ *
+ * Large products split C into one tile per thread and run the tiles on the
+ * default scheduler. Each element is still summed in the same order, so
+ * results are bitwise identical whatever the thread count. The thread count
+ * defaults to the scheduler's workers plus the calling thread, 1 keeps
+ * every multiply on the calling thread.
+ */
+void gemm_set_num_threads(unsigned int threads);
+unsigned int gemm_get_num_threads();
+void gemm_set_parallel_threshold(unsigned long min_work);
+unsigned long gemm_get_parallel_threshold();
+
+// Straightforward triple loop, tools/nncheck validates the blocked and
+// vector kernels against it
+void gemm_reference(unsigned int m, unsigned int n, unsigned int k,
+                    const float* a, unsigned int lda,
+                    const float* b, unsigned int ldb,
+                    float* c, unsigned int ldc);
+
+#endif
+
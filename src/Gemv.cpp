@@ -0,0 +1,657 @@
+
+#include "Gemv.hpp"
+#include "CpuFeatures.hpp"
+#include <vector>
+
+#if HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+// Inputs ---------------------------------------------------------------------
+/* Which inputs the row-major and packed kernels sum over: every one of the
+ * k, or only those gemv_compact_inputs kept. Either way input c of count
+ * is x[row(c)], the weights of which are on row row(c) of W.
+ */
+struct AllInputs {
+   const float* x;
+   unsigned int k;
+
+   unsigned int count() const { return k; }
+   unsigned int row(unsigned int c) const { return c; }
+   float value(unsigned int c) const { return x[c]; }
+};
+
+struct CompactInputs {
+   const uint32_t* index;
+   const float* values;
+   unsigned int num;
+
+   unsigned int count() const { return num; }
+   unsigned int row(unsigned int c) const { return index[c]; }
+   float value(unsigned int c) const { return values[c]; }
+};
+
+// Scalar ---------------------------------------------------------------------
+template<typename Inputs>
+static void gemv_columns(unsigned int n, Inputs in,
+                         const float* w, unsigned int ldw,
+                         float* y, const GemmEpilogue* epilogue,
+                         unsigned int col) {
+   for(unsigned int j = 0; j < n; j++) {
+      float acc = 0.0f;
+      for(unsigned int c = 0; c < in.count(); c++) {
+         acc += in.value(c) * w[in.row(c) * ldw + j];
+      }
+      y[j] = acc;
+   }
+   if(epilogue) apply_epilogue(epilogue, col, y, n);
+}
+
+template<typename Inputs>
+static void gemv_scalar(unsigned int n, Inputs in,
+                        const float* w, unsigned int ldw,
+                        float* y, const GemmEpilogue* epilogue) {
+   const unsigned int block = 8;
+   unsigned int j = 0;
+   for(; j + block <= n; j += block) {
+      float acc[block] = {};
+      for(unsigned int c = 0; c < in.count(); c++) {
+         const float x_val = in.value(c);
+         const float* w_row = w + in.row(c) * ldw + j;
+         for(unsigned int b = 0; b < block; b++) {
+            acc[b] += x_val * w_row[b];
+         }
+      }
+      for(unsigned int b = 0; b < block; b++) {
+         y[j + b] = acc[b];
+      }
+      if(epilogue) apply_epilogue(epilogue, j, y + j, block);
+   }
+   gemv_columns(n - j, in, w + j, ldw, y + j, epilogue, j);
+}
+
+#if HAVE_X86_SIMD
+// SSE ------------------------------------------------------------------------
+template<typename Inputs>
+__attribute__((target("sse2")))
+static void gemv_sse(unsigned int n, Inputs in,
+                     const float* w, unsigned int ldw,
+                     float* y, const GemmEpilogue* epilogue) {
+   unsigned int j = 0;
+   for(; j + 16 <= n; j += 16) {
+      __m128 acc0 = _mm_setzero_ps();
+      __m128 acc1 = _mm_setzero_ps();
+      __m128 acc2 = _mm_setzero_ps();
+      __m128 acc3 = _mm_setzero_ps();
+      for(unsigned int c = 0; c < in.count(); c++) {
+         const __m128 xv = _mm_set1_ps(in.value(c));
+         const float* w_row = w + in.row(c) * ldw + j;
+         acc0 = _mm_add_ps(acc0, _mm_mul_ps(xv, _mm_loadu_ps(w_row + 0)));
+         acc1 = _mm_add_ps(acc1, _mm_mul_ps(xv, _mm_loadu_ps(w_row + 4)));
+         acc2 = _mm_add_ps(acc2, _mm_mul_ps(xv, _mm_loadu_ps(w_row + 8)));
+         acc3 = _mm_add_ps(acc3, _mm_mul_ps(xv, _mm_loadu_ps(w_row + 12)));
+      }
+      _mm_storeu_ps(y + j + 0, acc0);
+      _mm_storeu_ps(y + j + 4, acc1);
+      _mm_storeu_ps(y + j + 8, acc2);
+      _mm_storeu_ps(y + j + 12, acc3);
+      if(epilogue) apply_epilogue(epilogue, j, y + j, 16);
+   }
+   for(; j + 4 <= n; j += 4) {
+      __m128 acc = _mm_setzero_ps();
+      for(unsigned int c = 0; c < in.count(); c++) {
+         acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(in.value(c)),
+                                          _mm_loadu_ps(w + in.row(c) * ldw + j)));
+      }
+      _mm_storeu_ps(y + j, acc);
+      if(epilogue) apply_epilogue(epilogue, j, y + j, 4);
+   }
+   gemv_columns(n - j, in, w + j, ldw, y + j, epilogue, j);
+}
+
+// AVX2 -----------------------------------------------------------------------
+template<typename Inputs>
+__attribute__((target("avx2,fma")))
+static void gemv_avx2(unsigned int n, Inputs in,
+                      const float* w, unsigned int ldw,
+                      float* y, const GemmEpilogue* epilogue) {
+   unsigned int j = 0;
+   for(; j + 32 <= n; j += 32) {
+      __m256 acc0 = _mm256_setzero_ps();
+      __m256 acc1 = _mm256_setzero_ps();
+      __m256 acc2 = _mm256_setzero_ps();
+      __m256 acc3 = _mm256_setzero_ps();
+      for(unsigned int c = 0; c < in.count(); c++) {
+         const __m256 xv = _mm256_set1_ps(in.value(c));
+         const float* w_row = w + in.row(c) * ldw + j;
+         acc0 = _mm256_fmadd_ps(xv, _mm256_loadu_ps(w_row + 0), acc0);
+         acc1 = _mm256_fmadd_ps(xv, _mm256_loadu_ps(w_row + 8), acc1);
+         acc2 = _mm256_fmadd_ps(xv, _mm256_loadu_ps(w_row + 16), acc2);
+         acc3 = _mm256_fmadd_ps(xv, _mm256_loadu_ps(w_row + 24), acc3);
+      }
+      _mm256_storeu_ps(y + j + 0, acc0);
+      _mm256_storeu_ps(y + j + 8, acc1);
+      _mm256_storeu_ps(y + j + 16, acc2);
+      _mm256_storeu_ps(y + j + 24, acc3);
+      if(epilogue) apply_epilogue(epilogue, j, y + j, 32);
+   }
+   for(; j + 8 <= n; j += 8) {
+      __m256 acc = _mm256_setzero_ps();
+      for(unsigned int c = 0; c < in.count(); c++) {
+         acc = _mm256_fmadd_ps(_mm256_set1_ps(in.value(c)),
+                               _mm256_loadu_ps(w + in.row(c) * ldw + j), acc);
+      }
+      _mm256_storeu_ps(y + j, acc);
+      if(epilogue) apply_epilogue(epilogue, j, y + j, 8);
+   }
+   gemv_columns(n - j, in, w + j, ldw, y + j, epilogue, j);
+}
+
+// AVX-512 --------------------------------------------------------------------
+template<typename Inputs>
+__attribute__((target("avx512f")))
+static void gemv_avx512(unsigned int n, Inputs in,
+                        const float* w, unsigned int ldw,
+                        float* y, const GemmEpilogue* epilogue) {
+   unsigned int j = 0;
+   for(; j + 64 <= n; j += 64) {
+      __m512 acc0 = _mm512_setzero_ps();
+      __m512 acc1 = _mm512_setzero_ps();
+      __m512 acc2 = _mm512_setzero_ps();
+      __m512 acc3 = _mm512_setzero_ps();
+      for(unsigned int c = 0; c < in.count(); c++) {
+         const __m512 xv = _mm512_set1_ps(in.value(c));
+         const float* w_row = w + in.row(c) * ldw + j;
+         acc0 = _mm512_fmadd_ps(xv, _mm512_loadu_ps(w_row + 0), acc0);
+         acc1 = _mm512_fmadd_ps(xv, _mm512_loadu_ps(w_row + 16), acc1);
+         acc2 = _mm512_fmadd_ps(xv, _mm512_loadu_ps(w_row + 32), acc2);
+         acc3 = _mm512_fmadd_ps(xv, _mm512_loadu_ps(w_row + 48), acc3);
+      }
+      _mm512_storeu_ps(y + j + 0, acc0);
+      _mm512_storeu_ps(y + j + 16, acc1);
+      _mm512_storeu_ps(y + j + 32, acc2);
+      _mm512_storeu_ps(y + j + 48, acc3);
+      if(epilogue) apply_epilogue(epilogue, j, y + j, 64);
+   }
+   // The last partial block is handled with masked loads and stores
+   while(j < n) {
+      unsigned int cols = n - j < 16 ? n - j : 16;
+      const __mmask16 mask = (__mmask16)((1u << cols) - 1);
+      __m512 acc = _mm512_setzero_ps();
+      for(unsigned int c = 0; c < in.count(); c++) {
+         acc = _mm512_fmadd_ps(_mm512_set1_ps(in.value(c)),
+                               _mm512_maskz_loadu_ps(mask, w + in.row(c) * ldw + j), acc);
+      }
+      _mm512_mask_storeu_ps(y + j, mask, acc);
+      if(epilogue) apply_epilogue(epilogue, j, y + j, cols);
+      j += cols;
+   }
+}
+#endif
+
+// Transposed and Packed Weights ----------------------------------------------
+/* W^T is n x k, so each output is a unit stride dot product with x. The
+ * partial sums are kept in separate lanes so the loop vectorizes.
+ */
+static void gemv_t_scalar(unsigned int n, unsigned int k,
+                          const float* x, const float* wt, unsigned int ldwt,
+                          float* y, const GemmEpilogue* epilogue) {
+   const unsigned int lanes = 8;
+   for(unsigned int j = 0; j < n; j++) {
+      const float* w_row = wt + j * ldwt;
+      float acc[lanes] = {};
+      unsigned int p = 0;
+      for(; p + lanes <= k; p += lanes) {
+         for(unsigned int l = 0; l < lanes; l++) {
+            acc[l] += x[p + l] * w_row[p + l];
+         }
+      }
+      float sum = 0.0f;
+      for(unsigned int l = 0; l < lanes; l++) sum += acc[l];
+      for(; p < k; p++) sum += x[p] * w_row[p];
+      y[j] = sum;
+   }
+   if(epilogue) apply_epilogue(epilogue, 0, y, n);
+}
+
+// Weights packed with gemm_pack_b, one NR column sliver after another
+template<typename Inputs>
+static void gemv_packed_scalar(unsigned int n, unsigned int k, Inputs in,
+                               const float* packed,
+                               float* y, const GemmEpilogue* epilogue) {
+   for(unsigned int j = 0; j < n; j += GEMM_NR) {
+      unsigned int cols = n - j < GEMM_NR ? n - j : GEMM_NR;
+      const float* sliver = packed + j * k;
+      float acc[GEMM_NR] = {};
+      for(unsigned int c = 0; c < in.count(); c++) {
+         const float x_val = in.value(c);
+         const float* w_row = sliver + in.row(c) * GEMM_NR;
+         for(unsigned int b = 0; b < GEMM_NR; b++) {
+            acc[b] += x_val * w_row[b];
+         }
+      }
+      for(unsigned int b = 0; b < cols; b++) y[j + b] = acc[b];
+      if(epilogue) apply_epilogue(epilogue, j, y + j, cols);
+   }
+}
+
+#if HAVE_X86_SIMD
+__attribute__((target("avx2,fma")))
+static float hsum_avx2(__m256 v) {
+   __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+   sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+   sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+   return _mm_cvtss_f32(sum);
+}
+
+__attribute__((target("avx2,fma")))
+static void gemv_t_avx2(unsigned int n, unsigned int k,
+                        const float* x, const float* wt, unsigned int ldwt,
+                        float* y, const GemmEpilogue* epilogue) {
+   for(unsigned int j = 0; j < n; j++) {
+      const float* w_row = wt + j * ldwt;
+      __m256 acc0 = _mm256_setzero_ps();
+      __m256 acc1 = _mm256_setzero_ps();
+      unsigned int p = 0;
+      for(; p + 16 <= k; p += 16) {
+         acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + p), _mm256_loadu_ps(w_row + p), acc0);
+         acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(x + p + 8), _mm256_loadu_ps(w_row + p + 8), acc1);
+      }
+      for(; p + 8 <= k; p += 8) {
+         acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + p), _mm256_loadu_ps(w_row + p), acc0);
+      }
+      float sum = hsum_avx2(_mm256_add_ps(acc0, acc1));
+      for(; p < k; p++) sum += x[p] * w_row[p];
+      y[j] = sum;
+   }
+   if(epilogue) apply_epilogue(epilogue, 0, y, n);
+}
+
+__attribute__((target("avx512f")))
+static float hsum_avx512(__m512 v) {
+   __m256 lo = _mm512_castps512_ps256(v);
+   __m256 hi = _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(v), 1));
+   __m256 sum8 = _mm256_add_ps(lo, hi);
+   __m128 sum = _mm_add_ps(_mm256_castps256_ps128(sum8), _mm256_extractf128_ps(sum8, 1));
+   sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+   sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+   return _mm_cvtss_f32(sum);
+}
+
+__attribute__((target("avx512f")))
+static void gemv_t_avx512(unsigned int n, unsigned int k,
+                          const float* x, const float* wt, unsigned int ldwt,
+                          float* y, const GemmEpilogue* epilogue) {
+   for(unsigned int j = 0; j < n; j++) {
+      const float* w_row = wt + j * ldwt;
+      __m512 acc0 = _mm512_setzero_ps();
+      __m512 acc1 = _mm512_setzero_ps();
+      unsigned int p = 0;
+      for(; p + 32 <= k; p += 32) {
+         acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + p), _mm512_loadu_ps(w_row + p), acc0);
+         acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(x + p + 16), _mm512_loadu_ps(w_row + p + 16), acc1);
+      }
+      while(p < k) {
+         unsigned int len = k - p < 16 ? k - p : 16;
+         const __mmask16 mask = (__mmask16)((1u << len) - 1);
+         acc0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, x + p),
+                                _mm512_maskz_loadu_ps(mask, w_row + p), acc0);
+         p += len;
+      }
+      y[j] = hsum_avx512(_mm512_add_ps(acc0, acc1));
+   }
+   if(epilogue) apply_epilogue(epilogue, 0, y, n);
+}
+
+// Four slivers are walked at once to keep four independent FMA chains busy
+template<typename Inputs>
+__attribute__((target("avx2,fma")))
+static void gemv_packed_avx2(unsigned int n, unsigned int k, Inputs in,
+                             const float* packed,
+                             float* y, const GemmEpilogue* epilogue) {
+   static_assert(GEMM_NR == 8, "packed AVX2 GEMV assumes 8 column slivers");
+   unsigned int j = 0;
+   for(; j + 32 <= n; j += 32) {
+      const float* s0 = packed + (j + 0) * k;
+      const float* s1 = packed + (j + 8) * k;
+      const float* s2 = packed + (j + 16) * k;
+      const float* s3 = packed + (j + 24) * k;
+      __m256 acc0 = _mm256_setzero_ps();
+      __m256 acc1 = _mm256_setzero_ps();
+      __m256 acc2 = _mm256_setzero_ps();
+      __m256 acc3 = _mm256_setzero_ps();
+      for(unsigned int c = 0; c < in.count(); c++) {
+         const __m256 xv = _mm256_set1_ps(in.value(c));
+         const unsigned int p = in.row(c);
+         acc0 = _mm256_fmadd_ps(xv, _mm256_loadu_ps(s0 + p * 8), acc0);
+         acc1 = _mm256_fmadd_ps(xv, _mm256_loadu_ps(s1 + p * 8), acc1);
+         acc2 = _mm256_fmadd_ps(xv, _mm256_loadu_ps(s2 + p * 8), acc2);
+         acc3 = _mm256_fmadd_ps(xv, _mm256_loadu_ps(s3 + p * 8), acc3);
+      }
+      _mm256_storeu_ps(y + j + 0, acc0);
+      _mm256_storeu_ps(y + j + 8, acc1);
+      _mm256_storeu_ps(y + j + 16, acc2);
+      _mm256_storeu_ps(y + j + 24, acc3);
+      if(epilogue) apply_epilogue(epilogue, j, y + j, 32);
+   }
+   for(; j < n; j += 8) {
+      unsigned int cols = n - j < 8 ? n - j : 8;
+      const float* sliver = packed + j * k;
+      __m256 acc = _mm256_setzero_ps();
+      for(unsigned int c = 0; c < in.count(); c++) {
+         acc = _mm256_fmadd_ps(_mm256_set1_ps(in.value(c)),
+                               _mm256_loadu_ps(sliver + in.row(c) * 8), acc);
+      }
+      alignas(32) float out[8];
+      _mm256_store_ps(out, acc);
+      for(unsigned int c = 0; c < cols; c++) y[j + c] = out[c];
+      if(epilogue) apply_epilogue(epilogue, j, y + j, cols);
+   }
+}
+#endif
+
+// 16 Bit Weights -------------------------------------------------------------
+template<WeightPrecision precision>
+static void gemv_packed_half_scalar(unsigned int n, unsigned int k,
+                                    const float* x, const uint16_t* packed,
+                                    float* y, const GemmEpilogue* epilogue) {
+   for(unsigned int j = 0; j < n; j += GEMM_NR) {
+      unsigned int cols = n - j < GEMM_NR ? n - j : GEMM_NR;
+      const uint16_t* sliver = packed + j * k;
+      float acc[GEMM_NR] = {};
+      for(unsigned int p = 0; p < k; p++) {
+         const float x_val = x[p];
+         for(unsigned int c = 0; c < GEMM_NR; c++) {
+            uint16_t w = sliver[p * GEMM_NR + c];
+            acc[c] += x_val * (precision == PRECISION_BF16 ? bf16_to_float(w) : fp16_to_float(w));
+         }
+      }
+      for(unsigned int c = 0; c < cols; c++) y[j + c] = acc[c];
+      if(epilogue) apply_epilogue(epilogue, j, y + j, cols);
+   }
+}
+
+#if HAVE_X86_SIMD
+// One sliver row of 8 weights as floats. BF16 only needs shifting into the
+// top of each lane, FP16 goes through F16C.
+template<WeightPrecision precision>
+__attribute__((target("avx2,fma,f16c")))
+static inline __m256 widen_sliver_row(const uint16_t* w) {
+   const __m128i half = _mm_loadu_si128((const __m128i*)w);
+   if(precision == PRECISION_BF16) {
+      return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(half), 16));
+   }
+   return _mm256_cvtph_ps(half);
+}
+
+// Same walk as gemv_packed_avx2, four slivers at a time
+template<WeightPrecision precision>
+__attribute__((target("avx2,fma,f16c")))
+static void gemv_packed_half_avx2(unsigned int n, unsigned int k,
+                                  const float* x, const uint16_t* packed,
+                                  float* y, const GemmEpilogue* epilogue) {
+   static_assert(GEMM_NR == 8, "packed AVX2 GEMV assumes 8 column slivers");
+   unsigned int j = 0;
+   for(; j + 32 <= n; j += 32) {
+      const uint16_t* s0 = packed + (j + 0) * k;
+      const uint16_t* s1 = packed + (j + 8) * k;
+      const uint16_t* s2 = packed + (j + 16) * k;
+      const uint16_t* s3 = packed + (j + 24) * k;
+      __m256 acc0 = _mm256_setzero_ps();
+      __m256 acc1 = _mm256_setzero_ps();
+      __m256 acc2 = _mm256_setzero_ps();
+      __m256 acc3 = _mm256_setzero_ps();
+      for(unsigned int p = 0; p < k; p++) {
+         const __m256 xv = _mm256_set1_ps(x[p]);
+         acc0 = _mm256_fmadd_ps(xv, widen_sliver_row<precision>(s0 + p * 8), acc0);
+         acc1 = _mm256_fmadd_ps(xv, widen_sliver_row<precision>(s1 + p * 8), acc1);
+         acc2 = _mm256_fmadd_ps(xv, widen_sliver_row<precision>(s2 + p * 8), acc2);
+         acc3 = _mm256_fmadd_ps(xv, widen_sliver_row<precision>(s3 + p * 8), acc3);
+      }
+      _mm256_storeu_ps(y + j + 0, acc0);
+      _mm256_storeu_ps(y + j + 8, acc1);
+      _mm256_storeu_ps(y + j + 16, acc2);
+      _mm256_storeu_ps(y + j + 24, acc3);
+      if(epilogue) apply_epilogue(epilogue, j, y + j, 32);
+   }
+   for(; j < n; j += 8) {
+      unsigned int cols = n - j < 8 ? n - j : 8;
+      const uint16_t* sliver = packed + j * k;
+      __m256 acc = _mm256_setzero_ps();
+      for(unsigned int p = 0; p < k; p++) {
+         acc = _mm256_fmadd_ps(_mm256_set1_ps(x[p]), widen_sliver_row<precision>(sliver + p * 8), acc);
+      }
+      alignas(32) float out[8];
+      _mm256_store_ps(out, acc);
+      for(unsigned int c = 0; c < cols; c++) y[j + c] = out[c];
+      if(epilogue) apply_epilogue(epilogue, j, y + j, cols);
+   }
+}
+#endif
+
+// Zero Inputs ----------------------------------------------------------------
+/* Every input is written out and the count only moves past the non-zero
+ * ones, so there's no branch to mispredict on ReLU outputs.
+ */
+static unsigned int compact_inputs_scalar(unsigned int k, const float* x,
+                                          uint32_t* index, float* values) {
+   unsigned int count = 0;
+   for(unsigned int p = 0; p < k; p++) {
+      index[count] = p;
+      values[count] = x[p];
+      count += x[p] != 0.0f;
+   }
+   return count;
+}
+
+#if HAVE_X86_SIMD
+__attribute__((target("avx512f")))
+static unsigned int compact_inputs_avx512(unsigned int k, const float* x,
+                                          uint32_t* index, float* values) {
+   const __m512i step = _mm512_set1_epi32(16);
+   __m512i idx = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+   unsigned int count = 0;
+   for(unsigned int p = 0; p < k; p += 16) {
+      unsigned int len = k - p < 16 ? k - p : 16;
+      const __mmask16 mask = (__mmask16)((1u << len) - 1);
+      const __m512 v = _mm512_maskz_loadu_ps(mask, x + p);
+      // NaNs compare unequal, so they're kept like any other non-zero
+      const __mmask16 nonzero = _mm512_mask_cmp_ps_mask(mask, v, _mm512_setzero_ps(), _CMP_NEQ_UQ);
+      _mm512_mask_compressstoreu_ps(values + count, nonzero, v);
+      _mm512_mask_compressstoreu_epi32(index + count, nonzero, idx);
+      count += __builtin_popcount(nonzero);
+      idx = _mm512_add_epi32(idx, step);
+   }
+   return count;
+}
+#endif
+
+unsigned int gemv_compact_inputs(unsigned int k, const float* x,
+                                 uint32_t* index, float* values) {
+   typedef unsigned int (*CompactKernel)(unsigned int, const float*, uint32_t*, float*);
+#if HAVE_X86_SIMD
+   static const CompactKernel kernel =
+      cpu_simd_level() >= SIMD_AVX512 ? compact_inputs_avx512 : compact_inputs_scalar;
+#else
+   static const CompactKernel kernel = compact_inputs_scalar;
+#endif
+   return kernel(k, x, index, values);
+}
+
+bool gemv_skip_zero_inputs(unsigned int count, unsigned int k) {
+   return count <= GEMV_SPARSE_INPUT_DENSITY * k;
+}
+
+// Entry Points ---------------------------------------------------------------
+/* The kernels above are written once for both kinds of inputs. These give
+ * each instantiation the signature of GemvKernel or GemvCompactKernel.
+ */
+template<void (*kernel)(unsigned int, AllInputs, const float*, unsigned int,
+                        float*, const GemmEpilogue*)>
+static void all_inputs(unsigned int n, unsigned int k,
+                       const float* x, const float* w, unsigned int ldw,
+                       float* y, const GemmEpilogue* epilogue) {
+   kernel(n, AllInputs{x, k}, w, ldw, y, epilogue);
+}
+
+template<void (*kernel)(unsigned int, CompactInputs, const float*, unsigned int,
+                        float*, const GemmEpilogue*)>
+static void compact_inputs(unsigned int n, unsigned int,
+                           const uint32_t* index, const float* values, unsigned int count,
+                           const float* w, unsigned int ldw,
+                           float* y, const GemmEpilogue* epilogue) {
+   kernel(n, CompactInputs{index, values, count}, w, ldw, y, epilogue);
+}
+
+template<void (*kernel)(unsigned int, unsigned int, AllInputs, const float*,
+                        float*, const GemmEpilogue*)>
+static void all_inputs_packed(unsigned int n, unsigned int k,
+                              const float* x, const float* packed, unsigned int,
+                              float* y, const GemmEpilogue* epilogue) {
+   kernel(n, k, AllInputs{x, k}, packed, y, epilogue);
+}
+
+template<void (*kernel)(unsigned int, unsigned int, CompactInputs, const float*,
+                        float*, const GemmEpilogue*)>
+static void compact_inputs_packed(unsigned int n, unsigned int k,
+                                  const uint32_t* index, const float* values, unsigned int count,
+                                  const float* packed, unsigned int,
+                                  float* y, const GemmEpilogue* epilogue) {
+   kernel(n, k, CompactInputs{index, values, count}, packed, y, epilogue);
+}
+
+// Dispatch -------------------------------------------------------------------
+GemvKernel gemv_kernel(SimdLevel level) {
+#if HAVE_X86_SIMD
+   switch(level) {
+      case SIMD_AVX512: return all_inputs<gemv_avx512<AllInputs>>;
+      case SIMD_AVX2: return all_inputs<gemv_avx2<AllInputs>>;
+      case SIMD_SSE: return all_inputs<gemv_sse<AllInputs>>;
+      default: break;
+   }
+#endif
+   return all_inputs<gemv_scalar<AllInputs>>;
+}
+
+GemvKernel gemv_t_kernel(SimdLevel level) {
+#if HAVE_X86_SIMD
+   switch(level) {
+      case SIMD_AVX512: return gemv_t_avx512;
+      case SIMD_AVX2: return gemv_t_avx2;
+      default: break;
+   }
+#endif
+   return gemv_t_scalar;
+}
+
+GemvKernel gemv_packed_kernel(SimdLevel level) {
+#if HAVE_X86_SIMD
+   if(level >= SIMD_AVX2) return all_inputs_packed<gemv_packed_avx2<AllInputs>>;
+#endif
+   return all_inputs_packed<gemv_packed_scalar<AllInputs>>;
+}
+
+GemvCompactKernel gemv_compact_kernel(SimdLevel level) {
+#if HAVE_X86_SIMD
+   switch(level) {
+      case SIMD_AVX512: return compact_inputs<gemv_avx512<CompactInputs>>;
+      case SIMD_AVX2: return compact_inputs<gemv_avx2<CompactInputs>>;
+      case SIMD_SSE: return compact_inputs<gemv_sse<CompactInputs>>;
+      default: break;
+   }
+#endif
+   return compact_inputs<gemv_scalar<CompactInputs>>;
+}
+
+GemvCompactKernel gemv_packed_compact_kernel(SimdLevel level) {
+#if HAVE_X86_SIMD
+   if(level >= SIMD_AVX2) return compact_inputs_packed<gemv_packed_avx2<CompactInputs>>;
+#endif
+   return compact_inputs_packed<gemv_packed_scalar<CompactInputs>>;
+}
+
+HalfGemvKernel gemv_packed_half_kernel(SimdLevel level, WeightPrecision precision) {
+   if(precision == PRECISION_BF16) {
+#if HAVE_X86_SIMD
+      if(level >= SIMD_AVX2 && cpu_has_f16c()) return gemv_packed_half_avx2<PRECISION_BF16>;
+#endif
+      return gemv_packed_half_scalar<PRECISION_BF16>;
+   }
+#if HAVE_X86_SIMD
+   if(level >= SIMD_AVX2 && cpu_has_f16c()) return gemv_packed_half_avx2<PRECISION_FP16>;
+#endif
+   return gemv_packed_half_scalar<PRECISION_FP16>;
+}
+
+void gemv(unsigned int n, unsigned int k,
+          const float* x, const float* w, unsigned int ldw,
+          float* y, const GemmEpilogue* epilogue) {
+   static const GemvKernel kernel = gemv_kernel(cpu_simd_level());
+   kernel(n, k, x, w, ldw, y, epilogue);
+}
+
+void gemv_t(unsigned int n, unsigned int k,
+            const float* x, const float* wt, unsigned int ldwt,
+            float* y, const GemmEpilogue* epilogue) {
+   static const GemvKernel kernel = gemv_t_kernel(cpu_simd_level());
+   kernel(n, k, x, wt, ldwt, y, epilogue);
+}
+
+void gemv_packed(unsigned int n, unsigned int k,
+                 const float* x, const float* packed,
+                 float* y, const GemmEpilogue* epilogue) {
+   static const GemvKernel kernel = gemv_packed_kernel(cpu_simd_level());
+   kernel(n, k, x, packed, 0, y, epilogue);
+}
+
+// Scratch for the non-zero inputs of the calling thread
+struct CompactBuffer {
+   std::vector<uint32_t> index;
+   std::vector<float> values;
+};
+
+static thread_local CompactBuffer compact_buffer;
+
+void gemv_sparse_input(unsigned int n, unsigned int k,
+                       const float* x, const float* w, unsigned int ldw,
+                       float* y, const GemmEpilogue* epilogue) {
+   static const GemvKernel dense = gemv_kernel(cpu_simd_level());
+   static const GemvCompactKernel compact = gemv_compact_kernel(cpu_simd_level());
+   CompactBuffer& buffer = compact_buffer;
+   if(buffer.index.size() < k) {
+      buffer.index.resize(k);
+      buffer.values.resize(k);
+   }
+   unsigned int count = gemv_compact_inputs(k, x, buffer.index.data(), buffer.values.data());
+   if(gemv_skip_zero_inputs(count, k)) {
+      compact(n, k, buffer.index.data(), buffer.values.data(), count, w, ldw, y, epilogue);
+   } else {
+      dense(n, k, x, w, ldw, y, epilogue);
+   }
+}
+
+void gemv_packed_sparse_input(unsigned int n, unsigned int k,
+                              const float* x, const float* packed,
+                              float* y, const GemmEpilogue* epilogue) {
+   static const GemvKernel dense = gemv_packed_kernel(cpu_simd_level());
+   static const GemvCompactKernel compact = gemv_packed_compact_kernel(cpu_simd_level());
+   CompactBuffer& buffer = compact_buffer;
+   if(buffer.index.size() < k) {
+      buffer.index.resize(k);
+      buffer.values.resize(k);
+   }
+   unsigned int count = gemv_compact_inputs(k, x, buffer.index.data(), buffer.values.data());
+   if(gemv_skip_zero_inputs(count, k)) {
+      compact(n, k, buffer.index.data(), buffer.values.data(), count, packed, 0, y, epilogue);
+   } else {
+      dense(n, k, x, packed, 0, y, epilogue);
+   }
+}
+
+void gemv_packed_half(unsigned int n, unsigned int k,
+                      const float* x, const uint16_t* packed, WeightPrecision precision,
+                      float* y, const GemmEpilogue* epilogue) {
+   static const HalfGemvKernel fp16 = gemv_packed_half_kernel(cpu_simd_level(), PRECISION_FP16);
+   static const HalfGemvKernel bf16 = gemv_packed_half_kernel(cpu_simd_level(), PRECISION_BF16);
+   (precision == PRECISION_BF16 ? bf16 : fp16)(n, k, x, packed, y, epilogue);
+}
@@ -0,0 +1,100 @@
+
+#ifndef GEMV_HPP
+#define GEMV_HPP
+
+#include <cstdint>
+#include "CpuFeatures.hpp"
+#include "Gemm.hpp"
+#include "Half.hpp"
+
+/* Row vector times matrix kernels, the single sample case of Matrix::dot.
+ *
+ *    y (1 x n) = x (1 x k) . W (k x n)
+ *
+ * W is row-major with leading dimension ldw. The kernels sweep down the
+ * rows of W a block of columns at a time, keeping that block of y in vector
+ * registers, so every load of W is unit stride. The optional epilogue is
+ * applied to each block of y right after it is stored.
+ */
+typedef void (*GemvKernel)(unsigned int n, unsigned int k,
+                           const float* x, const float* w, unsigned int ldw,
+                           float* y, const GemmEpilogue* epilogue);
+
+// Uses the best kernel for the running CPU
+void gemv(unsigned int n, unsigned int k,
+          const float* x, const float* w, unsigned int ldw,
+          float* y, const GemmEpilogue* epilogue = nullptr);
+
+// W given as its transpose (n x k): every output is a unit stride dot product
+void gemv_t(unsigned int n, unsigned int k,
+            const float* x, const float* wt, unsigned int ldwt,
+            float* y, const GemmEpilogue* epilogue = nullptr);
+
+// W packed with gemm_pack_b: streams each NR column sliver from top to bottom
+void gemv_packed(unsigned int n, unsigned int k,
+                 const float* x, const float* packed,
+                 float* y, const GemmEpilogue* epilogue = nullptr);
+
+// The kernel for a specific instruction set, falling back to the next best
+// one when this build can't provide it. For the packed kernel ldw is unused.
+GemvKernel gemv_kernel(SimdLevel level);
+GemvKernel gemv_t_kernel(SimdLevel level);
+GemvKernel gemv_packed_kernel(SimdLevel level);
+
+/* Zero inputs
+ *
+ * ReLU layers hand the next layer a vector full of exact zeros, each of
+ * which still costs a full row of W. The nonzero inputs are compacted into
+ * an index and a value list first, and only their rows of W are summed.
+ * Skipping a zero input only drops 0 * w terms, so the results match the
+ * dense kernels up to the sign of zero.
+ */
+
+// Inputs with at most this fraction of non-zeros go through the compact
+// kernels. Above it the compaction isn't paid back.
+#define GEMV_SPARSE_INPUT_DENSITY 0.5f
+
+// Writes the positions and values of the non-zeros of x, each buffer
+// holding up to k, and returns how many there are
+unsigned int gemv_compact_inputs(unsigned int k, const float* x,
+                                 uint32_t* index, float* values);
+
+// Whether count non-zeros out of k are worth the compact kernels
+bool gemv_skip_zero_inputs(unsigned int count, unsigned int k);
+
+// Same as GemvKernel with x given by gemv_compact_inputs. k is the full
+// number of inputs, which the packed kernel needs to find its slivers.
+typedef void (*GemvCompactKernel)(unsigned int n, unsigned int k,
+                                  const uint32_t* index, const float* values, unsigned int count,
+                                  const float* w, unsigned int ldw,
+                                  float* y, const GemmEpilogue* epilogue);
+
+GemvCompactKernel gemv_compact_kernel(SimdLevel level);
+GemvCompactKernel gemv_packed_compact_kernel(SimdLevel level);
+
+// gemv and gemv_packed, measuring the density of x on every call and
+// skipping its zeros when there are enough of them
+void gemv_sparse_input(unsigned int n, unsigned int k,
+                       const float* x, const float* w, unsigned int ldw,
+                       float* y, const GemmEpilogue* epilogue = nullptr);
+void gemv_packed_sparse_input(unsigned int n, unsigned int k,
+                              const float* x, const float* packed,
+                              float* y, const GemmEpilogue* epilogue = nullptr);
+
+/* Packed W with every weight stored in 16 bits (FP16 or BF16, see Half.hpp).
+ * Each sliver row is widened to floats as it's loaded and summed in fp32,
+ * so this reads half the bytes of gemv_packed.
+ */
+typedef void (*HalfGemvKernel)(unsigned int n, unsigned int k,
+                               const float* x, const uint16_t* packed,
+                               float* y, const GemmEpilogue* epilogue);
+
+void gemv_packed_half(unsigned int n, unsigned int k,
+                      const float* x, const uint16_t* packed, WeightPrecision precision,
+                      float* y, const GemmEpilogue* epilogue = nullptr);
+
+// The AVX2 kernels also need F16C, without it the scalar ones are used
+HalfGemvKernel gemv_packed_half_kernel(SimdLevel level, WeightPrecision precision);
+
+#endif
+
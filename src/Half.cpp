@@ -0,0 +1,153 @@
+
+#include "Half.hpp"
+#include "CpuFeatures.hpp"
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#if HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+static const char* WeightPrecisionStrings[] = { "FP32", "FP16", "BF16" };
+
+const char* weight_precision_str(WeightPrecision precision) {
+   return WeightPrecisionStrings[precision];
+}
+
+static uint32_t float_bits(float value) {
+   uint32_t bits;
+   memcpy(&bits, &value, sizeof(bits));
+   return bits;
+}
+
+static float bits_float(uint32_t bits) {
+   float value;
+   memcpy(&value, &bits, sizeof(value));
+   return value;
+}
+
+// Scalar ---------------------------------------------------------------------
+uint16_t float_to_fp16(float value) {
+   uint32_t bits = float_bits(value);
+   uint32_t sign = (bits >> 16) & 0x8000;
+   uint32_t abs = bits & 0x7FFFFFFF;
+
+   if(abs >= 0x7F800000) {
+      // Infinity, or NaN with its payload kept (and quieted)
+      return (uint16_t)(sign | 0x7C00 | (abs > 0x7F800000 ? 0x200 | ((abs >> 13) & 0x3FF) : 0));
+   }
+   if(abs >= 0x477FF000) {
+      // Rounds past 65504, the largest half
+      return (uint16_t)(sign | 0x7C00);
+   }
+   if(abs < 0x38800000) {
+      // Below 2^-14 the result is subnormal, in steps of 2^-24
+      uint32_t exponent = abs >> 23;
+      if(exponent < 102) return (uint16_t)sign;
+      uint32_t mantissa = (abs & 0x7FFFFF) | 0x800000;
+      uint32_t shift = 126 - exponent;
+      uint32_t half = mantissa >> shift;
+      uint32_t rest = mantissa & ((1u << shift) - 1);
+      uint32_t tie = 1u << (shift - 1);
+      if(rest > tie || (rest == tie && (half & 1))) half++;
+      return (uint16_t)(sign | half);
+   }
+
+   // Rebias the exponent from 127 to 15 and drop 13 mantissa bits, a carry
+   // out of the mantissa moves the exponent up as it should
+   uint32_t half = (abs - 0x38000000) >> 13;
+   uint32_t rest = abs & 0x1FFF;
+   if(rest > 0x1000 || (rest == 0x1000 && (half & 1))) half++;
+   return (uint16_t)(sign | half);
+}
+
+float fp16_to_float(uint16_t value) {
+   uint32_t sign = (uint32_t)(value & 0x8000) << 16;
+   uint32_t exponent = (value >> 10) & 0x1F;
+   uint32_t mantissa = value & 0x3FF;
+
+   if(exponent == 0) {
+      // Zero or subnormal, both exact as a float
+      float magnitude = (float)mantissa * 5.9604644775390625e-8f;
+      return sign ? -magnitude : magnitude;
+   }
+   if(exponent == 31) {
+      return bits_float(sign | 0x7F800000 | (mantissa << 13));
+   }
+   return bits_float(sign | ((exponent + 112) << 23) | (mantissa << 13));
+}
+
+uint16_t float_to_bf16(float value) {
+   uint32_t bits = float_bits(value);
+   if((bits & 0x7FFFFFFF) > 0x7F800000) {
+      return (uint16_t)((bits >> 16) | 0x40);
+   }
+   return (uint16_t)((bits + 0x7FFF + ((bits >> 16) & 1)) >> 16);
+}
+
+float bf16_to_float(uint16_t value) {
+   return bits_float((uint32_t)value << 16);
+}
+
+#if HAVE_X86_SIMD
+// F16C -----------------------------------------------------------------------
+__attribute__((target("avx,f16c")))
+static void floats_to_fp16_f16c(const float* in, uint16_t* out, size_t n) {
+   size_t i = 0;
+   for(; i + 8 <= n; i += 8) {
+      __m128i half = _mm256_cvtps_ph(_mm256_loadu_ps(in + i), _MM_FROUND_TO_NEAREST_INT);
+      _mm_storeu_si128((__m128i*)(out + i), half);
+   }
+   for(; i < n; i++) out[i] = float_to_fp16(in[i]);
+}
+
+__attribute__((target("avx,f16c")))
+static void fp16_to_floats_f16c(const uint16_t* in, float* out, size_t n) {
+   size_t i = 0;
+   for(; i + 8 <= n; i += 8) {
+      _mm256_storeu_ps(out + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(in + i))));
+   }
+   for(; i < n; i++) out[i] = fp16_to_float(in[i]);
+}
+#endif
+
+// Arrays ---------------------------------------------------------------------
+static void check_half(WeightPrecision precision) {
+   if(precision != PRECISION_FP16 && precision != PRECISION_BF16) {
+      printf("%s is not a 16 bit precision!\n", weight_precision_str(precision));
+      throw invalid_argument("Half conversions need FP16 or BF16!");
+   }
+}
+
+void floats_to_half(const float* in, uint16_t* out, size_t n, WeightPrecision precision) {
+   check_half(precision);
+   if(precision == PRECISION_BF16) {
+      for(size_t i = 0; i < n; i++) out[i] = float_to_bf16(in[i]);
+      return;
+   }
+#if HAVE_X86_SIMD
+   if(cpu_has_f16c()) {
+      floats_to_fp16_f16c(in, out, n);
+      return;
+   }
+#endif
+   for(size_t i = 0; i < n; i++) out[i] = float_to_fp16(in[i]);
+}
+
+void half_to_floats(const uint16_t* in, float* out, size_t n, WeightPrecision precision) {
+   check_half(precision);
+   if(precision == PRECISION_BF16) {
+      for(size_t i = 0; i < n; i++) out[i] = bf16_to_float(in[i]);
+      return;
+   }
+#if HAVE_X86_SIMD
+   if(cpu_has_f16c()) {
+      fp16_to_floats_f16c(in, out, n);
+      return;
+   }
+#endif
+   for(size_t i = 0; i < n; i++) out[i] = fp16_to_float(in[i]);
+}
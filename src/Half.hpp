@@ -0,0 +1,37 @@
+
+#ifndef HALF_HPP
+#define HALF_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+/* 16 bit weight storage
+ *
+ * FP16 is IEEE half precision: 10 bits of mantissa, but only a range of
+ * about 6e-8 to 65504. BF16 is the top half of a float: the full float
+ * range with 7 bits of mantissa. Either halves the bytes a layer's weights
+ * take and the bandwidth a memory bound forward pass needs. Arithmetic is
+ * always done in fp32, values are widened as the kernels read them.
+ *
+ * Conversions round to nearest even. FP16 overflows to infinity and keeps
+ * subnormals, NaNs stay NaNs in both formats.
+ */
+enum WeightPrecision {
+   PRECISION_FP32,
+   PRECISION_FP16,
+   PRECISION_BF16
+};
+
+const char* weight_precision_str(WeightPrecision precision);
+
+uint16_t float_to_fp16(float value);
+float fp16_to_float(uint16_t value);
+uint16_t float_to_bf16(float value);
+float bf16_to_float(uint16_t value);
+
+// n values to and from precision, which must be FP16 or BF16. FP16 uses
+// F16C when the CPU has it.
+void floats_to_half(const float* in, uint16_t* out, size_t n, WeightPrecision precision);
+void half_to_floats(const uint16_t* in, float* out, size_t n, WeightPrecision precision);
+
+#endif
@@ -0,0 +1,159 @@
+
+#include "InferenceEngine.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+// Value below which p percent of the sorted values fall (nearest rank)
+static double percentile(const vector<double>& sorted, double p) {
+   if(sorted.empty()) return 0.0;
+   size_t rank = (size_t)ceil(p / 100.0 * sorted.size());
+   return sorted[min(sorted.size(), max<size_t>(rank, 1)) - 1];
+}
+
+InferenceEngine::InferenceEngine(shared_ptr<Network> network, unsigned int batch_size,
+                                 shared_ptr<Scheduler> scheduler)
+   : tail_context(false) {
+   if(network == nullptr) {
+      printf("Inference engine needs a network!\n");
+      throw invalid_argument("Inference engine needs a network!");
+   }
+   this->network = network;
+   this->scheduler = scheduler ? scheduler : default_scheduler();
+   this->set_batch_size(batch_size);
+
+   // At most one batch per worker plus the calling thread at a time
+   unsigned int slots = this->scheduler->get_num_workers() + 1;
+   for(unsigned int i = 0; i < slots; i++) {
+      this->contexts.emplace_back(new InferenceContext(false));
+      this->free_contexts.push_back(this->contexts.back().get());
+   }
+
+   memset(&this->stats, 0, sizeof(this->stats));
+}
+
+InferenceEngine::~InferenceEngine() {}
+
+void InferenceEngine::set_batch_size(unsigned int batch_size) {
+   if(batch_size == 0) {
+      printf("Batch size must be at least 1!\n");
+      throw invalid_argument("Batch size must be at least 1!");
+   }
+   this->batch_size = batch_size;
+}
+
+unsigned int InferenceEngine::get_batch_size() const {
+   return this->batch_size;
+}
+
+shared_ptr<Network> InferenceEngine::get_network() const {
+   return this->network;
+}
+
+const InferenceStats& InferenceEngine::get_stats() const {
+   return this->stats;
+}
+
+void InferenceEngine::print_stats() const {
+   printf("Inference: %lu samples in %d batches, %.3f s (%.0f samples/s)\n",
+          this->stats.samples, this->stats.batches, this->stats.seconds,
+          this->stats.samples_per_second);
+   printf("Batch latency: p50 %.3f ms  p90 %.3f ms  p99 %.3f ms  max %.3f ms\n",
+          this->stats.latency_p50_ms, this->stats.latency_p90_ms,
+          this->stats.latency_p99_ms, this->stats.latency_max_ms);
+}
+
+InferenceContext* InferenceEngine::acquire_context() {
+   lock_guard<mutex> guard(this->contexts_lock);
+   if(this->free_contexts.empty()) {
+      // Only happens if the scheduler has more threads than it had when the
+      // engine was made, e.g. a waiting thread helping out
+      this->contexts.emplace_back(new InferenceContext(false));
+      return this->contexts.back().get();
+   }
+   InferenceContext* context = this->free_contexts.back();
+   this->free_contexts.pop_back();
+   return context;
+}
+
+void InferenceEngine::release_context(InferenceContext* context) {
+   lock_guard<mutex> guard(this->contexts_lock);
+   this->free_contexts.push_back(context);
+}
+
+shared_ptr<Matrix> InferenceEngine::run(const Matrix& inputs) {
+   unsigned int num_layers = this->network->get_num_layers();
+   unsigned int output_size = this->network->get_layer_size(num_layers - 1);
+   auto outputs = make_shared<Matrix>(inputs.get_rows(), output_size);
+   this->run(inputs, *outputs);
+   return outputs;
+}
+
+void InferenceEngine::run(const Matrix& inputs, Matrix& outputs) {
+   unsigned int num_layers = this->network->get_num_layers();
+   unsigned int input_size = this->network->get_input_size();
+   unsigned int output_size = this->network->get_layer_size(num_layers - 1);
+   unsigned int rows = inputs.get_rows();
+
+   if(inputs.get_cols() != input_size) {
+      printf("Inference inputs must have one column per network input!\n");
+      printf("Got %d columns, expected %d\n", inputs.get_cols(), input_size);
+      throw invalid_argument("Inference inputs must have one column per network input!");
+   }
+   if(outputs.get_rows() != rows || outputs.get_cols() != output_size) {
+      printf("Inference outputs must be (%d,%d), got (%d,%d)\n",
+             rows, output_size, outputs.get_rows(), outputs.get_cols());
+      throw invalid_argument("Inference outputs have the wrong dimensions!");
+   }
+
+   unsigned int batch_size = this->batch_size;
+   unsigned int num_batches = (rows + batch_size - 1) / batch_size;
+   unsigned int tail_batch = rows % batch_size ? num_batches - 1 : num_batches;
+   this->latencies.assign(num_batches, 0.0);
+
+   Clock::time_point start = Clock::now();
+
+   this->scheduler->parallel_for(0, num_batches, 1, [&](size_t begin, size_t end) {
+      for(size_t batch = begin; batch < end; batch++) {
+         Clock::time_point batch_start = Clock::now();
+
+         unsigned int y0 = batch * batch_size;
+         unsigned int batch_rows = min(batch_size, rows - y0);
+         InferenceContext* context = batch == tail_batch ? &this->tail_context
+                                                         : this->acquire_context();
+
+         shared_ptr<Matrix> result;
+         try {
+            result = this->network->compute_batch(inputs.slice(y0, 0, batch_rows, input_size), *context);
+            for(unsigned int y = 0; y < batch_rows; y++) {
+               memcpy(outputs.row_data(y0 + y), result->row_data(y), output_size * sizeof(float));
+            }
+         } catch(...) {
+            if(context != &this->tail_context) this->release_context(context);
+            throw;
+         }
+         if(context != &this->tail_context) this->release_context(context);
+
+         this->latencies[batch] = chrono::duration<double, milli>(Clock::now() - batch_start).count();
+      }
+   });
+
+   double seconds = chrono::duration<double>(Clock::now() - start).count();
+
+   sort(this->latencies.begin(), this->latencies.end());
+   this->stats.samples = rows;
+   this->stats.batches = num_batches;
+   this->stats.seconds = seconds;
+   this->stats.samples_per_second = seconds > 0.0 ? rows / seconds : 0.0;
+   this->stats.latency_p50_ms = percentile(this->latencies, 50.0);
+   this->stats.latency_p90_ms = percentile(this->latencies, 90.0);
+   this->stats.latency_p99_ms = percentile(this->latencies, 99.0);
+   this->stats.latency_max_ms = this->latencies.empty() ? 0.0 : this->latencies.back();
+}
@@ -0,0 +1,80 @@
+
+#ifndef INFERENCEENGINE_HPP
+#define INFERENCEENGINE_HPP
+
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "Matrix.hpp"
+#include "Network.hpp"
+#include "Scheduler.hpp"
+
+// Samples per batch when none is given
+#define INFERENCE_DEFAULT_BATCH 256
+
+// Timing of the last InferenceEngine::run
+struct InferenceStats {
+   unsigned long samples;
+   unsigned int batches;
+   double seconds;              // wall time of the whole run
+   double samples_per_second;
+
+   // Time to compute a single batch, in milliseconds
+   double latency_p50_ms;
+   double latency_p90_ms;
+   double latency_p99_ms;
+   double latency_max_ms;
+};
+
+/* Scores large input sets with one network on every core.
+ *
+ * The inputs (one sample per row) are cut into batches of batch_size rows
+ * which are handed to the scheduler, idle workers steal batches from busy
+ * ones. Each batch runs as a batched compute on an InferenceContext of its
+ * own and its rows are copied to the same rows of the output, so results
+ * come out in input order and match computing the samples one by one.
+ *
+ * Contexts are kept between runs, so scoring more data with the same batch
+ * size doesn't allocate layer buffers again. The network is only read, it
+ * must not be modified while a run is going.
+ */
+class InferenceEngine {
+public:
+   // Runs on the default scheduler when none is given
+   InferenceEngine(std::shared_ptr<Network> network,
+                   unsigned int batch_size = INFERENCE_DEFAULT_BATCH,
+                   std::shared_ptr<Scheduler> scheduler = nullptr);
+   virtual ~InferenceEngine();
+
+   // inputs is N x input size, outputs must already be N x output size
+   void run(const Matrix& inputs, Matrix& outputs);
+   std::shared_ptr<Matrix> run(const Matrix& inputs);
+
+   void set_batch_size(unsigned int batch_size);
+   unsigned int get_batch_size() const;
+   std::shared_ptr<Network> get_network() const;
+
+   const InferenceStats& get_stats() const;
+   void print_stats() const;
+
+private:
+   std::shared_ptr<Network> network;
+   std::shared_ptr<Scheduler> scheduler;
+   unsigned int batch_size;
+
+   // Contexts for full batches, handed out to whichever thread runs one.
+   // The last, shorter batch gets its own so the others keep their layout.
+   std::vector<std::unique_ptr<InferenceContext>> contexts;
+   std::vector<InferenceContext*> free_contexts;
+   std::mutex contexts_lock;
+   InferenceContext tail_context;
+
+   std::vector<double> latencies;
+   InferenceStats stats;
+
+   InferenceContext* acquire_context();
+   void release_context(InferenceContext* context);
+};
+
+#endif
+
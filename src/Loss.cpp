@@ -0,0 +1,85 @@
+
+#include "Loss.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <stdexcept>
+
+using namespace std;
+
+const char* loss_str(Loss loss) {
+   switch(loss) {
+      case LOSS_MSE: return "MSE";
+      case LOSS_CROSS_ENTROPY: return "CROSS_ENTROPY";
+      default: return "UNKNOWN";
+   }
+}
+
+static void check_loss_dims(const Matrix& output, const Matrix& target, const Matrix* grad) {
+   unsigned int rows = output.get_rows();
+   unsigned int cols = output.get_cols();
+   if(target.get_rows() != rows || target.get_cols() != cols ||
+      (grad && (grad->get_rows() != rows || grad->get_cols() != cols))) {
+      printf("Loss outputs are (%d,%d) but targets are (%d,%d)\n",
+             rows, cols, target.get_rows(), target.get_cols());
+      throw invalid_argument("Loss outputs and targets must have the same dimensions!");
+   }
+}
+
+// The sums are kept in double, a batch can hold millions of terms
+float compute_loss(Loss loss, const Matrix& output, const Matrix& target, Matrix* grad) {
+   check_loss_dims(output, target, grad);
+   unsigned int rows = output.get_rows();
+   unsigned int cols = output.get_cols();
+   float scale = 1.0f / ((float)rows * cols);
+
+   double total = 0.0;
+   for(unsigned int r = 0; r < rows; r++) {
+      const float* y = output.row_data(r);
+      const float* t = target.row_data(r);
+      float* g = grad ? grad->row_data(r) : nullptr;
+
+      switch(loss) {
+         case LOSS_MSE:
+            for(unsigned int j = 0; j < cols; j++) {
+               float diff = y[j] - t[j];
+               total += diff * diff;
+               if(g) g[j] = 2.0f * scale * diff;
+            }
+            break;
+
+         case LOSS_CROSS_ENTROPY:
+            for(unsigned int j = 0; j < cols; j++) {
+               float p = min(max(y[j], LOSS_EPSILON), 1.0f - LOSS_EPSILON);
+               total -= t[j] * logf(p) + (1.0f - t[j]) * logf(1.0f - p);
+               if(g) g[j] = scale * (p - t[j]) / (p * (1.0f - p));
+            }
+            break;
+
+         default:
+            printf("Loss %d is not supported!\n", loss);
+            throw invalid_argument("Loss is not supported!");
+      }
+   }
+   return (float)(total * scale);
+}
+
+float cross_entropy_sigmoid(const Matrix& output, const Matrix& target, Matrix* grad) {
+   check_loss_dims(output, target, grad);
+   unsigned int rows = output.get_rows();
+   unsigned int cols = output.get_cols();
+   float scale = 1.0f / ((float)rows * cols);
+
+   double total = 0.0;
+   for(unsigned int r = 0; r < rows; r++) {
+      const float* y = output.row_data(r);
+      const float* t = target.row_data(r);
+      float* g = grad ? grad->row_data(r) : nullptr;
+      for(unsigned int j = 0; j < cols; j++) {
+         float p = min(max(y[j], LOSS_EPSILON), 1.0f - LOSS_EPSILON);
+         total -= t[j] * logf(p) + (1.0f - t[j]) * logf(1.0f - p);
+         if(g) g[j] = scale * (y[j] - t[j]);
+      }
+   }
+   return (float)(total * scale);
+}
@@ -0,0 +1,36 @@
+
+#ifndef LOSS_HPP
+#define LOSS_HPP
+
+#include "Matrix.hpp"
+
+/* Training losses over a batch of outputs y and targets t, both one sample
+ * per row. The loss is the mean over every output of every sample:
+ *
+ *    LOSS_MSE            (y - t)^2
+ *    LOSS_CROSS_ENTROPY  -(t log y + (1 - t) log(1 - y)), for outputs in
+ *                        (0, 1) such as sigmoid ones. y is kept LOSS_EPSILON
+ *                        away from 0 and 1 so the log stays finite.
+ */
+enum Loss {
+   LOSS_MSE,
+   LOSS_CROSS_ENTROPY
+};
+
+#define LOSS_EPSILON 1e-7f
+
+const char* loss_str(Loss loss);
+
+// Mean loss of output against target. When grad is given it is set to
+// dLoss/dy in the same pass.
+float compute_loss(Loss loss, const Matrix& output, const Matrix& target,
+                   Matrix* grad = nullptr);
+
+/* Cross entropy of a sigmoid output, with grad set to dLoss/dx for the
+ * inputs x of the sigmoid. The two derivatives cancel out to (y - t) / size,
+ * which unlike dLoss/dy never blows up when the sigmoid saturates.
+ */
+float cross_entropy_sigmoid(const Matrix& output, const Matrix& target, Matrix* grad);
+
+#endif
+
@@ -1,125 +1,240 @@
 
 #include "Matrix.hpp"
+#include "MatrixAllocator.hpp"
+#include "Gemm.hpp"
+#include "Gemv.hpp"
 #include <stdexcept>
 #include <algorithm>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
 
 using namespace std;
 
 
+// Buffer Allocation ----------------------------------------------------------
+shared_ptr<float> matrix_alloc(unsigned int size) {
+   void* ptr = nullptr;
+   size_t bytes = max(1u, size) * sizeof(float);
+   if(posix_memalign(&ptr, MATRIX_ALIGNMENT, bytes) != 0) {
+      throw bad_alloc();
+   }
+   memset(ptr, 0, bytes);
+   return shared_ptr<float>(static_cast<float*>(ptr), free);
+}
+
 // Constructors ---------------------------------------------------------------
 Matrix::Matrix(unsigned int rows, unsigned int cols, const float* mat_data) : rows(rows), cols(cols) {
    size = rows * cols;
-   data = make_shared<vector<float>>(size, 0.0);
-   for(int i = 0; i < size; i++) {
-      data->at(i) = mat_data[i];
-   } 
-} 
+   stride = cols;
+   buffer = default_matrix_allocator()->allocate(size);
+   data = buffer.get();
+   memcpy(data, mat_data, size * sizeof(float));
+}
 
 Matrix::Matrix(unsigned int rows, unsigned int cols, const vector<float> mat_data) : rows(rows), cols(cols) {
    size = rows * cols;
-   data = make_shared<vector<float>>(size, 0.0);
-   for(int i = 0; i < size; i++) {
-      data->at(i) = mat_data[i];
-   } 
-} 
+   stride = cols;
+   buffer = default_matrix_allocator()->allocate(size);
+   data = buffer.get();
+   memcpy(data, mat_data.data(), size * sizeof(float));
+}
 
 Matrix::Matrix(unsigned int rows, unsigned int cols) : rows(rows), cols(cols) {
    size = rows * cols;
-   data = make_shared<vector<float>>(size, 0.0);
-} 
+   stride = cols;
+   buffer = default_matrix_allocator()->allocate(size);
+   data = buffer.get();
+}
 
-Matrix::Matrix(const std::shared_ptr<Matrix> mat) {
-   rows = mat->rows;
-   cols = mat->cols;
+Matrix::Matrix(unsigned int rows, unsigned int cols, MatrixAllocator& allocator)
+   : rows(rows), cols(cols) {
    size = rows * cols;
+   stride = cols;
+   buffer = allocator.allocate(size);
+   data = buffer.get();
+}
 
-   data = make_shared<vector<float>>(size, 0.0);
-   for(int i = 0; i < size; i++) {
-      data->at(i) = mat->at(i);
-   } 
-} 
+Matrix::Matrix(const std::shared_ptr<Matrix> mat) : Matrix(mat.get()) {}
 
 Matrix::Matrix(const Matrix* mat) {
    rows = mat->rows;
    cols = mat->cols;
    size = rows * cols;
+   stride = cols;
 
-   data = make_shared<vector<float>>(size, 0.0);
-   for(int i = 0; i < size; i++) {
-      data->at(i) = mat->at(i);
-   } 
+   buffer = default_matrix_allocator()->allocate(size);
+   data = buffer.get();
+   for(unsigned int y = 0; y < rows; y++) {
+      memcpy(data + y * stride, mat->row_data(y), cols * sizeof(float));
+   }
 }
 
-Matrix::~Matrix() {} 
+Matrix::Matrix(unsigned int rows, unsigned int cols, unsigned int stride,
+               shared_ptr<float> buffer, float* data)
+   : rows(rows), cols(cols), size(rows * cols), stride(stride),
+     buffer(buffer), data(data) {
+   if(stride < cols) {
+      printf("Matrix stride must be at least as large as its columns!\n");
+      printf("Got stride %d for %d columns\n", stride, cols);
+      throw invalid_argument("Matrix stride must be at least as large as its columns!");
+   }
+}
+
+Matrix::~Matrix() {}
 
 // Private --------------------------------------------------------------------
 unsigned int Matrix::index(unsigned int x, unsigned int y) const {
-   return y * cols + x;
-} 
+   return y * stride + x;
+}
 
-void Matrix::set(unsigned int x, unsigned int y, float val) {data->at(index(x,y)) = val;} 
-void Matrix::set(unsigned int i, float val) {data->at(i) = val;} 
+unsigned int Matrix::linear_index(unsigned int i) const {
+   if(stride == cols) return i;
+   return index(i % cols, i / cols);
+}
+
+void Matrix::check_bounds(unsigned int x, unsigned int y) const {
+#ifndef NDEBUG
+   if(x >= cols || y >= rows) {
+      printf("Matrix index (%d , %d) out of range for (%d , %d)\n", y, x, rows, cols);
+      throw out_of_range("Matrix index out of range!");
+   }
+#endif
+}
+
+void Matrix::set(unsigned int x, unsigned int y, float val) {
+   check_bounds(x, y);
+   data[index(x,y)] = val;
+}
+
+void Matrix::set(unsigned int i, float val) {
+   check_bounds(i % max(1u, cols), i / max(1u, cols));
+   data[linear_index(i)] = val;
+}
 
 // Public ---------------------------------------------------------------------
 unsigned int Matrix::get_rows() const {return this->rows;}
 unsigned int Matrix::get_cols() const {return this->cols;}
 unsigned int Matrix::get_size() const {return this->size;}
+unsigned int Matrix::get_stride() const {return this->stride;}
+bool Matrix::is_contiguous() const {return this->stride == this->cols || this->rows <= 1;}
 
-float Matrix::at(unsigned int x, unsigned int y) const {return data->at(index(x,y));} 
-float Matrix::at(unsigned int i) const {return data->at(i);} 
+float Matrix::at(unsigned int x, unsigned int y) const {
+   check_bounds(x, y);
+   return data[index(x,y)];
+}
 
+float Matrix::at(unsigned int i) const {
+   check_bounds(i % max(1u, cols), i / max(1u, cols));
+   return data[linear_index(i)];
+}
+
+// Raw Access -----------------------------------------------------------------
+float* Matrix::get_data() {return this->data;}
+const float* Matrix::get_data() const {return this->data;}
+float* Matrix::row_data(unsigned int y) {return this->data + y * this->stride;}
+const float* Matrix::row_data(unsigned int y) const {return this->data + y * this->stride;}
+
+// Views ----------------------------------------------------------------------
+shared_ptr<Matrix> Matrix::row(unsigned int y) const {
+   return this->slice(y, 0, 1, this->cols);
+}
+
+shared_ptr<Matrix> Matrix::col(unsigned int x) const {
+   return this->slice(0, x, this->rows, 1);
+}
+
+shared_ptr<Matrix> Matrix::slice(unsigned int y, unsigned int x,
+                                 unsigned int rows, unsigned int cols) const {
+   if(y + rows > this->rows || x + cols > this->cols) {
+      printf("Slice is out of range of the matrix!\n");
+      printf("Got (%d , %d) at (%d , %d) of (%d , %d)\n", rows, cols, y, x, this->rows, this->cols);
+      throw out_of_range("Slice is out of range of the matrix!");
+   }
+   return make_shared<Matrix>(rows, cols, this->stride, this->buffer,
+                              this->data + index(x, y));
+}
+
+// Operations -----------------------------------------------------------------
 shared_ptr<Matrix> Matrix::add(const shared_ptr<Matrix> other) const {
    if(this->rows != other->rows || this->cols != other->cols) {
       printf("Matrices must be of the same size to add them!\n");
       printf("Got (%d , %d) vs (%d , %d)\n", this->rows, this->cols, other->rows, other->cols);
       throw invalid_argument("Matrices must be of the same size to add them!");
-   } 
-   
-   auto result = make_shared<Matrix>(this);
-   for(int i = 0; i < size; i++) {
-      result->set(i, this->at(i) + other->at(i));
-   } 
+   }
+
+   auto result = make_shared<Matrix>(this->rows, this->cols);
+   for(unsigned int y = 0; y < rows; y++) {
+      const float* a = this->row_data(y);
+      const float* b = other->row_data(y);
+      float* r = result->row_data(y);
+      for(unsigned int x = 0; x < cols; x++) {
+         r[x] = a[x] + b[x];
+      }
+   }
 
    return result;
-} 
+}
 
 shared_ptr<Matrix> Matrix::dot(const std::shared_ptr<Matrix> other) const {
    if(this->cols != other->rows) {
       printf("Matrices are of incompatible sizes to be dotted.");
       printf("Got (%d , %d) vs (%d , %d)\n", this->rows, this->cols, other->rows, other->cols);
       throw invalid_argument("Matrices are of incompatible sizes to be dotted.");
-   } 
-   
-   unsigned int new_rows = this->rows;
-   unsigned int new_cols = other->cols;
-   auto result = make_shared<Matrix>(new_rows, new_cols);
-
-   unsigned int len = this->cols;
-   for(int ry = 0; ry < new_rows; ry++) {
-      for(int rx = 0; rx < new_cols; rx++) {
-         float val = 0;
-         for(int i = 0; i < len; i++) {
-            val += this->at(i, ry) * other->at(rx, i);
-         } 
-         result->set(rx,ry,val);
-      }
-   }  
+   }
+
+   auto result = make_shared<Matrix>(this->rows, other->cols);
+
+   // A single row (one network input) is a matrix-vector product
+   if(this->rows == 1) {
+      gemv(other->cols, this->cols, this->data, other->data, other->stride,
+           result->data);
+      return result;
+   }
+
+   gemm(this->rows, other->cols, this->cols,
+        this->data, this->stride, other->data, other->stride,
+        result->data, result->stride);
+   return result;
+}
 
+shared_ptr<Matrix> Matrix::dot_reference(const std::shared_ptr<Matrix> other) const {
+   if(this->cols != other->rows) {
+      printf("Matrices are of incompatible sizes to be dotted.");
+      printf("Got (%d , %d) vs (%d , %d)\n", this->rows, this->cols, other->rows, other->cols);
+      throw invalid_argument("Matrices are of incompatible sizes to be dotted.");
+   }
+
+   auto result = make_shared<Matrix>(this->rows, other->cols);
+   gemm_reference(this->rows, other->cols, this->cols,
+                  this->data, this->stride, other->data, other->stride,
+                  result->data, result->stride);
    return result;
-} 
+}
 
 std::shared_ptr<Matrix> Matrix::apply(float (*func)(float)) const {
-   auto result = make_shared<Matrix>(this);
-   for(int i = 0; i < result->size; i++) {
-      result->set(i, func(result->at(i)));
-   } 
+   auto result = make_shared<Matrix>(this->rows, this->cols);
+   for(unsigned int y = 0; y < rows; y++) {
+      const float* a = this->row_data(y);
+      float* r = result->row_data(y);
+      for(unsigned int x = 0; x < cols; x++) {
+         r[x] = func(a[x]);
+      }
+   }
+   return result;
+}
+
+// Runs the activation's batch kernel over each row
+shared_ptr<Matrix> Matrix::apply(Activation act) const {
+   auto result = make_shared<Matrix>(this->rows, this->cols);
+   for(unsigned int y = 0; y < rows; y++) {
+      activate(act, this->row_data(y), result->row_data(y), this->cols);
+   }
    return result;
 }
 
 shared_ptr<Matrix> Matrix::relu() const {
-   auto relu = [](float x) {return max(0.0f, x);};
-   return this->apply(relu);
+   return this->apply(ACT_RELU);
 }
 
 void Matrix::print(const char* name) const {
@@ -134,35 +249,43 @@ void Matrix::print(const char* name) const {
       printf("\n");
    }
    printf("];\n");
-} 
+}
 
 
 bool Matrix::equals(const std::shared_ptr<Matrix> mat) const {
    if(this->rows != mat->rows || this->cols != mat-> cols)
       return false;
-   
+
    const float epsilon = 0.000001;
-   for(int i = 0; i < this->size; i++) {
-      if(abs(this->at(i) - mat->at(i)) > epsilon) {
-         return false; 
-      } 
-   } 
+   for(unsigned int y = 0; y < rows; y++) {
+      const float* a = this->row_data(y);
+      const float* b = mat->row_data(y);
+      for(unsigned int x = 0; x < cols; x++) {
+         if(abs(a[x] - b[x]) > epsilon) {
+            return false;
+         }
+      }
+   }
    return true;
-} 
+}
 
 // General --------------------------------------------------------------------
 
 std::shared_ptr<Matrix> matrix_add(const std::shared_ptr<Matrix> mat_a,
                                    const std::shared_ptr<Matrix> mat_b) {
    return mat_a->add(mat_b);
-} 
+}
 
 std::shared_ptr<Matrix> matrix_dot(const std::shared_ptr<Matrix> mat_a,
                                    const std::shared_ptr<Matrix> mat_b) {
    return mat_a->dot(mat_b);
-} 
+}
+
+std::shared_ptr<Matrix> matrix_dot_reference(const std::shared_ptr<Matrix> mat_a,
+                                             const std::shared_ptr<Matrix> mat_b) {
+   return mat_a->dot_reference(mat_b);
+}
 
 std::shared_ptr<Matrix> matrix_relu(const std::shared_ptr<Matrix> mat) {
    return mat->relu();
-} 
-
+}
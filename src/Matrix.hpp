@@ -4,26 +4,65 @@
 
 #include <memory>
 #include <vector>
+#include "Activation.hpp"
 
+class MatrixAllocator;
+
+// Every Matrix buffer starts on a cache line boundary
+#define MATRIX_ALIGNMENT 64
+
+/* Matrices are stored row-major in one contiguous, aligned buffer.
+ * A Matrix may also be a view into another Matrix's buffer (a row, column or
+ * sub-matrix slice), in which case the stride is the row length of the
+ * parent and the view shares ownership of the buffer.
+ *
+ * Buffers come from default_matrix_allocator() unless an allocator is
+ * passed in, see MatrixAllocator.hpp.
+ *
+ * Element access with at() is bounds checked in debug builds only, define
+ * NDEBUG to turn the checks off. Kernels should use the raw data pointers.
+ */
 class Matrix {
 public:
    Matrix(unsigned int rows, unsigned int cols, const float* mat_data);
    Matrix(unsigned int rows, unsigned int cols, const std::vector<float> mat_data);
    Matrix(unsigned int rows, unsigned int cols);
+   Matrix(unsigned int rows, unsigned int cols, MatrixAllocator& allocator);
    Matrix(const std::shared_ptr<Matrix> mat);
    Matrix(const Matrix* mat);
+
+   // Zero-copy view over an existing buffer
+   Matrix(unsigned int rows, unsigned int cols, unsigned int stride,
+          std::shared_ptr<float> buffer, float* data);
 	virtual ~Matrix();
-   
+
    unsigned int get_rows() const;
    unsigned int get_cols() const;
    unsigned int get_size() const;
+   unsigned int get_stride() const;
+   bool is_contiguous() const;
+
    float at(unsigned int x, unsigned int y) const;
    float at(unsigned int i) const;
 
+   // Raw Access
+   float* get_data();
+   const float* get_data() const;
+   float* row_data(unsigned int y);
+   const float* row_data(unsigned int y) const;
+
+   // Views (share the underlying buffer)
+   std::shared_ptr<Matrix> row(unsigned int y) const;
+   std::shared_ptr<Matrix> col(unsigned int x) const;
+   std::shared_ptr<Matrix> slice(unsigned int y, unsigned int x,
+                                 unsigned int rows, unsigned int cols) const;
+
    std::shared_ptr<Matrix> add(const std::shared_ptr<Matrix> other) const;
    std::shared_ptr<Matrix> dot(const std::shared_ptr<Matrix> other) const;
+   std::shared_ptr<Matrix> dot_reference(const std::shared_ptr<Matrix> other) const;
 
    std::shared_ptr<Matrix> apply(float (*func)(float)) const;
+   std::shared_ptr<Matrix> apply(Activation act) const;
    std::shared_ptr<Matrix> relu() const;
 
    void print(const char* name = 0) const;
@@ -33,13 +72,28 @@ public:
 private:
    unsigned int rows, cols;
    unsigned int size;
-   std::shared_ptr<std::vector<float>> data;
-   
+   unsigned int stride;
+   std::shared_ptr<float> buffer;
+   float* data;
+
    unsigned int index(unsigned int x, unsigned int y) const;
+   unsigned int linear_index(unsigned int i) const;
+   void check_bounds(unsigned int x, unsigned int y) const;
    void set(unsigned int x, unsigned int y, float val);
    void set(unsigned int i, float val);
 };
 
+// Allocates a zeroed buffer of MATRIX_ALIGNMENT aligned floats
+std::shared_ptr<float> matrix_alloc(unsigned int size);
+
+// The same for count values of another type (int8 or 16 bit weights)
+template<typename T>
+std::shared_ptr<T> matrix_alloc_as(size_t count) {
+   size_t floats = (count * sizeof(T) + sizeof(float) - 1) / sizeof(float);
+   std::shared_ptr<float> buffer = matrix_alloc(static_cast<unsigned int>(floats));
+   return std::shared_ptr<T>(buffer, reinterpret_cast<T*>(buffer.get()));
+}
+
 
 std::shared_ptr<Matrix> matrix_add(const std::shared_ptr<Matrix> mat_a,
                                    const std::shared_ptr<Matrix> mat_b);
@@ -47,8 +101,12 @@ std::shared_ptr<Matrix> matrix_add(const std::shared_ptr<Matrix> mat_a,
 std::shared_ptr<Matrix> matrix_dot(const std::shared_ptr<Matrix> mat_a,
                                    const std::shared_ptr<Matrix> mat_b);
 
+// Unblocked multiply for validating matrix_dot
+std::shared_ptr<Matrix> matrix_dot_reference(const std::shared_ptr<Matrix> mat_a,
+                                             const std::shared_ptr<Matrix> mat_b);
+
 std::shared_ptr<Matrix> matrix_relu(const std::shared_ptr<Matrix> mat);
-                                  
+
 
 #endif
 
@@ -0,0 +1,205 @@
+
+#include "MatrixAllocator.hpp"
+#include "Matrix.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+using namespace std;
+
+// Every size is rounded up to a whole number of cache lines
+static const size_t ALIGN_FLOATS = MATRIX_ALIGNMENT / sizeof(float);
+
+static size_t round_up(size_t size) {
+   return (max<size_t>(1, size) + ALIGN_FLOATS - 1) / ALIGN_FLOATS * ALIGN_FLOATS;
+}
+
+static float* aligned_alloc_floats(size_t size) {
+   void* ptr = nullptr;
+   if(posix_memalign(&ptr, MATRIX_ALIGNMENT, size * sizeof(float)) != 0) {
+      throw bad_alloc();
+   }
+   return static_cast<float*>(ptr);
+}
+
+
+// Heap Allocator -------------------------------------------------------------
+shared_ptr<float> HeapAllocator::allocate(unsigned int size) {
+   return matrix_alloc(size);
+}
+
+
+// Pool Allocator -------------------------------------------------------------
+struct PoolAllocator::State {
+   mutex lock;
+   vector<vector<float*>> free_lists;
+   unsigned int min_class_log2;
+
+   ~State() {
+      for(auto& list : free_lists) {
+         for(float* ptr : list) free(ptr);
+      }
+   }
+};
+
+// Returns freed buffers to their size class. Holds on to the pool state so
+// buffers can safely outlive the PoolAllocator that made them.
+struct PoolAllocator::Releaser {
+   shared_ptr<State> state;
+   unsigned int size_class;
+
+   void operator()(float* ptr) const {
+      lock_guard<mutex> guard(state->lock);
+      state->free_lists[size_class].push_back(ptr);
+   }
+};
+
+PoolAllocator::PoolAllocator(unsigned int max_class_log2) {
+   this->state = make_shared<State>();
+   this->state->min_class_log2 = 4; // one cache line of floats
+   this->state->free_lists.resize(max(max_class_log2, 4u) - 4 + 1);
+}
+
+PoolAllocator::~PoolAllocator() {}
+
+shared_ptr<float> PoolAllocator::allocate(unsigned int size) {
+   unsigned int log2 = this->state->min_class_log2;
+   while((1u << log2) < size && log2 < 31) log2++;
+
+   unsigned int size_class = log2 - this->state->min_class_log2;
+   if(size_class >= this->state->free_lists.size()) {
+      return matrix_alloc(size);
+   }
+
+   float* ptr = nullptr;
+   {
+      lock_guard<mutex> guard(this->state->lock);
+      auto& list = this->state->free_lists[size_class];
+      if(!list.empty()) {
+         ptr = list.back();
+         list.pop_back();
+      }
+   }
+   if(ptr == nullptr) {
+      ptr = aligned_alloc_floats(1u << log2);
+   }
+
+   memset(ptr, 0, size * sizeof(float));
+   return shared_ptr<float>(ptr, Releaser{this->state, size_class});
+}
+
+void PoolAllocator::trim() {
+   lock_guard<mutex> guard(this->state->lock);
+   for(auto& list : this->state->free_lists) {
+      for(float* ptr : list) free(ptr);
+      list.clear();
+   }
+}
+
+size_t PoolAllocator::cached_buffers() const {
+   lock_guard<mutex> guard(this->state->lock);
+   size_t count = 0;
+   for(auto& list : this->state->free_lists) {
+      count += list.size();
+   }
+   return count;
+}
+
+
+// Arena Allocator ------------------------------------------------------------
+ArenaAllocator::ArenaAllocator(size_t initial_capacity) {
+   this->chunk_idx = 0;
+   this->offset = 0;
+   this->used = 0;
+   this->high_water = 0;
+   if(initial_capacity > 0) {
+      this->add_chunk(round_up(initial_capacity));
+   }
+}
+
+ArenaAllocator::~ArenaAllocator() {}
+
+void ArenaAllocator::add_chunk(size_t capacity) {
+   float* ptr = aligned_alloc_floats(capacity);
+   this->chunks.push_back(Chunk{shared_ptr<float>(ptr, free), capacity});
+}
+
+shared_ptr<float> ArenaAllocator::allocate(unsigned int size) {
+   size_t needed = round_up(size);
+
+   // Move on to the next chunk that fits, growing the arena if none do
+   while(this->chunk_idx < this->chunks.size() &&
+         this->offset + needed > this->chunks[this->chunk_idx].capacity) {
+      this->chunk_idx++;
+      this->offset = 0;
+   }
+   if(this->chunk_idx == this->chunks.size()) {
+      size_t last = this->chunks.empty() ? 0 : this->chunks.back().capacity;
+      this->add_chunk(max(needed, 2 * last));
+   }
+
+   Chunk& chunk = this->chunks[this->chunk_idx];
+   float* ptr = chunk.buffer.get() + this->offset;
+   this->offset += needed;
+   this->used += needed;
+   this->high_water = max(this->high_water, this->used);
+
+   memset(ptr, 0, size * sizeof(float));
+   // Aliasing constructor, the buffer shares the chunk's control block
+   return shared_ptr<float>(chunk.buffer, ptr);
+}
+
+void ArenaAllocator::reset() {
+   // Grew past the first chunk, replace them all with one that fits
+   if(this->chunks.size() > 1) {
+      this->chunks.clear();
+      this->add_chunk(this->high_water);
+   }
+   this->chunk_idx = 0;
+   this->offset = 0;
+   this->used = 0;
+}
+
+void ArenaAllocator::reserve(size_t capacity) {
+   capacity = round_up(capacity);
+   if(this->get_capacity() >= capacity) return;
+   this->high_water = max(this->high_water, capacity);
+   if(this->used == 0) {
+      this->chunks.clear();
+      this->add_chunk(capacity);
+   } else {
+      this->add_chunk(capacity - this->get_capacity());
+   }
+}
+
+size_t ArenaAllocator::get_capacity() const {
+   size_t capacity = 0;
+   for(auto& chunk : this->chunks) {
+      capacity += chunk.capacity;
+   }
+   return capacity;
+}
+
+size_t ArenaAllocator::get_used() const {
+   return this->used;
+}
+
+
+// Default Allocator ----------------------------------------------------------
+// Function local so Matrices built during static initialization get one too
+static shared_ptr<MatrixAllocator>& default_allocator() {
+   static shared_ptr<MatrixAllocator> allocator = make_shared<HeapAllocator>();
+   return allocator;
+}
+
+shared_ptr<MatrixAllocator> default_matrix_allocator() {
+   return atomic_load(&default_allocator());
+}
+
+void set_default_matrix_allocator(shared_ptr<MatrixAllocator> allocator) {
+   if(allocator == nullptr) {
+      allocator = make_shared<HeapAllocator>();
+   }
+   atomic_store(&default_allocator(), allocator);
+}
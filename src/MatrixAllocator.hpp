@@ -0,0 +1,98 @@
+
+#ifndef MATRIXALLOCATOR_HPP
+#define MATRIXALLOCATOR_HPP
+
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <cstddef>
+
+/* Pluggable storage for Matrix buffers.
+ *
+ * An allocator hands out zeroed, MATRIX_ALIGNMENT aligned float buffers as
+ * shared_ptr<float>, so a Matrix (and any views of it) keeps its storage
+ * alive no matter which allocator it came from.
+ *
+ *    HeapAllocator   one aligned heap allocation per buffer (the default)
+ *    PoolAllocator   power of two size classes, freed buffers are kept on a
+ *                    free list and handed out again. Thread safe.
+ *    ArenaAllocator  bump pointer workspace that is reset as a whole, each
+ *                    buffer shares the arena's control block so steady
+ *                    state allocation never touches malloc. Not thread safe,
+ *                    meant to be owned by one Network.
+ */
+class MatrixAllocator {
+public:
+   virtual ~MatrixAllocator() {}
+
+   // A zeroed buffer of at least size floats
+   virtual std::shared_ptr<float> allocate(unsigned int size) = 0;
+};
+
+// Heap Allocator -------------------------------------------------------------
+class HeapAllocator : public MatrixAllocator {
+public:
+   std::shared_ptr<float> allocate(unsigned int size) override;
+};
+
+// Pool Allocator -------------------------------------------------------------
+class PoolAllocator : public MatrixAllocator {
+public:
+   // Buffers larger than 2^max_class_log2 floats bypass the pool
+   PoolAllocator(unsigned int max_class_log2 = 24);
+   virtual ~PoolAllocator();
+
+   std::shared_ptr<float> allocate(unsigned int size) override;
+
+   // Frees every buffer sitting on a free list
+   void trim();
+
+   // Number of buffers currently waiting on the free lists
+   size_t cached_buffers() const;
+
+private:
+   struct State;
+   struct Releaser;
+   std::shared_ptr<State> state;
+};
+
+// Arena Allocator ------------------------------------------------------------
+class ArenaAllocator : public MatrixAllocator {
+public:
+   ArenaAllocator(size_t initial_capacity = 0);
+   virtual ~ArenaAllocator();
+
+   std::shared_ptr<float> allocate(unsigned int size) override;
+
+   // Makes the whole arena available again. Buffers handed out before the
+   // reset stay valid memory but will be reused by the next allocations.
+   void reset();
+
+   // Grows the arena up front so that capacity floats fit without growing
+   void reserve(size_t capacity);
+
+   size_t get_capacity() const;
+   size_t get_used() const;
+
+private:
+   struct Chunk {
+      std::shared_ptr<float> buffer;
+      size_t capacity;
+   };
+
+   std::vector<Chunk> chunks;
+   size_t chunk_idx;
+   size_t offset;
+   size_t used;
+   size_t high_water;
+
+   void add_chunk(size_t capacity);
+};
+
+// The allocator used by Matrix constructors that aren't given one.
+// Starts out as a HeapAllocator.
+std::shared_ptr<MatrixAllocator> default_matrix_allocator();
+void set_default_matrix_allocator(std::shared_ptr<MatrixAllocator> allocator);
+
+#endif
+
@@ -0,0 +1,214 @@
+
+#ifndef MATRIXEXPR_HPP
+#define MATRIXEXPR_HPP
+
+#include <memory>
+#include <stdexcept>
+#include <algorithm>
+#include <cstdio>
+#include "Matrix.hpp"
+
+/* Lazy Matrix expressions
+ *
+ * lazy(mat) starts a chain with the same fluent API as Matrix, but the
+ * element-wise operations (add, apply, relu, scale) only build up an
+ * expression. The expression is evaluated in a single pass when it is
+ * eval()'d into a new Matrix or eval_into() an existing one.
+ *
+ * dot() is the only operation that needs its operand in memory, so it
+ * evaluates everything to its left, multiplies, and starts a new chain from
+ * the product:
+ *
+ *    auto out = lazy(input).dot(w1).add(b1).apply(relu)
+ *                          .dot(wo).add(bo).apply(relu).eval();
+ *
+ * allocates the two products and the final result, rather than one Matrix
+ * per operator.
+ */
+
+template<typename L, typename R> class AddExpr;
+template<typename E> class ApplyExpr;
+template<typename E> class ReluExpr;
+template<typename E> class ScaleExpr;
+class MatrixTerm;
+
+// Expression Base ------------------------------------------------------------
+template<typename E>
+class MatrixExpr {
+public:
+   const E& self() const {return static_cast<const E&>(*this);}
+
+   unsigned int get_rows() const {return self().get_rows();}
+   unsigned int get_cols() const {return self().get_cols();}
+
+   // Element-wise operations, all lazy
+   AddExpr<E, MatrixTerm> add(const std::shared_ptr<Matrix> other) const;
+   template<typename E2>
+   AddExpr<E, E2> add(const MatrixExpr<E2>& other) const;
+   ApplyExpr<E> apply(float (*func)(float)) const;
+   ReluExpr<E> relu() const;
+   ScaleExpr<E> scale(float factor) const;
+
+   // Forces evaluation of this expression
+   MatrixTerm dot(const std::shared_ptr<Matrix> other) const;
+
+   // Evaluation
+   std::shared_ptr<Matrix> eval() const;
+   void eval_into(Matrix& dst) const;
+};
+
+// Leaf -----------------------------------------------------------------------
+class MatrixTerm : public MatrixExpr<MatrixTerm> {
+public:
+   MatrixTerm(const std::shared_ptr<Matrix> mat) : mat(mat) {}
+
+   unsigned int get_rows() const {return mat->get_rows();}
+   unsigned int get_cols() const {return mat->get_cols();}
+   float value(unsigned int y, unsigned int x) const {return mat->row_data(y)[x];}
+
+   // A plain matrix is already in memory
+   std::shared_ptr<Matrix> materialize() const {return mat;}
+
+private:
+   std::shared_ptr<Matrix> mat;
+};
+
+inline MatrixTerm lazy(const std::shared_ptr<Matrix> mat) {
+   return MatrixTerm(mat);
+}
+
+// Element-wise Nodes ---------------------------------------------------------
+template<typename L, typename R>
+class AddExpr : public MatrixExpr<AddExpr<L,R>> {
+public:
+   AddExpr(const L& lhs, const R& rhs) : lhs(lhs), rhs(rhs) {
+      if(lhs.get_rows() != rhs.get_rows() || lhs.get_cols() != rhs.get_cols()) {
+         printf("Matrices must be of the same size to add them!\n");
+         printf("Got (%d , %d) vs (%d , %d)\n", lhs.get_rows(), lhs.get_cols(),
+                rhs.get_rows(), rhs.get_cols());
+         throw std::invalid_argument("Matrices must be of the same size to add them!");
+      }
+   }
+
+   unsigned int get_rows() const {return lhs.get_rows();}
+   unsigned int get_cols() const {return lhs.get_cols();}
+   float value(unsigned int y, unsigned int x) const {
+      return lhs.value(y, x) + rhs.value(y, x);
+   }
+
+   std::shared_ptr<Matrix> materialize() const {return this->eval();}
+
+private:
+   const L lhs;
+   const R rhs;
+};
+
+template<typename E>
+class ApplyExpr : public MatrixExpr<ApplyExpr<E>> {
+public:
+   ApplyExpr(const E& expr, float (*func)(float)) : expr(expr), func(func) {}
+
+   unsigned int get_rows() const {return expr.get_rows();}
+   unsigned int get_cols() const {return expr.get_cols();}
+   float value(unsigned int y, unsigned int x) const {return func(expr.value(y, x));}
+
+   std::shared_ptr<Matrix> materialize() const {return this->eval();}
+
+private:
+   const E expr;
+   float (*func)(float);
+};
+
+template<typename E>
+class ReluExpr : public MatrixExpr<ReluExpr<E>> {
+public:
+   ReluExpr(const E& expr) : expr(expr) {}
+
+   unsigned int get_rows() const {return expr.get_rows();}
+   unsigned int get_cols() const {return expr.get_cols();}
+   float value(unsigned int y, unsigned int x) const {
+      return std::max(0.0f, expr.value(y, x));
+   }
+
+   std::shared_ptr<Matrix> materialize() const {return this->eval();}
+
+private:
+   const E expr;
+};
+
+template<typename E>
+class ScaleExpr : public MatrixExpr<ScaleExpr<E>> {
+public:
+   ScaleExpr(const E& expr, float factor) : expr(expr), factor(factor) {}
+
+   unsigned int get_rows() const {return expr.get_rows();}
+   unsigned int get_cols() const {return expr.get_cols();}
+   float value(unsigned int y, unsigned int x) const {return factor * expr.value(y, x);}
+
+   std::shared_ptr<Matrix> materialize() const {return this->eval();}
+
+private:
+   const E expr;
+   float factor;
+};
+
+// Expression Base Definitions ------------------------------------------------
+template<typename E>
+AddExpr<E, MatrixTerm> MatrixExpr<E>::add(const std::shared_ptr<Matrix> other) const {
+   return AddExpr<E, MatrixTerm>(self(), MatrixTerm(other));
+}
+
+template<typename E>
+template<typename E2>
+AddExpr<E, E2> MatrixExpr<E>::add(const MatrixExpr<E2>& other) const {
+   return AddExpr<E, E2>(self(), other.self());
+}
+
+template<typename E>
+ApplyExpr<E> MatrixExpr<E>::apply(float (*func)(float)) const {
+   return ApplyExpr<E>(self(), func);
+}
+
+template<typename E>
+ReluExpr<E> MatrixExpr<E>::relu() const {
+   return ReluExpr<E>(self());
+}
+
+template<typename E>
+ScaleExpr<E> MatrixExpr<E>::scale(float factor) const {
+   return ScaleExpr<E>(self(), factor);
+}
+
+template<typename E>
+MatrixTerm MatrixExpr<E>::dot(const std::shared_ptr<Matrix> other) const {
+   return MatrixTerm(self().materialize()->dot(other));
+}
+
+template<typename E>
+std::shared_ptr<Matrix> MatrixExpr<E>::eval() const {
+   auto result = std::make_shared<Matrix>(get_rows(), get_cols());
+   eval_into(*result);
+   return result;
+}
+
+template<typename E>
+void MatrixExpr<E>::eval_into(Matrix& dst) const {
+   const E& expr = self();
+   unsigned int rows = expr.get_rows();
+   unsigned int cols = expr.get_cols();
+   if(dst.get_rows() != rows || dst.get_cols() != cols) {
+      printf("Expression and destination must be the same size!\n");
+      printf("Got (%d , %d) vs (%d , %d)\n", rows, cols, dst.get_rows(), dst.get_cols());
+      throw std::invalid_argument("Expression and destination must be the same size!");
+   }
+
+   for(unsigned int y = 0; y < rows; y++) {
+      float* out = dst.row_data(y);
+      for(unsigned int x = 0; x < cols; x++) {
+         out[x] = expr.value(y, x);
+      }
+   }
+}
+
+#endif
+
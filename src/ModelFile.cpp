@@ -0,0 +1,262 @@
+
+#include "ModelFile.hpp"
+#include "Dense.hpp"
+#include "Gemm.hpp"
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define MODEL_FILE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define MODEL_FILE_MMAP 0
+#endif
+
+using namespace std;
+
+static_assert(sizeof(ModelHeader) == 64, "ModelHeader must be 64 bytes");
+static_assert(sizeof(ModelLayerRecord) == 64, "ModelLayerRecord must be 64 bytes");
+
+static uint64_t align_block(uint64_t offset) {
+   return (offset + MODEL_BLOCK_ALIGNMENT - 1) / MODEL_BLOCK_ALIGNMENT * MODEL_BLOCK_ALIGNMENT;
+}
+
+// Writing --------------------------------------------------------------------
+static void write_bytes(FILE* file, const void* data, size_t size, const string& path) {
+   if(size > 0 && fwrite(data, 1, size, file) != size) {
+      fclose(file);
+      remove(path.c_str());
+      printf("Couldn't write model file %s\n", path.c_str());
+      throw runtime_error("Couldn't write model file!");
+   }
+}
+
+static void write_padding(FILE* file, uint64_t& offset, const string& path) {
+   static const char zeros[MODEL_BLOCK_ALIGNMENT] = {};
+   uint64_t aligned = align_block(offset);
+   write_bytes(file, zeros, aligned - offset, path);
+   offset = aligned;
+}
+
+static void write_matrix(FILE* file, const Matrix& mat, uint64_t& offset, const string& path) {
+   size_t row_bytes = mat.get_cols() * sizeof(float);
+   if(mat.is_contiguous()) {
+      write_bytes(file, mat.get_data(), mat.get_rows() * row_bytes, path);
+   } else {
+      for(unsigned int r = 0; r < mat.get_rows(); r++) {
+         write_bytes(file, mat.row_data(r), row_bytes, path);
+      }
+   }
+   offset += mat.get_rows() * row_bytes;
+}
+
+void save_network(const Network& network, const string& path) {
+   unsigned int num_layers = network.get_num_layers();
+
+   // Lay the blocks out first, the records point at them
+   vector<ModelLayerRecord> records(num_layers);
+   uint64_t offset = sizeof(ModelHeader) + num_layers * sizeof(ModelLayerRecord);
+   for(unsigned int i = 0; i < num_layers; i++) {
+      const Layer& layer = network.get_layer(i);
+      auto stored = layer.get_stored_weights();
+      ModelLayerRecord& record = records[i];
+      memset(&record, 0, sizeof(record));
+
+      const char* act_name = activation_str(layer.get_activation());
+      if(strlen(act_name) >= MODEL_ACTIVATION_NAME) {
+         printf("Activation name %s is longer than %d characters\n", act_name, MODEL_ACTIVATION_NAME - 1);
+         throw invalid_argument("Activation name is too long for a model file!");
+      }
+      if(activation_from_name(act_name) != layer.get_activation()) {
+         printf("Layer %d's activation shares the name %s with another one, "
+                "register it under a name of its own\n", i, act_name);
+         throw invalid_argument("Activation name isn't unique!");
+      }
+      strncpy(record.activation, act_name, MODEL_ACTIVATION_NAME - 1);
+
+      record.layer_size = layer.get_layer_size();
+      record.input_size = layer.get_input_size();
+      record.weight_layout = layer.get_weight_layout();
+      record.weight_rows = stored->get_rows();
+      record.weight_cols = stored->get_cols();
+
+      record.weights_offset = align_block(offset);
+      offset = record.weights_offset + (uint64_t)stored->get_size() * sizeof(float);
+      record.biases_offset = align_block(offset);
+      offset = record.biases_offset + (uint64_t)record.layer_size * sizeof(float);
+   }
+
+   ModelHeader header;
+   memset(&header, 0, sizeof(header));
+   memcpy(header.magic, MODEL_MAGIC, sizeof(header.magic));
+   header.version = MODEL_VERSION;
+   header.header_size = sizeof(ModelHeader);
+   header.record_size = sizeof(ModelLayerRecord);
+   header.num_layers = num_layers;
+   header.input_size = network.get_input_size();
+   header.gemm_nr = GEMM_NR;
+   header.file_size = offset;
+
+   // Written beside the target and renamed over it, so networks still
+   // mapped from an older version of the file keep their weights
+   string tmp_path = path + ".tmp";
+   FILE* file = fopen(tmp_path.c_str(), "wb");
+   if(file == nullptr) {
+      printf("Couldn't open model file %s for writing\n", tmp_path.c_str());
+      throw runtime_error("Couldn't open model file for writing!");
+   }
+
+   write_bytes(file, &header, sizeof(header), tmp_path);
+   write_bytes(file, records.data(), num_layers * sizeof(ModelLayerRecord), tmp_path);
+   offset = sizeof(ModelHeader) + num_layers * sizeof(ModelLayerRecord);
+   for(unsigned int i = 0; i < num_layers; i++) {
+      const Layer& layer = network.get_layer(i);
+      write_padding(file, offset, tmp_path);
+      write_matrix(file, *layer.get_stored_weights(), offset, tmp_path);
+      write_padding(file, offset, tmp_path);
+      write_matrix(file, *layer.get_biases(), offset, tmp_path);
+   }
+
+   if(fclose(file) != 0 || rename(tmp_path.c_str(), path.c_str()) != 0) {
+      remove(tmp_path.c_str());
+      printf("Couldn't write model file %s\n", path.c_str());
+      throw runtime_error("Couldn't write model file!");
+   }
+}
+
+// Loading --------------------------------------------------------------------
+/* The whole file as one buffer. Mapped where the platform allows it,
+ * otherwise read into an aligned buffer. Matrices made from the file hold
+ * on to the buffer through aliasing shared_ptrs.
+ */
+static shared_ptr<char> open_model_file(const string& path, uint64_t& size) {
+#if MODEL_FILE_MMAP
+   int fd = open(path.c_str(), O_RDONLY);
+   if(fd < 0) {
+      printf("Couldn't open model file %s\n", path.c_str());
+      throw runtime_error("Couldn't open model file!");
+   }
+   struct stat info;
+   if(fstat(fd, &info) != 0 || (uint64_t)info.st_size < sizeof(ModelHeader)) {
+      close(fd);
+      printf("%s is too short to be a model file\n", path.c_str());
+      throw invalid_argument("Not a model file!");
+   }
+   size = info.st_size;
+
+   void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+   close(fd);   // the mapping keeps the file open
+   if(addr == MAP_FAILED) {
+      printf("Couldn't map model file %s\n", path.c_str());
+      throw runtime_error("Couldn't map model file!");
+   }
+   size_t length = size;
+   return shared_ptr<char>(static_cast<char*>(addr), [length](char* p) { munmap(p, length); });
+#else
+   FILE* file = fopen(path.c_str(), "rb");
+   if(file == nullptr) {
+      printf("Couldn't open model file %s\n", path.c_str());
+      throw runtime_error("Couldn't open model file!");
+   }
+   fseek(file, 0, SEEK_END);
+   long length = ftell(file);
+   fseek(file, 0, SEEK_SET);
+   if(length < (long)sizeof(ModelHeader)) {
+      fclose(file);
+      printf("%s is too short to be a model file\n", path.c_str());
+      throw invalid_argument("Not a model file!");
+   }
+   size = length;
+
+   auto buffer = matrix_alloc((unsigned int)((size + sizeof(float) - 1) / sizeof(float)));
+   size_t read = fread(buffer.get(), 1, size, file);
+   fclose(file);
+   if(read != size) {
+      printf("Couldn't read model file %s\n", path.c_str());
+      throw runtime_error("Couldn't read model file!");
+   }
+   return shared_ptr<char>(buffer, reinterpret_cast<char*>(buffer.get()));
+#endif
+}
+
+static void bad_model(const string& path, const char* what) {
+   printf("%s is not a valid model file: %s\n", path.c_str(), what);
+   throw invalid_argument("Invalid model file!");
+}
+
+// A rows x cols block at offset, checked to lie within the file
+static shared_ptr<Matrix> adopt_block(const shared_ptr<char>& file, uint64_t size,
+                                      uint64_t offset, unsigned int rows, unsigned int cols,
+                                      const string& path) {
+   uint64_t bytes = (uint64_t)rows * cols * sizeof(float);
+   if(offset % MODEL_BLOCK_ALIGNMENT != 0) bad_model(path, "misaligned block");
+   if(offset > size || bytes > size - offset) bad_model(path, "block past the end of the file");
+
+   float* data = reinterpret_cast<float*>(file.get() + offset);
+   return make_shared<Matrix>(rows, cols, cols, shared_ptr<float>(file, data), data);
+}
+
+shared_ptr<Network> load_network(const string& path) {
+   uint64_t size = 0;
+   shared_ptr<char> file = open_model_file(path, size);
+
+   // Only the header and layer records are read, the blocks aren't touched
+   ModelHeader header;
+   memcpy(&header, file.get(), sizeof(header));
+   if(memcmp(header.magic, MODEL_MAGIC, sizeof(header.magic)) != 0) {
+      bad_model(path, "wrong magic number");
+   }
+   if(header.version != MODEL_VERSION) {
+      printf("Model file version %u, this build reads version %d\n", header.version, MODEL_VERSION);
+      bad_model(path, "unsupported version");
+   }
+   if(header.header_size != sizeof(ModelHeader) || header.record_size != sizeof(ModelLayerRecord)) {
+      bad_model(path, "unexpected header size");
+   }
+   if(header.file_size != size) bad_model(path, "file is truncated");
+   if(header.num_layers == 0) bad_model(path, "no layers");
+   if((size - sizeof(ModelHeader)) / sizeof(ModelLayerRecord) < header.num_layers) {
+      bad_model(path, "layer table past the end of the file");
+   }
+
+   const ModelLayerRecord* records =
+      reinterpret_cast<const ModelLayerRecord*>(file.get() + sizeof(ModelHeader));
+
+   vector<Layer> layers;
+   layers.reserve(header.num_layers);
+   unsigned int prev_output_size = header.input_size;
+   for(unsigned int i = 0; i < header.num_layers; i++) {
+      ModelLayerRecord record;
+      memcpy(&record, records + i, sizeof(record));
+
+      if(record.input_size != prev_output_size) bad_model(path, "layer sizes don't chain");
+      if(record.weight_layout > PACKED_OUTPUT_MAJOR) bad_model(path, "unknown weight layout");
+      WeightLayout layout = static_cast<WeightLayout>(record.weight_layout);
+      if(layout == PACKED_OUTPUT_MAJOR && header.gemm_nr != GEMM_NR) {
+         printf("Weights are packed for GEMM_NR %u, this build uses %u\n", header.gemm_nr, GEMM_NR);
+         bad_model(path, "packed for a different GEMM_NR");
+      }
+
+      unsigned int rows, cols;
+      stored_weights_shape(layout, record.input_size, record.layer_size, rows, cols);
+      if(record.weight_rows != rows || record.weight_cols != cols) {
+         bad_model(path, "weight block has the wrong dimensions");
+      }
+      if(memchr(record.activation, '\0', MODEL_ACTIVATION_NAME) == nullptr) {
+         bad_model(path, "unterminated activation name");
+      }
+
+      auto weights = adopt_block(file, size, record.weights_offset, rows, cols, path);
+      auto biases = adopt_block(file, size, record.biases_offset, 1, record.layer_size, path);
+      layers.push_back(Layer(record.layer_size, record.input_size,
+                             activation_from_name(record.activation),
+                             weights, biases, layout));
+      prev_output_size = record.layer_size;
+   }
+   return make_shared<Network>(header.input_size, layers);
+}
@@ -0,0 +1,79 @@
+
+#ifndef MODEL_FILE_HPP
+#define MODEL_FILE_HPP
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include "Network.hpp"
+
+/* Binary model files
+ *
+ * A model file holds a whole Network: its topology, every layer's
+ * activation and the weights and biases exactly as the layers store them.
+ * All values are little endian.
+ *
+ *    ModelHeader                         64 bytes
+ *    ModelLayerRecord x num_layers       64 bytes each
+ *    weight and bias blocks              each starting on a
+ *                                        MODEL_BLOCK_ALIGNMENT boundary
+ *
+ * Weight blocks are the layer's stored weights (see WeightLayout), so
+ * loading never lays anything out again. Activations are saved by name
+ * and looked up in the registry when loading, registered activations have
+ * to be registered under the same name before the file is loaded.
+ *
+ * load_network maps the file and the layers adopt their blocks in place,
+ * nothing is read or copied up front. A page of weights is only read from
+ * disk the first time a computation touches it, so opening a large model
+ * costs a few page faults rather than a pass over every parameter. The
+ * mapping is private and writable, training a loaded network changes its
+ * copy in memory and never the file. The mapping stays open for as long as
+ * any of the network's matrices are alive.
+ *
+ * Loaded layers are always dense fp32, whatever storage they were saved
+ * from. Layer::select_storage picks sparse or ternary storage again, at the
+ * cost of reading every weight.
+ */
+
+#define MODEL_MAGIC "NNMODEL"
+#define MODEL_VERSION 1
+
+// Every block starts on a boundary the Matrix kernels expect
+#define MODEL_BLOCK_ALIGNMENT MATRIX_ALIGNMENT
+
+// Longest activation name a model file can hold, including the terminator
+#define MODEL_ACTIVATION_NAME 24
+
+struct ModelHeader {
+   char magic[8];             // MODEL_MAGIC
+   uint32_t version;          // MODEL_VERSION
+   uint32_t header_size;      // sizeof(ModelHeader)
+   uint32_t record_size;      // sizeof(ModelLayerRecord)
+   uint32_t num_layers;
+   uint32_t input_size;
+   uint32_t gemm_nr;          // GEMM_NR the packed layouts were made with
+   uint64_t file_size;
+   uint8_t reserved[24];
+};
+
+struct ModelLayerRecord {
+   uint32_t layer_size;
+   uint32_t input_size;
+   uint32_t weight_layout;    // WeightLayout
+   uint32_t weight_rows;      // dimensions of the stored weights
+   uint32_t weight_cols;
+   uint32_t reserved;
+   uint64_t weights_offset;   // from the start of the file
+   uint64_t biases_offset;    // layer_size floats
+   char activation[MODEL_ACTIVATION_NAME];
+};
+
+// Writes the network to path, replacing the file if there is one
+void save_network(const Network& network, const std::string& path);
+
+// Opens a file written by save_network, throws if it isn't a valid one
+std::shared_ptr<Network> load_network(const std::string& path);
+
+#endif
+
@@ -4,46 +4,96 @@
 #include <cstdlib>
 #include <ctime>
 #include <string>
+#include <stdexcept>
 #include "Matrix.hpp"
 #include "Network.hpp"
+#include "Dense.hpp"
+#include "ExecutionPlan.hpp"
+#include "Quantize.hpp"
+#include "Random.hpp"
+#include "Scheduler.hpp"
+#include "SparseMatrix.hpp"
+#include "TernaryMatrix.hpp"
 
 using namespace std;
 
-// Activation Functions -------------------------------------------------------
-float relu(float x) {
-   return std::max(0.0f, x);
-}
-float sigmoid(float x) {
-   return 1.0 / (1.0 + std::pow(M_E, -x));
-}
-
-
 // Network Single Layer -------------------------------------------------------
 Layer::Layer(unsigned int layer_size, unsigned int input_size, 
              float (*act_func)(float), 
-             const float* weights, const float* biases) { 
+             const float* weights, const float* biases,
+             WeightLayout layout) { 
    
    this->layer_size = layer_size;
    this->input_size = input_size;
-   this->act_func = act_func;
+   this->activation = activation_from_func(act_func);
+   this->weight_layout = layout;
    
-   this->weights = make_shared<Matrix>(input_size, layer_size, weights);
+   auto logical = make_shared<Matrix>(input_size, layer_size, weights);
+   if(layout == INPUT_MAJOR) {
+      this->weights = logical;
+   } else {
+      this->weights = layout_weights(*logical, layout);
+   } 
    this->biases = make_shared<Matrix>(1, layer_size, biases);
-
+   this->precision = PRECISION_FP32;
+   this->half_weights = nullptr;
+   this->sparse_weights = nullptr;
+   this->ternary_weights = nullptr;
+   this->logical_weights_mat = nullptr;
+   this->auto_storage = false;
+   this->select_storage();
+
+#ifdef NETWORK_KEEP_INTERMEDIATES
+   this->keep_intermediates = true;
+#else
+   this->keep_intermediates = false;
+#endif
    this->output_mat = nullptr;
+   this->pre_bias_output_mat = nullptr;
+   this->pre_act_output_mat = nullptr;
 } 
 
 Layer::Layer(unsigned int layer_size, unsigned int input_size, 
              float (*act_func)(float), 
-             const vector<float> weights, const vector<float> biases) {
-   
+             const vector<float> weights, const vector<float> biases,
+             WeightLayout layout) 
+   : Layer(layer_size, input_size, act_func, weights.data(), biases.data(), layout) {} 
+
+Layer::Layer(unsigned int layer_size, unsigned int input_size, Activation activation,
+             shared_ptr<Matrix> stored_weights, shared_ptr<Matrix> biases,
+             WeightLayout layout) {
+   unsigned int rows, cols;
+   stored_weights_shape(layout, input_size, layer_size, rows, cols);
+   if(stored_weights->get_rows() != rows || stored_weights->get_cols() != cols) {
+      printf("%s layer weights must be (%d,%d), got (%d,%d)\n", weight_layout_str(layout),
+             rows, cols, stored_weights->get_rows(), stored_weights->get_cols());
+      throw invalid_argument("Layer weights have the wrong dimensions!");
+   } 
+   if(biases->get_rows() != 1 || biases->get_cols() != layer_size) {
+      printf("Layer biases must be (1,%d), got (%d,%d)\n", layer_size,
+             biases->get_rows(), biases->get_cols());
+      throw invalid_argument("Layer biases have the wrong dimensions!");
+   } 
+   activation_info(activation); // throws if it was never registered
+
    this->layer_size = layer_size;
    this->input_size = input_size;
-   this->act_func = act_func;
-
-   this->weights = make_shared<Matrix>(input_size, layer_size, weights);
-   this->biases = make_shared<Matrix>(1, layer_size, biases);
-   
+   this->activation = activation;
+   this->weight_layout = layout;
+   this->weights = stored_weights;
+   this->biases = biases;
+   this->precision = PRECISION_FP32;
+   this->half_weights = nullptr;
+   this->sparse_weights = nullptr;
+   this->ternary_weights = nullptr;
+   this->logical_weights_mat = nullptr;
+   this->auto_storage = false;
+
+#ifdef NETWORK_KEEP_INTERMEDIATES
+   this->keep_intermediates = true;
+#else
+   this->keep_intermediates = false;
+#endif
    this->output_mat = nullptr;
    this->pre_bias_output_mat = nullptr;
    this->pre_act_output_mat = nullptr;
@@ -51,14 +101,88 @@ Layer::Layer(unsigned int layer_size, unsigned int input_size,
 
 Layer::~Layer() {} 
 
+// Weights that are mostly zeros are cheaper to run sparse, even when they
+// are all -1, 0 or +1, since the ternary kernels go over every bit. Denser
+// ternary weights need no multiplies at all.
+void Layer::select_storage() {
+   unsigned int size = this->input_size * this->layer_size;
+   if(size == 0 || !this->weights) return;
+   if(matrix_density(*this->weights, size) <= SPARSE_DENSITY_THRESHOLD) {
+      this->set_sparse(true);
+      this->auto_storage = true;
+   } else if(matrix_is_ternary(*this->weights)) {
+      this->set_ternary(true);
+      this->auto_storage = true;
+   } 
+} 
+
+bool Layer::has_auto_storage() const {
+   return this->auto_storage;
+} 
+
+void Layer::reserve_outputs(unsigned int rows) {
+   if(this->output_mat == nullptr || this->output_mat->get_rows() != rows) {
+      this->output_mat = make_shared<Matrix>(rows, this->layer_size);
+   } 
+
+   if(!this->keep_intermediates) {
+      this->pre_bias_output_mat = nullptr;
+      this->pre_act_output_mat = nullptr;
+   } else if(this->pre_bias_output_mat == nullptr || this->pre_bias_output_mat->get_rows() != rows) {
+      this->pre_bias_output_mat = make_shared<Matrix>(rows, this->layer_size);
+      this->pre_act_output_mat = make_shared<Matrix>(rows, this->layer_size);
+   } 
+} 
+
 shared_ptr<Matrix> Layer::compute(const std::shared_ptr<Matrix> input) {
-   this->pre_bias_output_mat = input->dot(this->weights);
-   this->pre_act_output_mat = pre_bias_output_mat->add(this->biases);
-   this->output_mat = pre_act_output_mat->apply(this->act_func);
-   //this->output_mat = pre_bias_output_mat->add(this->biases)->apply(this->act_func);
+   return this->compute_batch(input);
+} 
+
+shared_ptr<Matrix> Layer::compute_batch(const std::shared_ptr<Matrix> inputs) {
+   this->reserve_outputs(inputs->get_rows());
+   this->forward(*inputs, *this->output_mat, 
+                 this->pre_bias_output_mat.get(), this->pre_act_output_mat.get());
    return this->output_mat;
 } 
 
+void Layer::forward(const Matrix& inputs, Matrix& output,
+                    Matrix* pre_bias, Matrix* pre_act) const {
+   if(inputs.get_cols() != this->input_size) {
+      printf("Layer input must have one column per layer input!\n");
+      printf("Got %d columns, expected %d\n", inputs.get_cols(), this->input_size);
+      throw invalid_argument("Layer input must have one column per layer input!");
+   } 
+   if(this->ternary_weights) {
+      dense_forward_ternary(inputs, *this->ternary_weights,
+                            *this->biases, this->activation,
+                            output, pre_bias, pre_act);
+      return;
+   } 
+   if(this->sparse_weights) {
+      dense_forward_sparse(inputs, *this->sparse_weights,
+                           *this->biases, this->activation,
+                           output, pre_bias, pre_act);
+      return;
+   } 
+   if(this->precision != PRECISION_FP32) {
+      dense_forward_half(inputs, this->half_weights.get(), this->precision,
+                         *this->biases, this->activation,
+                         output, pre_bias, pre_act);
+      return;
+   } 
+   dense_forward(inputs, *this->weights, this->weight_layout, 
+                 *this->biases, this->activation,
+                 output, pre_bias, pre_act);
+} 
+
+void Layer::set_keep_intermediates(bool keep) {
+   this->keep_intermediates = keep;
+} 
+
+bool Layer::get_keep_intermediates() const {
+   return this->keep_intermediates;
+} 
+
 shared_ptr<Matrix> Layer::output() const {
    return this->output_mat;
 } 
@@ -72,27 +196,200 @@ shared_ptr<Matrix> Layer::pre_act_output() const {
 } 
 
 shared_ptr<Matrix> Layer::get_weights() const {
+   if(this->weights && this->weight_layout == INPUT_MAJOR) {
+      return this->weights; 
+   } 
+   // Built on first use, the renderer asks for these every frame. Two
+   // threads may race to build it, but they build the same matrix.
+   auto logical = atomic_load(&this->logical_weights_mat);
+   if(logical == nullptr) {
+      if(this->ternary_weights) {
+         logical = this->ternary_weights->transpose_to_dense();
+      } else if(this->sparse_weights) {
+         logical = this->sparse_weights->transpose_to_dense();
+      } else if(this->precision != PRECISION_FP32) {
+         logical = logical_half_weights(this->half_weights.get(), this->precision,
+                                        this->input_size, this->layer_size);
+      } else {
+         logical = logical_weights(*this->weights, this->weight_layout,
+                                   this->input_size, this->layer_size);
+      } 
+      atomic_store(&this->logical_weights_mat, logical);
+   } 
+   return logical;
+} 
+
+shared_ptr<Matrix> Layer::get_stored_weights() const {
+   if(!this->weights) {
+      return layout_weights(*this->get_weights(), this->weight_layout);
+   } 
    return this->weights; 
 } 
 
+void Layer::set_precision(WeightPrecision precision) {
+   if(precision == this->precision) return;
+
+   auto logical = this->get_weights();
+   this->sparse_weights = nullptr;
+   this->ternary_weights = nullptr;
+   this->auto_storage = false;
+   if(precision == PRECISION_FP32) {
+      this->weights = this->weight_layout == INPUT_MAJOR ? make_shared<Matrix>(logical)
+                                                         : layout_weights(*logical, this->weight_layout);
+      this->half_weights = nullptr;
+   } else {
+      this->half_weights = ::half_weights(*logical, precision);
+      this->weights = nullptr;
+   } 
+   this->precision = precision;
+   atomic_store(&this->logical_weights_mat, shared_ptr<Matrix>());
+} 
+
+WeightPrecision Layer::get_precision() const {
+   return this->precision;
+} 
+
+shared_ptr<uint16_t> Layer::get_half_weights() const {
+   return this->half_weights;
+} 
+
+void Layer::set_sparse(bool sparse) {
+   this->auto_storage = false;
+   if(sparse == this->is_sparse()) return;
+
+   auto logical = this->get_weights();
+   if(sparse) {
+      this->sparse_weights = SparseMatrix::transpose_of(*logical);
+      this->weights = nullptr;
+      this->half_weights = nullptr;
+      this->ternary_weights = nullptr;
+      this->precision = PRECISION_FP32;
+   } else {
+      this->weights = this->weight_layout == INPUT_MAJOR ? make_shared<Matrix>(logical)
+                                                         : layout_weights(*logical, this->weight_layout);
+      this->sparse_weights = nullptr;
+   } 
+   atomic_store(&this->logical_weights_mat, shared_ptr<Matrix>());
+} 
+
+bool Layer::is_sparse() const {
+   return this->sparse_weights != nullptr;
+} 
+
+shared_ptr<SparseMatrix> Layer::get_sparse_weights() const {
+   return this->sparse_weights;
+} 
+
+void Layer::set_ternary(bool ternary) {
+   this->auto_storage = false;
+   if(ternary == this->is_ternary()) return;
+
+   auto logical = this->get_weights();
+   if(ternary) {
+      if(!matrix_is_ternary(*logical)) {
+         printf("Layer weights must all be -1, 0 or 1 to be stored ternary!\n");
+         throw invalid_argument("Layer weights are not ternary!");
+      } 
+      this->ternary_weights = TernaryMatrix::transpose_of(*logical);
+      this->weights = nullptr;
+      this->half_weights = nullptr;
+      this->sparse_weights = nullptr;
+      this->precision = PRECISION_FP32;
+   } else {
+      this->weights = this->weight_layout == INPUT_MAJOR ? make_shared<Matrix>(logical)
+                                                         : layout_weights(*logical, this->weight_layout);
+      this->ternary_weights = nullptr;
+   } 
+   atomic_store(&this->logical_weights_mat, shared_ptr<Matrix>());
+} 
+
+bool Layer::is_ternary() const {
+   return this->ternary_weights != nullptr;
+} 
+
+shared_ptr<TernaryMatrix> Layer::get_ternary_weights() const {
+   return this->ternary_weights;
+} 
+
+WeightLayout Layer::get_weight_layout() const {
+   return this->weight_layout;
+} 
+
 shared_ptr<Matrix> Layer::get_biases() const {
    return this->biases;
 } 
 
+void Layer::set_weights(const Matrix& weights) {
+   if(weights.get_rows() != this->input_size || weights.get_cols() != this->layer_size) {
+      printf("Layer weights must be (%d,%d), got (%d,%d)\n", this->input_size, this->layer_size,
+             weights.get_rows(), weights.get_cols());
+      throw invalid_argument("Layer weights have the wrong dimensions!");
+   } 
+   if(this->ternary_weights) {
+      if(matrix_is_ternary(weights)) {
+         this->ternary_weights->assign_transpose(weights);
+      } else {
+         this->weights = this->weight_layout == INPUT_MAJOR ? make_shared<Matrix>(&weights)
+                                                            : layout_weights(weights, this->weight_layout);
+         this->ternary_weights = nullptr;
+         this->auto_storage = false;
+      } 
+   } else if(this->sparse_weights) {
+      if(!this->sparse_weights->assign_transpose(weights)) {
+         this->sparse_weights = SparseMatrix::transpose_of(weights);
+      } 
+   } else if(this->precision != PRECISION_FP32) {
+      half_weights_into(weights, this->precision, this->half_weights.get());
+   } else if(&weights != this->weights.get()) {
+      layout_weights_into(weights, this->weight_layout, *this->weights);
+   } 
+   // Rebuilt from the new weights when next asked for
+   atomic_store(&this->logical_weights_mat, shared_ptr<Matrix>());
+} 
+
+void Layer::set_biases(const Matrix& biases) {
+   if(biases.get_rows() != 1 || biases.get_cols() != this->layer_size) {
+      printf("Layer biases must be (1,%d), got (%d,%d)\n", this->layer_size,
+             biases.get_rows(), biases.get_cols());
+      throw invalid_argument("Layer biases have the wrong dimensions!");
+   } 
+   if(&biases != this->biases.get()) {
+      std::copy(biases.get_data(), biases.get_data() + this->layer_size, this->biases->get_data());
+   } 
+} 
+
+float (*Layer::get_act_func() const)(float) {
+   return activation_info(this->activation).func;
+} 
+
+void Layer::set_activation(Activation activation) {
+   activation_info(activation); // throws if it was never registered
+   this->activation = activation;
+} 
+
+Activation Layer::get_activation() const {
+   return this->activation;
+} 
+
 unsigned int Layer::get_layer_size() const {
    return this->layer_size; 
 } 
 
+unsigned int Layer::get_input_size() const {
+   return this->input_size; 
+} 
+
 
 // Multi-Layer Network --------------------------------------------------------
 Network::Network(unsigned int input_size, float (*act_func)(float), 
                  const vector<unsigned int> layer_sizes,
                  const vector<float*> layer_weights, 
-                 const vector<float*> layer_biases) {
+                 const vector<float*> layer_biases,
+                 WeightLayout layout) {
    this->input_size = input_size;
+   this->weight_layout = layout;
+   this->precision = PRECISION_FP32;
    this->num_layers = static_cast<unsigned int>(layer_sizes.size());
-   this->net_input_mat = nullptr;
-   this->net_output_mat = nullptr;
    
    //this->layers = make_shared<vector<shared_ptr<Layer>>>();
    
@@ -104,7 +401,7 @@ Network::Network(unsigned int input_size, float (*act_func)(float),
       auto biases = layer_biases[i];
 
       //auto layer = make_shared<Layer>(layer_size, prev_output_size, act_func, weights, biases);
-      auto layer = Layer(layer_size, prev_output_size, act_func, weights, biases);
+      auto layer = Layer(layer_size, prev_output_size, act_func, weights, biases, layout);
       this->layers.push_back(layer);
 
       prev_output_size = layer_size;
@@ -114,11 +411,12 @@ Network::Network(unsigned int input_size, float (*act_func)(float),
 Network::Network(unsigned int input_size, float (*act_func)(float), 
                  const vector<unsigned int> layer_sizes,
                  const vector<vector<float>> layer_weights, 
-                 const vector<vector<float>> layer_biases) {
+                 const vector<vector<float>> layer_biases,
+                 WeightLayout layout) {
    this->input_size = input_size;
+   this->weight_layout = layout;
+   this->precision = PRECISION_FP32;
    this->num_layers = static_cast<unsigned int>(layer_sizes.size());
-   this->net_input_mat = nullptr;
-   this->net_output_mat = nullptr;
    
    //this->
    //this->layers = make_shared<vector<shared_ptr<Layer>>>();
@@ -130,13 +428,35 @@ Network::Network(unsigned int input_size, float (*act_func)(float),
       auto biases = layer_biases[i];
 
       //auto layer = make_shared<Layer>(layer_size, prev_output_size, act_func, weights, biases);
-      auto layer = Layer(layer_size, prev_output_size, act_func, weights, biases);
+      auto layer = Layer(layer_size, prev_output_size, act_func, weights, biases, layout);
       this->layers.push_back(layer);
 
       prev_output_size = layer_size;
    }  
 } 
 
+Network::Network(unsigned int input_size, const vector<Layer>& layers) {
+   if(layers.empty()) {
+      printf("A network needs at least one layer!\n");
+      throw invalid_argument("A network needs at least one layer!");
+   } 
+   unsigned int prev_output_size = input_size;
+   for(unsigned int i = 0; i < layers.size(); i++) {
+      if(layers[i].get_input_size() != prev_output_size) {
+         printf("Layer %d takes %d inputs but gets %d\n", i,
+                layers[i].get_input_size(), prev_output_size);
+         throw invalid_argument("Layer input size doesn't match the previous layer!");
+      } 
+      prev_output_size = layers[i].get_layer_size();
+   } 
+
+   this->input_size = input_size;
+   this->weight_layout = layers[0].get_weight_layout();
+   this->precision = layers[0].get_precision();
+   this->num_layers = static_cast<unsigned int>(layers.size());
+   this->layers = layers;
+} 
+
 Network::~Network() {} 
 
 // Getting Network Info -------------------------------------------------------
@@ -148,32 +468,245 @@ unsigned int Network::get_input_size() const {
    return this->input_size; 
 } 
 
+WeightLayout Network::get_weight_layout() const {
+   return this->weight_layout; 
+} 
+
+void Network::set_precision(WeightPrecision precision) {
+   for(auto &layer : this->layers) {
+      layer.set_precision(precision);
+   } 
+   this->precision = precision;
+} 
+
+WeightPrecision Network::get_precision() const {
+   return this->precision; 
+} 
+
+shared_ptr<ArenaAllocator> Network::get_workspace() const {
+   return this->context.get_workspace(); 
+} 
+
+InferenceContext& Network::get_context() {
+   return this->context; 
+} 
+
+// Inference Context ----------------------------------------------------------
+InferenceContext::InferenceContext() {
+#ifdef NETWORK_KEEP_INTERMEDIATES
+   this->keep_intermediates = true;
+#else
+   this->keep_intermediates = false;
+#endif
+   this->workspace = make_shared<ArenaAllocator>();
+   this->prepared_rows = 0;
+   this->prepared_keep = false;
+} 
+
+InferenceContext::InferenceContext(bool keep_intermediates) : InferenceContext() {
+   this->keep_intermediates = keep_intermediates;
+} 
+
+// Copies never share buffers, the copy lays out its own on first use
+InferenceContext::InferenceContext(const InferenceContext& other) : InferenceContext() {
+   this->keep_intermediates = other.keep_intermediates;
+} 
+
+InferenceContext& InferenceContext::operator=(const InferenceContext& other) {
+   if(this != &other) {
+      // Starts over with a workspace of its own, like a copy
+      this->keep_intermediates = other.keep_intermediates;
+      this->workspace = make_shared<ArenaAllocator>();
+      this->prepared_sizes.clear();
+      this->prepared_rows = 0;
+      this->prepared_keep = false;
+      this->outputs.clear();
+      this->pre_bias_outputs.clear();
+      this->pre_act_outputs.clear();
+      this->input_mat = nullptr;
+      this->output_mat = nullptr;
+      this->vector_input_mat = nullptr;
+      this->batch_input_mat = nullptr;
+   } 
+   return *this;
+} 
+
+InferenceContext::~InferenceContext() {} 
+
+void InferenceContext::set_keep_intermediates(bool keep) {
+   this->keep_intermediates = keep;
+} 
+
+bool InferenceContext::get_keep_intermediates() const {
+   return this->keep_intermediates;
+} 
+
+shared_ptr<Matrix> InferenceContext::input() const {
+   return this->input_mat;
+} 
+
+shared_ptr<Matrix> InferenceContext::output() const {
+   return this->output_mat;
+} 
+
+shared_ptr<Matrix> InferenceContext::get_layer_output(unsigned int layer_num) const {
+   return layer_num < this->outputs.size() ? this->outputs[layer_num] : nullptr;
+} 
+
+shared_ptr<Matrix> InferenceContext::get_layer_pre_bias_output(unsigned int layer_num) const {
+   return layer_num < this->pre_bias_outputs.size() ? this->pre_bias_outputs[layer_num] : nullptr;
+} 
+
+shared_ptr<Matrix> InferenceContext::get_layer_pre_act_output(unsigned int layer_num) const {
+   return layer_num < this->pre_act_outputs.size() ? this->pre_act_outputs[layer_num] : nullptr;
+} 
+
+shared_ptr<ArenaAllocator> InferenceContext::get_workspace() const {
+   return this->workspace;
+} 
+
+void Network::prepare_context(InferenceContext& context, unsigned int rows) const {
+   bool same_sizes = context.prepared_sizes.size() == this->num_layers;
+   for(unsigned int i = 0; same_sizes && i < this->num_layers; i++) {
+      same_sizes = context.prepared_sizes[i] == this->layers[i].get_layer_size();
+   } 
+   if(same_sizes && context.prepared_rows == rows &&
+      context.prepared_keep == context.keep_intermediates) {
+      return;
+   } 
+
+   // Size the arena for the whole batch before carving it up, so it ends up
+   // as a single block. Outputs from the previous layout are released.
+   bool keep = context.keep_intermediates;
+   size_t needed = 0;
+   size_t line = MATRIX_ALIGNMENT / sizeof(float);
+   for(auto &layer : this->layers) {
+      size_t size = (size_t)rows * layer.get_layer_size();
+      needed += (keep ? 3 : 1) * ((size + line - 1) / line * line);
+   } 
+   context.workspace->reset();
+   context.workspace->reserve(needed);
+
+   ArenaAllocator& arena = *context.workspace;
+   context.outputs.assign(this->num_layers, nullptr);
+   context.pre_bias_outputs.assign(this->num_layers, nullptr);
+   context.pre_act_outputs.assign(this->num_layers, nullptr);
+   for(unsigned int i = 0; i < this->num_layers; i++) {
+      unsigned int size = this->layers[i].get_layer_size();
+      context.outputs[i] = make_shared<Matrix>(rows, size, arena);
+      if(keep) {
+         context.pre_bias_outputs[i] = make_shared<Matrix>(rows, size, arena);
+         context.pre_act_outputs[i] = make_shared<Matrix>(rows, size, arena);
+      } 
+   } 
+
+   context.prepared_sizes.resize(this->num_layers);
+   for(unsigned int i = 0; i < this->num_layers; i++) {
+      context.prepared_sizes[i] = this->layers[i].get_layer_size();
+   } 
+   context.prepared_rows = rows;
+   context.prepared_keep = keep;
+} 
+
 // Sending data through the network -------------------------------------------
-shared_ptr<Matrix> Network::compute(const vector<float> input) {
-   int input_size = static_cast<int>(input.size());
-   auto input_mat = make_shared<Matrix>(1, input_size, input);
-   return this->compute(input_mat);
+shared_ptr<Matrix> Network::compute(const vector<float>& input) {
+   return this->compute(input, this->context);
 } 
 
 shared_ptr<Matrix> Network::compute(const shared_ptr<Matrix> input) {
-   this->net_input_mat = input;
-   auto output = this->layers[0].compute(input);
-   //auto output = this->layers->at(0)->compute(input);
-   for(int layer_num = 1; layer_num < this->num_layers; layer_num++) {
-      output = this->layers[layer_num].compute(output);
-      //output = this->layers->at(layer_num)->compute(output);
+   return this->compute_batch(input, this->context);
+} 
+
+shared_ptr<Matrix> Network::compute_batch(const shared_ptr<Matrix> inputs) {
+   return this->compute_batch(inputs, this->context);
+} 
+
+shared_ptr<Matrix> Network::compute_batch(const vector<vector<float>>& inputs) {
+   return this->compute_batch(inputs, this->context);
+} 
+
+shared_ptr<Matrix> Network::compute(const vector<float>& input, InferenceContext& context) const {
+   unsigned int input_size = static_cast<unsigned int>(input.size());
+   // Copied into a buffer kept between calls. A fresh one is made if the
+   // caller still holds the last input, so input() never changes under them.
+   if(context.vector_input_mat == nullptr || 
+      context.vector_input_mat->get_cols() != input_size ||
+      context.vector_input_mat.use_count() > 2) {
+      context.vector_input_mat = make_shared<Matrix>(1, input_size);
+   } 
+   std::copy(input.begin(), input.end(), context.vector_input_mat->get_data());
+   return this->compute_batch(context.vector_input_mat, context);
+} 
+
+shared_ptr<Matrix> Network::compute(const shared_ptr<Matrix> input, InferenceContext& context) const {
+   return this->compute_batch(input, context);
+} 
+
+shared_ptr<Matrix> Network::compute_batch(const vector<vector<float>>& inputs,
+                                          InferenceContext& context) const {
+   unsigned int rows = static_cast<unsigned int>(inputs.size());
+   if(context.batch_input_mat == nullptr || 
+      context.batch_input_mat->get_rows() != rows ||
+      context.batch_input_mat->get_cols() != this->input_size ||
+      context.batch_input_mat.use_count() > 2) {
+      context.batch_input_mat = make_shared<Matrix>(rows, this->input_size);
+   } 
+   for(unsigned int y = 0; y < rows; y++) {
+      if(inputs[y].size() != this->input_size) {
+         printf("Every batch input must have one value per network input!\n");
+         printf("Sample %d has %d values, expected %d\n", y, (int)inputs[y].size(), this->input_size);
+         throw invalid_argument("Every batch input must have one value per network input!");
+      } 
+      std::copy(inputs[y].begin(), inputs[y].end(), context.batch_input_mat->row_data(y));
+   } 
+   return this->compute_batch(context.batch_input_mat, context);
+} 
+
+shared_ptr<Matrix> Network::compute_batch(const shared_ptr<Matrix> inputs,
+                                          InferenceContext& context) const {
+   this->prepare_context(context, inputs->get_rows());
+   context.input_mat = inputs;
+
+   const Matrix* layer_input = inputs.get();
+   for(unsigned int layer_num = 0; layer_num < this->num_layers; layer_num++) {
+      this->layers[layer_num].forward(*layer_input, *context.outputs[layer_num],
+                                      context.pre_bias_outputs[layer_num].get(),
+                                      context.pre_act_outputs[layer_num].get());
+      layer_input = context.outputs[layer_num].get();
    } 
-   this->net_output_mat = output;
-   return this->net_output_mat;
+   context.output_mat = context.outputs.back();
+   return context.output_mat;
+} 
+
+future<shared_ptr<Matrix>> Network::compute_async(const shared_ptr<Matrix> inputs,
+                                                  InferenceContext& context) const {
+   InferenceContext* target = &context;
+   return default_scheduler()->submit([this, inputs, target]() {
+      return this->compute_batch(inputs, *target);
+   });
+} 
+
+void Network::set_keep_intermediates(bool keep) {
+   // Intermediate buffers are added / dropped on the next compute
+   this->context.set_keep_intermediates(keep);
+} 
+
+shared_ptr<ExecutionPlan> Network::compile(unsigned int max_rows) const {
+   return make_shared<ExecutionPlan>(*this, max_rows);
+} 
+
+shared_ptr<QuantizedNetwork> Network::quantize(const Matrix& calibration,
+                                               unsigned int max_rows) const {
+   return make_shared<QuantizedNetwork>(*this, calibration, max_rows);
 } 
 
 // Getting Network I/O --------------------------------------------------------
 shared_ptr<Matrix> Network::input() const {
-   return this->net_input_mat; 
+   return this->context.input(); 
 } 
 
 shared_ptr<Matrix> Network::output() const {
-   return this->net_output_mat; 
+   return this->context.output(); 
 } 
 
 
@@ -183,11 +716,11 @@ shared_ptr<vector<shared_ptr<Matrix>>> Network::layer_outputs(bool include_input
    auto outputs = make_shared<vector<shared_ptr<Matrix>>>();
    
    if(include_input) {
-      outputs->push_back(this->net_input_mat);
+      outputs->push_back(this->context.input());
    } 
 
    for(int i = 0; i < this->num_layers; i++) {
-      outputs->push_back(this->layers[i].output());
+      outputs->push_back(this->context.get_layer_output(i));
    } 
    
    return outputs;
@@ -198,11 +731,11 @@ shared_ptr<vector<shared_ptr<Matrix>>> Network::layer_pre_bias_outputs(bool incl
    auto outputs = make_shared<vector<shared_ptr<Matrix>>>();
    
    if(include_input) {
-      outputs->push_back(this->net_input_mat);
+      outputs->push_back(this->context.input());
    } 
 
    for(int i = 0; i < this->num_layers; i++) {
-      outputs->push_back(this->layers[i].pre_bias_output());
+      outputs->push_back(this->context.get_layer_pre_bias_output(i));
    } 
    
    return outputs;
@@ -213,11 +746,11 @@ shared_ptr<vector<shared_ptr<Matrix>>> Network::layer_pre_act_outputs(bool inclu
    auto outputs = make_shared<vector<shared_ptr<Matrix>>>();
    
    if(include_input) {
-      outputs->push_back(this->net_input_mat);
+      outputs->push_back(this->context.input());
    } 
 
    for(int i = 0; i < this->num_layers; i++) {
-      outputs->push_back(this->layers[i].pre_act_output());
+      outputs->push_back(this->context.get_layer_pre_act_output(i));
    } 
    
    return outputs;
@@ -242,7 +775,11 @@ shared_ptr<vector<unsigned int>> Network::layer_sizes(bool include_input) const
 
 
 shared_ptr<Matrix> Network::get_layer_output(unsigned int layer_num) const {
-   return this->layers[layer_num].output();
+   return this->context.get_layer_output(layer_num);
+} 
+
+shared_ptr<Matrix> Network::get_layer_output(unsigned int layer_num, unsigned int sample) const {
+   return this->context.get_layer_output(layer_num)->row(sample);
 } 
    
 unsigned int Network::get_layer_size(unsigned int layer_num) const {
@@ -277,14 +814,38 @@ shared_ptr<Matrix> Network::get_layer_biases(unsigned int layer_num) const {
    return this->layers[layer_num].get_biases();
 } 
 
+float (*Network::get_layer_act_func(unsigned int layer_num) const)(float) {
+   return this->layers[layer_num].get_act_func();
+} 
+
+Activation Network::get_layer_activation(unsigned int layer_num) const {
+   return this->layers[layer_num].get_activation();
+} 
+
+void Network::set_layer_activation(unsigned int layer_num, Activation activation) {
+   this->layers[layer_num].set_activation(activation);
+} 
+
+Layer& Network::get_layer(unsigned int layer_num) {
+   if(layer_num >= this->num_layers) {
+      printf("Layer %d does not exist, the network has %d layers!\n", layer_num, this->num_layers);
+      throw out_of_range("Layer does not exist!");
+   } 
+   return this->layers[layer_num];
+} 
+
+const Layer& Network::get_layer(unsigned int layer_num) const {
+   return const_cast<Network*>(this)->get_layer(layer_num);
+} 
+
 
 void Network::print_network_state() const {
    printf("Current Network State\n");
-   this->net_input_mat->print("Input");
+   this->context.input()->print("Input");
    
    for(int i = 0; i < this->num_layers; i++) {
       string layer_name = "Layer " + to_string(i) + " Output";
-      this->layers[i].output()->print(layer_name.c_str());
+      this->context.get_layer_output(i)->print(layer_name.c_str());
    }
 } 
 
@@ -295,7 +856,8 @@ void Network::print_network_state() const {
 
 // Network Creation Functions -------------------------------------------------
 shared_ptr<Network> make_full_network(unsigned int input_size, unsigned int num_layers,
-                                        unsigned int layer_size) {
+                                        unsigned int layer_size, 
+                                        WeightLayout layout = INPUT_MAJOR) {
    vector<unsigned int> layer_sizes;
    vector<vector<float>> weights;
    vector<vector<float>> biases;
@@ -323,57 +885,48 @@ shared_ptr<Network> make_full_network(unsigned int input_size, unsigned int num_
       layer_sizes.push_back(layer_size);
    } 
 
-   return make_shared<Network>(input_size, sigmoid, layer_sizes, weights, biases);
-
-} 
+   return make_shared<Network>(input_size, sigmoid, layer_sizes, weights, biases, layout);
 
-float rand_between(float min, float max) {
-   return min + static_cast<float>(rand()) /(static_cast<float>(RAND_MAX/(max-min)));
 } 
 
 shared_ptr<Network> make_random_network(unsigned int input_size, unsigned int num_layers,
-                                        unsigned int layer_size, unsigned int seed, bool sparse = false) {
-
-   srand(seed);
-
-   vector<unsigned int> layer_sizes;
-   vector<vector<float>> weights;
-   vector<vector<float>> biases;
-
-   for(int i = 0; i < num_layers; i++) {
-      vector<float> layer_weights;
-      vector<float> layer_biases;
-
-      for(int j = 0; j < layer_size; j++) {
-         
-         if(i == 0) {
-            for(int k = 0; k < input_size; k++) {
-               float w = rand_between(-1,1);
-               if(sparse) w = round(w);
-               layer_weights.push_back(w);
-            } 
-         } else {
-            for(int k = 0; k < layer_size; k++) {
-               float w = rand_between(-1,1);
-               if(sparse) w = round(w);
-               layer_weights.push_back(w);
-            } 
-         }
-         float b = rand_between(-1,1);
-         if(sparse) b = round(b);
-         layer_biases.push_back(b);
-      }
-
-      weights.push_back(layer_weights);
-      biases.push_back(layer_biases);
-      layer_sizes.push_back(layer_size);
+                                        unsigned int layer_size, uint64_t seed, bool sparse,
+                                        WeightLayout layout, WeightInit init,
+                                        Activation activation) {
+   // Each layer's weights and biases have their own stream of the seed, so
+   // every layer fills independently and in parallel
+   Philox rng(seed);
+
+   vector<Layer> layers;
+   unsigned int prev_output_size = input_size;
+   for(unsigned int i = 0; i < num_layers; i++) {
+      auto weights = make_shared<Matrix>(prev_output_size, layer_size);
+      auto biases = make_shared<Matrix>(1, layer_size);
+      init_weights(*weights, init, rng.with_stream(2 * i));
+      // Biases start at zero for the scaled initializers
+      if(init == INIT_UNIFORM) {
+         random_uniform(rng.with_stream(2 * i + 1), biases->get_data(), layer_size, -1.0f, 1.0f);
+      } 
+
+      if(sparse) {
+         float* w = weights->get_data();
+         for(unsigned int j = 0; j < weights->get_size(); j++) w[j] = roundf(w[j]);
+         float* b = biases->get_data();
+         for(unsigned int j = 0; j < layer_size; j++) b[j] = roundf(b[j]);
+      } 
+
+      auto stored = (layout == INPUT_MAJOR) ? weights : layout_weights(*weights, layout);
+      Layer layer(layer_size, prev_output_size, activation, stored, biases, layout);
+      layer.select_storage();
+      layers.push_back(layer);
+      prev_output_size = layer_size;
    } 
 
-   return make_shared<Network>(input_size, sigmoid, layer_sizes, weights, biases);
-};
+   return make_shared<Network>(input_size, layers);
+} 
 
 
-shared_ptr<Network> default_network(NetworkType type) {
+shared_ptr<Network> default_network(NetworkType type, WeightLayout layout) {
    switch(type) {
       case XOR: {
          vector<float> w1_data = {1,-1,-1,1};
@@ -386,7 +939,7 @@ shared_ptr<Network> default_network(NetworkType type) {
          vector<vector<float>> weights = {w1_data, wo_data};
          vector<vector<float>> biases = {b1_data, bo_data};
 
-         return make_shared<Network>(2, relu, layer_sizes, weights, biases);
+         return make_shared<Network>(2, relu, layer_sizes, weights, biases, layout);
       break;}  
       
       case OR: {
@@ -400,7 +953,7 @@ shared_ptr<Network> default_network(NetworkType type) {
          vector<vector<float>> weights = {w1_data, wo_data};
          vector<vector<float>> biases = {b1_data, bo_data};
 
-         return make_shared<Network>(2, relu, layer_sizes, weights, biases);
+         return make_shared<Network>(2, relu, layer_sizes, weights, biases, layout);
       break;}  
       
       case AND: {
@@ -411,7 +964,7 @@ shared_ptr<Network> default_network(NetworkType type) {
          vector<vector<float>> weights = {wo_data};
          vector<vector<float>> biases = {bo_data};
 
-         return make_shared<Network>(2, relu, layer_sizes, weights, biases);
+         return make_shared<Network>(2, relu, layer_sizes, weights, biases, layout);
       break;}  
       
       case NOT: {
@@ -422,18 +975,18 @@ shared_ptr<Network> default_network(NetworkType type) {
          vector<vector<float>> weights = {wo_data};
          vector<vector<float>> biases = {bo_data};
 
-         return make_shared<Network>(1, relu, layer_sizes, weights, biases);
+         return make_shared<Network>(1, relu, layer_sizes, weights, biases, layout);
       break;}  
 
-      case RAND_4X4: return  make_random_network(2, 4, 4, time(NULL));
-      case SPARSE_RAND_4X4: return  make_random_network(2, 4, 4, time(NULL), true);
+      case RAND_4X4: return  make_random_network(2, 4, 4, time(NULL), false, layout);
+      case SPARSE_RAND_4X4: return  make_random_network(2, 4, 4, time(NULL), true, layout);
 
-      case SEEDED_4X4: return  make_random_network(2, 4, 4, 5);
-      case SEEDED_8X8: return  make_random_network(2, 8, 8, 5);
-      case SEEDED_LARGE: return  make_random_network(2, 6, 50, 5);
-      case SEEDED_HUGE: return  make_random_network(2, 8, 500, 5);
+      case SEEDED_4X4: return  make_random_network(2, 4, 4, 5, false, layout);
+      case SEEDED_8X8: return  make_random_network(2, 8, 8, 5, false, layout);
+      case SEEDED_LARGE: return  make_random_network(2, 6, 50, 5, false, layout);
+      case SEEDED_HUGE: return  make_random_network(2, 8, 500, 5, false, layout);
       
-      case FULL_4X4: return make_full_network(2, 4, 4);
+      case FULL_4X4: return make_full_network(2, 4, 4, layout);
    } 
 } 
 
@@ -6,11 +6,20 @@
 #include <cmath>
 #include <vector>
 #include <memory>
+#include <future>
 #include "Matrix.hpp"
+#include "Dense.hpp"
+#include "Activation.hpp"
+#include "MatrixAllocator.hpp"
+#include "Random.hpp"
 
-// Activation Functions -------------------------------------------------------
-float relu(float x); 
-float sigmoid(float x); 
+// Define to keep pre-bias and pre-activation layer outputs by default
+//#define NETWORK_KEEP_INTERMEDIATES
+
+class ExecutionPlan;
+class QuantizedNetwork;
+class SparseMatrix;
+class TernaryMatrix;
 
 typedef enum NetworkType {
    XOR, OR, AND, NOT,
@@ -25,33 +34,186 @@ typedef enum NetworkType {
 class Layer {
 public: 
    Layer(unsigned int layer_size, unsigned int input_size, float (*act_func)(float), 
-         const float* weights, const float* biases);
+         const float* weights, const float* biases,
+         WeightLayout layout = INPUT_MAJOR);
    Layer(unsigned int layer_size, unsigned int input_size, float (*act_func)(float), 
-         const std::vector<float> weights, const std::vector<float> biases);
+         const std::vector<float> weights, const std::vector<float> biases,
+         WeightLayout layout = INPUT_MAJOR);
+   // Adopts the matrices as they are, without copying or reading them.
+   // stored_weights must already be in the given layout (see
+   // stored_weights_shape).
+   //
+   // The copying constructors run select_storage on their weights, the
+   // adopting one leaves that to the caller.
+   Layer(unsigned int layer_size, unsigned int input_size, Activation activation,
+         std::shared_ptr<Matrix> stored_weights, std::shared_ptr<Matrix> biases,
+         WeightLayout layout = INPUT_MAJOR);
 
 	virtual ~Layer();
    
+   // Results are written into buffers owned by the layer and reused between
+   // calls, so the returned matrix is overwritten by the next compute
    std::shared_ptr<Matrix> compute(const std::shared_ptr<Matrix> input);
+
+   // One sample per row of inputs (B x input_size), all of them pushed
+   // through a single GEMM with the biases broadcast to every row.
+   // Returns B x layer_size.
+   std::shared_ptr<Matrix> compute_batch(const std::shared_ptr<Matrix> inputs);
    std::shared_ptr<Matrix> output() const;
    std::shared_ptr<Matrix> pre_bias_output() const;
    std::shared_ptr<Matrix> pre_act_output() const;
 
+   // Reentrant form of compute_batch, the results go to caller owned
+   // buffers and the layer itself is only read
+   void forward(const Matrix& inputs, Matrix& output,
+                Matrix* pre_bias = nullptr, Matrix* pre_act = nullptr) const;
+
+   // Pre-bias and pre-activation outputs are only stored when asked for
+   void set_keep_intermediates(bool keep);
+   bool get_keep_intermediates() const;
+
+   // Always the logical (input_size x layer_size) weights, whatever the layout
    std::shared_ptr<Matrix> get_weights() const;
    std::shared_ptr<Matrix> get_biases() const;
+   // The weights as the kernels see them, in get_weight_layout() order.
+   // 16 bit, sparse and ternary layers give an fp32 copy.
+   std::shared_ptr<Matrix> get_stored_weights() const;
+   WeightLayout get_weight_layout() const;
+
+   // Stores the weights in 16 bits (FP16 or BF16) or back in fp32. A 16 bit
+   // layer drops its fp32 weights and runs packed kernels that widen the
+   // weights as they are read, its layout applies again once it's back in
+   // fp32. Going to 16 bits and back rounds the weights.
+   void set_precision(WeightPrecision precision);
+   WeightPrecision get_precision() const;
+   // Packed as for PACKED_OUTPUT_MAJOR, null for fp32 layers
+   std::shared_ptr<uint16_t> get_half_weights() const;
+
+   // Stores weights with at most SPARSE_DENSITY_THRESHOLD non-zeros sparse
+   // (see set_sparse), and denser ones that are all -1, 0 or +1 as ternary
+   // bitplanes (see set_ternary), dropping the dense matrix. Anything else,
+   // and layers that aren't dense fp32, are left as they are.
+   void select_storage();
+   // Whether the sparse or ternary storage was picked by select_storage
+   // rather than asked for with set_sparse / set_ternary. Trainer keeps the
+   // zeros of sparse layers only when they were asked for.
+   bool has_auto_storage() const;
+
+   // Stores the weights as a SparseMatrix, only the non-zeros kept and
+   // multiplied, or back as a dense matrix in the layer's layout. Sparse
+   // weights are always fp32, a 16 bit layer is widened first and going to
+   // 16 bits makes the layer dense again.
+   void set_sparse(bool sparse);
+   bool is_sparse() const;
+   // CSR of the transposed (layer_size x input_size) weights, null for
+   // dense layers
+   std::shared_ptr<SparseMatrix> get_sparse_weights() const;
+
+   // Stores weights that are all -1, 0 or +1 as two bitplanes per output,
+   // 2 bits a weight, or back as a dense fp32 matrix in the layer's layout.
+   // Throws if any weight isn't ternary.
+   void set_ternary(bool ternary);
+   bool is_ternary() const;
+   // Bitplanes of the transposed (layer_size x input_size) weights, null
+   // for other layers
+   std::shared_ptr<TernaryMatrix> get_ternary_weights() const;
+   float (*get_act_func() const)(float);
+
+   // Overwrite the parameters in place, weights are given in the logical
+   // (input_size x layer_size) form and laid out as the layer stores them.
+   // Sparse layers only update in place while the non-zeros stay where they
+   // are, any other weights get a new SparseMatrix and plans compiled from
+   // the layer have to be compiled again. Ternary layers given weights that
+   // aren't all -1, 0 or +1 go back to dense fp32, which plans need to be
+   // compiled again for as well.
+   void set_weights(const Matrix& weights);
+   void set_biases(const Matrix& biases);
+
+   // Activation applied to this layer's output
+   void set_activation(Activation activation);
+   Activation get_activation() const;
    
    unsigned int get_layer_size() const;
+   unsigned int get_input_size() const;
 
 private:
    unsigned int layer_size;
    unsigned int input_size;
-   float (*act_func)(float);
+   Activation activation;
 
-   std::shared_ptr<Matrix> weights;
+   WeightLayout weight_layout;
+   WeightPrecision precision;
+   std::shared_ptr<Matrix> weights;         // fp32 layers
+   std::shared_ptr<uint16_t> half_weights;  // 16 bit layers
+   std::shared_ptr<SparseMatrix> sparse_weights; // sparse layers
+   std::shared_ptr<TernaryMatrix> ternary_weights; // ternary layers
    std::shared_ptr<Matrix> biases;
+   mutable std::shared_ptr<Matrix> logical_weights_mat;
+   bool auto_storage;
    
+   bool keep_intermediates;
    std::shared_ptr<Matrix> output_mat;
    std::shared_ptr<Matrix> pre_bias_output_mat;
    std::shared_ptr<Matrix> pre_act_output_mat;
+
+   void reserve_outputs(unsigned int rows);
+};
+
+
+// Inference Context ----------------------------------------------------------
+class Network;
+
+/* Everything one inference writes: the input, every layer's outputs and the
+ * arena they live in. The const Network::compute overloads only touch the
+ * context they are given, so any number of threads can run one Network at
+ * once, each with its own context.
+ *
+ * The buffers are laid out for the layer sizes and batch size of the last
+ * network the context was used with, and reused by any network with those
+ * same shapes. Copying a context gives a fresh one with the same settings.
+ */
+class InferenceContext {
+public:
+   InferenceContext();
+   InferenceContext(bool keep_intermediates);
+   InferenceContext(const InferenceContext& other);
+   InferenceContext& operator=(const InferenceContext& other);
+	virtual ~InferenceContext();
+
+   // Pre-bias and pre-activation outputs are only stored when asked for
+   void set_keep_intermediates(bool keep);
+   bool get_keep_intermediates() const;
+
+   // Results of the last compute, overwritten by the next one
+   std::shared_ptr<Matrix> input() const;
+   std::shared_ptr<Matrix> output() const;
+   std::shared_ptr<Matrix> get_layer_output(unsigned int layer_num) const;
+   std::shared_ptr<Matrix> get_layer_pre_bias_output(unsigned int layer_num) const;
+   std::shared_ptr<Matrix> get_layer_pre_act_output(unsigned int layer_num) const;
+
+   // Arena holding the layer output buffers
+   std::shared_ptr<ArenaAllocator> get_workspace() const;
+
+private:
+   friend class Network;
+
+   bool keep_intermediates;
+   std::shared_ptr<ArenaAllocator> workspace;
+
+   // What the buffers are currently laid out for. Shapes rather than the
+   // network's address, which a later network can be allocated at.
+   std::vector<unsigned int> prepared_sizes;
+   unsigned int prepared_rows;
+   bool prepared_keep;
+
+   std::vector<std::shared_ptr<Matrix>> outputs;
+   std::vector<std::shared_ptr<Matrix>> pre_bias_outputs;
+   std::vector<std::shared_ptr<Matrix>> pre_act_outputs;
+
+   std::shared_ptr<Matrix> input_mat;
+   std::shared_ptr<Matrix> output_mat;
+   std::shared_ptr<Matrix> vector_input_mat;
+   std::shared_ptr<Matrix> batch_input_mat;
 };
 
 
@@ -61,19 +223,69 @@ public:
    Network(unsigned int input_size, float (*act_func)(float), 
            const std::vector<unsigned int> layer_sizes,
            const std::vector<float*> layer_weights, 
-           const std::vector<float*> layer_biases);
+           const std::vector<float*> layer_biases,
+           WeightLayout layout = INPUT_MAJOR);
    
    Network(unsigned int input_size, float (*act_func)(float), 
            const std::vector<unsigned int> layer_sizes,
            const std::vector<std::vector<float>> layer_weights, 
-           const std::vector<std::vector<float>> layer_biases);
+           const std::vector<std::vector<float>> layer_biases,
+           WeightLayout layout = INPUT_MAJOR);
+
+   // From ready made layers, each taking the previous one's outputs
+   Network(unsigned int input_size, const std::vector<Layer>& layers);
 
 	virtual ~Network();
    
    // Computing the Network
-   std::shared_ptr<Matrix> compute(const std::vector<float> input);
+   std::shared_ptr<Matrix> compute(const std::vector<float>& input);
    std::shared_ptr<Matrix> compute(const std::shared_ptr<Matrix> input);
+
+   // Batched inference, one sample per row of inputs (B x input_size). Each
+   // layer runs as one GEMM over the whole batch, the result is
+   // B x output size with row i belonging to sample i.
+   std::shared_ptr<Matrix> compute_batch(const std::shared_ptr<Matrix> inputs);
+   std::shared_ptr<Matrix> compute_batch(const std::vector<std::vector<float>>& inputs);
+
+   // Reentrant versions, everything is written to the caller's context and
+   // the network is only read. The overloads above use the network's own
+   // context, which is what input(), output() and the layer outputs report.
+   std::shared_ptr<Matrix> compute(const std::vector<float>& input,
+                                   InferenceContext& context) const;
+   std::shared_ptr<Matrix> compute(const std::shared_ptr<Matrix> input,
+                                   InferenceContext& context) const;
+   std::shared_ptr<Matrix> compute_batch(const std::shared_ptr<Matrix> inputs,
+                                         InferenceContext& context) const;
+   std::shared_ptr<Matrix> compute_batch(const std::vector<std::vector<float>>& inputs,
+                                         InferenceContext& context) const;
+
+   // Runs compute_batch on the default scheduler. The network and context
+   // must outlive the future, and the context can't be used until it's ready.
+   std::future<std::shared_ptr<Matrix>> compute_async(const std::shared_ptr<Matrix> inputs,
+                                                      InferenceContext& context) const;
    
+   // Keep every layer's pre-bias and pre-activation outputs (for debugging)
+   void set_keep_intermediates(bool keep);
+
+   // Weight storage of every layer, see Layer::set_precision
+   void set_precision(WeightPrecision precision);
+   WeightPrecision get_precision() const;
+
+   // Flattens the network into a plan of kernel calls for up to max_rows
+   // samples at a time, see ExecutionPlan
+   std::shared_ptr<ExecutionPlan> compile(unsigned int max_rows = 1) const;
+
+   // Converts the network to int8 weights with the layer input ranges taken
+   // from the calibration samples (one per row), see QuantizedNetwork
+   std::shared_ptr<QuantizedNetwork> quantize(const Matrix& calibration,
+                                              unsigned int max_rows = 1) const;
+
+   // Arena holding every layer's output buffers. It is reset and carved up
+   // again only when the batch size changes, so repeated computes with the
+   // same shape don't allocate.
+   std::shared_ptr<ArenaAllocator> get_workspace() const;
+   InferenceContext& get_context();
+
    // Getting Network I/O
    std::shared_ptr<Matrix> input() const;
    std::shared_ptr<Matrix> output() const;
@@ -85,6 +297,8 @@ public:
    std::shared_ptr<std::vector<unsigned int>> layer_sizes(bool include_input = false) const;
 
    std::shared_ptr<Matrix> get_layer_output(unsigned int layer_num) const;
+   // One sample's row of a layer's output after compute_batch (a view)
+   std::shared_ptr<Matrix> get_layer_output(unsigned int layer_num, unsigned int sample) const;
    unsigned int get_layer_size(unsigned int layer_num) const;
 
    // Getting Layer Parameters
@@ -93,10 +307,17 @@ public:
 
    std::shared_ptr<Matrix> get_layer_weights(unsigned int layer_num) const;
    std::shared_ptr<Matrix> get_layer_biases(unsigned int layer_num) const;
+   float (*get_layer_act_func(unsigned int layer_num) const)(float);
+   Activation get_layer_activation(unsigned int layer_num) const;
+   void set_layer_activation(unsigned int layer_num, Activation activation);
+
+   Layer& get_layer(unsigned int layer_num);
+   const Layer& get_layer(unsigned int layer_num) const;
 
    // Get Network Information
    unsigned int get_num_layers() const;
    unsigned int get_input_size() const;
+   WeightLayout get_weight_layout() const;
 
    // Printing Info
    void print_network_state() const;
@@ -104,14 +325,29 @@ public:
 private:
    unsigned int num_layers;
    unsigned int input_size;
+   WeightLayout weight_layout;
+   WeightPrecision precision;
    
    std::vector<Layer> layers;
 
-   std::shared_ptr<Matrix> net_input_mat;
-   std::shared_ptr<Matrix> net_output_mat;
+   // Used by the stateful compute overloads
+   InferenceContext context;
+
+   void prepare_context(InferenceContext& context, unsigned int rows) const;
 };
 
 
-std::shared_ptr<Network> default_network(NetworkType type);
+std::shared_ptr<Network> default_network(NetworkType type, WeightLayout layout = INPUT_MAJOR);
+
+// num_layers layers of layer_size neurons with weights drawn by init. The
+// same seed always gives the same network, whatever the number of threads.
+// Sparse networks have every parameter rounded to the nearest integer,
+// which is -1, 0 or 1 for INIT_UNIFORM.
+std::shared_ptr<Network> make_random_network(unsigned int input_size, unsigned int num_layers,
+                                             unsigned int layer_size, uint64_t seed,
+                                             bool sparse = false,
+                                             WeightLayout layout = INPUT_MAJOR,
+                                             WeightInit init = INIT_UNIFORM,
+                                             Activation activation = ACT_SIGMOID);
 
 #endif
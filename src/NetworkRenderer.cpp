@@ -18,6 +18,7 @@
 
 #include "Network.hpp"
 #include "NetworkRenderer.hpp"
+#include "Scheduler.hpp"
 
 using namespace std;
 
@@ -303,21 +304,26 @@ void NetworkRenderer::compute_neuron_positions() {
 } 
 
 void NetworkRenderer::compute_neuron_connections() {
-   for(int i = 0; i < this->network->get_num_layers() + 1; i++) {
-      this->compute_neuron_connection(i);
-   } 
+   // Layers only read the network, so they are all worked out in parallel.
+   // connections[i] holds the connections into layer i+1.
+   unsigned int num_layers = this->network->get_num_layers();
+   this->connections.assign(num_layers, vector<ConnectionInfo>());
+   default_scheduler()->parallel_for(1, num_layers + 1, 1, [this](size_t begin, size_t end) {
+      for(size_t i = begin; i < end; i++) {
+         this->connections[i-1] = this->compute_neuron_connection(i);
+      } 
+   });
 } 
 
-void NetworkRenderer::compute_neuron_connection(unsigned int layer_num) {
+vector<ConnectionInfo> NetworkRenderer::compute_neuron_connection(unsigned int layer_num) const {
    
-   if(layer_num <= 0) return;
+   vector<ConnectionInfo> layer_connections;
+   if(layer_num <= 0) return layer_connections;
 
    LayerRenderInfo layer_info = this->get_layer_render_info(layer_num);
    LayerRenderInfo prev_layer_info = this->get_layer_render_info(layer_num-1);
    float neuron_size = layer_info.neuron_props.base_size;
 
-   vector<ConnectionInfo> layer_connections;
-
    for(int prev_i = 0; prev_i < prev_layer_info.size; prev_i++) {
       vec3 prev_pos = prev_layer_info.positions[prev_i];
 
@@ -359,7 +365,7 @@ void NetworkRenderer::compute_neuron_connection(unsigned int layer_num) {
          layer_connections.push_back(conn_info);
       }
    }   
-   this->connections.push_back(layer_connections);
+   return layer_connections;
 } 
 
 // Private - Computing Lighting -----------------------------------------------
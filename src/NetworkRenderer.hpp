@@ -114,7 +114,7 @@ private:
    // Precomputations ---------------------------------------------------------
    void compute_neuron_positions();
    void compute_neuron_connections();
-   void compute_neuron_connection(unsigned int layer_num);
+   std::vector<ConnectionInfo> compute_neuron_connection(unsigned int layer_num) const;
    
    // Lighting ----------------------------------------------------------------
    void compute_propagation_lighting(std::shared_ptr<MatrixStack> M);
@@ -0,0 +1,160 @@
+
+#include "Optimizer.hpp"
+#include "CpuFeatures.hpp"
+#include <cmath>
+#include <cstdio>
+#include <stdexcept>
+
+#if HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+// Settings -------------------------------------------------------------------
+OptimizerSettings sgd_optimizer(float learning_rate) {
+   return {OPT_SGD, learning_rate, 0.0f, 0.0f, 0.0f, 0.0f};
+}
+
+OptimizerSettings momentum_optimizer(float learning_rate, float momentum) {
+   return {OPT_MOMENTUM, learning_rate, momentum, 0.0f, 0.0f, 0.0f};
+}
+
+OptimizerSettings adam_optimizer(float learning_rate, float beta1, float beta2, float epsilon) {
+   return {OPT_ADAM, learning_rate, 0.0f, beta1, beta2, epsilon};
+}
+
+const char* optimizer_str(OptimizerType type) {
+   switch(type) {
+      case OPT_SGD: return "SGD";
+      case OPT_MOMENTUM: return "MOMENTUM";
+      case OPT_ADAM: return "ADAM";
+      default: return "UNKNOWN";
+   }
+}
+
+unsigned int optimizer_state_count(OptimizerType type) {
+   switch(type) {
+      case OPT_MOMENTUM: return 1;
+      case OPT_ADAM: return 2;
+      case OPT_SGD:
+      default: return 0;
+   }
+}
+
+// Scalar Kernels -------------------------------------------------------------
+static void sgd_scalar(float lr, float* w, const float* g, size_t n) {
+   for(size_t i = 0; i < n; i++) w[i] -= lr * g[i];
+}
+
+static void momentum_scalar(float lr, float mu, float* w, const float* g, float* v, size_t n) {
+   for(size_t i = 0; i < n; i++) {
+      v[i] = mu * v[i] + g[i];
+      w[i] -= lr * v[i];
+   }
+}
+
+static void adam_scalar(float lr_t, float b1, float b2, float eps,
+                        float* w, const float* g, float* m, float* v, size_t n) {
+   for(size_t i = 0; i < n; i++) {
+      m[i] = b1 * m[i] + (1.0f - b1) * g[i];
+      v[i] = b2 * v[i] + (1.0f - b2) * g[i] * g[i];
+      w[i] -= lr_t * m[i] / (sqrtf(v[i]) + eps);
+   }
+}
+
+#if HAVE_X86_SIMD
+// AVX2 -----------------------------------------------------------------------
+__attribute__((target("avx2,fma")))
+static void sgd_avx2(float lr, float* w, const float* g, size_t n) {
+   const __m256 neg_lr = _mm256_set1_ps(-lr);
+   size_t i = 0;
+   for(; i + 8 <= n; i += 8) {
+      __m256 wi = _mm256_fmadd_ps(neg_lr, _mm256_loadu_ps(g + i), _mm256_loadu_ps(w + i));
+      _mm256_storeu_ps(w + i, wi);
+   }
+   sgd_scalar(lr, w + i, g + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+static void momentum_avx2(float lr, float mu, float* w, const float* g, float* v, size_t n) {
+   const __m256 neg_lr = _mm256_set1_ps(-lr);
+   const __m256 mu_v = _mm256_set1_ps(mu);
+   size_t i = 0;
+   for(; i + 8 <= n; i += 8) {
+      __m256 vi = _mm256_fmadd_ps(mu_v, _mm256_loadu_ps(v + i), _mm256_loadu_ps(g + i));
+      _mm256_storeu_ps(v + i, vi);
+      _mm256_storeu_ps(w + i, _mm256_fmadd_ps(neg_lr, vi, _mm256_loadu_ps(w + i)));
+   }
+   momentum_scalar(lr, mu, w + i, g + i, v + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+static void adam_avx2(float lr_t, float b1, float b2, float eps,
+                      float* w, const float* g, float* m, float* v, size_t n) {
+   const __m256 b1_v = _mm256_set1_ps(b1);
+   const __m256 b2_v = _mm256_set1_ps(b2);
+   const __m256 c1 = _mm256_set1_ps(1.0f - b1);
+   const __m256 c2 = _mm256_set1_ps(1.0f - b2);
+   const __m256 eps_v = _mm256_set1_ps(eps);
+   const __m256 neg_lr = _mm256_set1_ps(-lr_t);
+   size_t i = 0;
+   for(; i + 8 <= n; i += 8) {
+      __m256 gi = _mm256_loadu_ps(g + i);
+      __m256 mi = _mm256_fmadd_ps(b1_v, _mm256_loadu_ps(m + i), _mm256_mul_ps(c1, gi));
+      __m256 vi = _mm256_fmadd_ps(b2_v, _mm256_loadu_ps(v + i),
+                                  _mm256_mul_ps(c2, _mm256_mul_ps(gi, gi)));
+      _mm256_storeu_ps(m + i, mi);
+      _mm256_storeu_ps(v + i, vi);
+      __m256 step = _mm256_div_ps(mi, _mm256_add_ps(_mm256_sqrt_ps(vi), eps_v));
+      _mm256_storeu_ps(w + i, _mm256_fmadd_ps(neg_lr, step, _mm256_loadu_ps(w + i)));
+   }
+   adam_scalar(lr_t, b1, b2, eps, w + i, g + i, m + i, v + i, n - i);
+}
+#endif
+
+// Update ---------------------------------------------------------------------
+void optimizer_step(const OptimizerSettings& settings, unsigned long step,
+                    float* params, const float* grads,
+                    float* state1, float* state2, size_t n) {
+#if HAVE_X86_SIMD
+   static const bool use_avx2 = cpu_simd_level() >= SIMD_AVX2;
+#endif
+   float lr = settings.learning_rate;
+
+   switch(settings.type) {
+      case OPT_SGD:
+#if HAVE_X86_SIMD
+         if(use_avx2) { sgd_avx2(lr, params, grads, n); return; }
+#endif
+         sgd_scalar(lr, params, grads, n);
+         return;
+
+      case OPT_MOMENTUM:
+#if HAVE_X86_SIMD
+         if(use_avx2) { momentum_avx2(lr, settings.momentum, params, grads, state1, n); return; }
+#endif
+         momentum_scalar(lr, settings.momentum, params, grads, state1, n);
+         return;
+
+      case OPT_ADAM: {
+         // Bias correction folded into the step size
+         double t = (double)step;
+         float lr_t = (float)(lr * sqrt(1.0 - pow(settings.beta2, t)) / (1.0 - pow(settings.beta1, t)));
+#if HAVE_X86_SIMD
+         if(use_avx2) {
+            adam_avx2(lr_t, settings.beta1, settings.beta2, settings.epsilon,
+                      params, grads, state1, state2, n);
+            return;
+         }
+#endif
+         adam_scalar(lr_t, settings.beta1, settings.beta2, settings.epsilon,
+                     params, grads, state1, state2, n);
+         return;
+      }
+
+      default:
+         printf("Optimizer %d is not supported!\n", settings.type);
+         throw invalid_argument("Optimizer is not supported!");
+   }
+}
@@ -0,0 +1,52 @@
+
+#ifndef OPTIMIZER_HPP
+#define OPTIMIZER_HPP
+
+#include <cstddef>
+
+/* Gradient descent update rules
+ *
+ *    OPT_SGD       w -= lr * g
+ *    OPT_MOMENTUM  v = momentum * v + g,  w -= lr * v
+ *    OPT_ADAM      m = b1 * m + (1 - b1) * g,  v = b2 * v + (1 - b2) * g^2,
+ *                  w -= lr * sqrt(1 - b2^t) / (1 - b1^t) * m / (sqrt(v) + eps)
+ *
+ * Each update is a single fused pass over the parameters, their gradients
+ * and the optimizer state.
+ */
+enum OptimizerType {
+   OPT_SGD,
+   OPT_MOMENTUM,
+   OPT_ADAM
+};
+
+struct OptimizerSettings {
+   OptimizerType type;
+   float learning_rate;
+   float momentum;   // OPT_MOMENTUM
+   float beta1;      // OPT_ADAM
+   float beta2;
+   float epsilon;
+};
+
+OptimizerSettings sgd_optimizer(float learning_rate = 0.1f);
+OptimizerSettings momentum_optimizer(float learning_rate = 0.05f, float momentum = 0.9f);
+OptimizerSettings adam_optimizer(float learning_rate = 0.001f, float beta1 = 0.9f,
+                                 float beta2 = 0.999f, float epsilon = 1e-8f);
+
+const char* optimizer_str(OptimizerType type);
+
+// How many state arrays, each as large as the parameters, the optimizer uses
+unsigned int optimizer_state_count(OptimizerType type);
+
+/* Updates n params from their gradients. state1 and state2 are the
+ * optimizer's state arrays (unused ones may be null), zeroed before the
+ * first step. step counts the updates made so far including this one,
+ * starting at 1.
+ */
+void optimizer_step(const OptimizerSettings& settings, unsigned long step,
+                    float* params, const float* grads,
+                    float* state1, float* state2, size_t n);
+
+#endif
+
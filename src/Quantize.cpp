@@ -0,0 +1,707 @@
+
+#include "Quantize.hpp"
+#include "Network.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#if HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+static const char* QuantKernelStrings[] = { "SCALAR", "AVX2", "AVX512_VNNI" };
+
+const char* quant_kernel_str(QuantKernelType type) {
+   return QuantKernelStrings[type];
+}
+
+static unsigned int padded_row(unsigned int k) {
+   return (k + QUANT_ROW_ALIGNMENT - 1) / QUANT_ROW_ALIGNMENT * QUANT_ROW_ALIGNMENT;
+}
+
+// Scalar ---------------------------------------------------------------------
+static void quant_dot_scalar(unsigned int n, const int8_t* x,
+                             const int8_t* w, unsigned int ldw,
+                             const int32_t* w_sums, int32_t* y) {
+   for(unsigned int j = 0; j < n; j++) {
+      const int8_t* w_row = w + (size_t)j * ldw;
+      int32_t acc = 0;
+      for(unsigned int p = 0; p < ldw; p++) {
+         acc += (int32_t)x[p] * (int32_t)w_row[p];
+      }
+      y[j] = acc;
+   }
+}
+
+// QUANT_GEMM_MR samples at a time, each weight row used for all of them
+// while it's in cache. One dot product per sample keeps the inner loop
+// simple enough for the compiler to vectorize.
+static void quant_gemm_scalar(unsigned int m, unsigned int n,
+                              const int8_t* x, unsigned int ldx,
+                              const int8_t* w, unsigned int ldw,
+                              const int32_t* w_sums, int32_t* y, unsigned int ldy) {
+   const unsigned int mr = QUANT_GEMM_MR;
+   unsigned int i = 0;
+   for(; i + mr <= m; i += mr) {
+      for(unsigned int j = 0; j < n; j++) {
+         const int8_t* w_row = w + (size_t)j * ldw;
+         for(unsigned int r = 0; r < mr; r++) {
+            const int8_t* x_row = x + (size_t)(i + r) * ldx;
+            int32_t acc = 0;
+            for(unsigned int p = 0; p < ldw; p++) {
+               acc += (int32_t)x_row[p] * (int32_t)w_row[p];
+            }
+            y[(size_t)(i + r) * ldy + j] = acc;
+         }
+      }
+   }
+   for(; i < m; i++) {
+      quant_dot_scalar(n, x + (size_t)i * ldx, w, ldw, w_sums, y + (size_t)i * ldy);
+   }
+}
+
+static void quantize_row_scalar(const float* x, unsigned int k, float inv_scale,
+                                int8_t* xq) {
+   for(unsigned int p = 0; p < k; p++) {
+      float q = nearbyintf(x[p] * inv_scale);
+      q = min(max(q, (float)-QUANT_INT8_MAX), (float)QUANT_INT8_MAX);
+      xq[p] = (int8_t)q;
+   }
+}
+
+#if HAVE_X86_SIMD
+// AVX2 -----------------------------------------------------------------------
+__attribute__((target("avx2")))
+static int32_t hsum_epi32_avx2(__m256i v) {
+   __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+   sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+   sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+   return _mm_cvtsi128_si32(sum);
+}
+
+// Both operands are widened to int16 and multiplied in pairs with madd,
+// which can't saturate for values within +-127. Four rows share each load
+// of x.
+__attribute__((target("avx2")))
+static void quant_dot_avx2(unsigned int n, const int8_t* x,
+                           const int8_t* w, unsigned int ldw,
+                           const int32_t* w_sums, int32_t* y) {
+   unsigned int j = 0;
+   for(; j + 4 <= n; j += 4) {
+      const int8_t* w0 = w + (size_t)(j + 0) * ldw;
+      const int8_t* w1 = w + (size_t)(j + 1) * ldw;
+      const int8_t* w2 = w + (size_t)(j + 2) * ldw;
+      const int8_t* w3 = w + (size_t)(j + 3) * ldw;
+      __m256i acc0 = _mm256_setzero_si256();
+      __m256i acc1 = _mm256_setzero_si256();
+      __m256i acc2 = _mm256_setzero_si256();
+      __m256i acc3 = _mm256_setzero_si256();
+      for(unsigned int p = 0; p < ldw; p += 16) {
+         const __m256i xv = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(x + p)));
+         acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(xv,
+                   _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(w0 + p)))));
+         acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(xv,
+                   _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(w1 + p)))));
+         acc2 = _mm256_add_epi32(acc2, _mm256_madd_epi16(xv,
+                   _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(w2 + p)))));
+         acc3 = _mm256_add_epi32(acc3, _mm256_madd_epi16(xv,
+                   _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(w3 + p)))));
+      }
+      y[j + 0] = hsum_epi32_avx2(acc0);
+      y[j + 1] = hsum_epi32_avx2(acc1);
+      y[j + 2] = hsum_epi32_avx2(acc2);
+      y[j + 3] = hsum_epi32_avx2(acc3);
+   }
+   for(; j < n; j++) {
+      const int8_t* w_row = w + (size_t)j * ldw;
+      __m256i acc = _mm256_setzero_si256();
+      for(unsigned int p = 0; p < ldw; p += 16) {
+         acc = _mm256_add_epi32(acc, _mm256_madd_epi16(
+                  _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(x + p))),
+                  _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(w_row + p)))));
+      }
+      y[j] = hsum_epi32_avx2(acc);
+   }
+}
+
+// Four samples by two weight rows, so every widened load of x or w feeds
+// two or four madds. 8 accumulators, 4 x and 2 w registers.
+__attribute__((target("avx2")))
+static void quant_gemm_avx2(unsigned int m, unsigned int n,
+                            const int8_t* x, unsigned int ldx,
+                            const int8_t* w, unsigned int ldw,
+                            const int32_t* w_sums, int32_t* y, unsigned int ldy) {
+   static_assert(QUANT_GEMM_MR == 4, "AVX2 int8 GEMM assumes 4 sample rows");
+   unsigned int i = 0;
+   for(; i + 4 <= m; i += 4) {
+      const int8_t* x0 = x + (size_t)(i + 0) * ldx;
+      const int8_t* x1 = x + (size_t)(i + 1) * ldx;
+      const int8_t* x2 = x + (size_t)(i + 2) * ldx;
+      const int8_t* x3 = x + (size_t)(i + 3) * ldx;
+      int32_t* y0 = y + (size_t)(i + 0) * ldy;
+      int32_t* y1 = y + (size_t)(i + 1) * ldy;
+      int32_t* y2 = y + (size_t)(i + 2) * ldy;
+      int32_t* y3 = y + (size_t)(i + 3) * ldy;
+      unsigned int j = 0;
+      for(; j + 2 <= n; j += 2) {
+         const int8_t* w0 = w + (size_t)(j + 0) * ldw;
+         const int8_t* w1 = w + (size_t)(j + 1) * ldw;
+         __m256i acc00 = _mm256_setzero_si256(), acc01 = _mm256_setzero_si256();
+         __m256i acc10 = _mm256_setzero_si256(), acc11 = _mm256_setzero_si256();
+         __m256i acc20 = _mm256_setzero_si256(), acc21 = _mm256_setzero_si256();
+         __m256i acc30 = _mm256_setzero_si256(), acc31 = _mm256_setzero_si256();
+         for(unsigned int p = 0; p < ldw; p += 16) {
+            const __m256i xv0 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(x0 + p)));
+            const __m256i xv1 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(x1 + p)));
+            const __m256i xv2 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(x2 + p)));
+            const __m256i xv3 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(x3 + p)));
+            const __m256i wv0 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(w0 + p)));
+            const __m256i wv1 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(w1 + p)));
+            acc00 = _mm256_add_epi32(acc00, _mm256_madd_epi16(xv0, wv0));
+            acc10 = _mm256_add_epi32(acc10, _mm256_madd_epi16(xv1, wv0));
+            acc20 = _mm256_add_epi32(acc20, _mm256_madd_epi16(xv2, wv0));
+            acc30 = _mm256_add_epi32(acc30, _mm256_madd_epi16(xv3, wv0));
+            acc01 = _mm256_add_epi32(acc01, _mm256_madd_epi16(xv0, wv1));
+            acc11 = _mm256_add_epi32(acc11, _mm256_madd_epi16(xv1, wv1));
+            acc21 = _mm256_add_epi32(acc21, _mm256_madd_epi16(xv2, wv1));
+            acc31 = _mm256_add_epi32(acc31, _mm256_madd_epi16(xv3, wv1));
+         }
+         y0[j] = hsum_epi32_avx2(acc00);  y0[j + 1] = hsum_epi32_avx2(acc01);
+         y1[j] = hsum_epi32_avx2(acc10);  y1[j + 1] = hsum_epi32_avx2(acc11);
+         y2[j] = hsum_epi32_avx2(acc20);  y2[j + 1] = hsum_epi32_avx2(acc21);
+         y3[j] = hsum_epi32_avx2(acc30);  y3[j + 1] = hsum_epi32_avx2(acc31);
+      }
+      for(; j < n; j++) {
+         const int8_t* w_row = w + (size_t)j * ldw;
+         __m256i acc0 = _mm256_setzero_si256();
+         __m256i acc1 = _mm256_setzero_si256();
+         __m256i acc2 = _mm256_setzero_si256();
+         __m256i acc3 = _mm256_setzero_si256();
+         for(unsigned int p = 0; p < ldw; p += 16) {
+            const __m256i wv = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(w_row + p)));
+            acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(
+                      _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(x0 + p))), wv));
+            acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(
+                      _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(x1 + p))), wv));
+            acc2 = _mm256_add_epi32(acc2, _mm256_madd_epi16(
+                      _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(x2 + p))), wv));
+            acc3 = _mm256_add_epi32(acc3, _mm256_madd_epi16(
+                      _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(x3 + p))), wv));
+         }
+         y0[j] = hsum_epi32_avx2(acc0);
+         y1[j] = hsum_epi32_avx2(acc1);
+         y2[j] = hsum_epi32_avx2(acc2);
+         y3[j] = hsum_epi32_avx2(acc3);
+      }
+   }
+   for(; i < m; i++) {
+      quant_dot_avx2(n, x + (size_t)i * ldx, w, ldw, w_sums, y + (size_t)i * ldy);
+   }
+}
+
+// Eight values at a time: round, clamp, then narrow 32 -> 16 -> 8 bits
+__attribute__((target("avx2")))
+static void quantize_row_avx2(const float* x, unsigned int k, float inv_scale,
+                              int8_t* xq) {
+   const __m256 scale = _mm256_set1_ps(inv_scale);
+   const __m256 lo = _mm256_set1_ps((float)-QUANT_INT8_MAX);
+   const __m256 hi = _mm256_set1_ps((float)QUANT_INT8_MAX);
+   unsigned int p = 0;
+   for(; p + 8 <= k; p += 8) {
+      __m256 v = _mm256_mul_ps(_mm256_loadu_ps(x + p), scale);
+      v = _mm256_min_ps(_mm256_max_ps(v, lo), hi);
+      __m256i q = _mm256_cvtps_epi32(v);
+      __m128i q16 = _mm_packs_epi32(_mm256_castsi256_si128(q), _mm256_extracti128_si256(q, 1));
+      __m128i q8 = _mm_packs_epi16(q16, q16);
+      _mm_storel_epi64((__m128i*)(xq + p), q8);
+   }
+   quantize_row_scalar(x + p, k - p, inv_scale, xq + p);
+}
+
+// AVX-512 VNNI ---------------------------------------------------------------
+// vpdpbusd multiplies unsigned by signed bytes, so x is shifted into
+// 1..255 by flipping its sign bit (x + 128) and 128 * sum(w) taken back
+// off at the end. Sums are exact in int32.
+__attribute__((target("avx512f,avx512vnni")))
+static void quant_dot_avx512_vnni(unsigned int n, const int8_t* x,
+                                  const int8_t* w, unsigned int ldw,
+                                  const int32_t* w_sums, int32_t* y) {
+   static_assert(QUANT_ROW_ALIGNMENT % 64 == 0, "VNNI kernel reads 64 byte blocks");
+   const __m512i flip = _mm512_set1_epi8((char)0x80);
+   unsigned int j = 0;
+   for(; j + 4 <= n; j += 4) {
+      const int8_t* w0 = w + (size_t)(j + 0) * ldw;
+      const int8_t* w1 = w + (size_t)(j + 1) * ldw;
+      const int8_t* w2 = w + (size_t)(j + 2) * ldw;
+      const int8_t* w3 = w + (size_t)(j + 3) * ldw;
+      __m512i acc0 = _mm512_setzero_si512();
+      __m512i acc1 = _mm512_setzero_si512();
+      __m512i acc2 = _mm512_setzero_si512();
+      __m512i acc3 = _mm512_setzero_si512();
+      for(unsigned int p = 0; p < ldw; p += 64) {
+         const __m512i xu = _mm512_xor_si512(_mm512_loadu_si512(x + p), flip);
+         acc0 = _mm512_dpbusd_epi32(acc0, xu, _mm512_loadu_si512(w0 + p));
+         acc1 = _mm512_dpbusd_epi32(acc1, xu, _mm512_loadu_si512(w1 + p));
+         acc2 = _mm512_dpbusd_epi32(acc2, xu, _mm512_loadu_si512(w2 + p));
+         acc3 = _mm512_dpbusd_epi32(acc3, xu, _mm512_loadu_si512(w3 + p));
+      }
+      y[j + 0] = _mm512_reduce_add_epi32(acc0) - 128 * w_sums[j + 0];
+      y[j + 1] = _mm512_reduce_add_epi32(acc1) - 128 * w_sums[j + 1];
+      y[j + 2] = _mm512_reduce_add_epi32(acc2) - 128 * w_sums[j + 2];
+      y[j + 3] = _mm512_reduce_add_epi32(acc3) - 128 * w_sums[j + 3];
+   }
+   for(; j < n; j++) {
+      const int8_t* w_row = w + (size_t)j * ldw;
+      __m512i acc = _mm512_setzero_si512();
+      for(unsigned int p = 0; p < ldw; p += 64) {
+         acc = _mm512_dpbusd_epi32(acc, _mm512_xor_si512(_mm512_loadu_si512(x + p), flip),
+                                   _mm512_loadu_si512(w_row + p));
+      }
+      y[j] = _mm512_reduce_add_epi32(acc) - 128 * w_sums[j];
+   }
+}
+
+// Four samples by four weight rows, 16 accumulators. The flipped x rows are
+// reused for all four weight rows, each weight load for all four samples.
+__attribute__((target("avx512f,avx512vnni")))
+static void quant_gemm_avx512_vnni(unsigned int m, unsigned int n,
+                                   const int8_t* x, unsigned int ldx,
+                                   const int8_t* w, unsigned int ldw,
+                                   const int32_t* w_sums, int32_t* y, unsigned int ldy) {
+   static_assert(QUANT_GEMM_MR == 4, "VNNI int8 GEMM assumes 4 sample rows");
+   const __m512i flip = _mm512_set1_epi8((char)0x80);
+   unsigned int i = 0;
+   for(; i + 4 <= m; i += 4) {
+      const int8_t* x0 = x + (size_t)(i + 0) * ldx;
+      const int8_t* x1 = x + (size_t)(i + 1) * ldx;
+      const int8_t* x2 = x + (size_t)(i + 2) * ldx;
+      const int8_t* x3 = x + (size_t)(i + 3) * ldx;
+      int32_t* y0 = y + (size_t)(i + 0) * ldy;
+      int32_t* y1 = y + (size_t)(i + 1) * ldy;
+      int32_t* y2 = y + (size_t)(i + 2) * ldy;
+      int32_t* y3 = y + (size_t)(i + 3) * ldy;
+      unsigned int j = 0;
+      for(; j + 4 <= n; j += 4) {
+         __m512i acc[4][4];
+         for(unsigned int r = 0; r < 4; r++) {
+            for(unsigned int c = 0; c < 4; c++) acc[r][c] = _mm512_setzero_si512();
+         }
+         for(unsigned int p = 0; p < ldw; p += 64) {
+            const __m512i xu0 = _mm512_xor_si512(_mm512_loadu_si512(x0 + p), flip);
+            const __m512i xu1 = _mm512_xor_si512(_mm512_loadu_si512(x1 + p), flip);
+            const __m512i xu2 = _mm512_xor_si512(_mm512_loadu_si512(x2 + p), flip);
+            const __m512i xu3 = _mm512_xor_si512(_mm512_loadu_si512(x3 + p), flip);
+            for(unsigned int c = 0; c < 4; c++) {
+               const __m512i wv = _mm512_loadu_si512(w + (size_t)(j + c) * ldw + p);
+               acc[0][c] = _mm512_dpbusd_epi32(acc[0][c], xu0, wv);
+               acc[1][c] = _mm512_dpbusd_epi32(acc[1][c], xu1, wv);
+               acc[2][c] = _mm512_dpbusd_epi32(acc[2][c], xu2, wv);
+               acc[3][c] = _mm512_dpbusd_epi32(acc[3][c], xu3, wv);
+            }
+         }
+         for(unsigned int c = 0; c < 4; c++) {
+            const int32_t bias = 128 * w_sums[j + c];
+            y0[j + c] = _mm512_reduce_add_epi32(acc[0][c]) - bias;
+            y1[j + c] = _mm512_reduce_add_epi32(acc[1][c]) - bias;
+            y2[j + c] = _mm512_reduce_add_epi32(acc[2][c]) - bias;
+            y3[j + c] = _mm512_reduce_add_epi32(acc[3][c]) - bias;
+         }
+      }
+      for(; j < n; j++) {
+         const int8_t* w_row = w + (size_t)j * ldw;
+         __m512i acc0 = _mm512_setzero_si512();
+         __m512i acc1 = _mm512_setzero_si512();
+         __m512i acc2 = _mm512_setzero_si512();
+         __m512i acc3 = _mm512_setzero_si512();
+         for(unsigned int p = 0; p < ldw; p += 64) {
+            const __m512i wv = _mm512_loadu_si512(w_row + p);
+            acc0 = _mm512_dpbusd_epi32(acc0, _mm512_xor_si512(_mm512_loadu_si512(x0 + p), flip), wv);
+            acc1 = _mm512_dpbusd_epi32(acc1, _mm512_xor_si512(_mm512_loadu_si512(x1 + p), flip), wv);
+            acc2 = _mm512_dpbusd_epi32(acc2, _mm512_xor_si512(_mm512_loadu_si512(x2 + p), flip), wv);
+            acc3 = _mm512_dpbusd_epi32(acc3, _mm512_xor_si512(_mm512_loadu_si512(x3 + p), flip), wv);
+         }
+         const int32_t bias = 128 * w_sums[j];
+         y0[j] = _mm512_reduce_add_epi32(acc0) - bias;
+         y1[j] = _mm512_reduce_add_epi32(acc1) - bias;
+         y2[j] = _mm512_reduce_add_epi32(acc2) - bias;
+         y3[j] = _mm512_reduce_add_epi32(acc3) - bias;
+      }
+   }
+   for(; i < m; i++) {
+      quant_dot_avx512_vnni(n, x + (size_t)i * ldx, w, ldw, w_sums, y + (size_t)i * ldy);
+   }
+}
+#endif
+
+// Dispatch -------------------------------------------------------------------
+// The type that actually runs when type is asked for
+static QuantKernelType available_quant_kernel(QuantKernelType type) {
+#if HAVE_X86_SIMD
+   if(type == QUANT_AVX512_VNNI && cpu_has_avx512_vnni()) return QUANT_AVX512_VNNI;
+   if(type >= QUANT_AVX2 && cpu_simd_level() >= SIMD_AVX2) return QUANT_AVX2;
+#endif
+   return QUANT_SCALAR;
+}
+
+QuantKernelType best_quant_kernel() {
+   return available_quant_kernel(QUANT_AVX512_VNNI);
+}
+
+QuantKernel quant_kernel(QuantKernelType type) {
+   switch(available_quant_kernel(type)) {
+#if HAVE_X86_SIMD
+      case QUANT_AVX512_VNNI: return quant_dot_avx512_vnni;
+      case QUANT_AVX2: return quant_dot_avx2;
+#endif
+      default: return quant_dot_scalar;
+   }
+}
+
+QuantGemmKernel quant_gemm_kernel(QuantKernelType type) {
+   switch(available_quant_kernel(type)) {
+#if HAVE_X86_SIMD
+      case QUANT_AVX512_VNNI: return quant_gemm_avx512_vnni;
+      case QUANT_AVX2: return quant_gemm_avx2;
+#endif
+      default: return quant_gemm_scalar;
+   }
+}
+
+void quantize_row(const float* x, unsigned int k, float scale,
+                  int8_t* xq, unsigned int ldx) {
+   const float inv_scale = 1.0f / scale;
+#if HAVE_X86_SIMD
+   if(cpu_simd_level() >= SIMD_AVX2) {
+      quantize_row_avx2(x, k, inv_scale, xq);
+   } else {
+      quantize_row_scalar(x, k, inv_scale, xq);
+   }
+#else
+   quantize_row_scalar(x, k, inv_scale, xq);
+#endif
+   if(ldx > k) memset(xq + k, 0, ldx - k);
+}
+
+// Calibration ----------------------------------------------------------------
+// Largest magnitude of every layer's input over the calibration samples
+static vector<float> calibrate_ranges(const Network& network, const Matrix& calibration) {
+   unsigned int num_layers = network.get_num_layers();
+   vector<float> ranges(num_layers, 0.0f);
+   InferenceContext context;
+   auto samples = make_shared<Matrix>(calibration);
+
+   for(unsigned int start = 0; start < calibration.get_rows(); start += QUANT_BATCH) {
+      unsigned int rows = min(QUANT_BATCH, calibration.get_rows() - start);
+      auto batch = samples->slice(start, 0, rows, calibration.get_cols());
+      network.compute_batch(batch, context);
+
+      for(unsigned int i = 0; i < num_layers; i++) {
+         const Matrix& input = i == 0 ? *batch : *context.get_layer_output(i - 1);
+         for(unsigned int y = 0; y < rows; y++) {
+            const float* row = input.row_data(y);
+            for(unsigned int x = 0; x < input.get_cols(); x++) {
+               ranges[i] = max(ranges[i], fabsf(row[x]));
+            }
+         }
+      }
+   }
+   return ranges;
+}
+
+// Step size that maps range onto +-127, zero ranges quantize everything to 0
+static float scale_for(float range) {
+   return range > 0.0f ? range / QUANT_INT8_MAX : 1.0f;
+}
+
+static QuantizedLayer quantize_layer(const Layer& layer, float input_range) {
+   QuantizedLayer q;
+   q.k = layer.get_input_size();
+   q.n = layer.get_layer_size();
+   q.ldw = padded_row(q.k);
+   q.input_scale = scale_for(input_range);
+   q.activation = layer.get_activation();
+   q.weights = matrix_alloc_as<int8_t>((size_t)q.n * q.ldw);
+   q.weight_sums.assign(q.n, 0);
+   q.weight_scales.assign(q.n, 1.0f);
+   q.output_scales.assign(q.n, 1.0f);
+
+   // Logical weights are k x n, each output's weights are a column
+   auto weights = layer.get_weights();
+   const float* biases = layer.get_biases()->get_data();
+   q.biases.assign(biases, biases + q.n);
+   for(unsigned int j = 0; j < q.n; j++) {
+      float range = 0.0f;
+      for(unsigned int p = 0; p < q.k; p++) {
+         range = max(range, fabsf(weights->row_data(p)[j]));
+      }
+      float scale = scale_for(range);
+      int8_t* w_row = q.weights.get() + (size_t)j * q.ldw;
+      int32_t sum = 0;
+      for(unsigned int p = 0; p < q.k; p++) {
+         float v = nearbyintf(weights->row_data(p)[j] / scale);
+         w_row[p] = (int8_t)min(max(v, (float)-QUANT_INT8_MAX), (float)QUANT_INT8_MAX);
+         sum += w_row[p];
+      }
+      memset(w_row + q.k, 0, q.ldw - q.k);
+      q.weight_sums[j] = sum;
+      q.weight_scales[j] = scale;
+      q.output_scales[j] = q.input_scale * scale;
+   }
+   return q;
+}
+
+// Quantizing -----------------------------------------------------------------
+QuantizedNetwork::QuantizedNetwork(const Network& network, const Matrix& calibration,
+                                   unsigned int max_rows) {
+   if(max_rows == 0) {
+      printf("A quantized network needs room for at least one row!\n");
+      throw invalid_argument("A quantized network needs room for at least one row!");
+   }
+   if(calibration.get_rows() == 0 || calibration.get_cols() != network.get_input_size()) {
+      printf("Calibration samples must be (N,%d) with N > 0, got (%d,%d)\n",
+             network.get_input_size(), calibration.get_rows(), calibration.get_cols());
+      throw invalid_argument("Calibration samples have the wrong dimensions!");
+   }
+   this->max_rows = max_rows;
+   this->input_size = network.get_input_size();
+
+   vector<float> ranges = calibrate_ranges(network, calibration);
+   this->widest = 0;
+   this->widest_ldw = 0;
+   for(unsigned int i = 0; i < network.get_num_layers(); i++) {
+      this->layers.push_back(quantize_layer(network.get_layer(i), ranges[i]));
+      this->widest = max(this->widest, this->layers.back().n);
+      this->widest_ldw = max(this->widest_ldw, this->layers.back().ldw);
+   }
+
+   this->buffer_size = max_rows * this->widest;
+   this->set_kernel(best_quant_kernel());
+   this->allocate_buffers();
+}
+
+QuantizedNetwork::QuantizedNetwork(const QuantizedNetwork& other)
+   : layers(other.layers), max_rows(other.max_rows), input_size(other.input_size),
+     buffer_size(other.buffer_size), widest(other.widest), widest_ldw(other.widest_ldw),
+     kernel_type(other.kernel_type), kernel(other.kernel), gemm_kernel(other.gemm_kernel) {
+   this->allocate_buffers();
+}
+
+QuantizedNetwork& QuantizedNetwork::operator=(const QuantizedNetwork& other) {
+   if(this != &other) {
+      this->layers = other.layers;
+      this->max_rows = other.max_rows;
+      this->input_size = other.input_size;
+      this->buffer_size = other.buffer_size;
+      this->widest = other.widest;
+      this->widest_ldw = other.widest_ldw;
+      this->kernel_type = other.kernel_type;
+      this->kernel = other.kernel;
+      this->gemm_kernel = other.gemm_kernel;
+      this->allocate_buffers();
+   }
+   return *this;
+}
+
+QuantizedNetwork::~QuantizedNetwork() {}
+
+void QuantizedNetwork::allocate_buffers() {
+   this->buffers[0] = matrix_alloc(this->buffer_size);
+   this->buffers[1] = matrix_alloc(this->buffer_size);
+   this->quant_buffer = matrix_alloc_as<int8_t>((size_t)this->max_rows * this->widest_ldw);
+   this->sum_buffer = matrix_alloc_as<int32_t>((size_t)this->max_rows * this->widest);
+}
+
+void QuantizedNetwork::set_kernel(QuantKernelType type) {
+   this->kernel_type = available_quant_kernel(type);
+   this->kernel = quant_kernel(type);
+   this->gemm_kernel = quant_gemm_kernel(type);
+}
+
+QuantKernelType QuantizedNetwork::get_kernel() const {
+   return this->kernel_type;
+}
+
+// Running --------------------------------------------------------------------
+void QuantizedNetwork::check_rows(unsigned int rows) const {
+   if(rows == 0 || rows > this->max_rows) {
+      printf("Quantized network was made for 1 to %d rows, got %d\n", this->max_rows, rows);
+      throw out_of_range("Too many rows for the quantized network!");
+   }
+}
+
+void QuantizedNetwork::execute(const float* input, unsigned int ld_input, unsigned int rows,
+                               float* output, unsigned int ld_output) {
+   int8_t* xq = this->quant_buffer.get();
+   int32_t* sums = this->sum_buffer.get();
+   const float* x = input;
+   unsigned int ldx = ld_input;
+   unsigned int num_layers = (unsigned int)this->layers.size();
+   for(unsigned int i = 0; i < num_layers; i++) {
+      const QuantizedLayer& layer = this->layers[i];
+      bool last = i + 1 == num_layers;
+      float* y = last ? output : this->buffers[i % 2].get();
+      unsigned int ldy = last ? ld_output : layer.n;
+
+      const ActivationInfo& act = activation_info(layer.activation);
+      bool identity = layer.activation == ACT_IDENTITY;
+      GemmEpilogue epilogue = {nullptr, identity ? nullptr : act.func,
+                                        identity ? nullptr : act.kernel};
+      const float* scales = layer.output_scales.data();
+      const float* biases = layer.biases.data();
+
+      // Every sample is quantized up front, so batches go through the
+      // weights QUANT_GEMM_MR samples at a time
+      for(unsigned int r = 0; r < rows; r++) {
+         quantize_row(x + (size_t)r * ldx, layer.k, layer.input_scale,
+                      xq + (size_t)r * layer.ldw, layer.ldw);
+      }
+      if(rows >= QUANT_GEMM_MR) {
+         this->gemm_kernel(rows, layer.n, xq, layer.ldw, layer.weights.get(), layer.ldw,
+                           layer.weight_sums.data(), sums, layer.n);
+      } else {
+         for(unsigned int r = 0; r < rows; r++) {
+            this->kernel(layer.n, xq + (size_t)r * layer.ldw, layer.weights.get(), layer.ldw,
+                         layer.weight_sums.data(), sums + (size_t)r * layer.n);
+         }
+      }
+
+      for(unsigned int r = 0; r < rows; r++) {
+         float* y_row = y + (size_t)r * ldy;
+         const int32_t* sum_row = sums + (size_t)r * layer.n;
+         for(unsigned int j = 0; j < layer.n; j++) {
+            y_row[j] = (float)sum_row[j] * scales[j] + biases[j];
+         }
+         if(!identity) apply_epilogue(&epilogue, 0, y_row, layer.n);
+      }
+      x = y;
+      ldx = ldy;
+   }
+}
+
+const float* QuantizedNetwork::run(const float* input, unsigned int rows) {
+   this->check_rows(rows);
+   float* output = this->buffers[(this->layers.size() - 1) % 2].get();
+   this->execute(input, this->input_size, rows, output, this->get_output_size());
+   return output;
+}
+
+void QuantizedNetwork::run(const Matrix& inputs, Matrix& outputs) {
+   unsigned int rows = inputs.get_rows();
+   this->check_rows(rows);
+   if(inputs.get_cols() != this->input_size ||
+      outputs.get_rows() != rows || outputs.get_cols() != this->get_output_size()) {
+      printf("Quantized network maps (%d,%d) to (%d,%d), got (%d,%d) and (%d,%d)\n",
+             rows, this->input_size, rows, this->get_output_size(),
+             inputs.get_rows(), inputs.get_cols(), outputs.get_rows(), outputs.get_cols());
+      throw invalid_argument("Quantized network inputs or outputs have the wrong dimensions!");
+   }
+   this->execute(inputs.get_data(), inputs.get_stride(), rows,
+                 outputs.get_data(), outputs.get_stride());
+}
+
+// Network Info ---------------------------------------------------------------
+unsigned int QuantizedNetwork::get_max_rows() const {
+   return this->max_rows;
+}
+
+unsigned int QuantizedNetwork::get_input_size() const {
+   return this->input_size;
+}
+
+unsigned int QuantizedNetwork::get_output_size() const {
+   return this->layers.back().n;
+}
+
+unsigned int QuantizedNetwork::get_num_layers() const {
+   return (unsigned int)this->layers.size();
+}
+
+const QuantizedLayer& QuantizedNetwork::get_layer(unsigned int layer_num) const {
+   if(layer_num >= this->layers.size()) {
+      printf("Layer %d does not exist, the network has %d layers!\n", layer_num, (int)this->layers.size());
+      throw out_of_range("Layer does not exist!");
+   }
+   return this->layers[layer_num];
+}
+
+size_t QuantizedNetwork::get_weight_bytes() const {
+   size_t bytes = 0;
+   for(const QuantizedLayer& layer : this->layers) {
+      bytes += (size_t)layer.n * layer.ldw;
+   }
+   return bytes;
+}
+
+void QuantizedNetwork::print_network_state() const {
+   printf("Quantized Network (%s kernel, %zu bytes of weights)\n",
+          quant_kernel_str(this->kernel_type), this->get_weight_bytes());
+   for(unsigned int i = 0; i < this->layers.size(); i++) {
+      const QuantizedLayer& layer = this->layers[i];
+      float min_scale = *min_element(layer.weight_scales.begin(), layer.weight_scales.end());
+      float max_scale = *max_element(layer.weight_scales.begin(), layer.weight_scales.end());
+      printf("   %d: %d -> %d, %s, input step %g, weight steps %g to %g\n", i,
+             layer.k, layer.n, activation_str(layer.activation),
+             layer.input_scale, min_scale, max_scale);
+   }
+}
+
+// Accuracy Report ------------------------------------------------------------
+static unsigned int argmax(const float* values, unsigned int n) {
+   return (unsigned int)(max_element(values, values + n) - values);
+}
+
+QuantizationReport quantization_report(const Network& network, QuantizedNetwork& quantized,
+                                       const Matrix& inputs) {
+   if(inputs.get_cols() != network.get_input_size() ||
+      quantized.get_input_size() != network.get_input_size()) {
+      printf("Report inputs must be (N,%d), got (%d,%d)\n",
+             network.get_input_size(), inputs.get_rows(), inputs.get_cols());
+      throw invalid_argument("Report inputs have the wrong dimensions!");
+   }
+   unsigned int outputs = quantized.get_output_size();
+   QuantizationReport report = {inputs.get_rows(), outputs, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f};
+   if(inputs.get_rows() == 0) return report;
+
+   InferenceContext context;
+   auto samples = make_shared<Matrix>(inputs);
+   double abs_sum = 0.0, sq_sum = 0.0;
+   unsigned int agree = 0;
+   for(unsigned int start = 0; start < inputs.get_rows(); start += QUANT_BATCH) {
+      unsigned int rows = min(QUANT_BATCH, inputs.get_rows() - start);
+      auto batch = samples->slice(start, 0, rows, inputs.get_cols());
+      auto expected = network.compute_batch(batch, context);
+
+      for(unsigned int y = 0; y < rows; y++) {
+         const float* want = expected->row_data(y);
+         const float* got = quantized.run(batch->row_data(y));
+         for(unsigned int j = 0; j < outputs; j++) {
+            float err = fabsf(got[j] - want[j]);
+            report.max_abs_error = max(report.max_abs_error, err);
+            report.max_float_output = max(report.max_float_output, fabsf(want[j]));
+            abs_sum += err;
+            sq_sum += (double)err * err;
+         }
+         if(argmax(got, outputs) == argmax(want, outputs)) agree++;
+      }
+   }
+
+   double count = (double)report.samples * outputs;
+   report.mean_abs_error = (float)(abs_sum / count);
+   report.rms_error = (float)sqrt(sq_sum / count);
+   report.argmax_agreement = (float)agree / report.samples;
+   return report;
+}
+
+void print_quantization_report(const QuantizationReport& report) {
+   printf("Int8 vs float over %d samples, %d outputs each\n", report.samples, report.outputs);
+   printf("   max abs error  %g (largest output %g)\n", report.max_abs_error, report.max_float_output);
+   printf("   mean abs error %g\n", report.mean_abs_error);
+   printf("   rms error      %g\n", report.rms_error);
+   if(report.outputs > 1) {
+      printf("   argmax agrees  %.2f%%\n", 100.0f * report.argmax_agreement);
+   }
+}
@@ -0,0 +1,178 @@
+
+#ifndef QUANTIZE_HPP
+#define QUANTIZE_HPP
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "Matrix.hpp"
+#include "Gemm.hpp"
+#include "CpuFeatures.hpp"
+
+class Network;
+
+/* Int8 inference
+ *
+ * Weights are stored as int8 with one scale per output neuron, chosen so
+ * the neuron's largest weight maps to 127. Layer inputs are quantized the
+ * same way on the fly with one scale per layer, calibrated up front from
+ * the largest value each layer sees over a sample set. Every layer is then
+ *
+ *    y[j] = act(input_scale * weight_scale[j] * sum_p xq[p] * wq[j][p] + bias[j])
+ *
+ * with the sum done in int32. Both sides are symmetric (zero maps to zero)
+ * and -128 is never used. Biases and layer outputs stay float.
+ */
+
+// Largest magnitude of a quantized value
+#define QUANT_INT8_MAX 127
+
+// Weight rows and quantized inputs are zero padded to a multiple of this
+// many bytes, so the kernels never need a tail loop
+#define QUANT_ROW_ALIGNMENT 64
+
+// Calibration and accuracy reports run the float network this many
+// samples at a time
+#define QUANT_BATCH 256u
+
+/* Int8 dot product kernels, one int32 sum per output
+ *
+ *    y[j] = sum_p x[p] * w[j * ldw + p]   for j < n, p < ldw
+ *
+ * ldw is a multiple of QUANT_ROW_ALIGNMENT and x is padded to ldw.
+ * w_sums[j] holds the sum of row j, which the VNNI kernel needs to undo
+ * running on unsigned inputs (x + 128).
+ */
+typedef void (*QuantKernel)(unsigned int n, const int8_t* x,
+                            const int8_t* w, unsigned int ldw,
+                            const int32_t* w_sums, int32_t* y);
+
+/* Int8 matrix product for batches, m samples at once
+ *
+ *    y[i * ldy + j] = sum_p x[i * ldx + p] * w[j * ldw + p]
+ *
+ * QUANT_GEMM_MR samples go through each weight row together, so the
+ * weights are read once per block of samples rather than once per sample.
+ * Leftover samples run through the matching dot product kernel.
+ */
+#define QUANT_GEMM_MR 4u
+
+typedef void (*QuantGemmKernel)(unsigned int m, unsigned int n,
+                                const int8_t* x, unsigned int ldx,
+                                const int8_t* w, unsigned int ldw,
+                                const int32_t* w_sums, int32_t* y, unsigned int ldy);
+
+enum QuantKernelType {
+   QUANT_SCALAR,
+   QUANT_AVX2,
+   QUANT_AVX512_VNNI
+};
+
+const char* quant_kernel_str(QuantKernelType type);
+
+// The best kernel for the running CPU, and a specific one falling back to
+// the next best when this build or CPU can't provide it
+QuantKernelType best_quant_kernel();
+QuantKernel quant_kernel(QuantKernelType type);
+QuantGemmKernel quant_gemm_kernel(QuantKernelType type);
+
+// xq[p] = round(x[p] / scale) clamped to +-127 for p < k, zero up to ldx
+void quantize_row(const float* x, unsigned int k, float scale,
+                  int8_t* xq, unsigned int ldx);
+
+// One layer of a QuantizedNetwork
+struct QuantizedLayer {
+   unsigned int k;                     // inputs
+   unsigned int n;                     // outputs
+   unsigned int ldw;                   // bytes per weight row, k rounded up
+   std::shared_ptr<int8_t> weights;    // n x ldw, one row per output
+   std::vector<int32_t> weight_sums;   // sum of each row
+   std::vector<float> weight_scales;   // real value of one step, per output
+   std::vector<float> output_scales;   // input_scale * weight_scales[j]
+   std::vector<float> biases;
+   float input_scale;                  // real value of one input step
+   Activation activation;
+};
+
+/* A Network converted to int8, made by Network::quantize.
+ *
+ * Runs like an ExecutionPlan: single samples or batches of up to max_rows,
+ * into buffers allocated up front. Batches of QUANT_GEMM_MR or more
+ * samples take the int8 GEMM kernels. The weights are copied, so the
+ * quantized network doesn't follow later changes to the float one, and
+ * copies share them but get buffers of their own. One thread at a time.
+ */
+class QuantizedNetwork {
+public:
+   // calibration holds sample inputs, one per row, that the layer input
+   // ranges are taken from. They should cover the inputs seen in use,
+   // anything larger is clamped.
+   QuantizedNetwork(const Network& network, const Matrix& calibration,
+                    unsigned int max_rows = 1);
+   QuantizedNetwork(const QuantizedNetwork& other);
+   QuantizedNetwork& operator=(const QuantizedNetwork& other);
+   virtual ~QuantizedNetwork();
+
+   // Same as ExecutionPlan::run
+   const float* run(const float* input, unsigned int rows = 1);
+   void run(const Matrix& inputs, Matrix& outputs);
+
+   // Pick the kernel, the best one for the CPU by default. Kernels the CPU
+   // lacks fall back as in quant_kernel, get_kernel tells which one runs.
+   void set_kernel(QuantKernelType type);
+   QuantKernelType get_kernel() const;
+
+   unsigned int get_max_rows() const;
+   unsigned int get_input_size() const;
+   unsigned int get_output_size() const;
+   unsigned int get_num_layers() const;
+   const QuantizedLayer& get_layer(unsigned int layer_num) const;
+
+   // Bytes of int8 weights, padding included
+   size_t get_weight_bytes() const;
+
+   void print_network_state() const;
+
+private:
+   std::vector<QuantizedLayer> layers;
+   unsigned int max_rows;
+   unsigned int input_size;
+   unsigned int buffer_size;
+   unsigned int widest;
+   unsigned int widest_ldw;
+   QuantKernelType kernel_type;
+   QuantKernel kernel;
+   QuantGemmKernel gemm_kernel;
+
+   // Ping-pong layer outputs, plus the quantized inputs and int32 sums of
+   // every sample for the layer being run
+   std::shared_ptr<float> buffers[2];
+   std::shared_ptr<int8_t> quant_buffer;
+   std::shared_ptr<int32_t> sum_buffer;
+
+   void allocate_buffers();
+   void check_rows(unsigned int rows) const;
+   void execute(const float* input, unsigned int ld_input, unsigned int rows,
+                float* output, unsigned int ld_output);
+};
+
+// Accuracy Report ------------------------------------------------------------
+/* How far the quantized outputs are from the float network's over a set of
+ * inputs (one per row). For networks with several outputs the argmax
+ * agreement is the fraction of samples whose largest output is the same.
+ */
+struct QuantizationReport {
+   unsigned int samples;
+   unsigned int outputs;
+   float max_abs_error;
+   float mean_abs_error;
+   float rms_error;
+   float max_float_output;   // largest float output magnitude, for scale
+   float argmax_agreement;
+};
+
+QuantizationReport quantization_report(const Network& network, QuantizedNetwork& quantized,
+                                       const Matrix& inputs);
+void print_quantization_report(const QuantizationReport& report);
+
+#endif
@@ -0,0 +1,253 @@
+
+#include "Random.hpp"
+#include "CpuFeatures.hpp"
+#include "Scheduler.hpp"
+#include <cmath>
+#include <cstdio>
+#include <stdexcept>
+
+#if HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+#define PHILOX_ROUNDS 10
+
+// 2^-24, the spacing of floats just below 1
+#define RANDOM_FLOAT_SCALE (1.0f / 16777216.0f)
+
+// Philox ---------------------------------------------------------------------
+Philox::Philox(uint64_t seed, uint64_t stream) {
+   this->seed = seed;
+   this->stream = stream;
+}
+
+void Philox::block(uint64_t counter, uint32_t out[4]) const {
+   uint32_t c0 = (uint32_t)counter;
+   uint32_t c1 = (uint32_t)(counter >> 32);
+   uint32_t c2 = (uint32_t)this->stream;
+   uint32_t c3 = (uint32_t)(this->stream >> 32);
+   uint32_t k0 = (uint32_t)this->seed;
+   uint32_t k1 = (uint32_t)(this->seed >> 32);
+
+   for(int round = 0; round < PHILOX_ROUNDS; round++) {
+      uint64_t p0 = (uint64_t)PHILOX_M0 * c0;
+      uint64_t p1 = (uint64_t)PHILOX_M1 * c2;
+      uint32_t n0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+      uint32_t n2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+      c1 = (uint32_t)p1;
+      c3 = (uint32_t)p0;
+      c0 = n0;
+      c2 = n2;
+      k0 += PHILOX_W0;
+      k1 += PHILOX_W1;
+   }
+   out[0] = c0;
+   out[1] = c1;
+   out[2] = c2;
+   out[3] = c3;
+}
+
+void Philox::uniform_block(uint64_t counter, float out[4]) const {
+   uint32_t words[4];
+   this->block(counter, words);
+   for(int i = 0; i < 4; i++) {
+      out[i] = (float)(words[i] >> 8) * RANDOM_FLOAT_SCALE;
+   }
+}
+
+// Box-Muller on two pairs of words. u1 is kept in (0, 1] for the log.
+void Philox::normal_block(uint64_t counter, float out[4]) const {
+   uint32_t words[4];
+   this->block(counter, words);
+   for(int i = 0; i < 4; i += 2) {
+      float u1 = (float)((words[i] >> 8) + 1) * RANDOM_FLOAT_SCALE;
+      float u2 = (float)(words[i + 1] >> 8) * RANDOM_FLOAT_SCALE;
+      float r = sqrtf(-2.0f * logf(u1));
+      float theta = 6.28318530718f * u2;
+      out[i] = r * cosf(theta);
+      out[i + 1] = r * sinf(theta);
+   }
+}
+
+Philox Philox::with_stream(uint64_t stream) const {
+   return Philox(this->seed, stream);
+}
+
+uint64_t Philox::get_seed() const {
+   return this->seed;
+}
+
+uint64_t Philox::get_stream() const {
+   return this->stream;
+}
+
+#if HAVE_X86_SIMD
+// AVX2 -----------------------------------------------------------------------
+// (hi, lo) halves of the eight 32 x 32 bit products a * m
+__attribute__((target("avx2")))
+static inline void mul_hi_lo(__m256i a, __m256i m, __m256i& hi, __m256i& lo) {
+   __m256i even = _mm256_mul_epu32(a, m);
+   __m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), m);
+   hi = _mm256_blend_epi32(_mm256_srli_epi64(even, 32), odd, 0xAA);
+   lo = _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0xAA);
+}
+
+/* Blocks counter .. counter + 7 turned into 32 uniform values at out, one
+ * block per lane. Only multiplies and adds, no fma, so the values are
+ * bitwise the same as the scalar path's.
+ */
+__attribute__((target("avx2")))
+static void uniform_blocks_avx2(const Philox& rng, uint64_t counter, float* out,
+                                float scale, float shift) {
+   uint32_t lo_words[8], hi_words[8];
+   for(int j = 0; j < 8; j++) {
+      lo_words[j] = (uint32_t)(counter + j);
+      hi_words[j] = (uint32_t)((counter + j) >> 32);
+   }
+   uint64_t stream = rng.get_stream();
+   uint64_t seed = rng.get_seed();
+
+   __m256i c0 = _mm256_loadu_si256((const __m256i*)lo_words);
+   __m256i c1 = _mm256_loadu_si256((const __m256i*)hi_words);
+   __m256i c2 = _mm256_set1_epi32((int)(uint32_t)stream);
+   __m256i c3 = _mm256_set1_epi32((int)(uint32_t)(stream >> 32));
+   uint32_t k0 = (uint32_t)seed;
+   uint32_t k1 = (uint32_t)(seed >> 32);
+   const __m256i m0 = _mm256_set1_epi32((int)PHILOX_M0);
+   const __m256i m1 = _mm256_set1_epi32((int)PHILOX_M1);
+
+   for(int round = 0; round < PHILOX_ROUNDS; round++) {
+      __m256i hi0, lo0, hi1, lo1;
+      mul_hi_lo(c0, m0, hi0, lo0);
+      mul_hi_lo(c2, m1, hi1, lo1);
+      c0 = _mm256_xor_si256(_mm256_xor_si256(hi1, c1), _mm256_set1_epi32((int)k0));
+      c2 = _mm256_xor_si256(_mm256_xor_si256(hi0, c3), _mm256_set1_epi32((int)k1));
+      c1 = lo1;
+      c3 = lo0;
+      k0 += PHILOX_W0;
+      k1 += PHILOX_W1;
+   }
+
+   // Lanes hold word w of eight blocks, the output wants block after block
+   __m256i t0 = _mm256_unpacklo_epi32(c0, c1);
+   __m256i t1 = _mm256_unpackhi_epi32(c0, c1);
+   __m256i t2 = _mm256_unpacklo_epi32(c2, c3);
+   __m256i t3 = _mm256_unpackhi_epi32(c2, c3);
+   __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+   __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+   __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+   __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+   __m256i blocks[4] = {
+      _mm256_permute2x128_si256(u0, u1, 0x20),
+      _mm256_permute2x128_si256(u2, u3, 0x20),
+      _mm256_permute2x128_si256(u0, u1, 0x31),
+      _mm256_permute2x128_si256(u2, u3, 0x31)
+   };
+
+   const __m256 unit = _mm256_set1_ps(RANDOM_FLOAT_SCALE);
+   const __m256 scale_v = _mm256_set1_ps(scale);
+   const __m256 shift_v = _mm256_set1_ps(shift);
+   for(int i = 0; i < 4; i++) {
+      __m256 v = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(blocks[i], 8)), unit);
+      _mm256_storeu_ps(out + 8 * i, _mm256_add_ps(_mm256_mul_ps(v, scale_v), shift_v));
+   }
+}
+#endif
+
+// Fills ----------------------------------------------------------------------
+// Values [begin, end) of the stream, out pointing at value begin. Blocks cut
+// by the range ends are generated whole and only partly used.
+template<bool NORMAL>
+static void fill_range(const Philox& rng, float* out, uint64_t begin, uint64_t end,
+                       float scale, float shift) {
+#if HAVE_X86_SIMD
+   static const bool use_avx2 = cpu_simd_level() >= SIMD_AVX2;
+#endif
+   float values[4];
+   uint64_t i = begin;
+   while(i < end) {
+#if HAVE_X86_SIMD
+      if(!NORMAL && use_avx2 && i % 4 == 0 && end - i >= 32) {
+         uniform_blocks_avx2(rng, i / 4, out + (i - begin), scale, shift);
+         i += 32;
+         continue;
+      }
+#endif
+      uint64_t counter = i / 4;
+      if(NORMAL) rng.normal_block(counter, values);
+      else rng.uniform_block(counter, values);
+      for(unsigned int w = i % 4; w < 4 && i < end; w++, i++) {
+         out[i - begin] = values[w] * scale + shift;
+      }
+   }
+}
+
+template<bool NORMAL>
+static void fill(const Philox& rng, float* out, size_t n, float scale, float shift, uint64_t offset) {
+   if(n <= RANDOM_PARALLEL_GRAIN) {
+      fill_range<NORMAL>(rng, out, offset, offset + n, scale, shift);
+      return;
+   }
+   default_scheduler()->parallel_for(0, n, RANDOM_PARALLEL_GRAIN, [&](size_t begin, size_t end) {
+      fill_range<NORMAL>(rng, out + begin, offset + begin, offset + end, scale, shift);
+   });
+}
+
+void random_uniform(const Philox& rng, float* out, size_t n,
+                    float min, float max, uint64_t offset) {
+   fill<false>(rng, out, n, max - min, min, offset);
+}
+
+void random_normal(const Philox& rng, float* out, size_t n,
+                   float mean, float stddev, uint64_t offset) {
+   fill<true>(rng, out, n, stddev, mean, offset);
+}
+
+// Weight Initializers --------------------------------------------------------
+const char* weight_init_str(WeightInit init) {
+   switch(init) {
+      case INIT_UNIFORM: return "UNIFORM";
+      case INIT_XAVIER_UNIFORM: return "XAVIER_UNIFORM";
+      case INIT_XAVIER_NORMAL: return "XAVIER_NORMAL";
+      case INIT_HE_UNIFORM: return "HE_UNIFORM";
+      case INIT_HE_NORMAL: return "HE_NORMAL";
+      default: return "UNKNOWN";
+   }
+}
+
+void init_weights(Matrix& weights, WeightInit init, const Philox& rng) {
+   float fan_in = (float)weights.get_rows();
+   float fan_out = (float)weights.get_cols();
+   bool normal = false;
+   float scale = 1.0f;
+
+   switch(init) {
+      case INIT_UNIFORM: break;
+      case INIT_XAVIER_UNIFORM: scale = sqrtf(6.0f / (fan_in + fan_out)); break;
+      case INIT_XAVIER_NORMAL: normal = true; scale = sqrtf(2.0f / (fan_in + fan_out)); break;
+      case INIT_HE_UNIFORM: scale = sqrtf(6.0f / fan_in); break;
+      case INIT_HE_NORMAL: normal = true; scale = sqrtf(2.0f / fan_in); break;
+      default:
+         printf("Weight initializer %d is not supported!\n", init);
+         throw invalid_argument("Weight initializer is not supported!");
+   }
+
+   // Value r * cols + c of the stream goes to (r, c) whatever the stride
+   unsigned int rows = weights.get_rows();
+   unsigned int cols = weights.get_cols();
+   if(weights.is_contiguous()) {
+      rows = 1;
+      cols = weights.get_size();
+   }
+   for(unsigned int r = 0; r < rows; r++) {
+      uint64_t offset = (uint64_t)r * cols;
+      if(normal) random_normal(rng, weights.row_data(r), cols, 0.0f, scale, offset);
+      else random_uniform(rng, weights.row_data(r), cols, -scale, scale, offset);
+   }
+}
@@ -0,0 +1,82 @@
+
+#ifndef RANDOM_HPP
+#define RANDOM_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include "Matrix.hpp"
+
+/* Counter-based random numbers (Philox4x32-10)
+ *
+ * Philox turns a 128-bit counter and a 64-bit key into four random 32-bit
+ * words with ten rounds of multiplies and xors. There is no state to
+ * advance: value i of a stream is simply a function of (key, stream, i/4),
+ * so any range of a stream can be generated on its own, by any thread, in
+ * any order, and the results only depend on the seed.
+ *
+ * The key is the seed. The upper half of the counter holds a stream
+ * number, so one seed gives 2^64 independent streams (one per layer, say),
+ * each 2^66 values long.
+ */
+
+// Values generated per task by the parallel fills
+#define RANDOM_PARALLEL_GRAIN (1u << 16)
+
+class Philox {
+public:
+   Philox(uint64_t seed = 0, uint64_t stream = 0);
+
+   // The four words of block counter
+   void block(uint64_t counter, uint32_t out[4]) const;
+
+   // Four floats of block counter, uniform in [0, 1) or standard normal
+   void uniform_block(uint64_t counter, float out[4]) const;
+   void normal_block(uint64_t counter, float out[4]) const;
+
+   // Another stream with the same seed
+   Philox with_stream(uint64_t stream) const;
+
+   uint64_t get_seed() const;
+   uint64_t get_stream() const;
+
+private:
+   uint64_t seed;
+   uint64_t stream;
+};
+
+/* out[i] = value offset + i of the stream, for n values. Large fills are
+ * split across the default scheduler, which doesn't change the result.
+ */
+void random_uniform(const Philox& rng, float* out, size_t n,
+                    float min, float max, uint64_t offset = 0);
+void random_normal(const Philox& rng, float* out, size_t n,
+                   float mean, float stddev, uint64_t offset = 0);
+
+// Weight Initializers --------------------------------------------------------
+/* How fresh weights are drawn for a layer with fan_in inputs and fan_out
+ * outputs.
+ *
+ *    INIT_UNIFORM         U(-1, 1)
+ *    INIT_XAVIER_UNIFORM  U(-a, a),    a = sqrt(6 / (fan_in + fan_out))
+ *    INIT_XAVIER_NORMAL   N(0, s^2),   s = sqrt(2 / (fan_in + fan_out))
+ *    INIT_HE_UNIFORM      U(-a, a),    a = sqrt(6 / fan_in)
+ *    INIT_HE_NORMAL       N(0, s^2),   s = sqrt(2 / fan_in)
+ *
+ * Xavier (Glorot) keeps the variance of sigmoid and tanh layers steady
+ * through a deep network, He does the same for relu.
+ */
+enum WeightInit {
+   INIT_UNIFORM,
+   INIT_XAVIER_UNIFORM,
+   INIT_XAVIER_NORMAL,
+   INIT_HE_UNIFORM,
+   INIT_HE_NORMAL
+};
+
+const char* weight_init_str(WeightInit init);
+
+// Fills logical (fan_in x fan_out) weights from the start of rng's stream
+void init_weights(Matrix& weights, WeightInit init, const Philox& rng);
+
+#endif
+
@@ -0,0 +1,374 @@
+
+#include "Scheduler.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <exception>
+#include <stdexcept>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+using namespace std;
+
+// The scheduler and worker index of the calling thread, if it is a worker
+static thread_local const Scheduler* current_scheduler = nullptr;
+static thread_local int current_worker = -1;
+
+// How long a waiting thread sleeps before checking on its condition again
+// when nothing wakes it up earlier
+#define SCHEDULER_POLL_US 200
+
+// Scheduler ------------------------------------------------------------------
+Scheduler::Scheduler(unsigned int num_workers, bool pin_workers) {
+   if(num_workers == 0) {
+      // hardware_concurrency is 0 when it can't be determined
+      unsigned int cores = thread::hardware_concurrency();
+      num_workers = cores > 1 ? cores - 1 : 1;
+   }
+   this->pin_workers = pin_workers;
+   this->pending = 0;
+   this->stopping = false;
+
+   for(unsigned int i = 0; i < num_workers; i++) {
+      this->workers.emplace_back(new Worker());
+   }
+   // Only start the threads once every deque exists, they steal from all
+   for(unsigned int i = 0; i < num_workers; i++) {
+      this->workers[i]->thread = thread(&Scheduler::worker_loop, this, i);
+   }
+}
+
+Scheduler::~Scheduler() {
+   // Drain whatever is still queued so no submitted future is left broken
+   this->help_until([this]() {return this->pending == 0;});
+
+   {
+      lock_guard<mutex> guard(this->sleep_lock);
+      this->stopping = true;
+   }
+   this->wake.notify_all();
+   for(auto& worker : this->workers) {
+      worker->thread.join();
+   }
+}
+
+unsigned int Scheduler::get_num_workers() const {
+   return static_cast<unsigned int>(this->workers.size());
+}
+
+bool Scheduler::get_pin_workers() const {
+   return this->pin_workers;
+}
+
+bool Scheduler::is_worker_thread() const {
+   return current_scheduler == this;
+}
+
+void Scheduler::notify_waiters() {
+   // Taking the lock orders this with a sleeper checking its condition
+   { lock_guard<mutex> guard(this->sleep_lock); }
+   this->wake.notify_all();
+}
+
+void Scheduler::push(function<void()> task) {
+   // Counted first so pending never drops below the number of queued tasks
+   this->pending++;
+   if(this->is_worker_thread()) {
+      Worker& self = *this->workers[current_worker];
+      lock_guard<mutex> guard(self.lock);
+      self.tasks.push_back(move(task));
+   } else {
+      lock_guard<mutex> guard(this->inject_lock);
+      this->injected.push_back(move(task));
+   }
+   { lock_guard<mutex> guard(this->sleep_lock); }
+   this->wake.notify_one();
+}
+
+bool Scheduler::pop(int self, function<void()>& task) {
+   // Newest task of our own first
+   if(self >= 0) {
+      Worker& worker = *this->workers[self];
+      lock_guard<mutex> guard(worker.lock);
+      if(!worker.tasks.empty()) {
+         task = move(worker.tasks.back());
+         worker.tasks.pop_back();
+         return true;
+      }
+   }
+
+   {
+      lock_guard<mutex> guard(this->inject_lock);
+      if(!this->injected.empty()) {
+         task = move(this->injected.front());
+         this->injected.pop_front();
+         return true;
+      }
+   }
+
+   // Steal the oldest task of another worker, starting with our neighbour
+   unsigned int num_workers = this->get_num_workers();
+   unsigned int start = self >= 0 ? self + 1 : 0;
+   for(unsigned int i = 0; i < num_workers; i++) {
+      unsigned int victim = (start + i) % num_workers;
+      if((int)victim == self) continue;
+      Worker& worker = *this->workers[victim];
+      lock_guard<mutex> guard(worker.lock);
+      if(!worker.tasks.empty()) {
+         task = move(worker.tasks.front());
+         worker.tasks.pop_front();
+         return true;
+      }
+   }
+   return false;
+}
+
+bool Scheduler::run_one() {
+   int self = this->is_worker_thread() ? current_worker : -1;
+   function<void()> task;
+   if(!this->pending || !this->pop(self, task)) {
+      return false;
+   }
+   this->pending--;
+   task();
+   return true;
+}
+
+void Scheduler::help_until(const function<bool()>& done) {
+   while(!done()) {
+      if(this->run_one()) continue;
+
+      unique_lock<mutex> guard(this->sleep_lock);
+      this->wake.wait_for(guard, chrono::microseconds(SCHEDULER_POLL_US), [&]() {
+         return this->pending > 0 || done();
+      });
+   }
+}
+
+void Scheduler::worker_loop(unsigned int index) {
+   current_scheduler = this;
+   current_worker = index;
+
+#ifdef __linux__
+   if(this->pin_workers) {
+      // Core 0 is left to the main thread
+      unsigned int cores = max(1u, thread::hardware_concurrency());
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET((index + 1) % cores, &cpus);
+      pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+   }
+#endif
+
+   while(true) {
+      if(this->run_one()) continue;
+
+      unique_lock<mutex> guard(this->sleep_lock);
+      this->wake.wait(guard, [this]() {
+         return this->stopping || this->pending > 0;
+      });
+      if(this->stopping && this->pending == 0) return;
+   }
+}
+
+void Scheduler::spawn(function<void()> task) {
+   this->push([task]() {
+      try {
+         task();
+      } catch(const exception& e) {
+         printf("Uncaught exception in a spawned task: %s\n", e.what());
+      }
+   });
+}
+
+// Parallel For ---------------------------------------------------------------
+/* Shared with the helper tasks, which may only get to run after the loop
+ * is already over, so it can't live on the caller's stack.
+ */
+struct ParallelForState {
+   const function<void(size_t, size_t)>* body;
+   size_t begin, end, grain, num_chunks;
+   atomic<size_t> next_chunk;
+   atomic<size_t> chunks_done;
+   mutex error_lock;
+   exception_ptr error;
+
+   // Claims chunks until there are none left
+   void run() {
+      size_t chunk;
+      while((chunk = next_chunk.fetch_add(1)) < num_chunks) {
+         size_t chunk_begin = begin + chunk * grain;
+         size_t chunk_end = min(end, chunk_begin + grain);
+         try {
+            (*body)(chunk_begin, chunk_end);
+         } catch(...) {
+            lock_guard<mutex> guard(error_lock);
+            if(!error) error = current_exception();
+         }
+         chunks_done++;
+      }
+   }
+};
+
+void Scheduler::parallel_for(size_t begin, size_t end, size_t grain,
+                             const function<void(size_t, size_t)>& body) {
+   if(end <= begin) return;
+   grain = max<size_t>(1, grain);
+   size_t num_chunks = (end - begin + grain - 1) / grain;
+
+   if(num_chunks == 1) {
+      body(begin, end);
+      return;
+   }
+
+   auto state = make_shared<ParallelForState>();
+   state->body = &body;
+   state->begin = begin;
+   state->end = end;
+   state->grain = grain;
+   state->num_chunks = num_chunks;
+   state->next_chunk = 0;
+   state->chunks_done = 0;
+
+   size_t helpers = min<size_t>(num_chunks - 1, this->get_num_workers());
+   for(size_t i = 0; i < helpers; i++) {
+      this->push([state, this]() {
+         state->run();
+         if(state->chunks_done == state->num_chunks) {
+            this->notify_waiters();
+         }
+      });
+   }
+
+   state->run();
+   this->help_until([&state]() {return state->chunks_done == state->num_chunks;});
+
+   if(state->error) {
+      rethrow_exception(state->error);
+   }
+}
+
+// Task Graph -----------------------------------------------------------------
+TaskGraph::TaskId TaskGraph::add(function<void()> task) {
+   Node node;
+   node.task = move(task);
+   this->nodes.push_back(move(node));
+   return static_cast<TaskId>(this->nodes.size() - 1);
+}
+
+void TaskGraph::precede(TaskId before, TaskId after) {
+   if(before >= this->nodes.size() || after >= this->nodes.size()) {
+      printf("Task %d or %d is not in the graph of %d tasks!\n", before, after, (int)this->nodes.size());
+      throw out_of_range("Task is not in the graph!");
+   }
+   this->nodes[before].successors.push_back(after);
+   this->nodes[after].num_predecessors++;
+}
+
+unsigned int TaskGraph::get_num_tasks() const {
+   return static_cast<unsigned int>(this->nodes.size());
+}
+
+struct TaskGraphRun {
+   vector<atomic<unsigned int>> remaining;
+   atomic<unsigned int> finished;
+   atomic<bool> failed;
+   mutex error_lock;
+   exception_ptr error;
+
+   TaskGraphRun(size_t size) : remaining(size) {}
+};
+
+void TaskGraph::run(Scheduler& scheduler) {
+   unsigned int num_tasks = this->get_num_tasks();
+   if(num_tasks == 0) return;
+
+   // Kahn's algorithm on the counts, every task has to be reachable
+   vector<unsigned int> counts(num_tasks);
+   vector<TaskId> ready;
+   for(TaskId i = 0; i < num_tasks; i++) {
+      counts[i] = this->nodes[i].num_predecessors;
+      if(counts[i] == 0) ready.push_back(i);
+   }
+   vector<TaskId> roots = ready;
+   unsigned int reachable = 0;
+   while(!ready.empty()) {
+      TaskId id = ready.back();
+      ready.pop_back();
+      reachable++;
+      for(TaskId next : this->nodes[id].successors) {
+         if(--counts[next] == 0) ready.push_back(next);
+      }
+   }
+   if(reachable != num_tasks) {
+      printf("Task graph has a cycle, only %d of %d tasks can run!\n", reachable, num_tasks);
+      throw invalid_argument("Task graph has a cycle!");
+   }
+
+   auto state = make_shared<TaskGraphRun>(num_tasks);
+   for(TaskId i = 0; i < num_tasks; i++) {
+      state->remaining[i] = this->nodes[i].num_predecessors;
+   }
+   state->finished = 0;
+   state->failed = false;
+
+   // Runs one task, then queues every successor it was the last
+   // predecessor of
+   Scheduler* sched = &scheduler;
+   const vector<Node>* nodes = &this->nodes;
+   shared_ptr<function<void(TaskId)>> execute = make_shared<function<void(TaskId)>>();
+   weak_ptr<function<void(TaskId)>> weak_execute = execute;
+   *execute = [state, sched, nodes, num_tasks, weak_execute](TaskId id) {
+      if(!state->failed) {
+         try {
+            (*nodes)[id].task();
+         } catch(...) {
+            lock_guard<mutex> guard(state->error_lock);
+            if(!state->error) state->error = current_exception();
+            state->failed = true;
+         }
+      }
+      auto execute = weak_execute.lock();
+      for(TaskId next : (*nodes)[id].successors) {
+         if(--state->remaining[next] == 0 && execute) {
+            sched->spawn([execute, next]() {(*execute)(next);});
+         }
+      }
+      if(++state->finished == num_tasks) {
+         sched->notify_waiters();
+      }
+   };
+
+   for(TaskId root : roots) {
+      scheduler.spawn([execute, root]() {(*execute)(root);});
+   }
+   scheduler.help_until([&state, num_tasks]() {return state->finished == num_tasks;});
+
+   if(state->error) {
+      rethrow_exception(state->error);
+   }
+}
+
+// Default Scheduler ----------------------------------------------------------
+static shared_ptr<Scheduler>& default_scheduler_ref() {
+   static shared_ptr<Scheduler> scheduler;
+   return scheduler;
+}
+
+static mutex default_scheduler_lock;
+
+shared_ptr<Scheduler> default_scheduler() {
+   lock_guard<mutex> guard(default_scheduler_lock);
+   shared_ptr<Scheduler>& scheduler = default_scheduler_ref();
+   if(scheduler == nullptr) {
+      scheduler = make_shared<Scheduler>();
+   }
+   return scheduler;
+}
+
+void set_default_scheduler(shared_ptr<Scheduler> scheduler) {
+   lock_guard<mutex> guard(default_scheduler_lock);
+   default_scheduler_ref() = scheduler;
+}
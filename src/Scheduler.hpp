@@ -0,0 +1,150 @@
+
+#ifndef SCHEDULER_HPP
+#define SCHEDULER_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+/* Work-stealing task scheduler
+ *
+ * Every worker owns a deque of tasks. Tasks spawned from a worker go on the
+ * back of its own deque and it takes work from the back (most recent first,
+ * which keeps caches warm), while idle workers steal from the front of
+ * other deques (oldest first, usually the biggest pieces of work). Tasks
+ * submitted from outside the pool go into a shared queue.
+ *
+ * Threads that wait on the scheduler (parallel_for, TaskGraph::run, wait)
+ * run queued tasks while they wait, so waiting from inside a task can't
+ * deadlock the pool.
+ *
+ * One process wide scheduler is returned by default_scheduler(), everything
+ * in the project that runs concurrently should submit to it rather than
+ * start threads of its own.
+ */
+class Scheduler {
+public:
+   // 0 workers means one per hardware thread, less one for the thread that
+   // submits the work. Pinned workers are each bound to their own core.
+   Scheduler(unsigned int num_workers = 0, bool pin_workers = false);
+   virtual ~Scheduler();
+
+   Scheduler(const Scheduler&) = delete;
+   Scheduler& operator=(const Scheduler&) = delete;
+
+   // Queues a task without a way to wait on it
+   void spawn(std::function<void()> task);
+
+   // Queues func, the future holds its result or the exception it threw
+   template<typename F>
+   std::future<typename std::result_of<F()>::type> submit(F func);
+
+   // Blocks until future is ready, running other tasks in the meantime
+   template<typename T>
+   void wait(const std::future<T>& future);
+
+   /* Calls body(chunk_begin, chunk_end) for consecutive chunks of at most
+    * grain items covering [begin, end), spread across the workers and the
+    * calling thread. Chunk boundaries only depend on begin, end and grain.
+    * Returns once every chunk has run, rethrowing the first exception.
+    */
+   void parallel_for(size_t begin, size_t end, size_t grain,
+                     const std::function<void(size_t, size_t)>& body);
+
+   unsigned int get_num_workers() const;
+   bool get_pin_workers() const;
+
+   // Whether the calling thread is one of this scheduler's workers
+   bool is_worker_thread() const;
+
+private:
+   friend class TaskGraph;
+
+   struct Worker {
+      std::mutex lock;
+      std::deque<std::function<void()>> tasks;
+      std::thread thread;
+   };
+
+   std::vector<std::unique_ptr<Worker>> workers;
+   bool pin_workers;
+
+   // Tasks from threads outside the pool
+   std::mutex inject_lock;
+   std::deque<std::function<void()>> injected;
+
+   // Idle workers sleep here until there is something to do
+   std::mutex sleep_lock;
+   std::condition_variable wake;
+   std::atomic<unsigned int> pending;
+   std::atomic<bool> stopping;
+
+   void push(std::function<void()> task);
+   bool pop(int self, std::function<void()>& task);
+   bool run_one();
+   void help_until(const std::function<bool()>& done);
+   void notify_waiters();
+   void worker_loop(unsigned int index);
+};
+
+/* Tasks with dependencies between them. A task only starts once everything
+ * that has to precede it has finished, tasks without a path between them
+ * run in parallel.
+ */
+class TaskGraph {
+public:
+   typedef unsigned int TaskId;
+
+   TaskId add(std::function<void()> task);
+
+   // after won't start until before has finished
+   void precede(TaskId before, TaskId after);
+
+   // Runs the whole graph, blocking until it is done. Throws if there is a
+   // cycle and rethrows the first exception a task threw, no further tasks
+   // are started once one has failed.
+   void run(Scheduler& scheduler);
+
+   unsigned int get_num_tasks() const;
+
+private:
+   struct Node {
+      std::function<void()> task;
+      std::vector<TaskId> successors;
+      unsigned int num_predecessors = 0;
+   };
+
+   std::vector<Node> nodes;
+};
+
+// The shared scheduler, created on first use with the default settings
+std::shared_ptr<Scheduler> default_scheduler();
+void set_default_scheduler(std::shared_ptr<Scheduler> scheduler);
+
+
+// Template Definitions -------------------------------------------------------
+template<typename F>
+std::future<typename std::result_of<F()>::type> Scheduler::submit(F func) {
+   typedef typename std::result_of<F()>::type Result;
+   auto task = std::make_shared<std::packaged_task<Result()>>(std::move(func));
+   std::future<Result> future = task->get_future();
+   this->spawn([task]() {(*task)();});
+   return future;
+}
+
+template<typename T>
+void Scheduler::wait(const std::future<T>& future) {
+   this->help_until([&future]() {
+      return future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+   });
+}
+
+#endif
+
@@ -0,0 +1,427 @@
+
+#include "SparseMatrix.hpp"
+#include "Scheduler.hpp"
+#include <algorithm>
+
+#if HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+// Construction ---------------------------------------------------------------
+SparseMatrix::SparseMatrix() : rows(0), cols(0) {}
+
+SparseMatrix::SparseMatrix(const Matrix& dense) {
+   this->rows = dense.get_rows();
+   this->cols = dense.get_cols();
+   this->row_ptr.reserve(this->rows + 1);
+   this->row_ptr.push_back(0);
+   for(unsigned int y = 0; y < this->rows; y++) {
+      const float* row = dense.row_data(y);
+      for(unsigned int x = 0; x < this->cols; x++) {
+         if(row[x] != 0.0f) {
+            this->col_idx.push_back(x);
+            this->values.push_back(row[x]);
+         }
+      }
+      this->row_ptr.push_back((uint32_t)this->values.size());
+   }
+}
+
+shared_ptr<SparseMatrix> SparseMatrix::transpose_of(const Matrix& dense) {
+   shared_ptr<SparseMatrix> sparse(new SparseMatrix());
+   unsigned int rows = dense.get_cols();
+   unsigned int cols = dense.get_rows();
+   sparse->rows = rows;
+   sparse->cols = cols;
+
+   // Count each row of the transpose first, then fill them in order
+   vector<uint32_t> counts(rows + 1, 0);
+   for(unsigned int p = 0; p < cols; p++) {
+      const float* row = dense.row_data(p);
+      for(unsigned int j = 0; j < rows; j++) {
+         if(row[j] != 0.0f) counts[j + 1]++;
+      }
+   }
+   for(unsigned int j = 0; j < rows; j++) counts[j + 1] += counts[j];
+   sparse->row_ptr = counts;
+   sparse->col_idx.resize(counts[rows]);
+   sparse->values.resize(counts[rows]);
+
+   for(unsigned int p = 0; p < cols; p++) {
+      const float* row = dense.row_data(p);
+      for(unsigned int j = 0; j < rows; j++) {
+         if(row[j] != 0.0f) {
+            uint32_t at = counts[j]++;
+            sparse->col_idx[at] = p;
+            sparse->values[at] = row[j];
+         }
+      }
+   }
+   return sparse;
+}
+
+SparseMatrix::~SparseMatrix() {}
+
+// Matrix Info ----------------------------------------------------------------
+unsigned int SparseMatrix::get_rows() const {
+   return this->rows;
+}
+
+unsigned int SparseMatrix::get_cols() const {
+   return this->cols;
+}
+
+unsigned int SparseMatrix::get_nnz() const {
+   return (unsigned int)this->values.size();
+}
+
+float SparseMatrix::get_density() const {
+   size_t size = (size_t)this->rows * this->cols;
+   return size ? (float)this->values.size() / size : 0.0f;
+}
+
+const uint32_t* SparseMatrix::get_row_ptr() const {
+   return this->row_ptr.data();
+}
+
+const uint32_t* SparseMatrix::get_col_idx() const {
+   return this->col_idx.data();
+}
+
+const float* SparseMatrix::get_values() const {
+   return this->values.data();
+}
+
+shared_ptr<Matrix> SparseMatrix::to_dense() const {
+   auto dense = make_shared<Matrix>(this->rows, this->cols);
+   for(unsigned int y = 0; y < this->rows; y++) {
+      float* row = dense->row_data(y);
+      for(uint32_t e = this->row_ptr[y]; e < this->row_ptr[y + 1]; e++) {
+         row[this->col_idx[e]] = this->values[e];
+      }
+   }
+   return dense;
+}
+
+shared_ptr<Matrix> SparseMatrix::transpose_to_dense() const {
+   auto dense = make_shared<Matrix>(this->cols, this->rows);
+   for(unsigned int y = 0; y < this->rows; y++) {
+      for(uint32_t e = this->row_ptr[y]; e < this->row_ptr[y + 1]; e++) {
+         dense->row_data(this->col_idx[e])[y] = this->values[e];
+      }
+   }
+   return dense;
+}
+
+bool SparseMatrix::assign_transpose(const Matrix& dense) {
+   if(dense.get_rows() != this->cols || dense.get_cols() != this->rows) return false;
+
+   // Same number of non-zeros, all of them where the stored ones are
+   size_t nnz = 0;
+   for(unsigned int p = 0; p < this->cols; p++) {
+      const float* row = dense.row_data(p);
+      for(unsigned int j = 0; j < this->rows; j++) nnz += row[j] != 0.0f;
+   }
+   if(nnz != this->values.size()) return false;
+   for(unsigned int j = 0; j < this->rows; j++) {
+      for(uint32_t e = this->row_ptr[j]; e < this->row_ptr[j + 1]; e++) {
+         if(dense.row_data(this->col_idx[e])[j] == 0.0f) return false;
+      }
+   }
+
+   for(unsigned int j = 0; j < this->rows; j++) {
+      for(uint32_t e = this->row_ptr[j]; e < this->row_ptr[j + 1]; e++) {
+         this->values[e] = dense.row_data(this->col_idx[e])[j];
+      }
+   }
+   return true;
+}
+
+float matrix_density(const Matrix& mat, unsigned int logical_size) {
+   size_t nnz = 0;
+   for(unsigned int y = 0; y < mat.get_rows(); y++) {
+      const float* row = mat.row_data(y);
+      for(unsigned int x = 0; x < mat.get_cols(); x++) {
+         nnz += row[x] != 0.0f;
+      }
+   }
+   return logical_size ? (float)nnz / logical_size : 0.0f;
+}
+
+// Scalar ---------------------------------------------------------------------
+static void sparse_gemv_scalar(const SparseMatrix& wt, const float* x,
+                               float* y, const GemmEpilogue* epilogue) {
+   const uint32_t* row_ptr = wt.get_row_ptr();
+   const uint32_t* col_idx = wt.get_col_idx();
+   const float* values = wt.get_values();
+   unsigned int n = wt.get_rows();
+   for(unsigned int j = 0; j < n; j++) {
+      float acc = 0.0f;
+      for(uint32_t e = row_ptr[j]; e < row_ptr[j + 1]; e++) {
+         acc += x[col_idx[e]] * values[e];
+      }
+      y[j] = acc;
+   }
+   if(epilogue) apply_epilogue(epilogue, 0, y, n);
+}
+
+#if HAVE_X86_SIMD
+// AVX2 -----------------------------------------------------------------------
+__attribute__((target("avx2,fma")))
+static float hsum_avx2(__m256 v) {
+   __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+   sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+   sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+   return _mm_cvtss_f32(sum);
+}
+
+// x is gathered 8 non-zeros at a time, two chains to hide the FMA latency
+__attribute__((target("avx2,fma")))
+static void sparse_gemv_avx2(const SparseMatrix& wt, const float* x,
+                             float* y, const GemmEpilogue* epilogue) {
+   const uint32_t* row_ptr = wt.get_row_ptr();
+   const uint32_t* col_idx = wt.get_col_idx();
+   const float* values = wt.get_values();
+   unsigned int n = wt.get_rows();
+   for(unsigned int j = 0; j < n; j++) {
+      uint32_t e = row_ptr[j];
+      const uint32_t end = row_ptr[j + 1];
+      __m256 acc0 = _mm256_setzero_ps();
+      __m256 acc1 = _mm256_setzero_ps();
+      for(; e + 16 <= end; e += 16) {
+         __m256i idx0 = _mm256_loadu_si256((const __m256i*)(col_idx + e));
+         __m256i idx1 = _mm256_loadu_si256((const __m256i*)(col_idx + e + 8));
+         acc0 = _mm256_fmadd_ps(_mm256_i32gather_ps(x, idx0, 4), _mm256_loadu_ps(values + e), acc0);
+         acc1 = _mm256_fmadd_ps(_mm256_i32gather_ps(x, idx1, 4), _mm256_loadu_ps(values + e + 8), acc1);
+      }
+      for(; e + 8 <= end; e += 8) {
+         __m256i idx = _mm256_loadu_si256((const __m256i*)(col_idx + e));
+         acc0 = _mm256_fmadd_ps(_mm256_i32gather_ps(x, idx, 4), _mm256_loadu_ps(values + e), acc0);
+      }
+      float acc = hsum_avx2(_mm256_add_ps(acc0, acc1));
+      for(; e < end; e++) acc += x[col_idx[e]] * values[e];
+      y[j] = acc;
+   }
+   if(epilogue) apply_epilogue(epilogue, 0, y, n);
+}
+
+// AVX-512 --------------------------------------------------------------------
+// Sixteen at a time, the tail of each row goes through a masked gather
+__attribute__((target("avx512f")))
+static void sparse_gemv_avx512(const SparseMatrix& wt, const float* x,
+                               float* y, const GemmEpilogue* epilogue) {
+   const uint32_t* row_ptr = wt.get_row_ptr();
+   const uint32_t* col_idx = wt.get_col_idx();
+   const float* values = wt.get_values();
+   unsigned int n = wt.get_rows();
+   for(unsigned int j = 0; j < n; j++) {
+      uint32_t e = row_ptr[j];
+      const uint32_t end = row_ptr[j + 1];
+      __m512 acc0 = _mm512_setzero_ps();
+      __m512 acc1 = _mm512_setzero_ps();
+      for(; e + 32 <= end; e += 32) {
+         __m512i idx0 = _mm512_loadu_si512(col_idx + e);
+         __m512i idx1 = _mm512_loadu_si512(col_idx + e + 16);
+         acc0 = _mm512_fmadd_ps(_mm512_i32gather_ps(idx0, x, 4), _mm512_loadu_ps(values + e), acc0);
+         acc1 = _mm512_fmadd_ps(_mm512_i32gather_ps(idx1, x, 4), _mm512_loadu_ps(values + e + 16), acc1);
+      }
+      while(e < end) {
+         unsigned int len = end - e < 16 ? end - e : 16;
+         const __mmask16 mask = (__mmask16)((1u << len) - 1);
+         __m512i idx = _mm512_maskz_loadu_epi32(mask, col_idx + e);
+         __m512 xv = _mm512_mask_i32gather_ps(_mm512_setzero_ps(), mask, idx, x, 4);
+         acc0 = _mm512_fmadd_ps(xv, _mm512_maskz_loadu_ps(mask, values + e), acc0);
+         e += len;
+      }
+      y[j] = _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+   }
+   if(epilogue) apply_epilogue(epilogue, 0, y, n);
+}
+#endif
+
+// Dispatch -------------------------------------------------------------------
+SparseGemvKernel sparse_gemv_kernel(SimdLevel level) {
+#if HAVE_X86_SIMD
+   switch(level) {
+      case SIMD_AVX512: return sparse_gemv_avx512;
+      case SIMD_AVX2: return sparse_gemv_avx2;
+      default: break;
+   }
+#endif
+   return sparse_gemv_scalar;
+}
+
+void sparse_gemv(const SparseMatrix& wt, const float* x,
+                 float* y, const GemmEpilogue* epilogue) {
+   static const SparseGemvKernel kernel = sparse_gemv_kernel(cpu_simd_level());
+   kernel(wt, x, y, epilogue);
+}
+
+// Batches ---------------------------------------------------------------------
+/* Y^T = W^T . X^T a block of SPARSE_GEMM_MB rows of X at a time. The block
+ * is transposed so that each of its inputs is a contiguous row of MB
+ * values, and every non-zero weight becomes a broadcast FMA into the MB
+ * sums of its output, with no gathers at all.
+ */
+typedef void (*SparseBlockKernel)(const SparseMatrix& wt, unsigned int j0, unsigned int j1,
+                                  const float* xt, unsigned int rows,
+                                  float* y, unsigned int ldy);
+
+static void sparse_block_scalar(const SparseMatrix& wt, unsigned int j0, unsigned int j1,
+                                const float* xt, unsigned int rows,
+                                float* y, unsigned int ldy) {
+   const uint32_t* row_ptr = wt.get_row_ptr();
+   const uint32_t* col_idx = wt.get_col_idx();
+   const float* values = wt.get_values();
+   for(unsigned int j = j0; j < j1; j++) {
+      float acc[SPARSE_GEMM_MB] = {};
+      for(uint32_t e = row_ptr[j]; e < row_ptr[j + 1]; e++) {
+         const float* xr = xt + (size_t)col_idx[e] * SPARSE_GEMM_MB;
+         for(unsigned int i = 0; i < SPARSE_GEMM_MB; i++) acc[i] += values[e] * xr[i];
+      }
+      for(unsigned int i = 0; i < rows; i++) y[(size_t)i * ldy + j] = acc[i];
+   }
+}
+
+#if HAVE_X86_SIMD
+__attribute__((target("avx2,fma")))
+static void sparse_block_avx2(const SparseMatrix& wt, unsigned int j0, unsigned int j1,
+                              const float* xt, unsigned int rows,
+                              float* y, unsigned int ldy) {
+   const uint32_t* row_ptr = wt.get_row_ptr();
+   const uint32_t* col_idx = wt.get_col_idx();
+   const float* values = wt.get_values();
+   alignas(32) float acc[SPARSE_GEMM_MB];
+   for(unsigned int j = j0; j < j1; j++) {
+      __m256 c0 = _mm256_setzero_ps(), c1 = _mm256_setzero_ps();
+      __m256 c2 = _mm256_setzero_ps(), c3 = _mm256_setzero_ps();
+      for(uint32_t e = row_ptr[j]; e < row_ptr[j + 1]; e++) {
+         const float* xr = xt + (size_t)col_idx[e] * SPARSE_GEMM_MB;
+         __m256 w = _mm256_broadcast_ss(values + e);
+         c0 = _mm256_fmadd_ps(w, _mm256_load_ps(xr), c0);
+         c1 = _mm256_fmadd_ps(w, _mm256_load_ps(xr + 8), c1);
+         c2 = _mm256_fmadd_ps(w, _mm256_load_ps(xr + 16), c2);
+         c3 = _mm256_fmadd_ps(w, _mm256_load_ps(xr + 24), c3);
+      }
+      _mm256_store_ps(acc, c0);
+      _mm256_store_ps(acc + 8, c1);
+      _mm256_store_ps(acc + 16, c2);
+      _mm256_store_ps(acc + 24, c3);
+      for(unsigned int i = 0; i < rows; i++) y[(size_t)i * ldy + j] = acc[i];
+   }
+}
+
+__attribute__((target("avx512f")))
+static void sparse_block_avx512(const SparseMatrix& wt, unsigned int j0, unsigned int j1,
+                                const float* xt, unsigned int rows,
+                                float* y, unsigned int ldy) {
+   const uint32_t* row_ptr = wt.get_row_ptr();
+   const uint32_t* col_idx = wt.get_col_idx();
+   const float* values = wt.get_values();
+   alignas(64) float acc[SPARSE_GEMM_MB];
+   for(unsigned int j = j0; j < j1; j++) {
+      __m512 c0 = _mm512_setzero_ps(), c1 = _mm512_setzero_ps();
+      for(uint32_t e = row_ptr[j]; e < row_ptr[j + 1]; e++) {
+         const float* xr = xt + (size_t)col_idx[e] * SPARSE_GEMM_MB;
+         __m512 w = _mm512_set1_ps(values[e]);
+         c0 = _mm512_fmadd_ps(w, _mm512_load_ps(xr), c0);
+         c1 = _mm512_fmadd_ps(w, _mm512_load_ps(xr + 16), c1);
+      }
+      _mm512_store_ps(acc, c0);
+      _mm512_store_ps(acc + 16, c1);
+      for(unsigned int i = 0; i < rows; i++) y[(size_t)i * ldy + j] = acc[i];
+   }
+}
+#endif
+
+static SparseBlockKernel sparse_block_kernel(SimdLevel level) {
+#if HAVE_X86_SIMD
+   switch(level) {
+      case SIMD_AVX512: return sparse_block_avx512;
+      case SIMD_AVX2: return sparse_block_avx2;
+      default: break;
+   }
+#endif
+   return sparse_block_scalar;
+}
+
+// Each thread keeps its transposed block around between calls
+struct TransposeBuffer {
+   shared_ptr<float> buffer;
+   size_t size = 0;
+
+   float* get(size_t needed) {
+      if(needed > size) {
+         buffer = matrix_alloc(needed);
+         size = needed;
+      }
+      return buffer.get();
+   }
+};
+
+static thread_local TransposeBuffer transpose_buffer;
+
+// Rows i0 .. i0 + rows of X into MB wide rows, padded with zeros
+static void transpose_block(const float* x, unsigned int ldx, unsigned int rows,
+                            unsigned int k, float* xt) {
+   for(unsigned int p = 0; p < k; p++) {
+      float* out = xt + (size_t)p * SPARSE_GEMM_MB;
+      for(unsigned int i = 0; i < rows; i++) out[i] = x[(size_t)i * ldx + p];
+      for(unsigned int i = rows; i < SPARSE_GEMM_MB; i++) out[i] = 0.0f;
+   }
+}
+
+void sparse_gemm(unsigned int m, const float* x, unsigned int ldx,
+                 const SparseMatrix& wt, float* y, unsigned int ldy,
+                 const GemmEpilogue* epilogue) {
+   static const SparseGemvKernel gemv = sparse_gemv_kernel(cpu_simd_level());
+   static const SparseBlockKernel block = sparse_block_kernel(cpu_simd_level());
+   unsigned int n = wt.get_rows();
+   unsigned int k = wt.get_cols();
+
+   // Too few rows to pay for the transpose
+   if(m < SPARSE_GEMM_MIN_ROWS) {
+      for(unsigned int i = 0; i < m; i++) {
+         gemv(wt, x + (size_t)i * ldx, y + (size_t)i * ldy, epilogue);
+      }
+      return;
+   }
+
+   // A grid of row blocks by output ranges, split like gemm's when there
+   // is enough work
+   unsigned int row_parts = (m + SPARSE_GEMM_MB - 1) / SPARSE_GEMM_MB;
+   unsigned int col_parts = 1;
+   unsigned long work = (unsigned long)m * max(1u, wt.get_nnz());
+   unsigned int threads = gemm_get_num_threads();
+   if(work >= gemm_get_parallel_threshold() && row_parts < threads) {
+      col_parts = min((threads + row_parts - 1) / row_parts, max(1u, n / 64));
+   }
+   unsigned int tile_n = (n + col_parts - 1) / col_parts;
+
+   auto task = [&](size_t t) {
+      unsigned int i0 = (unsigned int)(t / col_parts) * SPARSE_GEMM_MB;
+      unsigned int j0 = (unsigned int)(t % col_parts) * tile_n;
+      if(j0 >= n) return;
+      unsigned int rows = min(SPARSE_GEMM_MB, m - i0);
+      unsigned int j1 = min(n, j0 + tile_n);
+      float* xt = transpose_buffer.get((size_t)k * SPARSE_GEMM_MB);
+      transpose_block(x + (size_t)i0 * ldx, ldx, rows, k, xt);
+      block(wt, j0, j1, xt, rows, y + (size_t)i0 * ldy, ldy);
+      if(epilogue) {
+         for(unsigned int i = 0; i < rows; i++) {
+            apply_epilogue(epilogue, j0, y + (size_t)(i0 + i) * ldy + j0, j1 - j0);
+         }
+      }
+   };
+
+   unsigned int parts = row_parts * col_parts;
+   if(parts == 1 || work < gemm_get_parallel_threshold()) {
+      for(unsigned int t = 0; t < parts; t++) task(t);
+      return;
+   }
+   default_scheduler()->parallel_for(0, parts, 1, [&](size_t begin, size_t end) {
+      for(size_t t = begin; t < end; t++) task(t);
+   });
+}
@@ -0,0 +1,98 @@
+
+#ifndef SPARSEMATRIX_HPP
+#define SPARSEMATRIX_HPP
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "Matrix.hpp"
+#include "Gemm.hpp"
+#include "CpuFeatures.hpp"
+
+// Weights with at most this fraction of non-zeros are stored sparse when a
+// layer is built. Around here the gathers of the sparse kernels start to
+// beat streaming every zero through the dense ones.
+#define SPARSE_DENSITY_THRESHOLD 0.3f
+
+// Batches are multiplied SPARSE_GEMM_MB rows at a time, smaller ones than
+// SPARSE_GEMM_MIN_ROWS one row at a time
+#define SPARSE_GEMM_MB 32u
+#define SPARSE_GEMM_MIN_ROWS 4u
+
+/* Compressed sparse row matrix
+ *
+ * Only the non-zero values are kept, row after row, with the column of
+ * each one next to it and row_ptr[y] .. row_ptr[y + 1] the range of row y.
+ * Exact zeros are dropped, everything else is kept as it is.
+ *
+ * Layers store the CSR of their transposed (n x k) weights, one row per
+ * output neuron, which is the CSC of the logical (k x n) weights. Each
+ * output is then a dot product of x with that neuron's non-zeros.
+ */
+class SparseMatrix {
+public:
+   // CSR of dense
+   SparseMatrix(const Matrix& dense);
+   // CSR of dense's transpose
+   static std::shared_ptr<SparseMatrix> transpose_of(const Matrix& dense);
+   virtual ~SparseMatrix();
+
+   unsigned int get_rows() const;
+   unsigned int get_cols() const;
+   unsigned int get_nnz() const;
+   float get_density() const;
+
+   const uint32_t* get_row_ptr() const;
+   const uint32_t* get_col_idx() const;
+   const float* get_values() const;
+
+   std::shared_ptr<Matrix> to_dense() const;
+   // The dense transpose, i.e. the logical weights of a layer
+   std::shared_ptr<Matrix> transpose_to_dense() const;
+
+   // Overwrites the values with those of dense's transpose when it has its
+   // non-zeros in exactly the same places. Returns false and leaves the
+   // matrix as it was otherwise.
+   bool assign_transpose(const Matrix& dense);
+
+private:
+   SparseMatrix();
+
+   unsigned int rows, cols;
+   std::vector<uint32_t> row_ptr;
+   std::vector<uint32_t> col_idx;
+   std::vector<float> values;
+};
+
+// Non-zeros over all values, whatever the padding of the stored matrix
+float matrix_density(const Matrix& mat, unsigned int logical_size);
+
+/* Sparse weights kernels, W given as the CSR of its transpose (n x k)
+ *
+ *    y (1 x n) = x (1 x k) . W
+ *
+ * The epilogue is applied to y once it's all written.
+ */
+typedef void (*SparseGemvKernel)(const SparseMatrix& wt, const float* x,
+                                 float* y, const GemmEpilogue* epilogue);
+
+void sparse_gemv(const SparseMatrix& wt, const float* x,
+                 float* y, const GemmEpilogue* epilogue = nullptr);
+
+// The kernel for a specific instruction set, falling back to the next best
+// one when this build can't provide it
+SparseGemvKernel sparse_gemv_kernel(SimdLevel level);
+
+/* Y (m x n) = X (m x k) . W
+ *
+ * Blocks of rows of X are transposed so every non-zero weight multiplies
+ * a contiguous row of inputs from the whole block, which vectorizes far
+ * better than gathering inputs one sample at a time. Batches with enough
+ * work (see gemm_set_parallel_threshold) are split across the default
+ * scheduler like gemm's.
+ */
+void sparse_gemm(unsigned int m, const float* x, unsigned int ldx,
+                 const SparseMatrix& wt, float* y, unsigned int ldy,
+                 const GemmEpilogue* epilogue = nullptr);
+
+#endif
@@ -0,0 +1,103 @@
+
+#ifndef STATICMATRIX_HPP
+#define STATICMATRIX_HPP
+
+#include <initializer_list>
+#include <algorithm>
+#include <cstdio>
+
+/* Fixed size counterpart to Matrix for shapes known at compile time.
+ *
+ * The elements live inline (no heap, no shared_ptr) and every loop has a
+ * compile time trip count, so for small shapes the compiler unrolls the
+ * kernels completely. All operations are constexpr and can be evaluated at
+ * compile time when their inputs are constants.
+ *
+ * Indexing matches Matrix: at(x, y) is column x of row y.
+ */
+template<unsigned int R, unsigned int C>
+class StaticMatrix {
+public:
+   static constexpr unsigned int rows = R;
+   static constexpr unsigned int cols = C;
+   static constexpr unsigned int size = R * C;
+
+   constexpr StaticMatrix() : data() {}
+
+   constexpr StaticMatrix(std::initializer_list<float> values) : data() {
+      unsigned int i = 0;
+      for(auto it = values.begin(); it != values.end() && i < size; ++it) {
+         data[i++] = *it;
+      }
+   }
+
+   constexpr unsigned int get_rows() const {return R;}
+   constexpr unsigned int get_cols() const {return C;}
+   constexpr unsigned int get_size() const {return size;}
+
+   constexpr float at(unsigned int x, unsigned int y) const {return data[y * C + x];}
+   constexpr float at(unsigned int i) const {return data[i];}
+   constexpr void set(unsigned int x, unsigned int y, float val) {data[y * C + x] = val;}
+   constexpr void set(unsigned int i, float val) {data[i] = val;}
+
+   float* get_data() {return data;}
+   const float* get_data() const {return data;}
+
+   constexpr StaticMatrix<R,C> add(const StaticMatrix<R,C>& other) const {
+      StaticMatrix<R,C> result;
+      for(unsigned int i = 0; i < size; i++) {
+         result.data[i] = data[i] + other.data[i];
+      }
+      return result;
+   }
+
+   template<unsigned int N>
+   constexpr StaticMatrix<R,N> dot(const StaticMatrix<C,N>& other) const {
+      StaticMatrix<R,N> result;
+      for(unsigned int y = 0; y < R; y++) {
+         for(unsigned int i = 0; i < C; i++) {
+            const float a_val = data[y * C + i];
+            for(unsigned int x = 0; x < N; x++) {
+               result.set(x, y, result.at(x, y) + a_val * other.at(x, i));
+            }
+         }
+      }
+      return result;
+   }
+
+   constexpr StaticMatrix<R,C> apply(float (*func)(float)) const {
+      StaticMatrix<R,C> result;
+      for(unsigned int i = 0; i < size; i++) {
+         result.data[i] = func(data[i]);
+      }
+      return result;
+   }
+
+   constexpr StaticMatrix<R,C> relu() const {
+      StaticMatrix<R,C> result;
+      for(unsigned int i = 0; i < size; i++) {
+         result.data[i] = data[i] > 0.0f ? data[i] : 0.0f;
+      }
+      return result;
+   }
+
+   void print(const char* name = 0) const {
+      if(name) {
+         printf("%s = ", name);
+      }
+      printf(" (%d,%d) [\n", R, C);
+      for(unsigned int y = 0; y < R; ++y) {
+         for(unsigned int x = 0; x < C; ++x) {
+            printf("%- 5.2f ", at(x,y));
+         }
+         printf("\n");
+      }
+      printf("];\n");
+   }
+
+private:
+   float data[size > 0 ? size : 1];
+};
+
+#endif
+
@@ -0,0 +1,191 @@
+
+#ifndef STATICNETWORK_HPP
+#define STATICNETWORK_HPP
+
+#include <memory>
+#include <vector>
+#include <stdexcept>
+#include <cstdio>
+#include <cmath>
+#include "Activation.hpp"
+#include "StaticMatrix.hpp"
+#include "Network.hpp"
+
+/* Fixed topology networks built on StaticMatrix.
+ *
+ * StaticNetwork<Act, In, Layers...> takes In inputs and has one dense layer
+ * per entry in Layers, all with activation Act, e.g.
+ * StaticNetwork<ACT_RELU,2,2,1> is the XOR network. The whole network lives
+ * inline in the object and compute() makes no allocations.
+ *
+ * The activation is part of the type and runs inline, so compute() has no
+ * indirect calls and is constexpr. Networks with identity, relu or leaky
+ * relu activations can be evaluated at compile time, sigmoid and tanh need
+ * exp and only run at run time. Only the built-in activations can be used,
+ * registered ones don't have an id until run time.
+ *
+ * Weights are loaded from an equivalent dynamic Network with from_network()
+ * and can be turned back into one with to_network().
+ */
+
+// Activations ----------------------------------------------------------------
+// The scalar forms of Activation.hpp, inline for a fixed activation
+template<Activation Act>
+struct StaticActivation {
+   static_assert(Act >= 0 && Act < NUM_BUILTIN_ACTIVATIONS,
+                 "Static networks only support the built-in activations");
+};
+
+template<>
+struct StaticActivation<ACT_IDENTITY> {
+   static constexpr float apply(float x) {return x;}
+};
+
+template<>
+struct StaticActivation<ACT_RELU> {
+   static constexpr float apply(float x) {return x > 0.0f ? x : 0.0f;}
+};
+
+template<>
+struct StaticActivation<ACT_LEAKY_RELU> {
+   static constexpr float apply(float x) {return x > 0.0f ? x : LEAKY_RELU_SLOPE * x;}
+};
+
+template<>
+struct StaticActivation<ACT_SIGMOID> {
+   static float apply(float x) {return 1.0f / (1.0f + std::exp(-x));}
+};
+
+template<>
+struct StaticActivation<ACT_TANH> {
+   static float apply(float x) {return std::tanh(x);}
+};
+
+// Single Layer ---------------------------------------------------------------
+template<unsigned int In, unsigned int Out, Activation Act>
+struct StaticLayer {
+   static constexpr Activation activation = Act;
+
+   StaticMatrix<In,Out> weights;
+   StaticMatrix<1,Out> biases;
+
+   constexpr StaticMatrix<1,Out> compute(const StaticMatrix<1,In>& input) const {
+      StaticMatrix<1,Out> output = input.dot(weights).add(biases);
+      for(unsigned int x = 0; x < Out; x++) {
+         output.set(x, StaticActivation<Act>::apply(output.at(x)));
+      }
+      return output;
+   }
+
+   void load(const Network& net, unsigned int layer_num) {
+      auto layer_weights = net.get_layer_weights(layer_num);
+      auto layer_biases = net.get_layer_biases(layer_num);
+      if(layer_weights->get_rows() != In || layer_weights->get_cols() != Out) {
+         printf("Network layer %d does not match the static network!\n", layer_num);
+         printf("Got (%d , %d) expected (%d , %d)\n", layer_weights->get_rows(),
+                layer_weights->get_cols(), In, Out);
+         throw std::invalid_argument("Network layer does not match the static network!");
+      }
+      Activation layer_act = net.get_layer_activation(layer_num);
+      if(layer_act != Act) {
+         printf("Network layer %d does not match the static network!\n", layer_num);
+         printf("Got activation %s expected %s\n", activation_str(layer_act),
+                activation_str(Act));
+         throw std::invalid_argument("Network layer does not match the static network!");
+      }
+
+      for(unsigned int y = 0; y < In; y++) {
+         for(unsigned int x = 0; x < Out; x++) {
+            weights.set(x, y, layer_weights->at(x, y));
+         }
+      }
+      for(unsigned int x = 0; x < Out; x++) {
+         biases.set(x, layer_biases->at(x));
+      }
+   }
+};
+
+// Multi-Layer Network --------------------------------------------------------
+template<Activation Act, unsigned int In, unsigned int... Layers>
+class StaticNetwork;
+
+// No layers left, the input passes straight through
+template<Activation Act, unsigned int In>
+class StaticNetwork<Act, In> {
+public:
+   static constexpr unsigned int input_size = In;
+   static constexpr unsigned int output_size = In;
+   static constexpr unsigned int num_layers = 0;
+
+   constexpr StaticMatrix<1,In> compute(const StaticMatrix<1,In>& input) const {
+      return input;
+   }
+
+   void load(const Network& net, unsigned int layer_num) {}
+
+   void collect(std::vector<Layer>& layers) const {}
+};
+
+template<Activation Act, unsigned int In, unsigned int Out, unsigned int... Rest>
+class StaticNetwork<Act, In, Out, Rest...> {
+public:
+   typedef StaticNetwork<Act, Out, Rest...> Tail;
+   typedef StaticLayer<In, Out, Act> Head;
+
+   static constexpr unsigned int input_size = In;
+   static constexpr unsigned int output_size = Tail::output_size;
+   static constexpr unsigned int num_layers = Tail::num_layers + 1;
+
+   constexpr StaticMatrix<1,output_size> compute(const StaticMatrix<1,In>& input) const {
+      return tail.compute(layer.compute(input));
+   }
+
+   // Converting from / to a dynamic Network
+   static StaticNetwork from_network(const Network& net) {
+      if(net.get_input_size() != In || net.get_num_layers() != num_layers) {
+         printf("Network does not match the static network!\n");
+         printf("Got %d inputs and %d layers, expected %d inputs and %d layers\n",
+                net.get_input_size(), net.get_num_layers(), In, num_layers);
+         throw std::invalid_argument("Network does not match the static network!");
+      }
+      StaticNetwork static_net;
+      static_net.load(net, 0);
+      return static_net;
+   }
+
+   std::shared_ptr<Network> to_network() const {
+      std::vector<Layer> layers;
+      this->collect(layers);
+      return std::make_shared<Network>(In, layers);
+   }
+
+   constexpr Head& get_layer() {return layer;}
+   constexpr const Head& get_layer() const {return layer;}
+   constexpr Tail& get_tail() {return tail;}
+   constexpr const Tail& get_tail() const {return tail;}
+
+   void load(const Network& net, unsigned int layer_num) {
+      layer.load(net, layer_num);
+      tail.load(net, layer_num + 1);
+   }
+
+   void collect(std::vector<Layer>& layers) const {
+      layers.push_back(Layer(Out, In, activation_info(Act).func, layer.weights.get_data(),
+                             layer.biases.get_data()));
+      tail.collect(layers);
+   }
+
+private:
+   Head layer;
+   Tail tail;
+};
+
+// Static versions of the default networks ------------------------------------
+typedef StaticNetwork<ACT_RELU,2,2,1> StaticXorNetwork;        // XOR, OR
+typedef StaticNetwork<ACT_RELU,2,1> StaticAndNetwork;          // AND
+typedef StaticNetwork<ACT_RELU,1,1> StaticNotNetwork;          // NOT
+typedef StaticNetwork<ACT_SIGMOID,2,4,4,4,4> Static4x4Network; // *_4X4
+typedef StaticNetwork<ACT_SIGMOID,2,8,8,8,8,8,8,8,8> Static8x8Network; // SEEDED_8X8
+
+#endif
+
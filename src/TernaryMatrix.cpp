@@ -0,0 +1,466 @@
+
+#include "TernaryMatrix.hpp"
+#include "Scheduler.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <stdexcept>
+
+#if HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+// Construction ---------------------------------------------------------------
+TernaryMatrix::TernaryMatrix(unsigned int rows, unsigned int cols) {
+   this->rows = rows;
+   this->cols = cols;
+   this->words = (cols + TERNARY_WORD_BITS - 1) / TERNARY_WORD_BITS;
+   this->positive.assign((size_t)rows * this->words, 0);
+   this->negative.assign((size_t)rows * this->words, 0);
+}
+
+TernaryMatrix::TernaryMatrix(const Matrix& dense)
+   : TernaryMatrix(dense.get_rows(), dense.get_cols()) {
+   for(unsigned int y = 0; y < this->rows; y++) {
+      const float* row = dense.row_data(y);
+      for(unsigned int x = 0; x < this->cols; x++) this->set(y, x, row[x]);
+   }
+}
+
+shared_ptr<TernaryMatrix> TernaryMatrix::transpose_of(const Matrix& dense) {
+   shared_ptr<TernaryMatrix> ternary(new TernaryMatrix(dense.get_cols(), dense.get_rows()));
+   ternary->assign_transpose(dense);
+   return ternary;
+}
+
+TernaryMatrix::~TernaryMatrix() {}
+
+void TernaryMatrix::set(unsigned int row, unsigned int col, float value) {
+   size_t word = (size_t)row * this->words + col / TERNARY_WORD_BITS;
+   uint64_t bit = 1ull << (col % TERNARY_WORD_BITS);
+   if(value == 1.0f) {
+      this->positive[word] |= bit;
+   } else if(value == -1.0f) {
+      this->negative[word] |= bit;
+   } else if(value != 0.0f) {
+      printf("Ternary matrices only hold -1, 0 and 1, got %f at (%d,%d)\n", value, row, col);
+      throw invalid_argument("Value is not ternary!");
+   }
+}
+
+void TernaryMatrix::assign_transpose(const Matrix& dense) {
+   if(dense.get_rows() != this->cols || dense.get_cols() != this->rows) {
+      printf("Ternary matrix is (%d,%d), can't take the transpose of (%d,%d)\n",
+             this->rows, this->cols, dense.get_rows(), dense.get_cols());
+      throw invalid_argument("Ternary matrix has the wrong dimensions!");
+   }
+   if(!matrix_is_ternary(dense)) {
+      printf("Ternary matrices only hold -1, 0 and 1!\n");
+      throw invalid_argument("Value is not ternary!");
+   }
+   std::fill(this->positive.begin(), this->positive.end(), 0);
+   std::fill(this->negative.begin(), this->negative.end(), 0);
+   for(unsigned int p = 0; p < this->cols; p++) {
+      const float* row = dense.row_data(p);
+      for(unsigned int j = 0; j < this->rows; j++) this->set(j, p, row[j]);
+   }
+}
+
+// Matrix Info ----------------------------------------------------------------
+unsigned int TernaryMatrix::get_rows() const {
+   return this->rows;
+}
+
+unsigned int TernaryMatrix::get_cols() const {
+   return this->cols;
+}
+
+unsigned int TernaryMatrix::get_words() const {
+   return this->words;
+}
+
+size_t TernaryMatrix::get_bytes() const {
+   return (this->positive.size() + this->negative.size()) * sizeof(uint64_t);
+}
+
+const uint64_t* TernaryMatrix::get_positive(unsigned int row) const {
+   return this->positive.data() + (size_t)row * this->words;
+}
+
+const uint64_t* TernaryMatrix::get_negative(unsigned int row) const {
+   return this->negative.data() + (size_t)row * this->words;
+}
+
+static float ternary_value(uint64_t positive, uint64_t negative, unsigned int bit) {
+   if((positive >> bit) & 1) return 1.0f;
+   if((negative >> bit) & 1) return -1.0f;
+   return 0.0f;
+}
+
+shared_ptr<Matrix> TernaryMatrix::to_dense() const {
+   auto dense = make_shared<Matrix>(this->rows, this->cols);
+   for(unsigned int y = 0; y < this->rows; y++) {
+      const uint64_t* pos = this->get_positive(y);
+      const uint64_t* neg = this->get_negative(y);
+      float* row = dense->row_data(y);
+      for(unsigned int x = 0; x < this->cols; x++) {
+         unsigned int w = x / TERNARY_WORD_BITS;
+         row[x] = ternary_value(pos[w], neg[w], x % TERNARY_WORD_BITS);
+      }
+   }
+   return dense;
+}
+
+shared_ptr<Matrix> TernaryMatrix::transpose_to_dense() const {
+   auto dense = make_shared<Matrix>(this->cols, this->rows);
+   for(unsigned int y = 0; y < this->rows; y++) {
+      const uint64_t* pos = this->get_positive(y);
+      const uint64_t* neg = this->get_negative(y);
+      for(unsigned int x = 0; x < this->cols; x++) {
+         unsigned int w = x / TERNARY_WORD_BITS;
+         dense->row_data(x)[y] = ternary_value(pos[w], neg[w], x % TERNARY_WORD_BITS);
+      }
+   }
+   return dense;
+}
+
+bool matrix_is_ternary(const Matrix& mat) {
+   for(unsigned int y = 0; y < mat.get_rows(); y++) {
+      const float* row = mat.row_data(y);
+      for(unsigned int x = 0; x < mat.get_cols(); x++) {
+         if(row[x] != 0.0f && row[x] != 1.0f && row[x] != -1.0f) return false;
+      }
+   }
+   return true;
+}
+
+// Scalar ---------------------------------------------------------------------
+// Sum of x over the set bits of mask, x already offset to the word
+static float masked_sum(uint64_t mask, const float* x) {
+   float sum = 0.0f;
+   while(mask) {
+      sum += x[__builtin_ctzll(mask)];
+      mask &= mask - 1;
+   }
+   return sum;
+}
+
+static void ternary_gemv_scalar(const TernaryMatrix& wt, const float* x,
+                                float* y, const GemmEpilogue* epilogue) {
+   unsigned int n = wt.get_rows();
+   unsigned int words = wt.get_words();
+   for(unsigned int j = 0; j < n; j++) {
+      const uint64_t* pos = wt.get_positive(j);
+      const uint64_t* neg = wt.get_negative(j);
+      float acc = 0.0f;
+      for(unsigned int w = 0; w < words; w++) {
+         const float* xw = x + (size_t)w * TERNARY_WORD_BITS;
+         acc += masked_sum(pos[w], xw) - masked_sum(neg[w], xw);
+      }
+      y[j] = acc;
+   }
+   if(epilogue) apply_epilogue(epilogue, 0, y, n);
+}
+
+#if HAVE_X86_SIMD
+// AVX2 -----------------------------------------------------------------------
+__attribute__((target("avx2")))
+static __m256 byte_mask(unsigned int bits, __m256i lanes) {
+   __m256i set = _mm256_and_si256(_mm256_set1_epi32((int)bits), lanes);
+   return _mm256_castsi256_ps(_mm256_cmpeq_epi32(set, lanes));
+}
+
+__attribute__((target("avx2")))
+static float hsum_avx2(__m256 v) {
+   __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+   sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+   sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+   return _mm_cvtss_f32(sum);
+}
+
+// Eight inputs per byte of each plane, turned into lane masks. The
+// positive and negative sums are separate chains, subtracted at the end.
+// There are no branches on the bits, zeros cost as much as anything else.
+__attribute__((target("avx2")))
+static void ternary_gemv_avx2(const TernaryMatrix& wt, const float* x,
+                              float* y, const GemmEpilogue* epilogue) {
+   const __m256i lanes = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+   unsigned int n = wt.get_rows();
+   unsigned int k = wt.get_cols();
+   unsigned int full = k / 8;
+   for(unsigned int j = 0; j < n; j++) {
+      const uint8_t* pos = (const uint8_t*)wt.get_positive(j);
+      const uint8_t* neg = (const uint8_t*)wt.get_negative(j);
+      __m256 acc_pos = _mm256_setzero_ps();
+      __m256 acc_neg = _mm256_setzero_ps();
+      for(unsigned int b = 0; b < full; b++) {
+         __m256 xv = _mm256_loadu_ps(x + 8 * b);
+         acc_pos = _mm256_add_ps(acc_pos, _mm256_and_ps(byte_mask(pos[b], lanes), xv));
+         acc_neg = _mm256_add_ps(acc_neg, _mm256_and_ps(byte_mask(neg[b], lanes), xv));
+      }
+      // Fewer than 8 inputs left at the end of the row
+      float tail = 0.0f;
+      if(full * 8 < k) {
+         tail = masked_sum(pos[full], x + 8 * full) - masked_sum(neg[full], x + 8 * full);
+      }
+      y[j] = hsum_avx2(_mm256_sub_ps(acc_pos, acc_neg)) + tail;
+   }
+   if(epilogue) apply_epilogue(epilogue, 0, y, n);
+}
+
+// AVX-512 --------------------------------------------------------------------
+// Sixteen inputs at a time, each plane's bits are the masks of the adds as
+// they are. Four outputs share every load of x and each keeps one sum, the
+// positive mask adding into it and the negative one subtracting.
+__attribute__((target("avx512f")))
+static void ternary_gemv_avx512(const TernaryMatrix& wt, const float* x,
+                                float* y, const GemmEpilogue* epilogue) {
+   unsigned int n = wt.get_rows();
+   unsigned int k = wt.get_cols();
+   unsigned int full = k / 16;
+   unsigned int halves = (k + 15) / 16;
+   const __mmask16 tail = (__mmask16)((1u << (k % 16)) - 1);
+   unsigned int j = 0;
+   for(; j + 4 <= n; j += 4) {
+      const uint16_t* pos[4];
+      const uint16_t* neg[4];
+      for(unsigned int r = 0; r < 4; r++) {
+         pos[r] = (const uint16_t*)wt.get_positive(j + r);
+         neg[r] = (const uint16_t*)wt.get_negative(j + r);
+      }
+      __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+      __m512 acc2 = _mm512_setzero_ps(), acc3 = _mm512_setzero_ps();
+      for(unsigned int h = 0; h < halves; h++) {
+         __m512 xv = h < full ? _mm512_loadu_ps(x + 16 * h)
+                              : _mm512_maskz_loadu_ps(tail, x + 16 * h);
+         acc0 = _mm512_mask_add_ps(acc0, pos[0][h], acc0, xv);
+         acc1 = _mm512_mask_add_ps(acc1, pos[1][h], acc1, xv);
+         acc2 = _mm512_mask_add_ps(acc2, pos[2][h], acc2, xv);
+         acc3 = _mm512_mask_add_ps(acc3, pos[3][h], acc3, xv);
+         acc0 = _mm512_mask_sub_ps(acc0, neg[0][h], acc0, xv);
+         acc1 = _mm512_mask_sub_ps(acc1, neg[1][h], acc1, xv);
+         acc2 = _mm512_mask_sub_ps(acc2, neg[2][h], acc2, xv);
+         acc3 = _mm512_mask_sub_ps(acc3, neg[3][h], acc3, xv);
+      }
+      y[j] = _mm512_reduce_add_ps(acc0);
+      y[j + 1] = _mm512_reduce_add_ps(acc1);
+      y[j + 2] = _mm512_reduce_add_ps(acc2);
+      y[j + 3] = _mm512_reduce_add_ps(acc3);
+   }
+   for(; j < n; j++) {
+      const uint16_t* pos = (const uint16_t*)wt.get_positive(j);
+      const uint16_t* neg = (const uint16_t*)wt.get_negative(j);
+      __m512 acc = _mm512_setzero_ps();
+      for(unsigned int h = 0; h < halves; h++) {
+         __m512 xv = _mm512_maskz_loadu_ps((__mmask16)(pos[h] | neg[h]), x + 16 * h);
+         acc = _mm512_mask_add_ps(acc, pos[h], acc, xv);
+         acc = _mm512_mask_sub_ps(acc, neg[h], acc, xv);
+      }
+      y[j] = _mm512_reduce_add_ps(acc);
+   }
+   if(epilogue) apply_epilogue(epilogue, 0, y, n);
+}
+#endif
+
+// Dispatch -------------------------------------------------------------------
+TernaryGemvKernel ternary_gemv_kernel(SimdLevel level) {
+#if HAVE_X86_SIMD
+   switch(level) {
+      case SIMD_AVX512: return ternary_gemv_avx512;
+      case SIMD_AVX2: return ternary_gemv_avx2;
+      default: break;
+   }
+#endif
+   return ternary_gemv_scalar;
+}
+
+void ternary_gemv(const TernaryMatrix& wt, const float* x,
+                  float* y, const GemmEpilogue* epilogue) {
+   static const TernaryGemvKernel kernel = ternary_gemv_kernel(cpu_simd_level());
+   kernel(wt, x, y, epilogue);
+}
+
+// Batches ---------------------------------------------------------------------
+/* Same scheme as sparse_gemm: a block of TERNARY_GEMM_MB rows of X is
+ * transposed so each input is a contiguous row of MB values, and each set
+ * bit adds or subtracts one such row into the MB sums of its output.
+ */
+typedef void (*TernaryBlockKernel)(const TernaryMatrix& wt, unsigned int j0, unsigned int j1,
+                                   const float* xt, unsigned int rows,
+                                   float* y, unsigned int ldy);
+
+static void ternary_block_scalar(const TernaryMatrix& wt, unsigned int j0, unsigned int j1,
+                                 const float* xt, unsigned int rows,
+                                 float* y, unsigned int ldy) {
+   unsigned int words = wt.get_words();
+   for(unsigned int j = j0; j < j1; j++) {
+      const uint64_t* pos = wt.get_positive(j);
+      const uint64_t* neg = wt.get_negative(j);
+      float acc[TERNARY_GEMM_MB] = {};
+      for(unsigned int w = 0; w < words; w++) {
+         const float* xw = xt + (size_t)w * TERNARY_WORD_BITS * TERNARY_GEMM_MB;
+         for(uint64_t bits = pos[w]; bits; bits &= bits - 1) {
+            const float* xr = xw + __builtin_ctzll(bits) * TERNARY_GEMM_MB;
+            for(unsigned int i = 0; i < TERNARY_GEMM_MB; i++) acc[i] += xr[i];
+         }
+         for(uint64_t bits = neg[w]; bits; bits &= bits - 1) {
+            const float* xr = xw + __builtin_ctzll(bits) * TERNARY_GEMM_MB;
+            for(unsigned int i = 0; i < TERNARY_GEMM_MB; i++) acc[i] -= xr[i];
+         }
+      }
+      for(unsigned int i = 0; i < rows; i++) y[(size_t)i * ldy + j] = acc[i];
+   }
+}
+
+#if HAVE_X86_SIMD
+__attribute__((target("avx2")))
+static void ternary_block_avx2(const TernaryMatrix& wt, unsigned int j0, unsigned int j1,
+                               const float* xt, unsigned int rows,
+                               float* y, unsigned int ldy) {
+   unsigned int words = wt.get_words();
+   alignas(32) float acc[TERNARY_GEMM_MB];
+   for(unsigned int j = j0; j < j1; j++) {
+      const uint64_t* pos = wt.get_positive(j);
+      const uint64_t* neg = wt.get_negative(j);
+      __m256 c0 = _mm256_setzero_ps(), c1 = _mm256_setzero_ps();
+      __m256 c2 = _mm256_setzero_ps(), c3 = _mm256_setzero_ps();
+      for(unsigned int w = 0; w < words; w++) {
+         const float* xw = xt + (size_t)w * TERNARY_WORD_BITS * TERNARY_GEMM_MB;
+         for(uint64_t bits = pos[w]; bits; bits &= bits - 1) {
+            const float* xr = xw + __builtin_ctzll(bits) * TERNARY_GEMM_MB;
+            c0 = _mm256_add_ps(c0, _mm256_load_ps(xr));
+            c1 = _mm256_add_ps(c1, _mm256_load_ps(xr + 8));
+            c2 = _mm256_add_ps(c2, _mm256_load_ps(xr + 16));
+            c3 = _mm256_add_ps(c3, _mm256_load_ps(xr + 24));
+         }
+         for(uint64_t bits = neg[w]; bits; bits &= bits - 1) {
+            const float* xr = xw + __builtin_ctzll(bits) * TERNARY_GEMM_MB;
+            c0 = _mm256_sub_ps(c0, _mm256_load_ps(xr));
+            c1 = _mm256_sub_ps(c1, _mm256_load_ps(xr + 8));
+            c2 = _mm256_sub_ps(c2, _mm256_load_ps(xr + 16));
+            c3 = _mm256_sub_ps(c3, _mm256_load_ps(xr + 24));
+         }
+      }
+      _mm256_store_ps(acc, c0);
+      _mm256_store_ps(acc + 8, c1);
+      _mm256_store_ps(acc + 16, c2);
+      _mm256_store_ps(acc + 24, c3);
+      for(unsigned int i = 0; i < rows; i++) y[(size_t)i * ldy + j] = acc[i];
+   }
+}
+
+__attribute__((target("avx512f")))
+static void ternary_block_avx512(const TernaryMatrix& wt, unsigned int j0, unsigned int j1,
+                                 const float* xt, unsigned int rows,
+                                 float* y, unsigned int ldy) {
+   unsigned int words = wt.get_words();
+   alignas(64) float acc[TERNARY_GEMM_MB];
+   for(unsigned int j = j0; j < j1; j++) {
+      const uint64_t* pos = wt.get_positive(j);
+      const uint64_t* neg = wt.get_negative(j);
+      __m512 c0 = _mm512_setzero_ps(), c1 = _mm512_setzero_ps();
+      for(unsigned int w = 0; w < words; w++) {
+         const float* xw = xt + (size_t)w * TERNARY_WORD_BITS * TERNARY_GEMM_MB;
+         for(uint64_t bits = pos[w]; bits; bits &= bits - 1) {
+            const float* xr = xw + __builtin_ctzll(bits) * TERNARY_GEMM_MB;
+            c0 = _mm512_add_ps(c0, _mm512_load_ps(xr));
+            c1 = _mm512_add_ps(c1, _mm512_load_ps(xr + 16));
+         }
+         for(uint64_t bits = neg[w]; bits; bits &= bits - 1) {
+            const float* xr = xw + __builtin_ctzll(bits) * TERNARY_GEMM_MB;
+            c0 = _mm512_sub_ps(c0, _mm512_load_ps(xr));
+            c1 = _mm512_sub_ps(c1, _mm512_load_ps(xr + 16));
+         }
+      }
+      _mm512_store_ps(acc, c0);
+      _mm512_store_ps(acc + 16, c1);
+      for(unsigned int i = 0; i < rows; i++) y[(size_t)i * ldy + j] = acc[i];
+   }
+}
+#endif
+
+static TernaryBlockKernel ternary_block_kernel(SimdLevel level) {
+#if HAVE_X86_SIMD
+   switch(level) {
+      case SIMD_AVX512: return ternary_block_avx512;
+      case SIMD_AVX2: return ternary_block_avx2;
+      default: break;
+   }
+#endif
+   return ternary_block_scalar;
+}
+
+// Each thread keeps its transposed block around between calls
+struct TernaryTransposeBuffer {
+   shared_ptr<float> buffer;
+   size_t size = 0;
+
+   float* get(size_t needed) {
+      if(needed > size) {
+         buffer = matrix_alloc(needed);
+         size = needed;
+      }
+      return buffer.get();
+   }
+};
+
+static thread_local TernaryTransposeBuffer transpose_buffer;
+
+void ternary_gemm(unsigned int m, const float* x, unsigned int ldx,
+                  const TernaryMatrix& wt, float* y, unsigned int ldy,
+                  const GemmEpilogue* epilogue) {
+   static const TernaryGemvKernel gemv = ternary_gemv_kernel(cpu_simd_level());
+   static const TernaryBlockKernel block = ternary_block_kernel(cpu_simd_level());
+   unsigned int n = wt.get_rows();
+   unsigned int k = wt.get_cols();
+
+   // Too few rows to pay for the transpose
+   if(m < TERNARY_GEMM_MIN_ROWS) {
+      for(unsigned int i = 0; i < m; i++) {
+         gemv(wt, x + (size_t)i * ldx, y + (size_t)i * ldy, epilogue);
+      }
+      return;
+   }
+
+   unsigned int row_parts = (m + TERNARY_GEMM_MB - 1) / TERNARY_GEMM_MB;
+   unsigned int col_parts = 1;
+   unsigned long work = (unsigned long)m * n * k;
+   unsigned int threads = gemm_get_num_threads();
+   if(work >= gemm_get_parallel_threshold() && row_parts < threads) {
+      col_parts = min((threads + row_parts - 1) / row_parts, max(1u, n / 64));
+   }
+   unsigned int tile_n = (n + col_parts - 1) / col_parts;
+   // The whole last word of the block is read, bits past k or not
+   unsigned int padded_k = wt.get_words() * TERNARY_WORD_BITS;
+
+   auto task = [&](size_t t) {
+      unsigned int i0 = (unsigned int)(t / col_parts) * TERNARY_GEMM_MB;
+      unsigned int j0 = (unsigned int)(t % col_parts) * tile_n;
+      if(j0 >= n) return;
+      unsigned int rows = min(TERNARY_GEMM_MB, m - i0);
+      unsigned int j1 = min(n, j0 + tile_n);
+      float* xt = transpose_buffer.get((size_t)padded_k * TERNARY_GEMM_MB);
+      const float* xb = x + (size_t)i0 * ldx;
+      for(unsigned int p = 0; p < k; p++) {
+         float* out = xt + (size_t)p * TERNARY_GEMM_MB;
+         for(unsigned int i = 0; i < rows; i++) out[i] = xb[(size_t)i * ldx + p];
+         for(unsigned int i = rows; i < TERNARY_GEMM_MB; i++) out[i] = 0.0f;
+      }
+      block(wt, j0, j1, xt, rows, y + (size_t)i0 * ldy, ldy);
+      if(epilogue) {
+         for(unsigned int i = 0; i < rows; i++) {
+            apply_epilogue(epilogue, j0, y + (size_t)(i0 + i) * ldy + j0, j1 - j0);
+         }
+      }
+   };
+
+   unsigned int parts = row_parts * col_parts;
+   if(parts == 1 || work < gemm_get_parallel_threshold()) {
+      for(unsigned int t = 0; t < parts; t++) task(t);
+      return;
+   }
+   default_scheduler()->parallel_for(0, parts, 1, [&](size_t begin, size_t end) {
+      for(size_t t = begin; t < end; t++) task(t);
+   });
+}
@@ -0,0 +1,98 @@
+
+#ifndef TERNARYMATRIX_HPP
+#define TERNARYMATRIX_HPP
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "Matrix.hpp"
+#include "Gemm.hpp"
+#include "CpuFeatures.hpp"
+
+// Bits per word of a bitplane
+#define TERNARY_WORD_BITS 64u
+
+// Batches are multiplied TERNARY_GEMM_MB rows at a time, smaller ones than
+// TERNARY_GEMM_MIN_ROWS one row at a time
+#define TERNARY_GEMM_MB 32u
+#define TERNARY_GEMM_MIN_ROWS 4u
+
+/* Matrix of values in {-1, 0, +1}, two bits per value
+ *
+ * Each row is stored as two bitplanes of the same length, bit p of the
+ * positive plane set where the value at column p is +1 and bit p of the
+ * negative plane set where it is -1. A dot product with a row is then the
+ * sum of the inputs under the positive mask minus those under the
+ * negative one, without a single multiply.
+ *
+ * Like SparseMatrix, layers store their transposed (n x k) weights, one
+ * row per output neuron.
+ */
+class TernaryMatrix {
+public:
+   // Rows of dense, every value of which must be -1, 0 or +1
+   TernaryMatrix(const Matrix& dense);
+   // Same, from dense's transpose
+   static std::shared_ptr<TernaryMatrix> transpose_of(const Matrix& dense);
+   virtual ~TernaryMatrix();
+
+   unsigned int get_rows() const;
+   unsigned int get_cols() const;
+   // Words per row of each bitplane
+   unsigned int get_words() const;
+   // Bytes both bitplanes take
+   size_t get_bytes() const;
+
+   const uint64_t* get_positive(unsigned int row) const;
+   const uint64_t* get_negative(unsigned int row) const;
+
+   std::shared_ptr<Matrix> to_dense() const;
+   // The dense transpose, i.e. the logical weights of a layer
+   std::shared_ptr<Matrix> transpose_to_dense() const;
+
+   // Overwrites the bits with dense's transpose, which must be ternary and
+   // the transposed shape of this matrix
+   void assign_transpose(const Matrix& dense);
+
+private:
+   TernaryMatrix(unsigned int rows, unsigned int cols);
+
+   unsigned int rows, cols;
+   unsigned int words;
+   std::vector<uint64_t> positive;
+   std::vector<uint64_t> negative;
+
+   void set(unsigned int row, unsigned int col, float value);
+};
+
+// Whether every value of mat is -1, 0 or +1
+bool matrix_is_ternary(const Matrix& mat);
+
+/* Ternary weights kernels, W given as its transpose (n x k)
+ *
+ *    y (1 x n) = x (1 x k) . W
+ *
+ * The epilogue is applied to y once it's all written.
+ */
+typedef void (*TernaryGemvKernel)(const TernaryMatrix& wt, const float* x,
+                                  float* y, const GemmEpilogue* epilogue);
+
+void ternary_gemv(const TernaryMatrix& wt, const float* x,
+                  float* y, const GemmEpilogue* epilogue = nullptr);
+
+// The kernel for a specific instruction set, falling back to the next best
+// one when this build can't provide it
+TernaryGemvKernel ternary_gemv_kernel(SimdLevel level);
+
+/* Y (m x n) = X (m x k) . W
+ *
+ * Blocks of rows of X are transposed so every set bit adds or subtracts a
+ * contiguous row of inputs from the whole block, like sparse_gemm. Batches
+ * with enough work (see gemm_set_parallel_threshold) are split across the
+ * default scheduler like gemm's.
+ */
+void ternary_gemm(unsigned int m, const float* x, unsigned int ldx,
+                  const TernaryMatrix& wt, float* y, unsigned int ldy,
+                  const GemmEpilogue* epilogue = nullptr);
+
+#endif
@@ -0,0 +1,564 @@
+
+#include "Trainer.hpp"
+#include "Gemm.hpp"
+#include "Scheduler.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+
+using namespace std;
+
+// Elements of a gradient each task sums up across the shards
+#define TRAIN_REDUCE_GRAIN 16384
+
+// Networks with fewer parameters are updated on the calling thread
+#define TRAIN_PARALLEL_UPDATE_MIN (1u << 16)
+
+// Shard sizes with buffers kept per shard
+#define TRAIN_BATCH_CACHE 4
+
+// dst (cols x rows) = src^T, in blocks so both sides stay in cache
+static void transpose(const Matrix& src, unsigned int rows, float* dst) {
+   const unsigned int block = 32;
+   unsigned int cols = src.get_cols();
+   for(unsigned int y0 = 0; y0 < rows; y0 += block) {
+      unsigned int y1 = min(rows, y0 + block);
+      for(unsigned int x0 = 0; x0 < cols; x0 += block) {
+         unsigned int x1 = min(cols, x0 + block);
+         for(unsigned int y = y0; y < y1; y++) {
+            const float* row = src.row_data(y);
+            for(unsigned int x = x0; x < x1; x++) {
+               dst[(size_t)x * rows + y] = row[x];
+            }
+         }
+      }
+   }
+}
+
+Trainer::Trainer(shared_ptr<Network> network, Loss loss, OptimizerSettings optimizer,
+                 unsigned int batch_size)
+   : eval_context(false) {
+   if(network == nullptr) {
+      printf("Trainer needs a network!\n");
+      throw invalid_argument("Trainer needs a network!");
+   }
+   this->network = network;
+   this->loss = loss;
+   this->optimizer = optimizer;
+   this->set_batch_size(batch_size);
+   this->mode = TRAIN_SYNC;
+   this->max_shards = TRAIN_DEFAULT_MAX_SHARDS;
+   this->min_shard_rows = TRAIN_DEFAULT_MIN_SHARD_ROWS;
+   this->rng.seed(0);
+   this->reset_state();
+}
+
+Trainer::~Trainer() {}
+
+// Settings -------------------------------------------------------------------
+void Trainer::set_optimizer(OptimizerSettings optimizer) {
+   bool changed = optimizer.type != this->optimizer.type;
+   this->optimizer = optimizer;
+   if(changed) {
+      this->reset_optimizer_state();
+   }
+}
+
+OptimizerSettings Trainer::get_optimizer() const {
+   return this->optimizer;
+}
+
+void Trainer::set_learning_rate(float learning_rate) {
+   this->optimizer.learning_rate = learning_rate;
+}
+
+void Trainer::set_loss(Loss loss) {
+   this->loss = loss;
+}
+
+Loss Trainer::get_loss() const {
+   return this->loss;
+}
+
+void Trainer::set_batch_size(unsigned int batch_size) {
+   if(batch_size == 0) {
+      printf("Batch size must be at least 1!\n");
+      throw invalid_argument("Batch size must be at least 1!");
+   }
+   this->batch_size = batch_size;
+}
+
+unsigned int Trainer::get_batch_size() const {
+   return this->batch_size;
+}
+
+void Trainer::set_seed(unsigned int seed) {
+   this->rng.seed(seed);
+}
+
+void Trainer::set_mode(TrainMode mode) {
+   this->mode = mode;
+}
+
+TrainMode Trainer::get_mode() const {
+   return this->mode;
+}
+
+void Trainer::set_sharding(unsigned int max_shards, unsigned int min_shard_rows) {
+   if(max_shards == 0 || min_shard_rows == 0) {
+      printf("Training needs at least 1 shard of at least 1 row, got %d shards of %d rows\n",
+             max_shards, min_shard_rows);
+      throw invalid_argument("Training needs at least 1 shard of at least 1 row!");
+   }
+   this->max_shards = max_shards;
+   this->min_shard_rows = min_shard_rows;
+}
+
+unsigned int Trainer::get_num_shards(unsigned int rows) const {
+   return max(1u, min(this->max_shards, rows / this->min_shard_rows));
+}
+
+unsigned long Trainer::get_step_count() const {
+   return this->step_count;
+}
+
+shared_ptr<Network> Trainer::get_network() const {
+   return this->network;
+}
+
+shared_ptr<Matrix> Trainer::get_weight_gradient(unsigned int layer_num) const {
+   if(this->shards.empty()) return nullptr;
+   return this->shards[0]->weight_grads.at(layer_num);
+}
+
+shared_ptr<Matrix> Trainer::get_bias_gradient(unsigned int layer_num) const {
+   if(this->shards.empty()) return nullptr;
+   return this->shards[0]->bias_grads.at(layer_num);
+}
+
+// State ----------------------------------------------------------------------
+// The layers an optimizer step can write straight into
+static bool trains_in_place(const Layer& layer) {
+   return layer.get_weight_layout() == INPUT_MAJOR && layer.get_precision() == PRECISION_FP32 &&
+          !layer.is_sparse() && !layer.is_ternary();
+}
+
+void Trainer::reset_state() {
+   unsigned int num_layers = this->network->get_num_layers();
+   this->layers.assign(num_layers, LayerState());
+   this->densify_layers();
+
+   for(unsigned int i = 0; i < num_layers; i++) {
+      Layer& layer = this->network->get_layer(i);
+      LayerState& state = this->layers[i];
+      state.in_place = trains_in_place(layer);
+      if(state.in_place) {
+         state.weights = layer.get_stored_weights();
+      } else {
+         state.weights = make_shared<Matrix>(layer.get_weights());
+      }
+      if(layer.is_sparse()) {
+         state.mask = make_shared<Matrix>(state.weights);
+         float* mask = state.mask->get_data();
+         for(unsigned int j = 0; j < state.mask->get_size(); j++) {
+            mask[j] = mask[j] != 0.0f ? 1.0f : 0.0f;
+         }
+      }
+   }
+   this->reset_optimizer_state();
+}
+
+/* Layers whose sparse or ternary storage select_storage picked go back to
+ * dense weights in their layout, which hold the same values. Those that can
+ * be trained in place from now on are, the rest keep their fp32 copy.
+ */
+void Trainer::densify_layers() {
+   for(unsigned int i = 0; i < this->layers.size(); i++) {
+      Layer& layer = this->network->get_layer(i);
+      if(!layer.has_auto_storage()) continue;
+
+      LayerState& state = this->layers[i];
+      layer.set_sparse(false);
+      layer.set_ternary(false);
+      state.reselect = true;
+      if(state.weights && trains_in_place(layer)) {
+         state.weights = layer.get_stored_weights();
+         state.in_place = true;
+      }
+   }
+}
+
+void Trainer::restore_storage() {
+   for(unsigned int i = 0; i < this->layers.size(); i++) {
+      LayerState& state = this->layers[i];
+      if(!state.reselect) continue;
+
+      Layer& layer = this->network->get_layer(i);
+      layer.select_storage();
+      state.in_place = trains_in_place(layer);
+   }
+}
+
+void Trainer::reset_optimizer_state() {
+   unsigned int count = optimizer_state_count(this->optimizer.type);
+   for(auto& state : this->layers) {
+      unsigned int rows = state.weights->get_rows();
+      unsigned int cols = state.weights->get_cols();
+      for(unsigned int s = 0; s < 2; s++) {
+         state.weight_state[s] = s < count ? make_shared<Matrix>(rows, cols) : nullptr;
+         state.bias_state[s] = s < count ? make_shared<Matrix>(1, cols) : nullptr;
+      }
+   }
+   this->step_count = 0;
+}
+
+Trainer::Shard& Trainer::get_shard(unsigned int index) {
+   while(this->shards.size() <= index) {
+      unique_ptr<Shard> shard(new Shard());
+      for(auto& state : this->layers) {
+         unsigned int rows = state.weights->get_rows();
+         unsigned int cols = state.weights->get_cols();
+         shard->weight_grads.push_back(make_shared<Matrix>(rows, cols));
+         shard->bias_grads.push_back(make_shared<Matrix>(1, cols));
+      }
+      shard->loss = 0.0f;
+      this->shards.push_back(move(shard));
+   }
+   return *this->shards[index];
+}
+
+Trainer::BatchBuffers& Trainer::prepare_batch(Shard& shard, unsigned int rows) {
+   for(auto& batch : shard.batches) {
+      if(batch->rows == rows) return *batch;
+   }
+   if(shard.batches.size() == TRAIN_BATCH_CACHE) {
+      shard.batches.erase(shard.batches.begin());
+   }
+
+   unique_ptr<BatchBuffers> batch(new BatchBuffers());
+   unsigned int num_layers = this->network->get_num_layers();
+   batch->output_grads.resize(num_layers);
+   for(unsigned int i = 0; i < num_layers; i++) {
+      batch->output_grads[i] = make_shared<Matrix>(rows, this->network->get_layer_size(i));
+   }
+   batch->inputs = make_shared<Matrix>(rows, this->network->get_input_size());
+   batch->targets = make_shared<Matrix>(rows, this->network->get_layer_size(num_layers - 1));
+   batch->rows = rows;
+   shard.batches.push_back(move(batch));
+   return *shard.batches.back();
+}
+
+// Gradients ------------------------------------------------------------------
+float Trainer::compute_shard(Shard& shard, const shared_ptr<Matrix> inputs,
+                             const shared_ptr<Matrix> targets) {
+   unsigned int rows = inputs->get_rows();
+   unsigned int num_layers = this->network->get_num_layers();
+
+   BatchBuffers& batch = this->prepare_batch(shard, rows);
+   shared_ptr<Matrix> output = this->network->compute_batch(inputs, batch.context);
+
+   // The output layer's gradient, straight to dZ when the loss allows it
+   Matrix& out_grad = *batch.output_grads[num_layers - 1];
+   bool fused = this->loss == LOSS_CROSS_ENTROPY &&
+                this->network->get_layer_activation(num_layers - 1) == ACT_SIGMOID;
+   float loss = fused ? cross_entropy_sigmoid(*output, *targets, &out_grad)
+                      : compute_loss(this->loss, *output, *targets, &out_grad);
+
+   for(int l = num_layers - 1; l >= 0; l--) {
+      LayerState& state = this->layers[l];
+      Matrix& grad = *batch.output_grads[l];
+      const Matrix& pre_act = *batch.context.get_layer_pre_act_output(l);
+      const Matrix& out = *batch.context.get_layer_output(l);
+      Activation activation = this->network->get_layer_activation(l);
+      unsigned int n = grad.get_cols();
+
+      // dZ and the bias gradient in one pass over the rows
+      float* bias_grad = shard.bias_grads[l]->get_data();
+      std::fill(bias_grad, bias_grad + n, 0.0f);
+      for(unsigned int r = 0; r < rows; r++) {
+         float* dz = grad.row_data(r);
+         if(!(fused && l == (int)num_layers - 1)) {
+            activate_backward(activation, pre_act.row_data(r), out.row_data(r), dz, dz, n);
+         }
+         for(unsigned int j = 0; j < n; j++) bias_grad[j] += dz[j];
+      }
+
+      // dW = X^T . dZ
+      const Matrix& x = l == 0 ? *inputs : *batch.context.get_layer_output(l - 1);
+      Matrix& weight_grad = *shard.weight_grads[l];
+      unsigned int k = x.get_cols();
+      if(shard.transposed.size() < (size_t)k * rows) {
+         shard.transposed.resize((size_t)k * rows);
+      }
+      transpose(x, rows, shard.transposed.data());
+      gemm(k, n, rows, shard.transposed.data(), rows,
+           grad.get_data(), grad.get_stride(),
+           weight_grad.get_data(), weight_grad.get_stride());
+
+      // dY of the layer below = dZ . W^T
+      if(l > 0) {
+         Matrix& below = *batch.output_grads[l - 1];
+         gemm_bt(rows, k, n, grad.get_data(), grad.get_stride(),
+                 state.weights->get_data(), state.weights->get_stride(),
+                 below.get_data(), below.get_stride());
+      }
+   }
+   return loss;
+}
+
+/* Shard s of a batch of rows gets rows / num_shards samples, the first
+ * rows % num_shards shards one more. Each runs on its own gradient buffers
+ * on the scheduler. Returns the batch's loss, summed in shard order.
+ */
+float Trainer::run_shards(const shared_ptr<Matrix> inputs, const shared_ptr<Matrix> targets,
+                          unsigned int num_shards, bool apply_each) {
+   unsigned int rows = inputs->get_rows();
+   unsigned int base = rows / num_shards;
+   unsigned int extra = rows % num_shards;
+   unsigned int num_layers = this->network->get_num_layers();
+
+   if(targets->get_rows() != rows) {
+      printf("Training needs one target per input, got %d inputs and %d targets\n",
+             rows, targets->get_rows());
+      throw invalid_argument("Training needs one target per input!");
+   }
+
+   // Made up front, the shard list can't grow while the shards run
+   for(unsigned int s = 0; s < num_shards; s++) {
+      this->get_shard(s);
+   }
+
+   auto run = [&](size_t begin, size_t end) {
+      for(size_t s = begin; s < end; s++) {
+         Shard& shard = *this->shards[s];
+         if(num_shards == 1) {
+            shard.loss = this->compute_shard(shard, inputs, targets);
+         } else {
+            unsigned int shard_rows = base + (s < extra);
+            unsigned int first = s * base + min<unsigned int>(s, extra);
+            BatchBuffers& batch = this->prepare_batch(shard, shard_rows);
+            unsigned int in_cols = inputs->get_cols();
+            unsigned int out_cols = targets->get_cols();
+            if(in_cols != batch.inputs->get_cols() || out_cols != batch.targets->get_cols()) {
+               printf("Training data is %d -> %d wide, the network takes %d -> %d\n",
+                      in_cols, out_cols, batch.inputs->get_cols(), batch.targets->get_cols());
+               throw invalid_argument("Training data doesn't fit the network!");
+            }
+            for(unsigned int r = 0; r < shard_rows; r++) {
+               memcpy(batch.inputs->row_data(r), inputs->row_data(first + r), in_cols * sizeof(float));
+               memcpy(batch.targets->row_data(r), targets->row_data(first + r), out_cols * sizeof(float));
+            }
+            shard.loss = this->compute_shard(shard, batch.inputs, batch.targets);
+         }
+
+         if(apply_each) {
+            unsigned long step = ++this->step_count;
+            for(unsigned int l = 0; l < num_layers; l++) {
+               this->apply_layer(l, shard, step, false);
+            }
+         }
+      }
+   };
+   // A lone shard skips the scheduler, wrapping the task would allocate
+   if(num_shards == 1) {
+      run(0, 1);
+   } else {
+      default_scheduler()->parallel_for(0, num_shards, 1, run);
+   }
+
+   // Laying weights out can replace the layer's storage, which the other
+   // shards would still be running, so it waits for all of them
+   if(apply_each) {
+      for(unsigned int l = 0; l < num_layers; l++) {
+         this->network->get_layer(l).set_weights(*this->layers[l].weights);
+      }
+   }
+
+   double loss = 0.0;
+   for(unsigned int s = 0; s < num_shards; s++) {
+      loss += (double)this->shards[s]->loss * (base + (s < extra));
+   }
+   return (float)(loss / rows);
+}
+
+/* Every shard's gradient is the mean over its own samples, so they are
+ * weighted by their share of the batch and then added up pairwise,
+ * (0+1) + (2+3), ... into shard 0. Every element is summed in the same
+ * order however the work is split between threads.
+ */
+void Trainer::reduce_shards(unsigned int num_shards, unsigned int rows) {
+   unsigned int base = rows / num_shards;
+   unsigned int extra = rows % num_shards;
+   this->shard_weights.resize(num_shards);
+   this->reduce_buffers.resize(num_shards);
+   for(unsigned int s = 0; s < num_shards; s++) {
+      this->shard_weights[s] = (float)(base + (s < extra)) / rows;
+   }
+
+   auto reduce = [this, num_shards](size_t begin, size_t end) {
+      float** grads = this->reduce_buffers.data();
+      for(unsigned int s = 0; s < num_shards; s++) {
+         float weight = this->shard_weights[s];
+         for(size_t i = begin; i < end; i++) grads[s][i] *= weight;
+      }
+      for(unsigned int stride = 1; stride < num_shards; stride *= 2) {
+         for(unsigned int s = 0; s + stride < num_shards; s += 2 * stride) {
+            float* dst = grads[s];
+            const float* src = grads[s + stride];
+            for(size_t i = begin; i < end; i++) dst[i] += src[i];
+         }
+      }
+   };
+
+   for(unsigned int l = 0; l < this->layers.size(); l++) {
+      for(unsigned int s = 0; s < num_shards; s++) {
+         this->reduce_buffers[s] = this->shards[s]->weight_grads[l]->get_data();
+      }
+      default_scheduler()->parallel_for(0, this->shards[0]->weight_grads[l]->get_size(),
+                                        TRAIN_REDUCE_GRAIN, reduce);
+
+      for(unsigned int s = 0; s < num_shards; s++) {
+         this->reduce_buffers[s] = this->shards[s]->bias_grads[l]->get_data();
+      }
+      reduce(0, this->shards[0]->bias_grads[l]->get_size());
+   }
+}
+
+float Trainer::compute_gradients(const shared_ptr<Matrix> inputs, const shared_ptr<Matrix> targets) {
+   unsigned int rows = inputs->get_rows();
+   if(rows == 0) {
+      printf("Training needs at least one sample!\n");
+      throw invalid_argument("Training needs at least one sample!");
+   }
+   unsigned int num_shards = this->get_num_shards(rows);
+   float loss = this->run_shards(inputs, targets, num_shards, false);
+   if(num_shards > 1) {
+      this->reduce_shards(num_shards, rows);
+   }
+   return loss;
+}
+
+// Updates --------------------------------------------------------------------
+void Trainer::apply_layer(unsigned int layer_num, const Shard& shard, unsigned long step,
+                          bool relay) {
+   LayerState& state = this->layers[layer_num];
+   Layer& layer = this->network->get_layer(layer_num);
+   Matrix& biases = *layer.get_biases();
+
+   optimizer_step(this->optimizer, step,
+                  state.weights->get_data(), shard.weight_grads[layer_num]->get_data(),
+                  state.weight_state[0] ? state.weight_state[0]->get_data() : nullptr,
+                  state.weight_state[1] ? state.weight_state[1]->get_data() : nullptr,
+                  state.weights->get_size());
+   if(state.mask) {
+      // Pruned weights stay pruned
+      float* weights = state.weights->get_data();
+      const float* mask = state.mask->get_data();
+      for(unsigned int j = 0; j < state.weights->get_size(); j++) {
+         weights[j] *= mask[j];
+      }
+   }
+   optimizer_step(this->optimizer, step,
+                  biases.get_data(), shard.bias_grads[layer_num]->get_data(),
+                  state.bias_state[0] ? state.bias_state[0]->get_data() : nullptr,
+                  state.bias_state[1] ? state.bias_state[1]->get_data() : nullptr,
+                  biases.get_size());
+
+   // Relays packed / transposed / 16 bit / sparse / ternary weights, for fp32
+   // INPUT_MAJOR this only drops the cached logical copy
+   if(relay) layer.set_weights(*state.weights);
+}
+
+void Trainer::apply_gradients() {
+   if(this->shards.empty()) {
+      printf("There are no gradients to apply, compute them first!\n");
+      throw invalid_argument("There are no gradients to apply!");
+   }
+   this->densify_layers();
+   unsigned long step = ++this->step_count;
+   const Shard& shard = *this->shards[0];
+   size_t num_params = 0;
+   for(auto& state : this->layers) {
+      num_params += state.weights->get_size();
+   }
+   auto update = [&](size_t begin, size_t end) {
+      for(size_t l = begin; l < end; l++) {
+         this->apply_layer(l, shard, step, true);
+      }
+   };
+   if(num_params < TRAIN_PARALLEL_UPDATE_MIN) {
+      update(0, this->layers.size());
+   } else {
+      default_scheduler()->parallel_for(0, this->layers.size(), 1, update);
+   }
+}
+
+// Training -------------------------------------------------------------------
+float Trainer::train_batch(const shared_ptr<Matrix> inputs, const shared_ptr<Matrix> targets) {
+   this->densify_layers();
+   if(this->mode == TRAIN_HOGWILD) {
+      unsigned int rows = inputs->get_rows();
+      if(rows == 0) {
+         printf("Training needs at least one sample!\n");
+         throw invalid_argument("Training needs at least one sample!");
+      }
+      return this->run_shards(inputs, targets, this->get_num_shards(rows), true);
+   }
+   float loss = this->compute_gradients(inputs, targets);
+   this->apply_gradients();
+   return loss;
+}
+
+float Trainer::train_epoch(const Matrix& inputs, const Matrix& targets, bool shuffle) {
+   unsigned int rows = inputs.get_rows();
+   if(targets.get_rows() != rows) {
+      printf("Training needs one target per input, got %d inputs and %d targets\n",
+             rows, targets.get_rows());
+      throw invalid_argument("Training needs one target per input!");
+   }
+   if(rows == 0) return 0.0f;
+
+   unsigned int in_cols = this->network->get_input_size();
+   unsigned int out_cols = this->network->get_layer_size(this->network->get_num_layers() - 1);
+   if(inputs.get_cols() != in_cols || targets.get_cols() != out_cols) {
+      printf("Training data is (%d,%d) -> (%d,%d), the network takes %d -> %d\n",
+             rows, inputs.get_cols(), rows, targets.get_cols(), in_cols, out_cols);
+      throw invalid_argument("Training data doesn't fit the network!");
+   }
+
+   this->order.resize(rows);
+   iota(this->order.begin(), this->order.end(), 0u);
+   if(shuffle) {
+      std::shuffle(this->order.begin(), this->order.end(), this->rng);
+   }
+
+   double total = 0.0;
+   for(unsigned int start = 0; start < rows; start += this->batch_size) {
+      unsigned int batch_rows = min(this->batch_size, rows - start);
+
+      // Full batches and the last one each gather into their own buffers
+      int slot = batch_rows == this->batch_size ? 0 : 1;
+      shared_ptr<Matrix>& batch_inputs = this->epoch_inputs[slot];
+      shared_ptr<Matrix>& batch_targets = this->epoch_targets[slot];
+      if(batch_inputs == nullptr || batch_inputs->get_rows() != batch_rows) {
+         batch_inputs = make_shared<Matrix>(batch_rows, in_cols);
+         batch_targets = make_shared<Matrix>(batch_rows, out_cols);
+      }
+
+      for(unsigned int r = 0; r < batch_rows; r++) {
+         unsigned int sample = this->order[start + r];
+         memcpy(batch_inputs->row_data(r), inputs.row_data(sample), in_cols * sizeof(float));
+         memcpy(batch_targets->row_data(r), targets.row_data(sample), out_cols * sizeof(float));
+      }
+      total += (double)this->train_batch(batch_inputs, batch_targets) * batch_rows;
+   }
+   this->restore_storage();
+   return (float)(total / rows);
+}
+
+float Trainer::evaluate(const shared_ptr<Matrix> inputs, const Matrix& targets) {
+   shared_ptr<Matrix> output = this->network->compute_batch(inputs, this->eval_context);
+   return compute_loss(this->loss, *output, targets);
+}
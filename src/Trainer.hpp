@@ -0,0 +1,206 @@
+
+#ifndef TRAINER_HPP
+#define TRAINER_HPP
+
+#include <atomic>
+#include <memory>
+#include <random>
+#include <vector>
+#include "Matrix.hpp"
+#include "Network.hpp"
+#include "Loss.hpp"
+#include "Optimizer.hpp"
+
+// Samples per mini-batch when none is given
+#define TRAIN_DEFAULT_BATCH 32
+
+// Default sharding of a mini-batch for parallel training
+#define TRAIN_DEFAULT_MAX_SHARDS 16
+#define TRAIN_DEFAULT_MIN_SHARD_ROWS 64
+
+/* How the shards of a mini-batch are combined
+ *
+ *    TRAIN_SYNC     Every shard's gradients go to a buffer of its own, they
+ *                   are summed in a fixed pairwise tree and the optimizer
+ *                   makes one step with the result. The shards only depend
+ *                   on the batch size, so training is bitwise reproducible
+ *                   whatever the number of threads.
+ *    TRAIN_HOGWILD  Every shard makes its own optimizer step as soon as its
+ *                   gradients are ready, writing the shared weights without
+ *                   any locking while other shards may be reading them.
+ *                   Faster, but the results depend on thread timing. Layers
+ *                   trained through a copy (see below) only see the steps
+ *                   once the whole batch is done, their storage can't be
+ *                   replaced while other shards are running it.
+ */
+enum TrainMode {
+   TRAIN_SYNC,
+   TRAIN_HOGWILD
+};
+
+/* Mini-batch gradient descent on a Network's weights and biases.
+ *
+ * A step runs the batch forward with the layers' pre-activation outputs
+ * kept, then walks back through the layers:
+ *
+ *    dZ = dY * act'(Z)      (from the stored pre-activation outputs Z)
+ *    dW = X^T . dZ          db = column sums of dZ
+ *    dX = dZ . W^T          (dY of the layer before)
+ *
+ * and finally updates every parameter with the optimizer. Cross entropy
+ * through a sigmoid output layer is done as a single step.
+ *
+ * Mini-batches are cut into shards that run in parallel on the default
+ * scheduler, see TrainMode. A batch of B rows gets
+ * min(max_shards, B / min_shard_rows) shards (at least one) of about equal
+ * size, each with its own gradient buffers. Shards much smaller than 64
+ * rows make for inefficient GEMMs, and every shard holds a full copy of the
+ * gradients.
+ *
+ * Every buffer (layer outputs, gradients, optimizer state) is allocated up
+ * front and reused, a full batch and the shorter last batch of an epoch
+ * each have their own set, so training doesn't allocate per step.
+ *
+ * Weights of layers stored in a layout other than INPUT_MAJOR, or in 16
+ * bits, are trained in a logical fp32 copy, which is laid out (and rounded)
+ * into the layer after every step. Layers made sparse with set_sparse are
+ * trained the same way, with the weights that were zero when training
+ * started kept at zero so they stay as sparse as they were pruned. Layers
+ * made ternary with set_ternary go back to dense fp32 after the first step,
+ * which moves their weights off -1, 0 and +1.
+ *
+ * Sparse or ternary storage that Layer::select_storage picked on its own
+ * says nothing about which weights should stay zero. Those layers are
+ * trained dense and have their storage picked again from the trained
+ * weights at the end of every train_epoch, or by restore_storage.
+ * The network's parameters shouldn't be changed elsewhere while training,
+ * call reset_state() if they have been.
+ */
+class Trainer {
+public:
+   Trainer(std::shared_ptr<Network> network, Loss loss = LOSS_MSE,
+           OptimizerSettings optimizer = sgd_optimizer(),
+           unsigned int batch_size = TRAIN_DEFAULT_BATCH);
+   virtual ~Trainer();
+
+   // One optimizer step on a mini-batch (one sample per row), returns the
+   // batch's loss from before the step
+   float train_batch(const std::shared_ptr<Matrix> inputs, const std::shared_ptr<Matrix> targets);
+
+   // One pass over a data set in mini-batches of get_batch_size() rows,
+   // visited in a shuffled order unless shuffle is false. Returns the mean
+   // loss over the epoch.
+   float train_epoch(const Matrix& inputs, const Matrix& targets, bool shuffle = true);
+
+   // Loss on a data set, without training
+   float evaluate(const std::shared_ptr<Matrix> inputs, const Matrix& targets);
+
+   // The two halves of a TRAIN_SYNC train_batch. compute_gradients leaves
+   // the batch's gradients in get_weight_gradient / get_bias_gradient and
+   // returns its loss, apply_gradients makes one optimizer step with them.
+   float compute_gradients(const std::shared_ptr<Matrix> inputs, const std::shared_ptr<Matrix> targets);
+   void apply_gradients();
+
+   std::shared_ptr<Matrix> get_weight_gradient(unsigned int layer_num) const;
+   std::shared_ptr<Matrix> get_bias_gradient(unsigned int layer_num) const;
+
+   // Changing the optimizer type clears its state
+   void set_optimizer(OptimizerSettings optimizer);
+   OptimizerSettings get_optimizer() const;
+   void set_learning_rate(float learning_rate);
+
+   void set_loss(Loss loss);
+   Loss get_loss() const;
+   void set_batch_size(unsigned int batch_size);
+   unsigned int get_batch_size() const;
+   void set_seed(unsigned int seed);
+
+   void set_mode(TrainMode mode);
+   TrainMode get_mode() const;
+   void set_sharding(unsigned int max_shards, unsigned int min_shard_rows);
+   unsigned int get_num_shards(unsigned int rows) const;
+
+   // Optimizer steps taken so far
+   unsigned long get_step_count() const;
+
+   // Clears the optimizer state and the step count, and reads the network's
+   // weights in again
+   void reset_state();
+
+   // Runs Layer::select_storage again on the layers this trainer made dense
+   // for training. train_epoch does this when it's done, after train_batch
+   // or apply_gradients it's up to the caller. The next step makes them
+   // dense again.
+   void restore_storage();
+
+   std::shared_ptr<Network> get_network() const;
+
+private:
+   struct LayerState {
+      std::shared_ptr<Matrix> weights;   // logical weights being trained
+      std::shared_ptr<Matrix> mask;      // sparse layers, 1 where a weight is kept
+      bool in_place;                     // weights are the layer's own storage
+      bool reselect;                     // made dense from select_storage's pick
+      std::shared_ptr<Matrix> weight_state[2];
+      std::shared_ptr<Matrix> bias_state[2];
+   };
+
+   // Everything that depends on the number of rows in a batch
+   struct BatchBuffers {
+      unsigned int rows;
+      InferenceContext context;
+      std::vector<std::shared_ptr<Matrix>> output_grads;   // dY / dZ per layer
+      std::shared_ptr<Matrix> inputs;    // the shard's samples
+      std::shared_ptr<Matrix> targets;
+
+      BatchBuffers() : rows(0), context(true) {}
+   };
+
+   // One shard of a mini-batch, with the gradients of its samples. Buffers
+   // are kept for the last few shard sizes seen, a batch splits into at
+   // most two sizes and an epoch has at most two batch sizes.
+   struct Shard {
+      std::vector<std::unique_ptr<BatchBuffers>> batches;
+      std::vector<std::shared_ptr<Matrix>> weight_grads;
+      std::vector<std::shared_ptr<Matrix>> bias_grads;
+      std::vector<float> transposed;   // X^T of the layer being worked on
+      float loss;
+   };
+
+   std::shared_ptr<Network> network;
+   Loss loss;
+   OptimizerSettings optimizer;
+   unsigned int batch_size;
+
+   TrainMode mode;
+   unsigned int max_shards;
+   unsigned int min_shard_rows;
+   std::atomic<unsigned long> step_count;
+
+   std::vector<LayerState> layers;
+   std::vector<std::unique_ptr<Shard>> shards;
+   std::vector<float*> reduce_buffers;   // one gradient per shard
+   std::vector<float> shard_weights;     // each shard's share of the batch
+   InferenceContext eval_context;
+
+   // Samples gathered by train_epoch, for full batches and the last one
+   std::shared_ptr<Matrix> epoch_inputs[2];
+   std::shared_ptr<Matrix> epoch_targets[2];
+   std::vector<unsigned int> order;   // sample order of the current epoch
+   std::mt19937 rng;
+
+   Shard& get_shard(unsigned int index);
+   BatchBuffers& prepare_batch(Shard& shard, unsigned int rows);
+   float compute_shard(Shard& shard, const std::shared_ptr<Matrix> inputs,
+                       const std::shared_ptr<Matrix> targets);
+   float run_shards(const std::shared_ptr<Matrix> inputs, const std::shared_ptr<Matrix> targets,
+                    unsigned int num_shards, bool apply_each);
+   void reduce_shards(unsigned int num_shards, unsigned int rows);
+   // relay lays the trained weights into the layer, see run_shards
+   void apply_layer(unsigned int layer_num, const Shard& shard, unsigned long step, bool relay);
+   void reset_optimizer_state();
+   void densify_layers();
+};
+
+#endif
+
@@ -26,11 +26,14 @@ using namespace glm;
 #include "Lighting.hpp"
 
 #include "Matrix.hpp"
+#include "MatrixExpr.hpp"
 #include "Network.hpp"
 #include "NetworkRenderer.hpp"
 #include "Keybindings.hpp"
+#include "Scheduler.hpp"
 
 #include <array>
+#include <future>
 #include <limits>
 
 GLFWwindow *window; // Main application window
@@ -270,11 +273,21 @@ static void resize_callback(GLFWwindow *window, int width, int height) {
    glViewport(0, 0, width, height);
 }
 
-static shared_ptr<Shape> load_shape(const std::string &mesh_name) {
+// Reads and resizes a mesh on the scheduler. The GL buffers are made by
+// upload_shape, as only the main thread has the GL context.
+static future<shared_ptr<Shape>> load_shape(const std::string &mesh_name) {
    string obj_dir = RESOURCE_DIR + "objs/";
-   shared_ptr<Shape> shape = make_shared<Shape>();
-   shape->loadMesh(obj_dir + mesh_name);
-   shape->resize();
+   return default_scheduler()->submit([obj_dir, mesh_name]() {
+      shared_ptr<Shape> shape = make_shared<Shape>();
+      shape->loadMesh(obj_dir + mesh_name);
+      shape->resize();
+      return shape;
+   });
+} 
+
+static shared_ptr<Shape> upload_shape(future<shared_ptr<Shape>> loading) {
+   default_scheduler()->wait(loading);
+   shared_ptr<Shape> shape = loading.get();
    shape->init();
    return shape;
 } 
@@ -300,13 +313,20 @@ static void init()
 
 
    // Load Object Meshes ------------------------------------------------------
-	// Initialize meshs.
-   bunny = load_shape("bunny.obj");
-   sphere = load_shape("sphere.obj");
-   icosphere = load_shape("IcoSphere.obj");
-   cube = load_shape("cube.obj");
-   head = load_shape("Nefertiti-10K.obj");
-   connection = load_shape("connection.obj");
+	// Initialize meshs, every file is read in parallel.
+   auto bunny_mesh = load_shape("bunny.obj");
+   auto sphere_mesh = load_shape("sphere.obj");
+   auto icosphere_mesh = load_shape("IcoSphere.obj");
+   auto cube_mesh = load_shape("cube.obj");
+   auto head_mesh = load_shape("Nefertiti-10K.obj");
+   auto connection_mesh = load_shape("connection.obj");
+
+   bunny = upload_shape(move(bunny_mesh));
+   sphere = upload_shape(move(sphere_mesh));
+   icosphere = upload_shape(move(icosphere_mesh));
+   cube = upload_shape(move(cube_mesh));
+   head = upload_shape(move(head_mesh));
+   connection = upload_shape(move(connection_mesh));
 
    // Load Shaders ------------------------------------------------------------
    string shader_dir = RESOURCE_DIR + "shaders/";
@@ -462,7 +482,7 @@ void xor_test() {
    
    auto act_func = relu;
    auto run_net = [=] (shared_ptr<Matrix> input) {
-      return input->dot(w1)->add(b1)->apply(act_func)->dot(wo)->add(bo)->apply(act_func);
+      return lazy(input).dot(w1).add(b1).apply(act_func).dot(wo).add(bo).apply(act_func).eval();
    };
 
    // Tests
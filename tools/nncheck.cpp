@@ -0,0 +1,324 @@
+
+/* nncheck - self-check of the matrix kernels
+ *
+ *    nncheck
+ *
+ * Runs the blocked GEMM paths and every GEMV kernel the running CPU can
+ * execute against gemm_reference, on odd shapes and with padded leading
+ * dimensions, and checks that threaded GEMMs give the same bits as single
+ * threaded ones. Prints a line per failed check and exits with 1 if there
+ * were any.
+ *
+ * Results may differ from the reference by rounding only: each element is
+ * allowed 2 (k + 1) float epsilons of the sum of |a| |b| over its products.
+ */
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include "CpuFeatures.hpp"
+#include "Gemm.hpp"
+#include "Gemv.hpp"
+#include "Half.hpp"
+#include "Matrix.hpp"
+#include "Random.hpp"
+
+using namespace std;
+
+// Floats between the end of a row and the start of the next, filled with
+// NaN so a kernel that reads or sums them fails
+#define CHECK_PAD 3u
+
+struct Shape {
+   unsigned int m, n, k;
+};
+
+// Crosses the register blocks, the KC and MC cache blocks and one NC panel
+static const Shape GemmShapes[] = {
+   {1, 1, 1}, {3, 5, 7}, {8, 8, 8}, {9, 7, 1}, {13, 17, 19}, {33, 9, 65},
+   {70, 130, 300}, {129, 33, 257}, {5, 4101, 3}
+};
+
+static const Shape GemvShapes[] = {
+   {1, 1, 1}, {1, 3, 7}, {1, 8, 16}, {1, 17, 33}, {1, 100, 257}, {1, 515, 300}
+};
+
+static unsigned int checks = 0;
+static unsigned int failures = 0;
+
+// Operands ------------------------------------------------------------------
+struct Operand {
+   unsigned int rows, cols, ld;
+   vector<float> data;
+
+   Operand(unsigned int rows, unsigned int cols)
+      : rows(rows), cols(cols), ld(cols + CHECK_PAD), data((size_t)rows * ld, NAN) {}
+
+   float* row(unsigned int y) {return data.data() + (size_t)y * ld;}
+   const float* row(unsigned int y) const {return data.data() + (size_t)y * ld;}
+};
+
+static Operand random_operand(unsigned int rows, unsigned int cols, uint64_t seed) {
+   Operand op(rows, cols);
+   Philox rng(seed);
+   for(unsigned int y = 0; y < rows; y++) {
+      random_uniform(rng, op.row(y), cols, -1.0f, 1.0f, (uint64_t)y * cols);
+   }
+   return op;
+}
+
+static Operand transposed(const Operand& op) {
+   Operand t(op.cols, op.rows);
+   for(unsigned int y = 0; y < op.rows; y++) {
+      for(unsigned int x = 0; x < op.cols; x++) t.row(x)[y] = op.row(y)[x];
+   }
+   return t;
+}
+
+static Operand absolute(const Operand& op) {
+   Operand a(op.rows, op.cols);
+   for(unsigned int y = 0; y < op.rows; y++) {
+      for(unsigned int x = 0; x < op.cols; x++) a.row(y)[x] = fabsf(op.row(y)[x]);
+   }
+   return a;
+}
+
+// Every value rounded through 16 bits, what a half precision kernel sees
+static Operand rounded(const Operand& op, WeightPrecision precision) {
+   Operand r(op.rows, op.cols);
+   vector<uint16_t> half(op.cols);
+   for(unsigned int y = 0; y < op.rows; y++) {
+      floats_to_half(op.row(y), half.data(), op.cols, precision);
+      half_to_floats(half.data(), r.row(y), op.cols, precision);
+   }
+   return r;
+}
+
+static vector<float> packed(const Operand& b) {
+   vector<float> out(gemm_packed_b_size(b.rows, b.cols));
+   gemm_pack_b(b.rows, b.cols, b.data.data(), b.ld, out.data());
+   return out;
+}
+
+static vector<uint16_t> packed_half(const Operand& b, WeightPrecision precision) {
+   vector<float> floats = packed(b);
+   vector<uint16_t> out(floats.size());
+   floats_to_half(floats.data(), out.data(), floats.size(), precision);
+   return out;
+}
+
+// Checking ------------------------------------------------------------------
+/* The reference product of a and b, with the bound of every element: the
+ * same product taken over the absolute values.
+ */
+struct Expected {
+   Operand c;
+   Operand bound;
+
+   Expected(const Operand& a, const Operand& b)
+      : c(a.rows, b.cols), bound(a.rows, b.cols) {
+      gemm_reference(a.rows, b.cols, a.cols, a.data.data(), a.ld, b.data.data(), b.ld,
+                     c.data.data(), c.ld);
+      Operand abs_a = absolute(a);
+      Operand abs_b = absolute(b);
+      gemm_reference(a.rows, b.cols, a.cols, abs_a.data.data(), abs_a.ld,
+                     abs_b.data.data(), abs_b.ld, bound.data.data(), bound.ld);
+   }
+};
+
+// Compares the m x n result c to the reference, reporting the first
+// element that is off by more than rounding
+static void check(const char* name, const Shape& shape, const float* c, unsigned int ldc,
+                  const Expected& expected) {
+   checks++;
+   const float eps = 2.0f * (shape.k + 1) * FLT_EPSILON;
+   for(unsigned int y = 0; y < shape.m; y++) {
+      for(unsigned int x = 0; x < shape.n; x++) {
+         const float got = c[(size_t)y * ldc + x];
+         const float want = expected.c.row(y)[x];
+         const float tol = eps * expected.bound.row(y)[x] + FLT_MIN;
+         if(!(fabsf(got - want) <= tol)) {
+            printf("FAIL %s %ux%ux%u: c(%u, %u) = %g, reference %g\n",
+                   name, shape.m, shape.n, shape.k, x, y, got, want);
+            failures++;
+            return;
+         }
+      }
+   }
+}
+
+static void check_same(const char* name, const Shape& shape, unsigned int threads,
+                       const Operand& c, const Operand& serial) {
+   checks++;
+   for(unsigned int y = 0; y < shape.m; y++) {
+      if(memcmp(c.row(y), serial.row(y), shape.n * sizeof(float)) != 0) {
+         printf("FAIL %s %ux%ux%u: %u threads differ from 1 thread in row %u\n",
+                name, shape.m, shape.n, shape.k, threads, y);
+         failures++;
+         return;
+      }
+   }
+}
+
+// GEMM -----------------------------------------------------------------------
+static void check_gemm(const Shape& s, uint64_t seed) {
+   Operand a = random_operand(s.m, s.k, seed);
+   Operand b = random_operand(s.k, s.n, seed + 1);
+   Expected expected(a, b);
+
+   Operand c(s.m, s.n);
+   gemm(s.m, s.n, s.k, a.data.data(), a.ld, b.data.data(), b.ld, c.data.data(), c.ld);
+   check("gemm", s, c.data.data(), c.ld, expected);
+
+   Operand bt = transposed(b);
+   Operand c_bt(s.m, s.n);
+   gemm_bt(s.m, s.n, s.k, a.data.data(), a.ld, bt.data.data(), bt.ld, c_bt.data.data(), c_bt.ld);
+   check("gemm_bt", s, c_bt.data.data(), c_bt.ld, expected);
+
+   vector<float> b_packed = packed(b);
+   Operand c_packed(s.m, s.n);
+   gemm_packed_b(s.m, s.n, s.k, a.data.data(), a.ld, b_packed.data(),
+                 c_packed.data.data(), c_packed.ld);
+   check("gemm_packed_b", s, c_packed.data.data(), c_packed.ld, expected);
+
+   // Bias and relu in the epilogue, relu can only shrink the error
+   Operand bias = random_operand(1, s.n, seed + 2);
+   Operand c_epilogue(s.m, s.n);
+   GemmEpilogue epilogue = {bias.row(0), nullptr, activation_kernel(ACT_RELU, cpu_simd_level())};
+   gemm(s.m, s.n, s.k, a.data.data(), a.ld, b.data.data(), b.ld,
+        c_epilogue.data.data(), c_epilogue.ld, &epilogue);
+   Expected activated(a, b);
+   for(unsigned int y = 0; y < s.m; y++) {
+      for(unsigned int x = 0; x < s.n; x++) {
+         activated.c.row(y)[x] = max(0.0f, activated.c.row(y)[x] + bias.row(0)[x]);
+         activated.bound.row(y)[x] += fabsf(bias.row(0)[x]);
+      }
+   }
+   check("gemm epilogue", s, c_epilogue.data.data(), c_epilogue.ld, activated);
+
+   for(WeightPrecision precision : {PRECISION_FP16, PRECISION_BF16}) {
+      Expected expected_half(a, rounded(b, precision));
+      vector<uint16_t> b_half = packed_half(b, precision);
+      Operand c_half(s.m, s.n);
+      gemm_packed_b_half(s.m, s.n, s.k, a.data.data(), a.ld, b_half.data(), precision,
+                         c_half.data.data(), c_half.ld);
+      string name = string("gemm_packed_b_half ") + weight_precision_str(precision);
+      check(name.c_str(), s, c_half.data.data(), c_half.ld, expected_half);
+   }
+
+   // Matrix::dot picks its own path, GEMV for single rows
+   auto mat_a = make_shared<Matrix>(s.m, s.k);
+   auto mat_b = make_shared<Matrix>(s.k, s.n);
+   for(unsigned int y = 0; y < s.m; y++) memcpy(mat_a->row_data(y), a.row(y), s.k * sizeof(float));
+   for(unsigned int y = 0; y < s.k; y++) memcpy(mat_b->row_data(y), b.row(y), s.n * sizeof(float));
+   auto product = mat_a->dot(mat_b);
+   auto reference = mat_a->dot_reference(mat_b);
+   check("Matrix::dot", s, product->get_data(), product->get_cols(), expected);
+   check("Matrix::dot_reference", s, reference->get_data(), reference->get_cols(), expected);
+}
+
+// Threaded GEMMs split C into tiles but sum every element in the same order
+static void check_threads(const Shape& s, uint64_t seed) {
+   Operand a = random_operand(s.m, s.k, seed);
+   Operand b = random_operand(s.k, s.n, seed + 1);
+   Operand bt = transposed(b);
+   vector<float> b_packed = packed(b);
+
+   const unsigned int saved_threads = gemm_get_num_threads();
+   const unsigned long saved_threshold = gemm_get_parallel_threshold();
+   gemm_set_parallel_threshold(0);
+
+   gemm_set_num_threads(1);
+   Operand serial(s.m, s.n), serial_bt(s.m, s.n), serial_packed(s.m, s.n);
+   gemm(s.m, s.n, s.k, a.data.data(), a.ld, b.data.data(), b.ld, serial.data.data(), serial.ld);
+   gemm_bt(s.m, s.n, s.k, a.data.data(), a.ld, bt.data.data(), bt.ld,
+           serial_bt.data.data(), serial_bt.ld);
+   gemm_packed_b(s.m, s.n, s.k, a.data.data(), a.ld, b_packed.data(),
+                 serial_packed.data.data(), serial_packed.ld);
+
+   for(unsigned int threads : {2u, 3u, 4u, 7u}) {
+      gemm_set_num_threads(threads);
+      Operand c(s.m, s.n), c_bt(s.m, s.n), c_packed(s.m, s.n);
+      gemm(s.m, s.n, s.k, a.data.data(), a.ld, b.data.data(), b.ld, c.data.data(), c.ld);
+      gemm_bt(s.m, s.n, s.k, a.data.data(), a.ld, bt.data.data(), bt.ld,
+              c_bt.data.data(), c_bt.ld);
+      gemm_packed_b(s.m, s.n, s.k, a.data.data(), a.ld, b_packed.data(),
+                    c_packed.data.data(), c_packed.ld);
+      check_same("gemm", s, threads, c, serial);
+      check_same("gemm_bt", s, threads, c_bt, serial_bt);
+      check_same("gemm_packed_b", s, threads, c_packed, serial_packed);
+   }
+
+   gemm_set_num_threads(saved_threads);
+   gemm_set_parallel_threshold(saved_threshold);
+}
+
+// GEMV -----------------------------------------------------------------------
+static void check_gemv(const Shape& s, SimdLevel level, uint64_t seed) {
+   Operand x = random_operand(1, s.k, seed);
+   // Every other input zero, so the compact kernels have something to skip
+   for(unsigned int p = 0; p < s.k; p += 2) x.row(0)[p] = 0.0f;
+   Operand w = random_operand(s.k, s.n, seed + 1);
+   Operand wt = transposed(w);
+   vector<float> w_packed = packed(w);
+   Expected expected(x, w);
+
+   vector<uint32_t> index(s.k);
+   vector<float> values(s.k);
+   unsigned int count = gemv_compact_inputs(s.k, x.row(0), index.data(), values.data());
+
+   string prefix = string(simd_level_str(level)) + " ";
+   Operand y(1, s.n);
+
+   gemv_kernel(level)(s.n, s.k, x.row(0), w.data.data(), w.ld, y.row(0), nullptr);
+   check((prefix + "gemv").c_str(), s, y.row(0), y.ld, expected);
+
+   gemv_t_kernel(level)(s.n, s.k, x.row(0), wt.data.data(), wt.ld, y.row(0), nullptr);
+   check((prefix + "gemv_t").c_str(), s, y.row(0), y.ld, expected);
+
+   gemv_packed_kernel(level)(s.n, s.k, x.row(0), w_packed.data(), 0, y.row(0), nullptr);
+   check((prefix + "gemv_packed").c_str(), s, y.row(0), y.ld, expected);
+
+   gemv_compact_kernel(level)(s.n, s.k, index.data(), values.data(), count,
+                              w.data.data(), w.ld, y.row(0), nullptr);
+   check((prefix + "gemv_compact").c_str(), s, y.row(0), y.ld, expected);
+
+   gemv_packed_compact_kernel(level)(s.n, s.k, index.data(), values.data(), count,
+                                     w_packed.data(), 0, y.row(0), nullptr);
+   check((prefix + "gemv_packed_compact").c_str(), s, y.row(0), y.ld, expected);
+
+   for(WeightPrecision precision : {PRECISION_FP16, PRECISION_BF16}) {
+      Expected expected_half(x, rounded(w, precision));
+      vector<uint16_t> w_half = packed_half(w, precision);
+      gemv_packed_half_kernel(level, precision)(s.n, s.k, x.row(0), w_half.data(),
+                                                y.row(0), nullptr);
+      string name = prefix + "gemv_packed_half " + weight_precision_str(precision);
+      check(name.c_str(), s, y.row(0), y.ld, expected_half);
+   }
+}
+
+int main() {
+   uint64_t seed = 1;
+   for(const Shape& shape : GemmShapes) {
+      check_gemm(shape, seed);
+      seed += 3;
+   }
+   check_threads({200, 150, 300}, seed);
+   check_threads({37, 301, 19}, seed + 2);
+
+   // Only the instruction sets this CPU has, lower ones always run
+   for(int level = SIMD_SCALAR; level <= cpu_simd_level(); level++) {
+      for(const Shape& shape : GemvShapes) {
+         check_gemv(shape, (SimdLevel)level, seed);
+         seed += 2;
+      }
+   }
+
+   printf("%u of %u checks passed (%s)\n", checks - failures, checks,
+          simd_level_str(cpu_simd_level()));
+   return failures ? 1 : 0;
+}
@@ -0,0 +1,85 @@
+/* nncodegen - turns a trained network into a standalone C++ header
+ *
+ *    nncodegen <model file | preset> <output.hpp> [options]
+ *
+ *    --name <identifier>   namespace of the generated code (default: network)
+ *    --unroll <weights>    largest layer to unroll completely
+ *    --no-simd             leave out the AVX2 kernels
+ *
+ * The network is either a model file written by save_network or one of the
+ * default networks by name (XOR, OR, AND, NOT, SEEDED_4X4, SEEDED_8X8,
+ * SEEDED_LARGE, SEEDED_HUGE, FULL_4X4).
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <string>
+#include "CodeGen.hpp"
+#include "ModelFile.hpp"
+#include "Network.hpp"
+
+using namespace std;
+
+struct Preset {
+   const char* name;
+   NetworkType type;
+};
+
+// The random presets are left out, they change from run to run
+static const Preset Presets[] = {
+   {"XOR", XOR}, {"OR", OR}, {"AND", AND}, {"NOT", NOT},
+   {"SEEDED_4X4", SEEDED_4X4}, {"SEEDED_8X8", SEEDED_8X8},
+   {"SEEDED_LARGE", SEEDED_LARGE}, {"SEEDED_HUGE", SEEDED_HUGE},
+   {"FULL_4X4", FULL_4X4}
+};
+
+static void usage() {
+   printf("Usage: nncodegen <model file | preset> <output.hpp> "
+          "[--name <identifier>] [--unroll <weights>] [--no-simd]\n");
+   printf("Presets:");
+   for(const Preset& preset : Presets) printf(" %s", preset.name);
+   printf("\n");
+}
+
+static shared_ptr<Network> open_network(const string& source) {
+   for(const Preset& preset : Presets) {
+      if(source == preset.name) return default_network(preset.type);
+   }
+   return load_network(source);
+}
+
+int main(int argc, char** argv) {
+   if(argc < 3) {
+      usage();
+      return 1;
+   }
+   string source = argv[1];
+   string output = argv[2];
+   CodeGenOptions options = codegen_options("network");
+
+   for(int i = 3; i < argc; i++) {
+      if(strcmp(argv[i], "--name") == 0 && i + 1 < argc) {
+         options.name = argv[++i];
+      } else if(strcmp(argv[i], "--unroll") == 0 && i + 1 < argc) {
+         options.unroll_limit = (unsigned int)strtoul(argv[++i], nullptr, 10);
+      } else if(strcmp(argv[i], "--no-simd") == 0) {
+         options.simd = false;
+      } else {
+         printf("Unknown option %s\n", argv[i]);
+         usage();
+         return 1;
+      }
+   }
+
+   try {
+      auto network = open_network(source);
+      write_code(*network, output, options, source);
+      printf("Wrote %s: %d inputs, %d layers\n", output.c_str(),
+             network->get_input_size(), network->get_num_layers());
+   } catch(const exception& e) {
+      printf("nncodegen failed: %s\n", e.what());
+      return 1;
+   }
+   return 0;
+}